@@ -0,0 +1,475 @@
+#include "document.h"
+#include "html.h"
+#include "escape.h"
+#include "autolink.h"
+
+#include "common.h"
+#include <time.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+#include "monolithic_examples.h"
+
+
+/* FEATURES INFO / DEFAULTS */
+
+#define DEF_SIZE 4096		/* KB of generated input per kernel */
+#define DEF_REPEAT 5
+#define DEF_DENSITY 10
+#define DEF_SEED 1
+#define DEF_MAX_NESTING 16
+
+struct bench_kernel;
+
+typedef void (*bench_generate)(sd_buffer *ib, const struct bench_kernel *kernel, size_t size, int density);
+typedef void (*bench_run)(sd_buffer *ob, sd_document *doc, sd_buffer *ib);
+
+/* bench_kernel: a hot path of the library, fed with generated input where
+ * `density` percent of the words (or blocks) are one of the constructs */
+struct bench_kernel {
+	const char *name;
+	const char *description;
+	const char *const *constructs;
+	size_t construct_count;
+	char separator;		/* between words, lines are broken on spaces only */
+	bench_generate generate;
+	bench_run run;
+};
+
+
+/* INPUT GENERATION */
+
+static const char *const words[] = {
+	"lorem", "ipsum", "dolor", "sit", "amet", "consectetuer", "adipiscing",
+	"elit", "sed", "diam", "nonummy", "nibh", "euismod", "tincidunt", "ut",
+	"laoreet", "magna", "aliquam", "erat", "volutpat"
+};
+
+static const char *const inline_constructs[] = {
+	"*emphasis*", "**strong**", "`code`", "[link](http://example.com/)",
+	"![image](image.png)", "<http://example.com/>", "\\*escaped\\*",
+	"~~struck~~", "==marked==", "&amp;", "<span>", "trailing  \n"
+};
+
+static const char *const escape_html_constructs[] = {
+	"a&b", "<tag>", "</tag>", "\"quoted\"", "it's", "a/b"
+};
+
+static const char *const escape_href_constructs[] = {
+	"a b", "\"q\"", "<x>", "caf\xC3\xA9", "a&b", "it's", "%20", "a?b=c#d"
+};
+
+static const char *const smartypants_constructs[] = {
+	"\"quoted\"", "it's", "'single'", "--", "---", "...", "(c)", "(tm)",
+	"1/2", "<code>x--y</code>"
+};
+
+static const char *const autolink_constructs[] = {
+	"http://example.com/some/path", "https://example.org/?q=1",
+	"www.example.net", "user@example.com", "a:b", "@handle"
+};
+
+static const char *const tab_constructs[] = {
+	"\t", "a\tb", "\t\t", "abc\t"
+};
+
+static uint32_t bench_seed;
+
+/* bench_random • xorshift, so inputs only depend on the seed */
+static uint32_t
+bench_random(void)
+{
+	uint32_t x = bench_seed;
+
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+
+	return bench_seed = x;
+}
+
+/* generate_words • words separated by `separator`, lines of about 70 chars
+ * when the separator is a space and paragraphs of 8 lines */
+static void
+generate_words(sd_buffer *ib, const struct bench_kernel *kernel, size_t size, int density)
+{
+	size_t column = 0, lines = 0;
+
+	while (ib->size < size) {
+		const char *word;
+
+		if ((int)(bench_random() % 100) < density)
+			word = kernel->constructs[bench_random() % kernel->construct_count];
+		else
+			word = words[bench_random() % count_of(words)];
+
+		sd_buffer_puts(ib, word);
+		column += strlen(word);
+
+		if (kernel->separator != ' ') {
+			sd_buffer_putc(ib, kernel->separator);
+		} else if (column < 70) {
+			sd_buffer_putc(ib, ' ');
+			column++;
+		} else {
+			sd_buffer_putc(ib, '\n');
+			column = 0;
+			if (++lines % 8 == 0)
+				sd_buffer_putc(ib, '\n');
+		}
+	}
+}
+
+/* generate_tables • paragraphs and tables of 10 rows by 4 columns, tables
+ * being `density` percent of the blocks */
+static void
+generate_tables(sd_buffer *ib, const struct bench_kernel *kernel, size_t size, int density)
+{
+	size_t row, col;
+
+	while (ib->size < size) {
+		if ((int)(bench_random() % 100) >= density) {
+			for (row = 0; row < 4; ++row) {
+				for (col = 0; col < 10; ++col) {
+					sd_buffer_puts(ib, words[bench_random() % count_of(words)]);
+					sd_buffer_putc(ib, col < 9 ? ' ' : '\n');
+				}
+			}
+		} else {
+			UPSKIRT_BUFPUTSL(ib, "| Name | Value | Unit | Note |\n");
+			UPSKIRT_BUFPUTSL(ib, "|:-----|------:|:----:|------|\n");
+			for (row = 0; row < 10; ++row) {
+				for (col = 0; col < 4; ++col) {
+					UPSKIRT_BUFPUTSL(ib, "| ");
+					sd_buffer_puts(ib, words[bench_random() % count_of(words)]);
+					sd_buffer_putc(ib, ' ');
+				}
+				UPSKIRT_BUFPUTSL(ib, "|\n");
+			}
+		}
+		sd_buffer_putc(ib, '\n');
+	}
+}
+
+
+/* KERNELS */
+
+static void
+run_inline(sd_buffer *ob, sd_document *doc, sd_buffer *ib)
+{
+	sd_document_render_inline(doc, ob, ib->data, ib->size, 0);
+}
+
+static void
+run_document(sd_buffer *ob, sd_document *doc, sd_buffer *ib)
+{
+	sd_document_render(doc, ob, ib->data, ib->size, 0);
+}
+
+static void
+run_escape_html(sd_buffer *ob, sd_document *doc, sd_buffer *ib)
+{
+	sd_escape_html(ob, ib->data, ib->size, 0);
+}
+
+static void
+run_escape_href(sd_buffer *ob, sd_document *doc, sd_buffer *ib)
+{
+	sd_escape_href(ob, ib->data, ib->size);
+}
+
+static void
+run_smartypants(sd_buffer *ob, sd_document *doc, sd_buffer *ib)
+{
+	sd_html_smartypants(ob, ib->data, ib->size);
+}
+
+/* run_autolink • calls the scanners on their trigger chars, the way the
+ * document does for the autolink extension */
+static void
+run_autolink(sd_buffer *ob, sd_document *doc, sd_buffer *ib)
+{
+	size_t i = 0, rewind, len;
+
+	while (i < ib->size) {
+		len = 0;
+		ob->size = 0;
+
+		if (ib->data[i] == ':')
+			len = sd_autolink__url(&rewind, ob, ib->data, i, ib->size, 0);
+		else if (ib->data[i] == '@')
+			len = sd_autolink__email(&rewind, ob, ib->data, i, ib->size, 0);
+		else if (ib->data[i] == 'w')
+			len = sd_autolink__www(&rewind, ob, ib->data, i, ib->size, UPSKIRT_AUTOLINK_SHORT_DOMAINS);
+
+		i += len ? len : 1;
+	}
+}
+
+static const struct bench_kernel kernels[] = {
+	{"inline", "inline parsing and rendering", inline_constructs, count_of(inline_constructs), ' ', generate_words, run_inline},
+	{"escape_html", "HTML escaping", escape_html_constructs, count_of(escape_html_constructs), ' ', generate_words, run_escape_html},
+	{"escape_href", "URL escaping", escape_href_constructs, count_of(escape_href_constructs), '/', generate_words, run_escape_href},
+	{"smartypants", "SmartyPants punctuation", smartypants_constructs, count_of(smartypants_constructs), ' ', generate_words, run_smartypants},
+	{"autolink", "autolink scanners", autolink_constructs, count_of(autolink_constructs), ' ', generate_words, run_autolink},
+	{"tabs", "tab expansion (inline rendering)", tab_constructs, count_of(tab_constructs), ' ', generate_words, run_inline},
+	{"tables", "table parsing and rendering", NULL, 0, ' ', generate_tables, run_document},
+};
+
+
+/* PRINT HELP */
+
+static void
+print_help(const char *basename)
+{
+	size_t k;
+
+	/* usage */
+	printf("Usage: %s [OPTION]... [KERNEL]...\n\n", basename);
+
+	/* description */
+	printf("Measure the throughput of the hot paths of the library on generated input, and print it in MB/s and ns/byte. "
+	       "Every kernel is run on the same input several times, the fastest run is reported.\n\n");
+
+	/* kernels */
+	printf("Kernels (all when none is given):\n");
+	for (k = 0; k < count_of(kernels); k++)
+		printf("  %-18s  %s\n", kernels[k].name, kernels[k].description);
+	printf("\n");
+
+	/* main options */
+	printf("Main options:\n");
+	print_option('s', "size=N", "Size of the input in KB. Default is " str(DEF_SIZE) ".");
+	print_option('r', "repeat=N", "Number of runs per kernel. Default is " str(DEF_REPEAT) ".");
+	print_option('d', "density=N", "Percentage of words, or blocks for tables, that are constructs of the kernel. Default is " str(DEF_DENSITY) ".");
+	print_option(0, "seed=N", "Seed of the input generator. Default is " str(DEF_SEED) ".");
+	print_option('h', "help", "Print this help text.");
+	print_option('v', "version", "Print Upskirt version.");
+	printf("\n");
+
+	/* ending */
+	printf("Exit status is 0 if no errors occurred, 1 with option parsing errors.\n\n");
+}
+
+
+/* OPTION PARSING */
+
+struct option_data {
+	const char *basename;
+	int done;
+
+	size_t size;
+	long repeat;
+	long density;
+	long seed;
+
+	int selected[count_of(kernels)];
+	int any_selected;
+};
+
+static int
+parse_short_option(char opt, const char *next, void *opaque)
+{
+	struct option_data *data = opaque;
+	long int num = 0;
+	int isNum = next ? parseint(next, &num) : 0;
+
+	if (opt == 'h') {
+		print_help(data->basename);
+		data->done = 1;
+		return 0;
+	}
+
+	if (opt == 'v') {
+		print_version();
+		data->done = 1;
+		return 0;
+	}
+
+	/* options requiring value */
+
+	if (opt == 's' && isNum && num > 0) {
+		data->size = (size_t)num * 1024;
+		return 2;
+	}
+
+	if (opt == 'r' && isNum && num > 0) {
+		data->repeat = num;
+		return 2;
+	}
+
+	if (opt == 'd' && isNum && num >= 0 && num <= 100) {
+		data->density = num;
+		return 2;
+	}
+
+	fprintf(stderr, "Wrong option '-%c' found.\n", opt);
+	return 0;
+}
+
+static int
+parse_long_option(const char *opt, const char *next, void *opaque)
+{
+	struct option_data *data = opaque;
+	long int num = 0;
+	int isNum = next ? parseint(next, &num) : 0;
+
+	if (strcmp(opt, "help")==0) {
+		print_help(data->basename);
+		data->done = 1;
+		return 0;
+	}
+
+	if (strcmp(opt, "version")==0) {
+		print_version();
+		data->done = 1;
+		return 0;
+	}
+
+	if (strcmp(opt, "size")==0 && isNum && num > 0) {
+		data->size = (size_t)num * 1024;
+		return 2;
+	}
+
+	if (strcmp(opt, "repeat")==0 && isNum && num > 0) {
+		data->repeat = num;
+		return 2;
+	}
+
+	if (strcmp(opt, "density")==0 && isNum && num >= 0 && num <= 100) {
+		data->density = num;
+		return 2;
+	}
+
+	if (strcmp(opt, "seed")==0 && isNum && num != 0) {
+		data->seed = num;
+		return 2;
+	}
+
+	fprintf(stderr, "Wrong option '--%s' found.\n", opt);
+	return 0;
+}
+
+static int
+parse_argument(int argn, const char *arg, int is_forced, void *opaque)
+{
+	struct option_data *data = opaque;
+	size_t k;
+
+	for (k = 0; k < count_of(kernels); k++) {
+		if (strcmp(arg, kernels[k].name) == 0) {
+			data->selected[k] = 1;
+			data->any_selected = 1;
+			return 1;
+		}
+	}
+
+	fprintf(stderr, "Unknown kernel '%s'.\n", arg);
+	return 0;
+}
+
+
+/* MAIN LOGIC */
+
+/* bench_time • monotonic wall clock time in seconds */
+static double
+bench_time(void)
+{
+#ifdef _WIN32
+	LARGE_INTEGER count, freq;
+	QueryPerformanceCounter(&count);
+	QueryPerformanceFrequency(&freq);
+	return (double)count.QuadPart / (double)freq.QuadPart;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+#endif
+}
+
+static localization
+get_local(void)
+{
+	localization local;
+	local.figure = "Figure";
+	local.listing = "Listing";
+	local.table = "Table";
+	return local;
+}
+
+#if defined(BUILD_MONOLITHIC)
+#define main(cnt, arr)      bench_main(cnt, arr)
+#endif
+
+int main(int argc, const char **argv)
+{
+	struct option_data data;
+	sd_renderer *renderer;
+	sd_document *document;
+	sd_buffer *ib, *ob;
+	size_t k;
+	long r;
+
+	/* Parse options */
+	memset(&data, 0x0, sizeof(data));
+	data.basename = argv[0];
+	data.size = DEF_SIZE * 1024;
+	data.repeat = DEF_REPEAT;
+	data.density = DEF_DENSITY;
+	data.seed = DEF_SEED;
+
+	argc = parse_options(argc, argv, parse_short_option, parse_long_option, parse_argument, &data);
+	if (data.done) return 0;
+	if (!argc) return 1;
+
+	renderer = sd_html_renderer_new(0, 0, get_local());
+	document = sd_document_new(renderer,
+		UPSKIRT_EXT_BLOCK | UPSKIRT_EXT_SPAN | UPSKIRT_EXT_FLAGS,
+		NULL, NULL, DEF_MAX_NESTING);
+
+	ib = sd_buffer_new(64 * 1024);
+	ob = sd_buffer_new(64 * 1024);
+
+	printf("%-12s %10s %10s %10s\n", "kernel", "bytes", "MB/s", "ns/byte");
+
+	for (k = 0; k < count_of(kernels); k++) {
+		const struct bench_kernel *kernel = &kernels[k];
+		double best = 0;
+
+		if (data.any_selected && !data.selected[k])
+			continue;
+
+		/* every kernel gets the same sequence for the same seed */
+		bench_seed = (uint32_t)data.seed;
+		ib->size = 0;
+		kernel->generate(ib, kernel, data.size, (int)data.density);
+
+		for (r = 0; r < data.repeat; r++) {
+			double start, elapsed;
+
+			ob->size = 0;
+			start = bench_time();
+			kernel->run(ob, document, ib);
+			elapsed = bench_time() - start;
+
+			if (r == 0 || elapsed < best)
+				best = elapsed;
+		}
+
+		if (best <= 0)
+			best = 1e-9;
+
+		printf("%-12s %10zu %10.1f %10.3f\n", kernel->name, ib->size,
+			ib->size / best / 1e6, best * 1e9 / ib->size);
+	}
+
+	/* Cleanup */
+	sd_buffer_free(ib);
+	sd_buffer_free(ob);
+	sd_document_free(document);
+	sd_html_renderer_free(renderer);
+
+	return 0;
+}
@@ -19,16 +19,6 @@ parseint(const char *string, long *result)
 	return !(*end || errno);
 }
 
-static const char *
-strprefix(const char *str, const char *prefix)
-{
-	while (*prefix) {
-		if (!(*str && *str == *prefix)) return 0;
-		prefix++; str++;
-	}
-	return str;
-}
-
 static void
 print_option(char short_opt, const char *long_opt, const char *description)
 {
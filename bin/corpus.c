@@ -0,0 +1,823 @@
+#include "document.h"
+#include "html.h"
+#include "input.h"
+
+#include "common.h"
+#include <math.h>
+#include <time.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <dirent.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#endif
+
+#include "monolithic_examples.h"
+
+
+/* FEATURES INFO / DEFAULTS */
+
+#define DEF_REPEAT 5
+#define DEF_SYNTHETIC_SIZE 256	/* KB per synthetic document */
+#define DEF_TOLERANCE 10
+#define DEF_OUNIT 64
+#define DEF_MAX_NESTING 16
+
+#define BENCH_EXTENSIONS (UPSKIRT_EXT_BLOCK | UPSKIRT_EXT_SPAN | UPSKIRT_EXT_FLAGS | UPSKIRT_EXT_SCI)
+
+
+/* PRINT HELP */
+
+static void
+print_help(const char *basename)
+{
+	/* usage */
+	printf("Usage: %s [OPTION]... [FILE|DIRECTORY]...\n\n", basename);
+
+	/* description */
+	printf("Render a corpus of documents in process and report the throughput, the latency per document, "
+	       "the allocations made through the library wrappers and the peak resident set size. "
+	       "Directories are searched recursively for .md, .text and .markdown files.\n\n");
+
+	/* main options */
+	printf("Main options:\n");
+	print_option('r', "repeat=N", "Number of renders of every document. Default is " str(DEF_REPEAT) ".");
+	print_option('s', "synthetic=N", "Add N generated documents with includes, floats, footnotes and a TOC.");
+	print_option(0, "synthetic-size=N", "Size of the generated documents in KB. Default is " str(DEF_SYNTHETIC_SIZE) ".");
+	print_option('w', "work-dir=DIR", "Where the generated documents are written. Default is the temporary directory.");
+	print_option('j', "json", "Print the results as JSON.");
+	print_option('b', "baseline=FILE", "Compare with the JSON results of a previous run.");
+	print_option('t', "tolerance=N", "Change in percent reported as a regression. Default is " str(DEF_TOLERANCE) ".");
+	print_option('h', "help", "Print this help text.");
+	print_option('v', "version", "Print Upskirt version.");
+	printf("\n");
+
+	/* ending */
+	printf("Exit status is 0 if no errors occurred, 1 with option parsing errors, 2 when a regression was found "
+	       "against the baseline, 4 with memory allocation errors or 5 with I/O errors.\n\n");
+}
+
+
+/* OPTION PARSING */
+
+struct corpus_file {
+	char *path;
+	size_t size;
+	int generated;		/* removed at exit */
+
+	double *latencies;	/* seconds, one per render, sorted */
+	size_t alloc_count;	/* allocations per render */
+	size_t alloc_bytes;
+};
+
+struct option_data {
+	const char *basename;
+	int done;
+
+	long repeat;
+	long synthetic;
+	size_t synthetic_size;
+	const char *work_dir;
+	int json;
+	const char *baseline;
+	long tolerance;
+
+	struct corpus_file *files;
+	size_t count;
+	size_t asize;
+	int failed;
+};
+
+static int corpus_add_path(struct option_data *data, const char *path, int explicit);
+
+static int
+parse_short_option(char opt, const char *next, void *opaque)
+{
+	struct option_data *data = opaque;
+	long int num = 0;
+	int isNum = next ? parseint(next, &num) : 0;
+
+	if (opt == 'h') {
+		print_help(data->basename);
+		data->done = 1;
+		return 0;
+	}
+
+	if (opt == 'v') {
+		print_version();
+		data->done = 1;
+		return 0;
+	}
+
+	if (opt == 'j') {
+		data->json = 1;
+		return 1;
+	}
+
+	/* options requiring value */
+
+	if (opt == 'r' && isNum && num > 0) {
+		data->repeat = num;
+		return 2;
+	}
+
+	if (opt == 's' && isNum && num >= 0) {
+		data->synthetic = num;
+		return 2;
+	}
+
+	if (opt == 't' && isNum && num >= 0) {
+		data->tolerance = num;
+		return 2;
+	}
+
+	if (opt == 'w' && next) {
+		data->work_dir = next;
+		return 2;
+	}
+
+	if (opt == 'b' && next) {
+		data->baseline = next;
+		return 2;
+	}
+
+	fprintf(stderr, "Wrong option '-%c' found.\n", opt);
+	return 0;
+}
+
+static int
+parse_long_option(const char *opt, const char *next, void *opaque)
+{
+	struct option_data *data = opaque;
+	long int num = 0;
+	int isNum = next ? parseint(next, &num) : 0;
+
+	if (strcmp(opt, "help")==0) {
+		print_help(data->basename);
+		data->done = 1;
+		return 0;
+	}
+
+	if (strcmp(opt, "version")==0) {
+		print_version();
+		data->done = 1;
+		return 0;
+	}
+
+	if (strcmp(opt, "json")==0) {
+		data->json = 1;
+		return 1;
+	}
+
+	if (strcmp(opt, "repeat")==0 && isNum && num > 0) {
+		data->repeat = num;
+		return 2;
+	}
+
+	if (strcmp(opt, "synthetic")==0 && isNum && num >= 0) {
+		data->synthetic = num;
+		return 2;
+	}
+
+	if (strcmp(opt, "synthetic-size")==0 && isNum && num > 0) {
+		data->synthetic_size = (size_t)num * 1024;
+		return 2;
+	}
+
+	if (strcmp(opt, "tolerance")==0 && isNum && num >= 0) {
+		data->tolerance = num;
+		return 2;
+	}
+
+	if (strcmp(opt, "work-dir")==0 && next) {
+		data->work_dir = next;
+		return 2;
+	}
+
+	if (strcmp(opt, "baseline")==0 && next) {
+		data->baseline = next;
+		return 2;
+	}
+
+	fprintf(stderr, "Wrong option '--%s' found.\n", opt);
+	return 0;
+}
+
+static int
+parse_argument(int argn, const char *arg, int is_forced, void *opaque)
+{
+	return corpus_add_path(opaque, arg, 1);
+}
+
+
+/* CORPUS */
+
+static void
+corpus_add_file(struct option_data *data, const char *path, int generated)
+{
+	struct corpus_file *file;
+
+	if (data->count == data->asize) {
+		data->asize = data->asize ? data->asize * 2 : 64;
+		data->files = sd_realloc(data->files, data->asize * sizeof(struct corpus_file));
+	}
+
+	file = &data->files[data->count++];
+	memset(file, 0x0, sizeof(struct corpus_file));
+	file->path = sd_malloc(strlen(path) + 1);
+	strcpy(file->path, path);
+	file->generated = generated;
+}
+
+static int
+is_markdown(const char *name)
+{
+	const char *ext = strrchr(name, '.');
+
+	return ext && (strcmp(ext, ".md") == 0 || strcmp(ext, ".text") == 0 || strcmp(ext, ".markdown") == 0);
+}
+
+/* corpus_add_path • adds a file, or the Markdown files under a directory;
+ * files given explicitly are taken whatever their extension */
+static int
+corpus_add_path(struct option_data *data, const char *path, int explicit)
+{
+	size_t len = strlen(path);
+	char *child;
+
+#ifdef _WIN32
+	WIN32_FIND_DATAA entry;
+	HANDLE find;
+	DWORD attributes = GetFileAttributesA(path);
+
+	if (attributes == INVALID_FILE_ATTRIBUTES) {
+		fprintf(stderr, "Unable to open input file \"%s\".\n", path);
+		return 0;
+	}
+
+	if (!(attributes & FILE_ATTRIBUTE_DIRECTORY)) {
+		if (explicit || is_markdown(path))
+			corpus_add_file(data, path, 0);
+		return 1;
+	}
+
+	child = sd_malloc(len + MAX_PATH + 2);
+	sprintf(child, "%s\\*", path);
+	find = FindFirstFileA(child, &entry);
+
+	if (find != INVALID_HANDLE_VALUE) {
+		do {
+			if (entry.cFileName[0] == '.')
+				continue;
+			sprintf(child, "%s\\%s", path, entry.cFileName);
+			if (!corpus_add_path(data, child, 0))
+				break;
+		} while (FindNextFileA(find, &entry));
+		FindClose(find);
+	}
+#else
+	struct dirent *entry;
+	struct stat st;
+	DIR *dir;
+
+	if (stat(path, &st) != 0) {
+		fprintf(stderr, "Unable to open input file \"%s\": %s\n", path, strerror(errno));
+		return 0;
+	}
+
+	if (!S_ISDIR(st.st_mode)) {
+		if (explicit || is_markdown(path))
+			corpus_add_file(data, path, 0);
+		return 1;
+	}
+
+	dir = opendir(path);
+	if (!dir) {
+		fprintf(stderr, "Unable to open directory \"%s\": %s\n", path, strerror(errno));
+		return 0;
+	}
+
+	child = NULL;
+	while ((entry = readdir(dir)) != NULL) {
+		if (entry->d_name[0] == '.')
+			continue;
+		child = sd_realloc(child, len + strlen(entry->d_name) + 2);
+		sprintf(child, "%s/%s", path, entry->d_name);
+		if (!corpus_add_path(data, child, 0))
+			break;
+	}
+	closedir(dir);
+#endif
+
+	free(child);
+	return 1;
+}
+
+static int
+corpus_compare(const void *a, const void *b)
+{
+	return strcmp(((const struct corpus_file *)a)->path, ((const struct corpus_file *)b)->path);
+}
+
+static const char *
+default_work_dir(void)
+{
+#ifdef _WIN32
+	const char *dir = getenv("TEMP");
+	return dir ? dir : ".";
+#else
+	const char *dir = getenv("TMPDIR");
+	return dir ? dir : "/tmp";
+#endif
+}
+
+static int
+write_file(const char *path, const sd_buffer *contents)
+{
+	FILE *file = fopen(path, "wb");
+
+	if (!file) {
+		fprintf(stderr, "Unable to open output file \"%s\": %s\n", path, strerror(errno));
+		return 0;
+	}
+
+	(void)fwrite(contents->data, 1, contents->size, file);
+	if (ferror(file) | fclose(file)) {
+		fprintf(stderr, "I/O errors found while writing \"%s\".\n", path);
+		return 0;
+	}
+
+	return 1;
+}
+
+/* corpus_generate • writes a scidown document of about `size` bytes made of
+ * sections with floats, cross-references and footnotes, with a TOC and an
+ * include every ten sections, then the included file next to it */
+static int
+corpus_generate(struct option_data *data, unsigned int n, size_t size)
+{
+	const char *dir = data->work_dir ? data->work_dir : default_work_dir();
+	sd_buffer *doc = sd_buffer_new(64 * 1024);
+	sd_buffer *path = sd_buffer_new(256);
+	sd_buffer *include = sd_buffer_new(1024);
+	unsigned int section = 0;
+	int ok;
+
+	sd_buffer_printf(include, "upskirt-corpus-%u-include.md", n);
+
+	UPSKIRT_BUFPUTSL(doc, "---\ntitle: Synthetic document\nauthor: Upskirt\n---\n\n@toc\n\n");
+	while (doc->size < size) {
+		section++;
+		sd_buffer_printf(doc, "# Section %u\n\n", section);
+		sd_buffer_printf(doc,
+			"This section refers to the figure (#fig:%u), to the table (#tab:%u) "
+			"and to a note[^n%u], with *emphasis*, **strong text**, `code` and a "
+			"[link](http://example.com/%u).\n\n", section, section, section, section);
+		sd_buffer_printf(doc, "## Subsection %u.1\n\n", section);
+		sd_buffer_printf(doc,
+			"@figure(fig:%u)\n![Figure %u](figure.png)\n@caption(The figure of section %u.)\n@/\n\n",
+			section, section, section);
+		sd_buffer_printf(doc,
+			"@table(tab:%u)\n| Name | Value |\n|:-----|------:|\n| a | %u |\n| b | %u |\n"
+			"@caption(The table of section %u.)\n@/\n\n",
+			section, section, section * 2, section);
+		sd_buffer_printf(doc, "[^n%u]: The note of section %u, see (#fig:%u).\n\n", section, section, section);
+
+		if (section % 10 == 0) {
+			UPSKIRT_BUFPUTSL(doc, "@include(");
+			sd_buffer_put(doc, include->data, include->size);
+			UPSKIRT_BUFPUTSL(doc, ")\n\n");
+		}
+	}
+
+	sd_buffer_printf(path, "%s/upskirt-corpus-%u.md", dir, n);
+	ok = write_file(sd_buffer_cstr(path), doc);
+	if (ok)
+		corpus_add_file(data, sd_buffer_cstr(path), 1);
+
+	doc->size = 0;
+	UPSKIRT_BUFPUTSL(doc, "Included text with a list:\n\n* one\n* two\n* three\n\n> and a quote\n\n");
+
+	path->size = 0;
+	sd_buffer_printf(path, "%s/", dir);
+	sd_buffer_put(path, include->data, include->size);
+	if (ok) {
+		ok = write_file(sd_buffer_cstr(path), doc);
+		if (ok)
+			corpus_add_file(data, sd_buffer_cstr(path), 1);
+	}
+
+	sd_buffer_free(doc);
+	sd_buffer_free(path);
+	sd_buffer_free(include);
+	return ok;
+}
+
+
+/* MEASUREMENTS */
+
+/* corpus_time • monotonic wall clock time in seconds */
+static double
+corpus_time(void)
+{
+#ifdef _WIN32
+	LARGE_INTEGER count, freq;
+	QueryPerformanceCounter(&count);
+	QueryPerformanceFrequency(&freq);
+	return (double)count.QuadPart / (double)freq.QuadPart;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+#endif
+}
+
+/* peak resident set size in KB, or -1 when it is not known */
+static long
+peak_rss(void)
+{
+#ifdef _WIN32
+	return -1;
+#else
+	struct rusage usage;
+
+	if (getrusage(RUSAGE_SELF, &usage) != 0)
+		return -1;
+#ifdef __APPLE__
+	return usage.ru_maxrss / 1024;
+#else
+	return usage.ru_maxrss;
+#endif
+#endif
+}
+
+static int
+compare_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return (x > y) - (x < y);
+}
+
+/* nearest-rank percentile of sorted values */
+static double
+percentile(const double *values, size_t count, double p)
+{
+	size_t rank = (size_t)ceil(p / 100.0 * count);
+
+	return values[rank ? rank - 1 : 0];
+}
+
+static localization
+get_local(void)
+{
+	localization local;
+	local.figure = "Figure";
+	local.listing = "Listing";
+	local.table = "Table";
+	return local;
+}
+
+/* the directory of the file, for its includes */
+static char *
+base_folder(const char *path)
+{
+	const char *slash = strrchr(path, '/');
+	char *folder;
+
+#ifdef _WIN32
+	const char *backslash = strrchr(path, '\\');
+	if (backslash && (!slash || backslash > slash))
+		slash = backslash;
+#endif
+
+	if (!slash)
+		return NULL;
+
+	folder = sd_malloc(slash - path + 1);
+	memcpy(folder, path, slash - path);
+	folder[slash - path] = 0;
+
+	return folder;
+}
+
+/* renders a file with a fresh document every time, the way a one-shot
+ * conversion does; returns 0 on success */
+static int
+corpus_render(struct corpus_file *file, const sd_renderer *renderer, long repeat)
+{
+	char *folder = base_folder(file->path);
+	sd_input input;
+	long r;
+
+	if (sd_input_load(&input, file->path)) {
+		fprintf(stderr, "Unable to open input file \"%s\": %s\n", file->path, strerror(errno));
+		free(folder);
+		return -1;
+	}
+
+	file->size = input.size;
+	file->latencies = sd_malloc(repeat * sizeof(double));
+
+	for (r = 0; r < repeat; r++) {
+		sd_document *document = sd_document_new(renderer, BENCH_EXTENSIONS, NULL, folder, DEF_MAX_NESTING);
+		sd_buffer *ob = sd_buffer_new(DEF_OUNIT);
+		sd_alloc_stats stats;
+		double start;
+
+		sd_alloc_stats_enable(1);
+		start = corpus_time();
+		sd_document_render(document, ob, input.data, input.size, -1);
+		file->latencies[r] = corpus_time() - start;
+		sd_alloc_stats_get(&stats);
+		sd_alloc_stats_enable(0);
+
+		file->alloc_count += stats.count;
+		file->alloc_bytes += stats.bytes;
+
+		sd_buffer_free(ob);
+		sd_document_free(document);
+	}
+
+	file->alloc_count /= repeat;
+	file->alloc_bytes /= repeat;
+	qsort(file->latencies, repeat, sizeof(double), compare_double);
+
+	sd_input_release(&input);
+	free(folder);
+	return 0;
+}
+
+
+/* REPORT */
+
+struct corpus_summary {
+	size_t documents;
+	size_t bytes;
+	double throughput;	/* MB/s */
+	double p50;		/* median latency of the documents, in us */
+	double p99;
+	size_t alloc_count;	/* allocations per render of the corpus */
+	size_t alloc_bytes;
+	long peak_rss;		/* KB */
+};
+
+static void
+summarize(struct corpus_summary *summary, const struct option_data *data)
+{
+	double *medians = sd_malloc((data->count ? data->count : 1) * sizeof(double));
+	double total = 0;
+	size_t i;
+	long r;
+
+	memset(summary, 0x0, sizeof(struct corpus_summary));
+
+	for (i = 0; i < data->count; i++) {
+		const struct corpus_file *file = &data->files[i];
+
+		for (r = 0; r < data->repeat; r++)
+			total += file->latencies[r];
+
+		medians[i] = percentile(file->latencies, data->repeat, 50) * 1e6;
+		summary->bytes += file->size;
+		summary->alloc_count += file->alloc_count;
+		summary->alloc_bytes += file->alloc_bytes;
+	}
+
+	qsort(medians, data->count, sizeof(double), compare_double);
+
+	summary->documents = data->count;
+	if (data->count) {
+		summary->p50 = percentile(medians, data->count, 50);
+		summary->p99 = percentile(medians, data->count, 99);
+	}
+	if (total > 0)
+		summary->throughput = summary->bytes * (double)data->repeat / total / 1e6;
+	summary->peak_rss = peak_rss();
+
+	free(medians);
+}
+
+static void
+json_string(FILE *out, const char *str)
+{
+	fputc('"', out);
+	for (; *str; str++) {
+		if (*str == '"' || *str == '\\')
+			fprintf(out, "\\%c", *str);
+		else if ((unsigned char)*str < 0x20)
+			fprintf(out, "\\u%04x", (unsigned char)*str);
+		else
+			fputc(*str, out);
+	}
+	fputc('"', out);
+}
+
+static void
+print_json(FILE *out, const struct corpus_summary *summary, const struct option_data *data)
+{
+	size_t i;
+
+	fprintf(out, "{\n");
+	fprintf(out, "\t\"version\": \"%s\",\n", UPSKIRT_VERSION);
+	fprintf(out, "\t\"repeat\": %ld,\n", data->repeat);
+	fprintf(out, "\t\"documents\": %zu,\n", summary->documents);
+	fprintf(out, "\t\"bytes\": %zu,\n", summary->bytes);
+	fprintf(out, "\t\"throughput_mb_s\": %.3f,\n", summary->throughput);
+	fprintf(out, "\t\"latency_p50_us\": %.3f,\n", summary->p50);
+	fprintf(out, "\t\"latency_p99_us\": %.3f,\n", summary->p99);
+	fprintf(out, "\t\"alloc_count\": %zu,\n", summary->alloc_count);
+	fprintf(out, "\t\"alloc_bytes\": %zu,\n", summary->alloc_bytes);
+	if (summary->peak_rss < 0)
+		fprintf(out, "\t\"peak_rss_kb\": null,\n");
+	else
+		fprintf(out, "\t\"peak_rss_kb\": %ld,\n", summary->peak_rss);
+
+	fprintf(out, "\t\"files\": [");
+	for (i = 0; i < data->count; i++) {
+		const struct corpus_file *file = &data->files[i];
+
+		fprintf(out, "%s\n\t\t{\"path\": ", i ? "," : "");
+		json_string(out, file->path);
+		fprintf(out, ", \"bytes\": %zu, \"p50_us\": %.3f, \"p99_us\": %.3f, \"allocs\": %zu, \"alloc_size\": %zu}",
+			file->size,
+			percentile(file->latencies, data->repeat, 50) * 1e6,
+			percentile(file->latencies, data->repeat, 99) * 1e6,
+			file->alloc_count, file->alloc_bytes);
+	}
+	fprintf(out, "\n\t]\n}\n");
+}
+
+static void
+print_text(FILE *out, const struct corpus_summary *summary, const struct option_data *data)
+{
+	fprintf(out, "Documents:         %zu, %zu bytes, %ld renders each\n", summary->documents, summary->bytes, data->repeat);
+	fprintf(out, "Throughput:        %.1f MB/s\n", summary->throughput);
+	fprintf(out, "Latency p50:       %.1f us\n", summary->p50);
+	fprintf(out, "Latency p99:       %.1f us\n", summary->p99);
+	fprintf(out, "Allocations:       %zu per corpus render, %zu bytes\n", summary->alloc_count, summary->alloc_bytes);
+	if (summary->peak_rss >= 0)
+		fprintf(out, "Peak RSS:          %ld KB\n", summary->peak_rss);
+}
+
+/* json_number • value of a top-level number in results printed by
+ * print_json, which come before the list of files */
+static int
+json_number(const char *json, const char *key, double *value)
+{
+	size_t len = strlen(key);
+	const char *p = json;
+	char *end;
+
+	while ((p = strchr(p, '"')) != NULL) {
+		if (strncmp(p + 1, key, len) == 0 && p[len + 1] == '"') {
+			p += len + 2;
+			while (*p == ' ' || *p == ':')
+				p++;
+			*value = strtod(p, &end);
+			return end != p;
+		}
+		p++;
+	}
+
+	return 0;
+}
+
+/* compares the results with a baseline; returns the exit status */
+static int
+compare_baseline(FILE *out, const struct corpus_summary *summary, const struct option_data *data)
+{
+	static const struct {
+		const char *key;
+		int higher_is_better;
+	} metrics[] = {
+		{"throughput_mb_s", 1},
+		{"latency_p50_us", 0},
+		{"latency_p99_us", 0},
+		{"alloc_count", 0},
+		{"alloc_bytes", 0},
+		{"peak_rss_kb", 0},
+	};
+
+	double current[count_of(metrics)];
+	sd_input input;
+	sd_buffer *json;
+	int status = EXIT_SUCCESS;
+	size_t m;
+
+	if (sd_input_load(&input, data->baseline)) {
+		fprintf(stderr, "Unable to open baseline file \"%s\": %s\n", data->baseline, strerror(errno));
+		return 5;
+	}
+
+	json = sd_buffer_new(input.size + 1);
+	sd_buffer_put(json, input.data, input.size);
+	sd_input_release(&input);
+
+	current[0] = summary->throughput;
+	current[1] = summary->p50;
+	current[2] = summary->p99;
+	current[3] = (double)summary->alloc_count;
+	current[4] = (double)summary->alloc_bytes;
+	current[5] = (double)summary->peak_rss;
+
+	fprintf(out, "\n%-18s %14s %14s %9s\n", "Baseline", "before", "after", "change");
+	for (m = 0; m < count_of(metrics); m++) {
+		double before, change;
+		int regression;
+
+		if (!json_number(sd_buffer_cstr(json), metrics[m].key, &before) || before <= 0 || current[m] < 0)
+			continue;
+
+		change = (current[m] - before) / before * 100;
+		regression = metrics[m].higher_is_better ? change < -data->tolerance : change > data->tolerance;
+		if (regression)
+			status = 2;
+
+		fprintf(out, "%-18s %14.1f %14.1f %+8.1f%%%s\n", metrics[m].key, before, current[m], change,
+			regression ? "  REGRESSION" : "");
+	}
+
+	sd_buffer_free(json);
+	return status;
+}
+
+
+/* MAIN LOGIC */
+
+#if defined(BUILD_MONOLITHIC)
+#define main(cnt, arr)      corpus_main(cnt, arr)
+#endif
+
+int main(int argc, const char **argv)
+{
+	struct option_data data;
+	struct corpus_summary summary;
+	sd_renderer *renderer;
+	int status = EXIT_SUCCESS;
+	size_t i;
+	long n;
+
+	/* Parse options */
+	memset(&data, 0x0, sizeof(data));
+	data.basename = argv[0];
+	data.repeat = DEF_REPEAT;
+	data.synthetic_size = DEF_SYNTHETIC_SIZE * 1024;
+	data.tolerance = DEF_TOLERANCE;
+
+	argc = parse_options(argc, argv, parse_short_option, parse_long_option, parse_argument, &data);
+	if (data.done) return 0;
+	if (!argc) return 1;
+
+	for (n = 0; n < data.synthetic; n++) {
+		if (!corpus_generate(&data, (unsigned int)n, data.synthetic_size)) {
+			status = 5;
+			goto cleanup;
+		}
+	}
+
+	if (!data.count) {
+		fprintf(stderr, "No documents to render.\n");
+		status = 1;
+		goto cleanup;
+	}
+
+	qsort(data.files, data.count, sizeof(struct corpus_file), corpus_compare);
+
+	/* Render every document */
+	renderer = sd_html_renderer_new(0, 0, get_local());
+
+	for (i = 0; i < data.count; i++) {
+		if (corpus_render(&data.files[i], renderer, data.repeat)) {
+			status = 5;
+			break;
+		}
+	}
+
+	sd_html_renderer_free(renderer);
+
+	if (status == EXIT_SUCCESS) {
+		summarize(&summary, &data);
+
+		if (data.json)
+			print_json(stdout, &summary, &data);
+		else
+			print_text(stdout, &summary, &data);
+
+		if (data.baseline)
+			status = compare_baseline(data.json ? stderr : stdout, &summary, &data);
+	}
+
+cleanup:
+	for (i = 0; i < data.count; i++) {
+		if (data.files[i].generated)
+			remove(data.files[i].path);
+		free(data.files[i].path);
+		free(data.files[i].latencies);
+	}
+	free(data.files);
+
+	return status;
+}
@@ -12,6 +12,8 @@ extern int charter_tex_main(int argc, const char* argv[]);
 
 extern int smartypants_main(int argc, const char* argv[]);
 extern int upskirt_main(int argc, const char* argv[]);
+extern int bench_main(int argc, const char* argv[]);
+extern int corpus_main(int argc, const char* argv[]);
 
 #ifdef __cplusplus
 }
@@ -1,10 +1,23 @@
 #include "document.h"
 #include "html.h"
 #include "md_latex.h"
+#include "input.h"
+#include "tree.h"
 
 #include "common.h"
 #include "utils.h"
 #include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <direct.h>
+#else
+#include <dirent.h>
+#include <pthread.h>
+#include <unistd.h>
+#endif
 
 #include "monolithic_examples.h"
 
@@ -68,7 +81,8 @@ static struct html_flag_info html_flags_info[] = {
 	{UPSKIRT_RENDER_USE_XHTML, "xhtml", "Render XHTML."},
 	{UPSKIRT_RENDER_MERMAID, "mermaid", "Render mermaid diagrams."},
 	{UPSKIRT_RENDER_GNUPLOT, "gnuplot", "Render gnuplot plot."},
-	{UPSKIRT_RENDER_CSS, "style", "Set specified style-sheet."}
+	{UPSKIRT_RENDER_CSS, "style", "Set specified style-sheet."},
+	{UPSKIRT_RENDER_SMARTYPANTS, "smartypants", "Render quotes, dashes and ellipses as typographic punctuation."},
 };
 
 static const char *category_prefix = "all-";
@@ -76,6 +90,7 @@ static const char *negative_prefix = "no-";
 
 #define DEF_IUNIT 1024
 #define DEF_OUNIT 64
+#define DEF_FLUSH (64 * 1024)
 #define DEF_MAX_NESTING 16
 
 /* Get local info */
@@ -98,11 +113,15 @@ print_help(const char *basename)
 	size_t e;
 
 	/* usage */
-	printf("Usage: %s [OPTION]... [FILE]\n\n", basename);
+	printf("Usage: %s [OPTION]... [FILE]\n", basename);
+	printf("  or:  %s --batch [OPTION]... [FILE]...\n\n", basename);
 
 	/* description */
 	printf("Process the Markdown in FILE (or standard input) and render it to standard output, using the Upskirt library. "
 	       "Parsing and rendering can be customized through the options below. The default is to parse pure markdown and output HTML.\n\n");
+	printf("In batch mode every FILE is rendered to a file of the same name with the extension of the output format, "
+	       "on a pool of worker threads. Without FILE, the list is read from standard input, one file per line; "
+	       "a line may give the output file after a tab.\n\n");
 
 	/* main options */
 	printf("Main options:\n");
@@ -114,6 +133,18 @@ print_help(const char *basename)
 	
 
 	print_option('T', "time", "Show time spent in rendering.");
+	print_option('b', "batch", "Render many files, see above.");
+	print_option('j', "jobs=N", "Number of worker threads in batch mode. Default is the number of CPUs.");
+	print_option(  0, "output-dir=DIR", "Write the batch outputs to DIR, created if missing, instead of next to the inputs.");
+	print_option('p', "parallel=N", "Render a large file on N threads, split between top-level blocks.");
+	print_option(  0, "max-output=N", "Stop rendering past N bytes of output.");
+	print_option(  0, "max-steps=N", "Stop rendering past N blocks and spans parsed.");
+	print_option(  0, "timeout=MS", "Stop rendering MS milliseconds after it started.");
+	print_option(  0, "tree", "Parse the input to a document tree first, then render the tree.");
+	print_option(  0, "save-tree=FILE", "Also save the document tree to FILE, for --load-tree. Implies --tree.");
+	print_option(  0, "load-tree", "Render the document tree saved in the input instead of parsing it. The extensions are those it was saved with.");
+	print_option(  0, "cache-dir=DIR", "Keep the outputs in DIR and reuse them while the input, the files it includes, the options and the version are the same. Not with --stream or --save-tree.");
+	print_option(  0, "stream", "Read the input by input-unit chunks and write every block once rendered.");
 	print_option('i', "input-unit=N", "Reading block size. Default is " str(DEF_IUNIT) ".");
 	print_option('o', "output-unit=N", "Writing block size. Default is " str(DEF_OUNIT) ".");
 	print_option('h', "help", "Print this help text.");
@@ -146,7 +177,7 @@ print_help(const char *basename)
 	       "Options are processed in order, so in case of contradictory options the last specified stands.\n\n");
 
 	printf("When FILE is '-', read standard input. If no FILE was given, read standard input. Use '--' to signal end of option parsing. "
-	       "Exit status is 0 if no errors occurred, 1 with option parsing errors, 4 with memory allocation errors or 5 with I/O errors.\n\n");
+	       "Exit status is 0 if no errors occurred, 1 with option parsing errors, 4 with memory allocation errors, 5 with I/O errors or 6 when rendering was stopped by a limit.\n\n");
 }
 
 
@@ -163,6 +194,20 @@ struct option_data {
 	size_t iunit;
 	size_t ounit;
 	const char *filename;
+	const char **files;
+	int nfiles;
+
+	/* batch mode */
+	int batch;
+	long jobs;
+	const char *output_dir;
+	long parallel;
+	int stream;
+	int tree;
+	const char *save_tree;
+	int load_tree;
+	const char *cache_dir;
+	sd_render_limits limits;
 
 	/* renderer */
 	enum renderer_type renderer;
@@ -198,6 +243,11 @@ parse_short_option(char opt, const char *next, void *opaque)
 		return 1;
 	}
 
+	if (opt == 'b') {
+		data->batch = 1;
+		return 1;
+	}
+
 	/* options requiring value */
 	/* FIXME: add validation */
 
@@ -221,10 +271,30 @@ parse_short_option(char opt, const char *next, void *opaque)
 		return 2;
 	}
 
+	if (opt == 'j' && isNum) {
+		data->jobs = num;
+		return 2;
+	}
+
+	if (opt == 'p' && isNum) {
+		data->parallel = num;
+		return 2;
+	}
+
 	fprintf(stderr, "Wrong option '-%c' found.\n", opt);
 	return 0;
 }
 
+static const char *
+strprefix(const char *str, const char *prefix)
+{
+	while (*prefix) {
+		if (!(*str && *str == *prefix)) return 0;
+		prefix++; str++;
+	}
+	return str;
+}
+
 static int
 parse_category_option(const char *opt, struct option_data *data)
 {
@@ -325,6 +395,26 @@ parse_long_option(const char *opt, const char *next, void *opaque)
 		return 1;
 	}
 
+	if (strcmp(opt, "stream")==0) {
+		data->stream = 1;
+		return 1;
+	}
+
+	if (strcmp(opt, "batch")==0) {
+		data->batch = 1;
+		return 1;
+	}
+
+	if (strcmp(opt, "tree")==0) {
+		data->tree = 1;
+		return 1;
+	}
+
+	if (strcmp(opt, "load-tree")==0) {
+		data->load_tree = 1;
+		return 1;
+	}
+
 	/* FIXME: validation */
 
 	if (strcmp(opt, "max-nesting")==0 && isNum) {
@@ -343,6 +433,39 @@ parse_long_option(const char *opt, const char *next, void *opaque)
 		data->ounit = num;
 		return 2;
 	}
+	if (strcmp(opt, "jobs")==0 && isNum) {
+		data->jobs = num;
+		return 2;
+	}
+	if (strcmp(opt, "save-tree")==0 && next) {
+		data->save_tree = next;
+		data->tree = 1;
+		return 2;
+	}
+	if (strcmp(opt, "cache-dir")==0 && next) {
+		data->cache_dir = next;
+		return 2;
+	}
+	if (strcmp(opt, "output-dir")==0 && next) {
+		data->output_dir = next;
+		return 2;
+	}
+	if (strcmp(opt, "parallel")==0 && isNum) {
+		data->parallel = num;
+		return 2;
+	}
+	if (strcmp(opt, "max-output")==0 && isNum) {
+		data->limits.max_output = num;
+		return 2;
+	}
+	if (strcmp(opt, "max-steps")==0 && isNum) {
+		data->limits.max_steps = num;
+		return 2;
+	}
+	if (strcmp(opt, "timeout")==0 && isNum) {
+		data->limits.timeout_ms = num;
+		return 2;
+	}
 
 	if (strcmp(opt, "html")==0) {
 		data->renderer = RENDERER_HTML;
@@ -367,15 +490,989 @@ parse_argument(int argn, const char *arg, int is_forced, void *opaque)
 {
 	struct option_data *data = opaque;
 
-	if (argn == 0) {
-		/* Input file */
-		if (strcmp(arg, "-")!=0 || is_forced) data->filename = arg;
+	/* Input files; more than one is checked once batch mode is known */
+	if (strcmp(arg, "-")!=0 || is_forced) {
+		if (argn == 0) data->filename = arg;
+		data->files[data->nfiles++] = arg;
+	}
+
+	return 1;
+}
+
+
+/* RENDER LIMITS */
+
+/* limit_reached • tells which limit stopped the last render of a file,
+ * standard input when NULL; returns the exit status */
+static int
+limit_reached(const sd_document *document, const char *name)
+{
+	static const char *limits[] = { NULL, "output", "step", "time" };
+	sd_render_status status = sd_document_status(document);
+
+	if (status == UPSKIRT_RENDER_OK)
+		return EXIT_SUCCESS;
+
+	if (name)
+		fprintf(stderr, "Rendering of \"%s\" stopped: %s limit reached.\n", name, limits[status]);
+	else
+		fprintf(stderr, "Rendering stopped: %s limit reached.\n", limits[status]);
+	return 6;
+}
+
+
+/* RENDER CACHE */
+
+/* An output is kept in the cache directory under the SHA-256 of everything
+ * it depends on: the version, the options changing it, the input and the
+ * files the input includes. An entry is served on its name alone, so the
+ * hash must not collide. It is written to a temporary file first, then
+ * renamed to its key, so that a reader only ever finds whole outputs; the
+ * ones a crash leaves behind are removed by a later run. */
+
+#define CACHE_KEY_SIZE 65	/* 64 hexadecimal digits and the NUL */
+#define CACHE_SUFFIX_SIZE 64	/* .<pid>.<serial>.tmp of a temporary file */
+#define CACHE_STALE_SECONDS 3600	/* age of a temporary file left by a crash */
+
+/* the files named by the input, in the order they are met */
+struct cache_files {
+	char **paths;
+	size_t count;
+	size_t asize;
+};
+
+/* SHA-256 of the key material, as in FIPS 180-4 */
+struct cache_sha256 {
+	uint32_t state[8];
+	uint64_t size;		/* bytes hashed so far */
+	uint8_t block[64];
+};
+
+static const uint32_t cache_sha256_k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define cache_ror(x, n)	(((x) >> (n)) | ((x) << (32 - (n))))
+
+static void
+cache_sha256_init(struct cache_sha256 *sha)
+{
+	static const uint32_t init[8] = {
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+		0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+	};
+
+	memcpy(sha->state, init, sizeof(init));
+	sha->size = 0;
+}
+
+/* cache_sha256_block • mixes a 64-byte block into the state */
+static void
+cache_sha256_block(struct cache_sha256 *sha, const uint8_t *block)
+{
+	uint32_t w[64], v[8], t1, t2;
+	int i;
+
+	for (i = 0; i < 16; i++)
+		w[i] = (uint32_t)block[4 * i] << 24 | (uint32_t)block[4 * i + 1] << 16 |
+			(uint32_t)block[4 * i + 2] << 8 | block[4 * i + 3];
+	for (i = 16; i < 64; i++)
+		w[i] = w[i - 16] + w[i - 7] +
+			(cache_ror(w[i - 15], 7) ^ cache_ror(w[i - 15], 18) ^ (w[i - 15] >> 3)) +
+			(cache_ror(w[i - 2], 17) ^ cache_ror(w[i - 2], 19) ^ (w[i - 2] >> 10));
+
+	memcpy(v, sha->state, sizeof(v));
+	for (i = 0; i < 64; i++) {
+		t1 = v[7] + (cache_ror(v[4], 6) ^ cache_ror(v[4], 11) ^ cache_ror(v[4], 25)) +
+			((v[4] & v[5]) ^ (~v[4] & v[6])) + cache_sha256_k[i] + w[i];
+		t2 = (cache_ror(v[0], 2) ^ cache_ror(v[0], 13) ^ cache_ror(v[0], 22)) +
+			((v[0] & v[1]) ^ (v[0] & v[2]) ^ (v[1] & v[2]));
+		memmove(v + 1, v, 7 * sizeof(uint32_t));
+		v[4] += t1;
+		v[0] = t1 + t2;
+	}
+
+	for (i = 0; i < 8; i++)
+		sha->state[i] += v[i];
+}
+
+static void
+cache_sha256_update(struct cache_sha256 *sha, const void *data, size_t size)
+{
+	const uint8_t *bytes = data;
+	size_t used = sha->size % 64, n;
+
+	sha->size += size;
+	while (size) {
+		n = 64 - used < size ? 64 - used : size;
+		memcpy(sha->block + used, bytes, n);
+		bytes += n;
+		size -= n;
+		used += n;
+
+		if (used == 64) {
+			cache_sha256_block(sha, sha->block);
+			used = 0;
+		}
+	}
+}
+
+/* cache_sha256_final • the digest in hexadecimal, in key */
+static void
+cache_sha256_final(struct cache_sha256 *sha, char *key)
+{
+	uint64_t bits = sha->size * 8;
+	uint8_t pad[72] = { 0x80 };
+	size_t n = 64 - (sha->size + 8) % 64;
+	int i;
+
+	for (i = 0; i < 8; i++)
+		pad[n + i] = (uint8_t)(bits >> (56 - 8 * i));
+	cache_sha256_update(sha, pad, n + 8);
+
+	for (i = 0; i < 8; i++)
+		snprintf(key + 8 * i, CACHE_KEY_SIZE - 8 * i, "%08lx", (unsigned long)sha->state[i]);
+}
+
+/* cache_hash • hashes a field preceded by its size, so that the fields
+ * cannot run into each other */
+static void
+cache_hash(struct cache_sha256 *sha, const void *data, size_t size)
+{
+	uint8_t prefix[8];
+	uint64_t n = size;
+	size_t i;
+
+	for (i = 0; i < sizeof(prefix); i++, n >>= 8)
+		prefix[i] = (uint8_t)(n & 0xFF);
+
+	cache_sha256_update(sha, prefix, sizeof(prefix));
+	cache_sha256_update(sha, data, size);
+}
+
+static int
+cache_is_file(const char *path)
+{
+	struct stat st;
+	return stat(path, &st) == 0 && (st.st_mode & S_IFMT) == S_IFREG;
+}
+
+static int
+cache_is_directory(const char *path)
+{
+	struct stat st;
+	return stat(path, &st) == 0 && (st.st_mode & S_IFMT) == S_IFDIR;
+}
+
+/* cache_scan • adds the files named by @include and @bib in data to those
+ * not met yet; the names are read as the parser reads them, relative to the
+ * working directory, wherever they appear. Returns 0 when out of memory */
+static int
+cache_scan(struct cache_files *files, const uint8_t *data, size_t size)
+{
+	const uint8_t *p = data, *end = data + size;
+	size_t n, skip, i;
+	int bib;
+
+	while ((p = memchr(p, '@', end - p)) != NULL) {
+		if (end - p >= 9 && memcmp(p, "@include(", 9) == 0) {
+			skip = 9;
+			bib = 0;
+		} else if (end - p >= 5 && memcmp(p, "@bib(", 5) == 0) {
+			skip = 5;
+			bib = 1;
+		} else {
+			p++;
+			continue;
+		}
+
+		p += skip;
+		for (n = 0; p + n < end && p[n] != ')' && !(bib && p[n] == '\n'); n++);
+
+		for (i = 0; i < files->count; i++)
+			if (strlen(files->paths[i]) == n && memcmp(files->paths[i], p, n) == 0)
+				break;
+
+		if (n && i == files->count) {
+			if (files->count == files->asize) {
+				size_t neosz = files->asize ? files->asize * 2 : 16;
+				char **paths = realloc(files->paths, neosz * sizeof(char *));
+				if (!paths) return 0;
+				files->paths = paths;
+				files->asize = neosz;
+			}
+
+			files->paths[files->count] = malloc(n + 1);
+			if (!files->paths[files->count]) return 0;
+			memcpy(files->paths[files->count], p, n);
+			files->paths[files->count++][n] = 0;
+		}
+
+		p += n;
+	}
+
+	return 1;
+}
+
+/* cache_key • the key of the output of the input with the options; returns
+ * 0 when it cannot be told */
+static int
+cache_key(const struct option_data *data, const sd_input *input, char *key)
+{
+	long settings[] = {
+		data->renderer, data->extensions, data->render_flags, data->toc_level,
+		(long)data->max_nesting, data->load_tree, (long)data->limits.max_output,
+		(long)data->limits.max_steps, (long)data->limits.timeout_ms
+	};
+	struct cache_files files = { NULL, 0, 0 };
+	struct cache_sha256 sha;
+	sd_input file;
+	uint8_t found;
+	size_t i;
+	int ok;
+
+	cache_sha256_init(&sha);
+	cache_hash(&sha, UPSKIRT_VERSION, strlen(UPSKIRT_VERSION));
+	cache_hash(&sha, settings, sizeof(settings));
+	cache_hash(&sha, input->data, input->size);
+
+	/* the included files, then the ones they include, each once; a missing
+	 * file counts too, so that creating it changes the key. A saved tree
+	 * already holds what it included */
+	ok = data->load_tree || cache_scan(&files, input->data, input->size);
+	for (i = 0; ok && i < files.count; i++) {
+		found = cache_is_file(files.paths[i]) && sd_input_load(&file, files.paths[i]) == 0;
+
+		cache_hash(&sha, files.paths[i], strlen(files.paths[i]));
+		cache_hash(&sha, &found, 1);
+		if (found) {
+			cache_hash(&sha, file.data, file.size);
+			ok = cache_scan(&files, file.data, file.size);
+			sd_input_release(&file);
+		}
+	}
+
+	for (i = 0; i < files.count; i++)
+		free(files.paths[i]);
+	free(files.paths);
+
+	cache_sha256_final(&sha, key);
+	return ok;
+}
+
+/* cache_path • the path of a key in the cache, with a suffix when given */
+static char *
+cache_path(const char *dir, const char *key, const char *suffix)
+{
+	size_t size = strlen(dir) + 1 + CACHE_KEY_SIZE + (suffix ? strlen(suffix) : 0);
+	char *path = malloc(size);
+
+	if (path)
+		snprintf(path, size, "%s/%s%s", dir, key, suffix ? suffix : "");
+	return path;
+}
+
+/* cache_load • maps the output kept under a key; returns 0 on a hit */
+static int
+cache_load(sd_input *cached, const char *dir, const char *key)
+{
+	char *path = cache_path(dir, key, NULL);
+	int status = -1;
+
+	if (path && cache_is_file(path))
+		status = sd_input_load(cached, path);
+
+	free(path);
+	return status;
+}
+
+/* cache_open • creates the temporary file of an output entering the cache;
+ * serial tells apart the renders of the same process */
+static FILE *
+cache_open(const char *dir, const char *key, unsigned long serial, char **temp)
+{
+	char suffix[CACHE_SUFFIX_SIZE];
+	FILE *file;
+
+#ifdef _WIN32
+	snprintf(suffix, sizeof(suffix), ".%lu.%lu.tmp", (unsigned long)GetCurrentProcessId(), serial);
+#else
+	snprintf(suffix, sizeof(suffix), ".%lu.%lu.tmp", (unsigned long)getpid(), serial);
+#endif
+
+	*temp = cache_path(dir, key, suffix);
+	if (!*temp)
+		return NULL;
+
+	file = fopen(*temp, "wb");
+	if (!file) {
+		free(*temp);
+		*temp = NULL;
+	}
+	return file;
+}
+
+/* the output of a render written both to its destination and to the cache */
+struct cache_output {
+	FILE *out;
+	FILE *entry;
+};
+
+/* cache_write • writes the output flushed by a render, keeping a copy */
+static void
+cache_write(const uint8_t *data, size_t size, void *opaque)
+{
+	struct cache_output *output = opaque;
+
+	(void)fwrite(data, 1, size, output->out);
+	(void)fwrite(data, 1, size, output->entry);
+}
+
+/* cache_commit • closes a temporary file and renames it to its key when the
+ * output is whole and was written without errors, or removes it */
+static void
+cache_commit(FILE *file, char *temp, const char *dir, const char *key, int whole)
+{
+	char *path;
+
+	if (ferror(file) | fclose(file))
+		whole = 0;
+
+	path = whole ? cache_path(dir, key, NULL) : NULL;
+#ifdef _WIN32
+	if (!path || !MoveFileExA(temp, path, MOVEFILE_REPLACE_EXISTING))
+#else
+	if (!path || rename(temp, path) != 0)
+#endif
+		remove(temp);
+
+	free(path);
+	free(temp);
+}
+
+
+/* cache_is_temp • whether a file name is the one of a temporary file,
+ * <key>.<pid>.<serial>.tmp, the suffix being shorter than CACHE_SUFFIX_SIZE */
+static int
+cache_is_temp(const char *name)
+{
+	size_t size = strlen(name), i;
+
+	if (size <= CACHE_KEY_SIZE + 4 || size >= CACHE_KEY_SIZE + CACHE_SUFFIX_SIZE ||
+	    name[CACHE_KEY_SIZE - 1] != '.' ||
+	    strcmp(name + size - 4, ".tmp") != 0)
+		return 0;
+
+	for (i = 0; i < CACHE_KEY_SIZE - 1; i++)
+		if (!strchr("0123456789abcdef", name[i]))
+			return 0;
+
+	return 1;
+}
+
+/* cache_sweep • removes the temporary files a render that crashed left
+ * behind; those untouched for CACHE_STALE_SECONDS cannot belong to a render
+ * still running */
+static void
+cache_sweep(const char *dir)
+{
+	char *path = malloc(strlen(dir) + 1 + CACHE_KEY_SIZE + CACHE_SUFFIX_SIZE);
+#ifdef _WIN32
+	WIN32_FIND_DATAA entry;
+	ULARGE_INTEGER now, written;
+	FILETIME ft;
+	HANDLE find;
+
+	if (!path) return;
+
+	GetSystemTimeAsFileTime(&ft);
+	now.LowPart = ft.dwLowDateTime;
+	now.HighPart = ft.dwHighDateTime;
+
+	sprintf(path, "%s\\*.tmp", dir);
+	find = FindFirstFileA(path, &entry);
+	if (find != INVALID_HANDLE_VALUE) {
+		do {
+			written.LowPart = entry.ftLastWriteTime.dwLowDateTime;
+			written.HighPart = entry.ftLastWriteTime.dwHighDateTime;
+			if (!cache_is_temp(entry.cFileName) ||
+			    written.QuadPart + CACHE_STALE_SECONDS * 10000000ULL > now.QuadPart)
+				continue;
+
+			sprintf(path, "%s\\%s", dir, entry.cFileName);
+			remove(path);
+		} while (FindNextFileA(find, &entry));
+		FindClose(find);
+	}
+#else
+	time_t now = time(NULL);
+	struct dirent *entry;
+	struct stat st;
+	DIR *handle;
+
+	if (!path) return;
+
+	handle = opendir(dir);
+	while (handle && (entry = readdir(handle)) != NULL) {
+		if (!cache_is_temp(entry->d_name))
+			continue;
+
+		sprintf(path, "%s/%s", dir, entry->d_name);
+		if (stat(path, &st) == 0 && (st.st_mode & S_IFMT) == S_IFREG &&
+		    now - st.st_mtime >= CACHE_STALE_SECONDS)
+			remove(path);
+	}
+	if (handle)
+		closedir(handle);
+#endif
+
+	free(path);
+}
+
+
+/* BATCH MODE */
+
+#ifdef _WIN32
+typedef HANDLE batch_thread;
+typedef CRITICAL_SECTION batch_lock;
+#define batch_lock_init(l)	InitializeCriticalSection(l)
+#define batch_lock_free(l)	DeleteCriticalSection(l)
+#define batch_lock_enter(l)	EnterCriticalSection(l)
+#define batch_lock_leave(l)	LeaveCriticalSection(l)
+#else
+typedef pthread_t batch_thread;
+typedef pthread_mutex_t batch_lock;
+#define batch_lock_init(l)	pthread_mutex_init(l, NULL)
+#define batch_lock_free(l)	pthread_mutex_destroy(l)
+#define batch_lock_enter(l)	pthread_mutex_lock(l)
+#define batch_lock_leave(l)	pthread_mutex_unlock(l)
+#endif
+
+struct batch_job {
+	char *input;
+	char *output;
+};
+
+struct batch {
+	const sd_document_config *config;
+	const sd_render_limits *limits;
+	size_t ounit;
+	const struct option_data *cache;	/* options keying the cached outputs */
+
+	struct batch_job *jobs;
+	size_t count;
+
+	/* shared between the workers */
+	batch_lock lock;
+	size_t next;
+	size_t failed;
+	size_t bytes_in;
+	size_t bytes_out;
+};
+
+/* wall clock time in seconds, for the throughput report */
+static double
+batch_time(void)
+{
+#ifdef _WIN32
+	LARGE_INTEGER count, freq;
+	QueryPerformanceCounter(&count);
+	QueryPerformanceFrequency(&freq);
+	return (double)count.QuadPart / (double)freq.QuadPart;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+#endif
+}
+
+static long
+batch_cpu_count(void)
+{
+#ifdef _WIN32
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	return info.dwNumberOfProcessors;
+#else
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	return n > 0 ? n : 1;
+#endif
+}
+
+static char *
+batch_strndup(const char *str, size_t size)
+{
+	char *copy = malloc(size + 1);
+	if (!copy) return NULL;
+	memcpy(copy, str, size);
+	copy[size] = 0;
+	return copy;
+}
+
+/* the output of a file with no explicit destination: its name with the
+ * extension of the output format, in output_dir if given */
+static char *
+batch_output_path(const char *input, const char *output_dir, const char *ext)
+{
+	const char *name = input, *dot, *p;
+	size_t dir_size, name_size, n;
+	char *path;
+
+	for (p = input; *p; p++)
+		if (*p == '/' || *p == '\\') name = p + 1;
+
+	if (!output_dir) {
+		output_dir = input;
+		dir_size = name - input;
+	} else {
+		dir_size = strlen(output_dir);
+	}
+
+	/* an input that already has the extension keeps it, so that it is
+	 * never overwritten */
+	dot = strrchr(name, '.');
+	name_size = (dot && dot != name && strcmp(dot, ext) != 0) ? (size_t)(dot - name) : strlen(name);
+
+	path = malloc(dir_size + 1 + name_size + strlen(ext) + 1);
+	if (!path) return NULL;
+
+	memcpy(path, output_dir, dir_size);
+	n = dir_size;
+	if (n && path[n - 1] != '/' && path[n - 1] != '\\')
+		path[n++] = '/';
+	memcpy(path + n, name, name_size);
+	strcpy(path + n + name_size, ext);
+
+	return path;
+}
+
+/* batch_output_dir • creates the directory of the outputs when missing;
+ * returns 0 when there is no such directory after all */
+static int
+batch_output_dir(const char *dir)
+{
+	if (cache_is_directory(dir))
+		return 1;
+
+#ifdef _WIN32
+	if (_mkdir(dir) == 0)
+#else
+	if (mkdir(dir, 0777) == 0)
+#endif
 		return 1;
+
+	fprintf(stderr, "Unable to create output directory \"%s\": %s\n", dir, strerror(errno));
+	return 0;
+}
+
+static int
+batch_add(struct batch *batch, size_t *asize, const char *input, size_t input_size, const char *output, size_t output_size, const struct option_data *data, const char *ext)
+{
+	struct batch_job *job;
+
+	if (batch->count == *asize) {
+		size_t neosz = *asize ? *asize * 2 : 64;
+		job = realloc(batch->jobs, neosz * sizeof(struct batch_job));
+		if (!job) return 0;
+		batch->jobs = job;
+		*asize = neosz;
 	}
 
-	fprintf(stderr, "Too many arguments.\n");
+	job = &batch->jobs[batch->count];
+	job->input = batch_strndup(input, input_size);
+	if (!job->input) return 0;
+
+	if (output)
+		job->output = batch_strndup(output, output_size);
+	else
+		job->output = batch_output_path(job->input, data->output_dir, ext);
+	if (!job->output) {
+		free(job->input);
+		return 0;
+	}
+
+	batch->count++;
+	return 1;
+}
+
+static void
+batch_free_jobs(struct batch *batch)
+{
+	size_t i;
+
+	for (i = 0; i < batch->count; i++) {
+		free(batch->jobs[i].input);
+		free(batch->jobs[i].output);
+	}
+	free(batch->jobs);
+}
+
+/* reads the list of files from standard input: one input per line,
+ * optionally followed by a tab and its output; returns an exit status */
+static int
+batch_read_manifest(struct batch *batch, size_t *asize, const struct option_data *data, const char *ext)
+{
+	sd_input manifest;
+	size_t beg = 0, end, len;
+	int ok = 1;
+
+	if (sd_input_read(&manifest, stdin, data->iunit)) {
+		fprintf(stderr, "I/O errors found while reading input.\n");
+		return 5;
+	}
+
+	while (ok && beg < manifest.size) {
+		const char *line = (const char *)manifest.data + beg;
+		const char *tab;
+
+		for (end = beg; end < manifest.size && manifest.data[end] != '\n'; end++);
+		len = end - beg;
+		if (len && line[len - 1] == '\r')
+			len--;
+
+		if (len) {
+			tab = memchr(line, '\t', len);
+			if (tab)
+				ok = batch_add(batch, asize, line, tab - line, tab + 1, line + len - tab - 1, data, ext);
+			else
+				ok = batch_add(batch, asize, line, len, NULL, 0, data, ext);
+		}
+
+		beg = end + 1;
+	}
+
+	sd_input_release(&manifest);
+	return ok ? EXIT_SUCCESS : 4;
+}
+
+/* renders one job, or copies its output from the cache; returns the size of
+ * its input or -1 on errors */
+static long long
+batch_render_job(sd_document *document, sd_buffer *ob, const struct batch_job *job, const struct option_data *cache, unsigned long serial)
+{
+	char key[CACHE_KEY_SIZE], *temp = NULL;
+	sd_input input, cached;
+	FILE *file, *entry = NULL;
+	long long size;
+	int keyed, hit;
+
+	if (sd_input_load(&input, job->input)) {
+		fprintf(stderr, "Unable to open input file \"%s\": %s\n", job->input, strerror(errno));
+		return -1;
+	}
+
+	ob->size = 0;
+	keyed = cache && cache_key(cache, &input, key);
+	hit = keyed && cache_load(&cached, cache->cache_dir, key) == 0;
+	if (hit) {
+		sd_buffer_put(ob, cached.data, cached.size);
+		sd_input_release(&cached);
+	} else
+		sd_document_render(document, ob, input.data, input.size, -1);
+	size = input.size;
+	sd_input_release(&input);
+
+	if (!hit && limit_reached(document, job->input) != EXIT_SUCCESS)
+		return -1;
+
+	file = fopen(job->output, "wb");
+	if (!file) {
+		fprintf(stderr, "Unable to open output file \"%s\": %s\n", job->output, strerror(errno));
+		return -1;
+	}
+
+	(void)fwrite(ob->data, 1, ob->size, file);
+	if (ferror(file) | fclose(file)) {
+		fprintf(stderr, "I/O errors found while writing \"%s\".\n", job->output);
+		return -1;
+	}
+
+	if (keyed && !hit && (entry = cache_open(cache->cache_dir, key, serial, &temp)) != NULL) {
+		(void)fwrite(ob->data, 1, ob->size, entry);
+		cache_commit(entry, temp, cache->cache_dir, key, 1);
+	}
+
+	return size;
+}
+
+/* a worker renders jobs with its own document until there are none left */
+static void
+batch_worker(struct batch *batch)
+{
+	sd_document *document = sd_document_new_from_config(batch->config);
+	sd_buffer *ob = sd_buffer_new(batch->ounit);
+	size_t failed = 0, bytes_in = 0, bytes_out = 0;
+
+	sd_document_set_limits(document, batch->limits);
+
+	while (1) {
+		const struct batch_job *job = NULL;
+		long long size;
+
+		batch_lock_enter(&batch->lock);
+		if (batch->next < batch->count)
+			job = &batch->jobs[batch->next++];
+		batch_lock_leave(&batch->lock);
+
+		if (!job)
+			break;
+
+		size = batch_render_job(document, ob, job, batch->cache, (unsigned long)(job - batch->jobs));
+		if (size < 0) {
+			failed++;
+		} else {
+			bytes_in += (size_t)size;
+			bytes_out += ob->size;
+		}
+	}
+
+	batch_lock_enter(&batch->lock);
+	batch->failed += failed;
+	batch->bytes_in += bytes_in;
+	batch->bytes_out += bytes_out;
+	batch_lock_leave(&batch->lock);
+
+	sd_buffer_free(ob);
+	sd_document_free(document);
+}
+
+#ifdef _WIN32
+static DWORD WINAPI
+batch_thread_main(LPVOID opaque)
+{
+	batch_worker(opaque);
 	return 0;
 }
+#else
+static void *
+batch_thread_main(void *opaque)
+{
+	batch_worker(opaque);
+	return NULL;
+}
+#endif
+
+/* renders all the files of the batch on a pool of threads sharing one
+ * configuration, then reports the throughput on standard error */
+static int
+batch_render(const struct option_data *data, const sd_document_config *config, const char *ext)
+{
+	struct batch batch;
+	batch_thread *threads;
+	size_t asize = 0, i;
+	long jobs, started = 0;
+	double t1, t2;
+	int status = EXIT_SUCCESS;
+
+	memset(&batch, 0, sizeof(batch));
+	batch.config = config;
+	batch.limits = &data->limits;
+	batch.ounit = data->ounit;
+	batch.cache = data->cache_dir ? data : NULL;
+
+	/* checked once rather than failing every job */
+	if (data->output_dir && !batch_output_dir(data->output_dir))
+		return 5;
+
+	if (data->nfiles) {
+		for (i = 0; status == EXIT_SUCCESS && i < (size_t)data->nfiles; i++)
+			if (!batch_add(&batch, &asize, data->files[i], strlen(data->files[i]), NULL, 0, data, ext))
+				status = 4;
+	} else {
+		status = batch_read_manifest(&batch, &asize, data, ext);
+	}
+	if (status == 4)
+		fprintf(stderr, "Allocation failed.\n");
+	if (status != EXIT_SUCCESS || !batch.count) {
+		batch_free_jobs(&batch);
+		return status;
+	}
+
+	jobs = data->jobs > 0 ? data->jobs : batch_cpu_count();
+	if ((size_t)jobs > batch.count)
+		jobs = (long)batch.count;
+
+	batch_lock_init(&batch.lock);
+	threads = malloc(jobs * sizeof(batch_thread));
+
+	t1 = batch_time();
+	/* the main thread works as well */
+	for (started = 0; threads && started < jobs - 1; started++) {
+#ifdef _WIN32
+		threads[started] = CreateThread(NULL, 0, batch_thread_main, &batch, 0, NULL);
+		if (!threads[started]) break;
+#else
+		if (pthread_create(&threads[started], NULL, batch_thread_main, &batch) != 0) break;
+#endif
+	}
+	batch_worker(&batch);
+	for (i = 0; i < (size_t)started; i++) {
+#ifdef _WIN32
+		WaitForSingleObject(threads[i], INFINITE);
+		CloseHandle(threads[i]);
+#else
+		pthread_join(threads[i], NULL);
+#endif
+	}
+	t2 = batch_time();
+
+	fprintf(stderr, "Rendered %lu files (%lu failed) on %ld thread%s in %.3f s: %.1f files/s, %.2f MB/s in, %.2f MB/s out.\n",
+	        (unsigned long)(batch.count - batch.failed), (unsigned long)batch.failed,
+	        started + 1, started ? "s" : "", t2 - t1,
+	        t2 > t1 ? (batch.count - batch.failed) / (t2 - t1) : 0.0,
+	        t2 > t1 ? batch.bytes_in / (t2 - t1) / 1e6 : 0.0,
+	        t2 > t1 ? batch.bytes_out / (t2 - t1) / 1e6 : 0.0);
+
+	batch_free_jobs(&batch);
+	free(threads);
+	batch_lock_free(&batch.lock);
+
+	return batch.failed ? 5 : EXIT_SUCCESS;
+}
+
+
+/* STREAM MODE */
+
+/* write_output • writes the output flushed by a render */
+static void
+write_output(const uint8_t *data, size_t size, void *opaque)
+{
+	(void)fwrite(data, 1, size, opaque);
+}
+
+/* stream_write • writes and empties the output rendered so far */
+static void
+stream_write(sd_buffer *ob)
+{
+	if (!ob->size)
+		return;
+
+	(void)fwrite(ob->data, 1, ob->size, stdout);
+	fflush(stdout);
+	ob->size = 0;
+}
+
+/* the input is fed to the document as it is read */
+static int
+stream_render(const struct option_data *data, sd_document *document, sd_buffer *ob)
+{
+	FILE *in = stdin;
+	uint8_t *chunk;
+	size_t n;
+	int status = EXIT_SUCCESS;
+
+	if (data->filename && (in = fopen(data->filename, "rb")) == NULL) {
+		fprintf(stderr, "Unable to open input file \"%s\": %s\n", data->filename, strerror(errno));
+		return 5;
+	}
+
+	chunk = malloc(data->iunit);
+	if (!chunk) {
+		fprintf(stderr, "Allocation failed.\n");
+		if (in != stdin)
+			fclose(in);
+		return 4;
+	}
+
+	while ((n = fread(chunk, 1, data->iunit, in)) > 0) {
+		sd_document_feed(document, ob, chunk, n);
+		stream_write(ob);
+	}
+
+	if (ferror(in)) {
+		fprintf(stderr, "I/O errors found while reading input.\n");
+		status = 5;
+	}
+
+	sd_document_finish(document, ob);
+	stream_write(ob);
+
+	if (in != stdin)
+		fclose(in);
+	free(chunk);
+
+	if (ferror(stdout)) {
+		fprintf(stderr, "I/O errors found while writing output.\n");
+		return 5;
+	}
+
+	return status;
+}
+
+
+/* TREE MODE */
+
+/* tree_save • writes a tree to the file given by --save-tree */
+static int
+tree_save(const struct option_data *data, const sd_tree *tree)
+{
+	sd_buffer *saved = sd_buffer_new(data->ounit);
+	FILE *file;
+	int status = EXIT_SUCCESS;
+
+	sd_tree_write(saved, tree);
+
+	file = fopen(data->save_tree, "wb");
+	if (!file || fwrite(saved->data, 1, saved->size, file) != saved->size) {
+		fprintf(stderr, "Unable to write document tree \"%s\": %s\n", data->save_tree, strerror(errno));
+		status = 5;
+	}
+	if (file && fclose(file) != 0 && status == EXIT_SUCCESS) {
+		fprintf(stderr, "Unable to write document tree \"%s\": %s\n", data->save_tree, strerror(errno));
+		status = 5;
+	}
+
+	sd_buffer_free(saved);
+	return status;
+}
+
+/* tree_render • parses the input to a tree with the recording renderer, then
+ * renders the tree with the document; returns the exit status */
+static int
+tree_render(const struct option_data *data, sd_document *document, ext_definition *ext, const sd_input *input, sd_buffer *ob)
+{
+	sd_renderer *recorder = sd_tree_renderer_new();
+	sd_document *parser = sd_document_new(recorder, data->extensions, ext, NULL, data->max_nesting);
+	sd_buffer *scratch = sd_buffer_new(data->ounit);
+	sd_tree *tree;
+	int status = EXIT_SUCCESS;
+
+	sd_document_set_limits(parser, &data->limits);
+	sd_document_render(parser, scratch, input->data, input->size, -1);
+	tree = sd_tree_renderer_take(recorder);
+
+	if (data->save_tree && tree)
+		status = tree_save(data, tree);
+	sd_document_render_tree(document, ob, tree);
+
+	sd_tree_free(tree);
+	sd_buffer_free(scratch);
+	sd_document_free(parser);
+	sd_tree_renderer_free(recorder);
+	return status;
+}
+
+/* tree_load • renders the tree saved in the input, read where it lies */
+static int
+tree_load(const struct option_data *data, sd_document *document, const sd_input *input, sd_buffer *ob)
+{
+	sd_tree tree;
+
+	if (sd_tree_load(&tree, input->data, input->size)) {
+		fprintf(stderr, "Invalid document tree in \"%s\".\n", data->filename ? data->filename : "-");
+		return 5;
+	}
+
+	sd_document_render_tree(document, ob, &tree);
+	return EXIT_SUCCESS;
+}
 
 
 /* MAIN LOGIC */
@@ -388,11 +1485,15 @@ int main(int argc, const char** argv)
 {
 	struct option_data data;
 	clock_t t1, t2;
-	FILE *file = stdin;
-	sd_buffer *ib, *ob;
+	sd_input input, cached;
+	sd_buffer *ob;
+	char key[CACHE_KEY_SIZE], *temp = NULL;
+	struct cache_output output = { stdout, NULL };
+	int keyed = 0;
 	sd_renderer *renderer = NULL;
 	void (*renderer_free)(sd_renderer *) = NULL;
 	sd_document *document;
+	int status;
 
 	/* Parse options */
 	data.basename = argv[0];
@@ -401,34 +1502,73 @@ int main(int argc, const char** argv)
 	data.iunit = DEF_IUNIT;
 	data.ounit = DEF_OUNIT;
 	data.filename = NULL;
+	data.files = malloc(argc * sizeof(const char *));
+	data.nfiles = 0;
+	data.batch = 0;
+	data.jobs = 0;
+	data.parallel = 0;
+	data.stream = 0;
+	data.tree = 0;
+	data.save_tree = NULL;
+	data.load_tree = 0;
+	data.cache_dir = NULL;
+	data.limits = (sd_render_limits){0, 0, 0};
+	data.output_dir = NULL;
 	data.renderer = RENDERER_HTML;
 	data.toc_level = 0;
 	data.render_flags = UPSKIRT_RENDER_CHARTER;
-	data.extensions = UPSKIRT_EXT_BLOCK | UPSKIRT_EXT_SPAN | UPSKIRT_EXT_FLAGS;
+	data.extensions = UPSKIRT_EXT_BLOCK | UPSKIRT_EXT_SPAN | UPSKIRT_EXT_FLAGS | UPSKIRT_EXT_SCI;
 	data.max_nesting = DEF_MAX_NESTING;
 
+	if (!data.files) {
+		fprintf(stderr, "Allocation failed.\n");
+		return 4;
+	}
+
 	argc = parse_options(argc, argv, parse_short_option, parse_long_option, parse_argument, &data);
-	if (data.done) return EXIT_SUCCESS;
-	if (!argc) return EXIT_FAILURE;
+	if (data.done || !argc || (data.nfiles > 1 && !data.batch)) {
+		if (!data.done && argc)
+			fprintf(stderr, "Too many arguments.\n");
+		free(data.files);
+		return data.done ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
 
-	/* Open input file, if needed */
-	if (data.filename) {
-		file = fopen(data.filename, "r");
-		if (!file) {
+	if (data.cache_dir && !cache_is_directory(data.cache_dir)) {
+		fprintf(stderr, "Cache directory \"%s\" is not a directory.\n", data.cache_dir);
+		free(data.files);
+		return 5;
+	}
+	if (data.cache_dir)
+		cache_sweep(data.cache_dir);
+
+	/* Read everything: files are mapped, pipes are read in iunit chunks */
+	if (data.batch || data.stream) {
+		/* every worker reads its own files, streams are read while rendering */
+	} else if (data.filename) {
+		if (sd_input_load(&input, data.filename)) {
 			fprintf(stderr, "Unable to open input file \"%s\": %s\n", data.filename, strerror(errno));
 			return 5;
 		}
-	}
-
-	/* Read everything */
-	ib = sd_buffer_new(data.iunit);
-
-	if (sd_buffer_putf(ib, file)) {
+	} else if (sd_input_read(&input, stdin, data.iunit)) {
 		fprintf(stderr, "I/O errors found while reading input.\n");
 		return 5;
 	}
 
-	if (file != stdin) fclose(file);
+	/* An output kept in the cache is all there is to write */
+	if (data.cache_dir && !data.batch && !data.stream && !data.save_tree)
+		keyed = cache_key(&data, &input, key);
+	if (keyed && cache_load(&cached, data.cache_dir, key) == 0) {
+		(void)fwrite(cached.data, 1, cached.size, stdout);
+		sd_input_release(&cached);
+		sd_input_release(&input);
+		free(data.files);
+
+		if (ferror(stdout)) {
+			fprintf(stderr, "I/O errors found while writing output.\n");
+			return 5;
+		}
+		return EXIT_SUCCESS;
+	}
 
 	/* Create the renderer */
 	if (data.renderer == RENDERER_HTML)
@@ -449,19 +1589,71 @@ int main(int argc, const char** argv)
 							"<script src=\"https://cdn.jsdelivr.net/npm/katex@0.13.2/dist/contrib/auto-render.min.js\" crossorigin=\"anonymous\"></script>\n";
 		ext.extra_closing = "<script>renderMathInElement(document.body);</script>\n";
 	}
+
+	if (data.batch) {
+		sd_document_config *config = sd_document_config_new(renderer, data.extensions, &ext, NULL, data.max_nesting);
+
+		status = batch_render(&data, config, data.renderer == RENDERER_LATEX ? ".tex" : ".html");
+
+		sd_document_config_free(config);
+		sd_buffer_free(ob);
+		renderer_free(renderer);
+		free(data.files);
+		return status;
+	}
+
 	document = sd_document_new(renderer, data.extensions,&ext, NULL, data.max_nesting);
+	if (data.parallel > 1)
+		sd_document_set_parallel(document, (unsigned int)data.parallel);
+	sd_document_set_limits(document, &data.limits);
+
+	if (data.stream) {
+		status = stream_render(&data, document, ob);
+		if (status == EXIT_SUCCESS)
+			status = limit_reached(document, data.filename);
+
+		sd_document_free(document);
+		renderer_free(renderer);
+		free(data.files);
+		sd_buffer_free(ob);
+		return status;
+	}
+
+	/* the output goes out while the rest is rendered, and to the cache */
+	if (keyed)
+		output.entry = cache_open(data.cache_dir, key, 0, &temp);
+	if (output.entry)
+		sd_document_set_output(document, cache_write, &output, DEF_FLUSH);
+	else
+		sd_document_set_output(document, write_output, stdout, DEF_FLUSH);
 
 	t1 = clock();
-	sd_document_render(document, ob, ib->data, ib->size, -1);
+	if (data.load_tree)
+		status = tree_load(&data, document, &input, ob);
+	else if (data.tree)
+		status = tree_render(&data, document, &ext, &input, ob);
+	else {
+		sd_document_render(document, ob, input.data, input.size, -1);
+		status = EXIT_SUCCESS;
+	}
 	t2 = clock();
+	if (status == EXIT_SUCCESS)
+		status = limit_reached(document, data.filename);
 
 	/* Cleanup */
-	sd_buffer_free(ib);
+	sd_input_release(&input);
 	sd_document_free(document);
 	renderer_free(renderer);
-
-	/* Write the result to stdout */
-	(void)fwrite(ob->data, 1, ob->size, stdout);
+	free(data.files);
+
+	/* Write the result to stdout, if anything is left after the flushes */
+	if (ob->size)
+		(void)fwrite(ob->data, 1, ob->size, stdout);
+	if (output.entry) {
+		if (ob->size)
+			(void)fwrite(ob->data, 1, ob->size, output.entry);
+		cache_commit(output.entry, temp, data.cache_dir, key, status == EXIT_SUCCESS && !ferror(stdout));
+	}
 	sd_buffer_free(ob);
 	ob = NULL;
 
@@ -486,5 +1678,5 @@ int main(int argc, const char** argv)
 			fprintf(stderr, "Time spent on rendering: %6.3f s.\n", elapsed);
 	}
 
-	return EXIT_SUCCESS;
+	return status;
 }
@@ -38,6 +38,8 @@ static const struct dispatch_table_rec dispatch_table[] =
 	{ "tex", charter_tex_main },
 	{ "smartypants", smartypants_main },
 	{ "md", upskirt_main },
+	{ "bench", bench_main },
+	{ "corpus", corpus_main },
 };
 
 static void print_command_list(void)
@@ -0,0 +1,172 @@
+#include "arena.h"
+
+#include <string.h>
+#include <assert.h>
+
+/* every object is aligned for the largest scalar type */
+#define ARENA_ALIGN 16
+#define ARENA_ROUND(n) (((n) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+struct sd_arena_chunk {
+	struct sd_arena_chunk *next;
+	size_t size;	/* bytes available after the header */
+	size_t used;	/* bytes handed out since the last reset */
+};
+
+#define CHUNK_HEADER ARENA_ROUND(sizeof(struct sd_arena_chunk))
+#define CHUNK_DATA(c) ((uint8_t *)(c) + CHUNK_HEADER)
+
+void
+sd_arena_init(sd_arena *arena, size_t unit)
+{
+	assert(arena);
+
+	arena->head = arena->current = NULL;
+	arena->unit = unit ? ARENA_ROUND(unit) : 4096;
+}
+
+void
+sd_arena_uninit(sd_arena *arena)
+{
+	struct sd_arena_chunk *chunk, *next;
+
+	assert(arena);
+
+	for (chunk = arena->head; chunk != NULL; chunk = next) {
+		next = chunk->next;
+		free(chunk);
+	}
+
+	arena->head = arena->current = NULL;
+}
+
+void
+sd_arena_reset(sd_arena *arena, size_t retain)
+{
+	struct sd_arena_chunk *chunk, *next;
+	size_t kept = 0;
+
+	assert(arena);
+
+	arena->current = arena->head;
+	if (!arena->head)
+		return;
+
+	/* the first chunk stays, then the following ones while they fit in
+	 * retain, so that a single large render does not pin its peak */
+	chunk = arena->head;
+	while (chunk->next && kept + chunk->next->size <= retain) {
+		chunk = chunk->next;
+		kept += chunk->size;
+	}
+
+	next = chunk->next;
+	chunk->next = NULL;
+	while (next != NULL) {
+		chunk = next->next;
+		free(next);
+		next = chunk;
+	}
+
+	/* the chunks after the first one are cleared as they are reached */
+	arena->head->used = 0;
+}
+
+size_t
+sd_arena_size(const sd_arena *arena)
+{
+	const struct sd_arena_chunk *chunk;
+	size_t size = 0;
+
+	assert(arena);
+
+	for (chunk = arena->head; chunk != NULL; chunk = chunk->next)
+		size += chunk->size;
+
+	return size;
+}
+
+/* arena_fail • a size that cannot be allocated fails as sd_malloc does */
+static void
+arena_fail(void)
+{
+	fprintf(stderr, "Allocation failed.\n");
+	abort();
+}
+
+/* arena_next • moves to the next chunk large enough for size bytes,
+ * inserting a new one in the list when the following chunk is too small */
+static void *
+arena_next(sd_arena *arena, size_t size)
+{
+	struct sd_arena_chunk *cur = arena->current;
+	struct sd_arena_chunk *next = cur ? cur->next : arena->head;
+
+	if (next == NULL || next->size < size) {
+		size_t chunk_size = size > arena->unit ? size : arena->unit;
+		struct sd_arena_chunk *chunk = sd_malloc(CHUNK_HEADER + chunk_size);
+
+		chunk->size = chunk_size;
+		chunk->next = next;
+		if (cur)
+			cur->next = chunk;
+		else
+			arena->head = chunk;
+		next = chunk;
+	}
+
+	next->used = size;
+	arena->current = next;
+
+	return CHUNK_DATA(next);
+}
+
+void *
+sd_arena_alloc(sd_arena *arena, size_t size)
+{
+	struct sd_arena_chunk *chunk;
+	void *ptr;
+
+	if (!arena)
+		return sd_malloc(size);
+
+	/* rounded up and with its chunk header, size must not wrap around */
+	if (size > SIZE_MAX - CHUNK_HEADER - ARENA_ALIGN)
+		arena_fail();
+
+	size = ARENA_ROUND(size);
+	chunk = arena->current;
+
+	if (chunk == NULL || chunk->size - chunk->used < size)
+		return arena_next(arena, size);
+
+	ptr = CHUNK_DATA(chunk) + chunk->used;
+	chunk->used += size;
+
+	return ptr;
+}
+
+void *
+sd_arena_calloc(sd_arena *arena, size_t nmemb, size_t size)
+{
+	void *ptr;
+
+	if (size && nmemb > SIZE_MAX / size)
+		arena_fail();
+
+	ptr = sd_arena_alloc(arena, nmemb * size);
+	memset(ptr, 0x0, nmemb * size);
+	return ptr;
+}
+
+char *
+sd_arena_strndup(sd_arena *arena, const uint8_t *data, size_t size)
+{
+	char *str = sd_arena_alloc(arena, size + 1);
+
+	if (size)
+		memcpy(str, data, size);
+	str[size] = 0;
+
+	return str;
+}
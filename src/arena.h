@@ -0,0 +1,61 @@
+/* arena.h - bump allocation of short-lived objects */
+
+#ifndef UPSKIRT_ARENA_H
+#define UPSKIRT_ARENA_H
+
+#include "buffer.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+/*********
+ * TYPES *
+ *********/
+
+struct sd_arena_chunk;
+
+/* sd_arena: objects are carved out of a list of chunks and released all at
+ * once; the chunks kept on reset are filled again in the same order */
+struct sd_arena {
+	struct sd_arena_chunk *head;	/* first chunk of the list */
+	struct sd_arena_chunk *current;	/* chunk being filled, NULL when empty */
+	size_t unit;			/* size of a regular chunk */
+};
+
+typedef struct sd_arena sd_arena;
+
+
+/*************
+ * FUNCTIONS *
+ *************/
+
+/* sd_arena_init: initialize an arena allocating chunks of the given size */
+void sd_arena_init(sd_arena *arena, size_t unit);
+
+/* sd_arena_uninit: free all the chunks of the arena */
+void sd_arena_uninit(sd_arena *arena);
+
+/* sd_arena_reset: release every object at once, keeping the first chunk and
+ * as many of the following ones as fit in retain bytes */
+void sd_arena_reset(sd_arena *arena, size_t retain);
+
+/* sd_arena_size: bytes held by the chunks of the arena */
+size_t sd_arena_size(const sd_arena *arena);
+
+/* sd_arena_alloc: allocate size bytes; a NULL arena allocates from the heap */
+void *sd_arena_alloc(sd_arena *arena, size_t size) __attribute__ ((malloc));
+
+/* sd_arena_calloc: allocate a zeroed array of nmemb objects */
+void *sd_arena_calloc(sd_arena *arena, size_t nmemb, size_t size) __attribute__ ((malloc));
+
+/* sd_arena_strndup: copy size bytes of data as a NUL-terminated string */
+char *sd_arena_strndup(sd_arena *arena, const uint8_t *data, size_t size) __attribute__ ((malloc));
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /** UPSKIRT_ARENA_H **/
@@ -5,11 +5,55 @@
 #include <string.h>
 #include <assert.h>
 
+/* allocation counters, only touched while counting; they are updated
+ * atomically where the compiler allows it so that parallel renders can
+ * be measured */
+static int alloc_counting = 0;
+static size_t alloc_count = 0;
+static size_t alloc_bytes = 0;
+
+#if defined(__GNUC__)
+#define alloc_add(var, n)	__atomic_fetch_add(&(var), (n), __ATOMIC_RELAXED)
+#define alloc_load(var)		__atomic_load_n(&(var), __ATOMIC_RELAXED)
+#else
+#define alloc_add(var, n)	((var) += (n))
+#define alloc_load(var)		(var)
+#endif
+
+#define alloc_record(size) do { \
+	if (alloc_counting) { \
+		alloc_add(alloc_count, 1); \
+		alloc_add(alloc_bytes, (size)); \
+	} \
+} while (0)
+
+void
+sd_alloc_stats_enable(int enable)
+{
+	if (enable) {
+		alloc_count = 0;
+		alloc_bytes = 0;
+	}
+
+	alloc_counting = enable;
+}
+
+void
+sd_alloc_stats_get(sd_alloc_stats *stats)
+{
+	assert(stats);
+
+	stats->count = alloc_load(alloc_count);
+	stats->bytes = alloc_load(alloc_bytes);
+}
+
 void *
 sd_malloc(size_t size)
 {
 	void *ret = malloc(size);
 
+	alloc_record(size);
+
 	if (!ret) {
 		fprintf(stderr, "Allocation failed.\n");
 		abort();
@@ -23,6 +67,8 @@ sd_calloc(size_t nmemb, size_t size)
 {
 	void *ret = calloc(nmemb, size);
 
+	alloc_record(nmemb * size);
+
 	if (!ret) {
 		fprintf(stderr, "Allocation failed.\n");
 		abort();
@@ -36,6 +82,8 @@ sd_realloc(void *ptr, size_t size)
 {
 	void *ret = realloc(ptr, size);
 
+	alloc_record(size);
+
 	if (!ret) {
 		fprintf(stderr, "Allocation failed.\n");
 		abort();
@@ -60,12 +108,14 @@ sd_buffer_init(
 	buf->data_realloc = data_realloc;
 	buf->data_free = data_free;
 	buf->buffer_free = buffer_free;
+	buf->growth = UPSKIRT_BUFFER_GEOMETRIC;
+	buf->parent = NULL;
 }
 
 void
 sd_buffer_uninit(sd_buffer *buf)
 {
-	assert(buf && buf->unit);
+	assert(buf && buf->unit && !buf->parent);
 	buf->data_free(buf->data);
 }
 
@@ -81,7 +131,7 @@ void
 sd_buffer_free(sd_buffer *buf)
 {
 	if (!buf) return;
-	assert(buf && buf->unit);
+	assert(buf && buf->unit && !buf->parent);
 
 	buf->data_free(buf->data);
 
@@ -92,13 +142,20 @@ sd_buffer_free(sd_buffer *buf)
 void
 sd_buffer_reset(sd_buffer *buf)
 {
-	assert(buf && buf->unit);
+	assert(buf && buf->unit && !buf->parent);
 
 	buf->data_free(buf->data);
 	buf->data = NULL;
 	buf->size = buf->asize = 0;
 }
 
+void
+sd_buffer_set_growth(sd_buffer *buf, enum sd_buffer_growth growth)
+{
+	assert(buf);
+	buf->growth = growth;
+}
+
 void
 sd_buffer_grow(sd_buffer *buf, size_t neosz)
 {
@@ -108,15 +165,73 @@ sd_buffer_grow(sd_buffer *buf, size_t neosz)
 	if (buf->asize >= neosz)
 		return;
 
+	/* a view grows the buffers it is nested in, up to the real one */
+	if (buf->parent) {
+		sd_buffer *parent = buf->parent;
+
+		sd_buffer_grow(parent, parent->size + neosz);
+		buf->data = parent->data + parent->size;
+		buf->asize = parent->asize - parent->size;
+		return;
+	}
+
+	/* doubling keeps appending linear overall, whatever the unit */
 	neoasz = buf->asize + buf->unit;
-	while (neoasz < neosz)
-		neoasz += buf->unit;
+	if (buf->growth == UPSKIRT_BUFFER_GEOMETRIC && neoasz < buf->asize * 2)
+		neoasz = buf->asize * 2;
+
+	if (neoasz < neosz)
+		neoasz = neosz + (buf->unit - neosz % buf->unit) % buf->unit;
 
 	buf->data = buf->data_realloc(buf->data, neoasz);
-	memset(&buf->data[buf->asize], 0, neoasz - buf->asize);
 	buf->asize = neoasz;
 }
 
+void
+sd_buffer_view_open(sd_buffer *view, sd_buffer *parent)
+{
+	assert(view && parent && parent->unit);
+
+	view->data = parent->data ? parent->data + parent->size : NULL;
+	view->size = 0;
+	view->asize = parent->asize - parent->size;
+	view->unit = parent->unit;
+	view->data_realloc = NULL;
+	view->data_free = NULL;
+	view->buffer_free = NULL;
+	view->growth = parent->growth;
+	view->parent = parent;
+}
+
+void
+sd_buffer_view_close(sd_buffer *view)
+{
+	assert(view && view->parent);
+
+	view->parent->size += view->size;
+	view->parent = NULL;
+	view->data = NULL;
+	view->size = view->asize = 0;
+}
+
+uint8_t *
+sd_buffer_reserve(sd_buffer *buf, size_t size)
+{
+	assert(buf && buf->unit);
+
+	if (buf->size + size > buf->asize)
+		sd_buffer_grow(buf, buf->size + size);
+
+	return buf->data + buf->size;
+}
+
+void
+sd_buffer_commit(sd_buffer *buf, size_t size)
+{
+	assert(buf && buf->size + size <= buf->asize);
+	buf->size += size;
+}
+
 void
 sd_buffer_put(sd_buffer *buf, const uint8_t *data, size_t size)
 {
@@ -157,8 +272,8 @@ sd_buffer_putf(sd_buffer *buf, FILE *file)
 	assert(buf && buf->unit);
 
 	while (!(feof(file) || ferror(file))) {
-		sd_buffer_grow(buf, buf->size + buf->unit);
-		buf->size += fread(buf->data + buf->size, 1, buf->unit, file);
+		uint8_t *dest = sd_buffer_reserve(buf, buf->unit);
+		sd_buffer_commit(buf, fread(dest, 1, buf->unit, file));
 	}
 
 	return ferror(file);
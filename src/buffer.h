@@ -24,6 +24,12 @@ extern "C" {
  * TYPES *
  *********/
 
+/* sd_buffer_growth: how the allocation of a buffer grows when it is full */
+enum sd_buffer_growth {
+	UPSKIRT_BUFFER_GEOMETRIC = 0,	/* doubled, in multiples of the unit */
+	UPSKIRT_BUFFER_LINEAR		/* by units, just enough for the new size */
+};
+
 typedef void *(*sd_realloc_callback)(void *, size_t);
 typedef void (*sd_free_callback)(void *);
 
@@ -36,10 +42,21 @@ struct sd_buffer {
 	sd_realloc_callback data_realloc;
 	sd_free_callback data_free;
 	sd_free_callback buffer_free;
+
+	enum sd_buffer_growth growth;	/* geometric unless set otherwise */
+	struct sd_buffer *parent;	/* buffer a view writes into, NULL otherwise */
 };
 
 typedef struct sd_buffer sd_buffer;
 
+/* sd_alloc_stats: allocations made through the wrappers while counting */
+struct sd_alloc_stats {
+	size_t count;	/* calls to sd_malloc, sd_calloc and sd_realloc */
+	size_t bytes;	/* bytes requested by those calls */
+};
+
+typedef struct sd_alloc_stats sd_alloc_stats;
+
 
 /*************
  * FUNCTIONS *
@@ -50,6 +67,13 @@ void *sd_malloc(size_t size) __attribute__ ((malloc));
 void *sd_calloc(size_t nmemb, size_t size) __attribute__ ((malloc));
 void *sd_realloc(void *ptr, size_t size) __attribute__ ((malloc));
 
+/* sd_alloc_stats_enable: start or stop counting the allocations, which is
+ * off by default; the counters are reset when counting starts */
+void sd_alloc_stats_enable(int enable);
+
+/* sd_alloc_stats_get: read the allocations counted so far */
+void sd_alloc_stats_get(sd_alloc_stats *stats);
+
 /* sd_buffer_init: initialize a buffer with custom allocators */
 void sd_buffer_init(
 	sd_buffer *buffer,
@@ -68,9 +92,28 @@ sd_buffer *sd_buffer_new(size_t unit) __attribute__ ((malloc));
 /* sd_buffer_reset: free internal data of the buffer */
 void sd_buffer_reset(sd_buffer *buf);
 
-/* sd_buffer_grow: increase the allocated size to the given value */
+/* sd_buffer_set_growth: choose how the buffer grows from now on */
+void sd_buffer_set_growth(sd_buffer *buf, enum sd_buffer_growth growth);
+
+/* sd_buffer_grow: increase the allocated size to at least the given value;
+ * the new space is not initialized */
 void sd_buffer_grow(sd_buffer *buf, size_t neosz);
 
+/* sd_buffer_reserve: make room for size more bytes after the data and return
+ * where they start, to be written directly then added with sd_buffer_commit */
+uint8_t *sd_buffer_reserve(sd_buffer *buf, size_t size);
+
+/* sd_buffer_commit: add to the data the first size bytes written in the
+ * space returned by sd_buffer_reserve */
+void sd_buffer_commit(sd_buffer *buf, size_t size);
+
+/* sd_buffer_view_open: start a view appending to the data of parent, which
+ * is seen empty; parent is left alone until sd_buffer_view_close */
+void sd_buffer_view_open(sd_buffer *view, sd_buffer *parent);
+
+/* sd_buffer_view_close: add the data written in the view to its parent */
+void sd_buffer_view_close(sd_buffer *view);
+
 /* sd_buffer_put: append raw data to a buffer */
 void sd_buffer_put(sd_buffer *buf, const uint8_t *data, size_t size);
 
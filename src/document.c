@@ -8,6 +8,24 @@
 #include <sys/stat.h>
 
 #include "stack.h"
+#include "arena.h"
+#include "scan.h"
+#include "input.h"
+#include "tree.h"
+
+#ifndef UPSKIRT_NO_THREADS
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+#endif
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
 
 #ifndef _MSC_VER
 #include <unistd.h>
@@ -18,33 +36,106 @@
 #define S_ISREG(m)  (((m) & S_IFMT) == S_IFREG)
 #endif
 
-#define REF_TABLE_SIZE 8
+/* smallest label table, grown by doubling past a load of 3/4 */
+#define LABEL_TABLE_MIN 16
 
 #define BUFFER_BLOCK 0
 #define BUFFER_SPAN 1
 
+/* work buffers larger than this are given back on reset */
+#define WORK_BUFFER_MAX (64 * 1024)
+
+/* arena chunks past the first one and past this many bytes are given back
+ * on reset */
+#define ARENA_RETAIN (256 * 1024)
+
 #define UPSKIRT_LI_END 8	/* internal list flag */
 
 const char *sd_find_block_tag(const char *str, unsigned int len);
-int find_ref(reference * refs, char*id, int *counter);
 
 /***************
  * LOCAL TYPES *
  ***************/
 
+/* label_slot: a label of a label_table, NULL label when free */
+struct label_slot {
+	unsigned int hash;
+	size_t size;
+	const uint8_t *label;	/* label, folded to lowercase unless exact */
+	void *value;
+};
+
+/* label_table: objects found by label, ignoring ASCII case unless exact;
+ * open addressing with linear probing, the slots come from the arena */
+struct label_table {
+	struct label_slot *slots;
+	size_t mask;		/* number of slots - 1 */
+	size_t count;
+	int exact;		/* labels compared with their case */
+};
+
+/* scan_index: where the next occurrence of a byte is from any position of
+ * a range of text; every table is built on first use */
+struct scan_index {
+	const uint8_t *data;
+	size_t size;
+	uint32_t *next[256];	/* next position of a byte, or size */
+	uint32_t *next_text;	/* next position that is not spacing */
+	uint32_t *run_end;	/* end of the run of backticks at a position */
+	uint32_t *run_next;	/* next run at least as long as the one starting here */
+};
+
+#define INLINE_MEMOS 8
+#define INLINE_SCAN_PASSES 4	/* passes over a frame before its scans are memoized */
+#define INLINE_SCAN_SLACK 256
+
+/* frame_close: the last search for the closing string of a construct in
+ * a frame; the searches starting from `from` up to `until` end at `at` */
+struct frame_close {
+	size_t from;
+	size_t until;
+	size_t at;			/* size of the frame when there is none */
+};
+
+enum frame_close_type {
+	CLOSE_TAG,			/* '>' of a tag */
+	CLOSE_COMMENT,			/* "-->" of an HTML comment */
+	CLOSE_AUTOLINK,			/* end of the URL of an autolink */
+	CLOSE_TITLE_SINGLE,		/* ')' after the '\'' of a link title */
+	CLOSE_TITLE_DOUBLE,		/* ')' after the '"' of a link title */
+	CLOSE_COUNT
+};
+
+/* inline_frame: a range of text being parsed by parse_inline; once the
+ * scans for closing chars cost more than a few passes over it, their
+ * results are remembered so that no position is scanned twice */
+struct inline_frame {
+	const uint8_t *data;
+	size_t size;
+	size_t work;			/* bytes read by the scans so far */
+
+	struct scan_index *index;	/* NULL until the scans are memoized */
+	int own_index;			/* the index is not an enclosing frame's */
+	uint8_t memo_char[INLINE_MEMOS];
+	uint32_t *memo[INLINE_MEMOS];	/* result of a scan from a position */
+	size_t memo_count;
+
+	size_t link_work;		/* bytes read by the inline link scans */
+	uint32_t *link_end;		/* end of the inline link scan from a position */
+	struct frame_close close[CLOSE_COUNT];
+
+	struct inline_frame *parent;
+};
+
 /* link_ref: reference to a link */
 struct link_ref {
-	unsigned int id;
-
 	sd_buffer *link;
 	sd_buffer *title;
-
-	struct link_ref *next;
 };
 
 /* footnote_ref: reference to a footnote */
 struct footnote_ref {
-	unsigned int id;
+	unsigned int index;	/* position among the footnotes found */
 
 	int is_used;
 	unsigned int num;
@@ -65,6 +156,52 @@ struct footnote_list {
 	struct footnote_item *tail;
 };
 
+/* include_file: a file read by @include or @bib, kept until the end of the render */
+struct include_file {
+	char *path;		/* path after resolution against the base folder */
+	int found;		/* the path is a regular file that could be read */
+	sd_input contents;
+
+	struct include_file *next;
+};
+
+/* header_shift: effect of a run of headers on the header counter; the
+ * lower levels start again from zero after a higher level header */
+struct header_shift {
+	int chapter;
+	int section;
+	int subsection;
+	int keep_section;
+	int keep_subsection;
+};
+
+/* render_piece: a run of top-level blocks rendered on its own by a
+ * parallel worker, with what the render depended on and changed */
+struct render_piece {
+	uint8_t *data;
+	size_t size;
+	int position;
+
+	/* state at the beginning of the piece */
+	h_counter counter;
+	unsigned int footnotes;		/* footnotes numbered before the piece */
+	void *state;			/* renderer state, NULL for the first guess */
+
+	/* recorded while rendering */
+	unsigned int headers;
+	struct header_shift shift;
+	unsigned int *notes;		/* footnotes referenced, in order of first reference */
+	unsigned int note_count;
+	uint8_t *noted;			/* whether each footnote is in notes already */
+	void *after;			/* renderer state at the end */
+	int state_changed;
+
+	sd_buffer *ob;
+	int filled;			/* the output before the piece is not empty */
+	int redo;
+	sd_render_status status;	/* the render of the piece stopped early */
+};
+
 /* char_trigger: function pointer to render active chars */
 /*   returns the number of chars taken care of */
 /*   data is the pointer of the beginning of the span */
@@ -89,6 +226,11 @@ static size_t char_math(sd_buffer *ob, sd_document *doc, uint8_t *data, size_t o
 static size_t char_ref(sd_buffer *ob, sd_document *doc, uint8_t *data, size_t offset, size_t size);
 
 void sub_render(sd_document *doc, sd_buffer *ob, const uint8_t *data, size_t size, int position);
+static void piece_header(struct render_piece *piece, size_t level);
+static void piece_note(struct render_piece *piece, const struct footnote_ref *fr);
+static void inline_frame_push(sd_document *doc, struct inline_frame *frame, const uint8_t *data, size_t size);
+static void inline_frame_pop(sd_document *doc, struct inline_frame *frame);
+static size_t find_close(sd_document *doc, const uint8_t *data, size_t size, int type, size_t i);
 
 enum markdown_char_t {
 	MD_CHAR_NONE = 0,
@@ -128,40 +270,75 @@ static char_trigger markdown_char_ptrs[] = {
 	&char_ref
 };
 
-struct sd_document {
+/* sd_document_config: everything that does not change while rendering;
+ * it is only read once built, so any number of documents can share it */
+struct sd_document_config {
 	sd_renderer md;
+	ext_definition * extensions;
+	char * base_folder;
+	uint8_t active_char[256];
+	sd_scan_table active_scan;
+	sd_extensions ext_flags;
+	size_t max_nesting;
+};
+
+/* sd_document: state of the renders of one thread */
+struct sd_document {
+	const sd_document_config *config;
+	sd_document_config *own_config;	/* config made by sd_document_new */
+	void *state;			/* private copy of the renderer state */
+
 	sd_renderer_data data;
 	metadata * document_metadata;
-	reference * floating_references;
-	ext_definition * extensions;
+	struct label_table floats;	/* numbered floats, by id */
 	toc * table_of_contents;
 	h_counter counter;
 
-	char * base_folder;
+	struct include_file *includes;
+	sd_arena arena;		/* objects living until the end of the render */
 
-	struct link_ref *refs[REF_TABLE_SIZE];
+	struct label_table refs;	/* link references by label */
 	struct footnote_list footnotes_found;
 	struct footnote_list footnotes_used;
-	uint8_t active_char[256];
+	struct label_table notes;	/* footnotes found, by label */
 	sd_stack work_bufs[2];
-	sd_extensions ext_flags;
-	size_t max_nesting;
+	size_t in_place;		/* work buffers spared by the containers rendered in place */
 	int in_link_body;
+	struct inline_frame *inline_frame;	/* text parse_inline is in */
+
+	sd_output_callback output;	/* sink of the rendered output, if any */
+	void *output_opaque;
+	size_t output_threshold;	/* output kept before calling the sink */
+	sd_buffer *out;			/* top-level output of the render */
+	size_t out_start;		/* size of out when the render started writing to it */
+	size_t written;			/* output no longer in out */
+
+	sd_render_limits limits;	/* bounds of every render */
+	int limited;			/* one of them is set */
+	sd_render_status status;	/* what stopped the last render */
+	size_t steps;			/* blocks and spans parsed by the render */
+	double deadline;		/* time the render has to end by */
+
+	struct render_stream *stream;	/* render fed with sd_document_feed */
+	int missing;			/* definitions looked up and not found */
+
+	struct render_piece *piece;	/* piece rendered by a parallel worker */
+	unsigned int parallel;		/* threads rendering large documents */
+	sd_document **workers;		/* documents used by those threads */
 };
 
 /***************************
  * HELPER FUNCTIONS *
  ***************************/
 
- static int
- startsWith(char *pre, char *str)
- {
- 	if (!pre || !str)
- 		return 0;
-    size_t lenpre = strlen(pre),
-           lenstr = strlen(str);
-    return lenstr < lenpre ? 0 : strncmp(pre, str, lenpre) == 0;
- }
+/* has_prefix • returns whether data[0..size) starts with the given string */
+static int
+has_prefix(const uint8_t *data, size_t size, const char *prefix)
+{
+	size_t len = strlen(prefix);
+
+	return size >= len && memcmp(data, prefix, len) == 0;
+}
 
 int
 is_separator(uint8_t chr)
@@ -169,38 +346,33 @@ is_separator(uint8_t chr)
 	return chr == ' ' || chr == '(' || chr == '\t' || chr == '\n';
 }
 
- static int
- is_regular_file(const char *path, char * base_folder)
- {
- 	if (path[0] != '/') {
- 		char *cwd;
-
- 		if (base_folder != NULL) {
-			int n1 = strlen(base_folder);
- 			int n2 = strlen(path);
- 			int n =  n1 + n2 + 2;
- 			cwd = malloc(n*sizeof(char));
- 			cwd[n-1] = 0;
- 			memcpy(cwd, base_folder, n1);
- 			cwd[n1] = '/';
- 			memcpy(cwd+n1+1, path, n2);
- 		} else {
- 			cwd = malloc(256*sizeof(char));
- 			memset(cwd, 0, 256);
- 			getcwd(cwd, 256);
- 			strcat(cwd, "/");
- 			strcat(cwd, path);
-	 	}
- 		struct stat path_stat;
-	    stat(cwd, &path_stat);
-	    free(cwd);
-	    return S_ISREG(path_stat.st_mode);
- 	}
-
-    struct stat path_stat;
-    stat(path, &path_stat);
-    return S_ISREG(path_stat.st_mode);
- }
+/* resolve_path • returns the path of a file named in the document */
+static char *
+resolve_path(sd_arena *arena, const uint8_t *name, size_t size, const char *base_folder)
+{
+	size_t n = (base_folder != NULL && name[0] != '/') ? strlen(base_folder) + 1 : 0;
+	char *path = sd_arena_alloc(arena, n + size + 1);
+
+	if (n) {
+		memcpy(path, base_folder, n - 1);
+		path[n - 1] = '/';
+	}
+	memcpy(path + n, name, size);
+	path[n + size] = 0;
+
+	return path;
+}
+
+static int
+is_regular_file(const char *path)
+{
+	struct stat path_stat;
+
+	if (stat(path, &path_stat) != 0)
+		return 0;
+
+	return S_ISREG(path_stat.st_mode);
+}
 
 static sd_buffer *
 newbuf(sd_document *doc, int type)
@@ -227,6 +399,125 @@ popbuf(sd_document *doc, int type)
 	doc->work_bufs[type].size--;
 }
 
+static void budget_cut(sd_document *doc, sd_buffer *ob);
+
+/* flush_output • hands the top-level output over to the sink once it is
+ * large enough; the last byte stays, renderers look at whether something
+ * was written before them */
+static void
+flush_output(sd_document *doc, sd_buffer *ob, int all)
+{
+	size_t keep = all ? 0 : 1;
+
+	budget_cut(doc, ob);
+
+	if (!doc->output || ob != doc->out || ob->size <= keep ||
+	    (!all && ob->size < doc->output_threshold))
+		return;
+
+	doc->output(ob->data, ob->size - keep, doc->output_opaque);
+	doc->written += ob->size - keep - doc->out_start;
+	doc->out_start = 0;
+	if (keep)
+		ob->data[0] = ob->data[ob->size - 1];
+	ob->size = keep;
+}
+
+/* steps between two looks at the clock */
+#define BUDGET_CLOCK_STEPS 64
+
+/* budget_clock • monotonic time in seconds */
+static double
+budget_clock(void)
+{
+#ifdef _WIN32
+	LARGE_INTEGER count, freq;
+	QueryPerformanceCounter(&count);
+	QueryPerformanceFrequency(&freq);
+	return (double)count.QuadPart / (double)freq.QuadPart;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+#endif
+}
+
+/* budget_start • starts a render writing to ob, counted against the limits */
+static void
+budget_start(sd_document *doc, sd_buffer *ob)
+{
+	doc->status = UPSKIRT_RENDER_OK;
+	doc->steps = 0;
+	doc->out = ob;
+	doc->out_start = ob->size;
+	doc->written = 0;
+
+	if (doc->limits.timeout_ms)
+		doc->deadline = budget_clock() + doc->limits.timeout_ms / 1000.0;
+}
+
+/* budget_output • bytes of output the render wrote to ob; a work buffer
+ * is part of the output to come */
+static size_t
+budget_output(const sd_document *doc, const sd_buffer *ob)
+{
+	return ob == doc->out ? doc->written + ob->size - doc->out_start : ob->size;
+}
+
+/* budget_spent • counts a step of the render writing to ob; returns whether
+ * the render went past one of its limits, at this step or before */
+static int
+budget_spent(sd_document *doc, const sd_buffer *ob)
+{
+	if (doc->status != UPSKIRT_RENDER_OK)
+		return 1;
+
+	if (!doc->limited)
+		return 0;
+
+	doc->steps++;
+	if (doc->limits.max_steps && doc->steps > doc->limits.max_steps)
+		doc->status = UPSKIRT_RENDER_STEP_LIMIT;
+	else if (doc->limits.max_output && budget_output(doc, ob) > doc->limits.max_output)
+		doc->status = UPSKIRT_RENDER_OUTPUT_LIMIT;
+	else if (doc->limits.timeout_ms && doc->steps % BUDGET_CLOCK_STEPS == 0 &&
+		 budget_clock() > doc->deadline)
+		doc->status = UPSKIRT_RENDER_TIMEOUT;
+
+	return doc->status != UPSKIRT_RENDER_OK;
+}
+
+/* budget_written • looks at the output once a block or a span was written
+ * to ob, without counting a step, so that a render stops right after the
+ * block that went past max_output */
+static void
+budget_written(sd_document *doc, const sd_buffer *ob)
+{
+	if (doc->status == UPSKIRT_RENDER_OK && doc->limits.max_output &&
+	    budget_output(doc, ob) > doc->limits.max_output)
+		doc->status = UPSKIRT_RENDER_OUTPUT_LIMIT;
+}
+
+/* budget_cut • cuts the top-level output past max_output before it is
+ * handed over, the closing of the document included; what was handed over
+ * before never goes past the limit, so the cut stays in ob */
+static void
+budget_cut(sd_document *doc, sd_buffer *ob)
+{
+	size_t output;
+
+	if (!doc->limits.max_output || ob != doc->out)
+		return;
+
+	output = budget_output(doc, ob);
+	if (output <= doc->limits.max_output)
+		return;
+
+	if (doc->status == UPSKIRT_RENDER_OK)
+		doc->status = UPSKIRT_RENDER_OUTPUT_LIMIT;
+	ob->size -= output - doc->limits.max_output;
+}
+
 static void
 unscape_text(sd_buffer *ob, sd_buffer *src)
 {
@@ -247,82 +538,195 @@ unscape_text(sd_buffer *ob, sd_buffer *src)
 	}
 }
 
+#define fold_ascii(c) ((c) >= 'A' && (c) <= 'Z' ? (c) + ('a' - 'A') : (c))
+
+/* hash_link_ref • FNV-1a hash of a label folded to lowercase */
 static unsigned int
 hash_link_ref(const uint8_t *link_ref, size_t length)
 {
 	size_t i;
-	unsigned int hash = 0;
+	unsigned int hash = 2166136261u;
 
 	for (i = 0; i < length; ++i)
-		hash = tolower(link_ref[i]) + (hash << 6) + (hash << 16) - hash;
+		hash = (hash ^ fold_ascii(link_ref[i])) * 16777619u;
 
 	return hash;
 }
 
+static void
+label_table_init(struct label_table *table, int exact)
+{
+	table->slots = NULL;
+	table->mask = 0;
+	table->count = 0;
+	table->exact = exact;
+}
+
+/* label_table_slot • slot holding the label, or the free slot where it
+ * belongs; the table must have free slots */
+static struct label_slot *
+label_table_slot(const struct label_table *table, unsigned int hash, const uint8_t *label, size_t size)
+{
+	size_t i = hash & table->mask, j;
+
+	while (1) {
+		struct label_slot *slot = &table->slots[i];
+
+		if (!slot->label)
+			return slot;
+
+		if (slot->hash == hash && slot->size == size) {
+			if (table->exact)
+				j = memcmp(slot->label, label, size) ? 0 : size;
+			else
+				for (j = 0; j < size && slot->label[j] == fold_ascii(label[j]); ++j);
+
+			if (j == size)
+				return slot;
+		}
+
+		i = (i + 1) & table->mask;
+	}
+}
+
+/* label_table_grow • moves the labels to a table twice as large */
+static void
+label_table_grow(sd_arena *arena, struct label_table *table)
+{
+	size_t size = table->slots ? (table->mask + 1) * 2 : LABEL_TABLE_MIN;
+	struct label_slot *old = table->slots;
+	size_t i, old_size = table->slots ? table->mask + 1 : 0;
+
+	table->slots = sd_arena_calloc(arena, size, sizeof(struct label_slot));
+	table->mask = size - 1;
+
+	for (i = 0; i < old_size; ++i)
+		if (old[i].label)
+			*label_table_slot(table, old[i].hash, old[i].label, old[i].size) = old[i];
+}
+
+/* label_table_put • slot of the label, added with a NULL value if new */
+static struct label_slot *
+label_table_put(sd_arena *arena, struct label_table *table, const uint8_t *label, size_t size)
+{
+	unsigned int hash = hash_link_ref(label, size);
+	struct label_slot *slot;
+	uint8_t *folded;
+	size_t i;
+
+	if ((table->count + 1) * 4 > (table->slots ? table->mask + 1 : 0) * 3)
+		label_table_grow(arena, table);
+
+	slot = label_table_slot(table, hash, label, size);
+	if (slot->label)
+		return slot;
+
+	folded = sd_arena_alloc(arena, size ? size : 1);
+	for (i = 0; i < size; ++i)
+		folded[i] = table->exact ? label[i] : fold_ascii(label[i]);
+
+	slot->hash = hash;
+	slot->size = size;
+	slot->label = folded;
+	slot->value = NULL;
+	table->count++;
+
+	return slot;
+}
+
+/* label_table_get • value of the label, NULL when missing */
+static void *
+label_table_get(const struct label_table *table, const uint8_t *label, size_t size)
+{
+	if (!table->count)
+		return NULL;
+
+	return label_table_slot(table, hash_link_ref(label, size), label, size)->value;
+}
+
+/* add_link_ref • a later definition of a label replaces the former */
 static struct link_ref *
 add_link_ref(
-	struct link_ref **references,
+	sd_arena *arena,
+	struct label_table *references,
 	const uint8_t *name, size_t name_size)
 {
-	struct link_ref *ref = sd_calloc(1, sizeof(struct link_ref));
-
-	ref->id = hash_link_ref(name, name_size);
-	ref->next = references[ref->id % REF_TABLE_SIZE];
+	struct link_ref *ref = sd_arena_calloc(arena, 1, sizeof(struct link_ref));
 
-	references[ref->id % REF_TABLE_SIZE] = ref;
+	label_table_put(arena, references, name, name_size)->value = ref;
 	return ref;
 }
 
 static struct link_ref *
-find_link_ref(struct link_ref **references, uint8_t *name, size_t length)
+find_link_ref(const struct label_table *references, uint8_t *name, size_t length)
 {
-	unsigned int hash = hash_link_ref(name, length);
-	struct link_ref *ref = NULL;
+	return label_table_get(references, name, length);
+}
 
-	ref = references[hash % REF_TABLE_SIZE];
+/* add_reference • numbers a float under its id; the first float with an
+ * id is the one the id refers to */
+static void
+add_reference(sd_arena *arena, struct label_table *floats, char *id, int counter, float_type type)
+{
+	struct label_slot *slot = label_table_put(arena, floats, (uint8_t *)id, strlen(id));
+	reference *ref;
 
-	while (ref != NULL) {
-		if (ref->id == hash)
-			return ref;
+	if (slot->value)
+		return;
 
-		ref = ref->next;
-	}
+	ref = sd_arena_alloc(arena, sizeof(reference));
+	ref->next = NULL;
+	ref->id = id;
+	ref->type = type;
+	ref->counter = counter;
+	slot->value = ref;
+}
 
-	return NULL;
+static int
+find_ref(const struct label_table *floats, const char *id, int *counter)
+{
+	const reference *ref = label_table_get(floats, (const uint8_t *)id, strlen(id));
+
+	if (!ref)
+		return 0;
+
+	*counter = ref->counter;
+	return 1;
 }
 
-static void
-free_link_refs(struct link_ref **references)
+/* arena_buffer • read-only buffer holding a copy of data */
+static sd_buffer *
+arena_buffer(sd_arena *arena, const uint8_t *data, size_t size)
 {
-	size_t i;
+	sd_buffer *buf = sd_arena_alloc(arena, sizeof(sd_buffer));
 
-	for (i = 0; i < REF_TABLE_SIZE; ++i) {
-		struct link_ref *r = references[i];
-		struct link_ref *next;
+	buf->data = (uint8_t *)sd_arena_strndup(arena, data, size);
+	buf->size = size;
+	buf->asize = buf->unit = 0;
+	buf->data_realloc = NULL;
+	buf->data_free = buf->buffer_free = NULL;
 
-		while (r) {
-			next = r->next;
-			sd_buffer_free(r->link);
-			sd_buffer_free(r->title);
-			free(r);
-			r = next;
-		}
-	}
+	return buf;
 }
 
+/* create_footnote_ref • the first footnote found with a label is the one
+ * the label refers to */
 static struct footnote_ref *
-create_footnote_ref(struct footnote_list *list, const uint8_t *name, size_t name_size)
+create_footnote_ref(sd_arena *arena, struct label_table *notes, const uint8_t *name, size_t name_size)
 {
-	struct footnote_ref *ref = sd_calloc(1, sizeof(struct footnote_ref));
-	ref->id = hash_link_ref(name, name_size);
+	struct footnote_ref *ref = sd_arena_calloc(arena, 1, sizeof(struct footnote_ref));
+	struct label_slot *slot = label_table_put(arena, notes, name, name_size);
+
+	if (!slot->value)
+		slot->value = ref;
 
 	return ref;
 }
 
 static int
-add_footnote_ref(struct footnote_list *list, struct footnote_ref *ref)
+add_footnote_ref(sd_arena *arena, struct footnote_list *list, struct footnote_ref *ref)
 {
-	struct footnote_item *item = sd_calloc(1, sizeof(struct footnote_item));
+	struct footnote_item *item = sd_arena_calloc(arena, 1, sizeof(struct footnote_item));
 	if (!item)
 		return 0;
 	item->ref = ref;
@@ -339,42 +743,20 @@ add_footnote_ref(struct footnote_list *list, struct footnote_ref *ref)
 }
 
 static struct footnote_ref *
-find_footnote_ref(struct footnote_list *list, uint8_t *name, size_t length)
-{
-	unsigned int hash = hash_link_ref(name, length);
-	struct footnote_item *item = NULL;
-
-	item = list->head;
-
-	while (item != NULL) {
-		if (item->ref->id == hash)
-			return item->ref;
-		item = item->next;
-	}
-
-	return NULL;
-}
-
-static void
-free_footnote_ref(struct footnote_ref *ref)
+find_footnote_ref(const struct label_table *notes, uint8_t *name, size_t length)
 {
-	sd_buffer_free(ref->contents);
-	free(ref);
+	return label_table_get(notes, name, length);
 }
 
+/* free_footnote_list • frees the contents of the footnotes, the items
+ * themselves belong to the arena */
 static void
-free_footnote_list(struct footnote_list *list, int free_refs)
+free_footnote_list(struct footnote_list *list)
 {
-	struct footnote_item *item = list->head;
-	struct footnote_item *next;
+	struct footnote_item *item;
 
-	while (item) {
-		next = item->next;
-		if (free_refs)
-			free_footnote_ref(item->ref);
-		free(item);
-		item = next;
-	}
+	for (item = list->head; item != NULL; item = item->next)
+		sd_buffer_free(item->ref->contents);
 }
 
 
@@ -464,7 +846,7 @@ is_mail_autolink(uint8_t *data, size_t size)
 
 /* tag_length • returns the length of the given tag, or 0 is it's not valid */
 static size_t
-tag_length(uint8_t *data, size_t size, sd_autolink_type *autolink)
+tag_length(sd_document *doc, uint8_t *data, size_t size, sd_autolink_type *autolink)
 {
 	size_t i, j;
 
@@ -475,15 +857,10 @@ tag_length(uint8_t *data, size_t size, sd_autolink_type *autolink)
 
         /* HTML comment, laxist form */
         if (size > 5 && data[1] == '!' && data[2] == '-' && data[3] == '-') {
-		i = 5;
-
-		while (i < size && !(data[i - 2] == '-' && data[i - 1] == '-' && data[i] == '>'))
-			i++;
-
-		i++;
+		i = find_close(doc, data, size, CLOSE_COMMENT, 3);
 
-		if (i <= size)
-			return i;
+		if (i < size)
+			return i + 3;
         }
 
 	/* begins with a '<' optionally followed by '/', followed by letter or number */
@@ -517,14 +894,7 @@ tag_length(uint8_t *data, size_t size, sd_autolink_type *autolink)
 
 	else if (*autolink) {
 		j = i;
-
-		while (i < size) {
-			if (data[i] == '\\') i += 2;
-			else if (data[i] == '>' || data[i] == '\'' ||
-					data[i] == '"' || data[i] == ' ' || data[i] == '\n')
-					break;
-			else i++;
-		}
+		i = find_close(doc, data, size, CLOSE_AUTOLINK, i);
 
 		if (i >= size) return 0;
 		if (i > j && data[i] == '>') return i + 1;
@@ -533,7 +903,7 @@ tag_length(uint8_t *data, size_t size, sd_autolink_type *autolink)
 	}
 
 	/* looking for something looking like a tag end */
-	while (i < size && data[i] != '>') i++;
+	i = find_close(doc, data, size, CLOSE_TAG, i);
 	if (i >= size) return 0;
 	return i + 1;
 }
@@ -544,26 +914,32 @@ parse_inline(sd_buffer *ob, sd_document *doc, uint8_t *data, size_t size)
 {
 	size_t i = 0, end = 0, consumed = 0;
 	sd_buffer work = { 0, 0, 0, 0, NULL, NULL, NULL };
-	uint8_t *active_char = doc->active_char;
+	const uint8_t *active_char = doc->config->active_char;
+	struct inline_frame frame;
 
 	if (doc->work_bufs[BUFFER_SPAN].size +
-		doc->work_bufs[BUFFER_BLOCK].size > doc->max_nesting)
+		doc->work_bufs[BUFFER_BLOCK].size + doc->in_place > doc->config->max_nesting)
 		return;
 
-	while (i < size) {
-		/* copying inactive chars into the output */
-		while (end < size && active_char[data[end]] == 0)
-			end++;
+	inline_frame_push(doc, &frame, data, size);
 
-		if (doc->md.normal_text) {
+	while (i < size) {
+		/* copying inactive chars into the output; a parenthesis only
+		 * matters when it opens a cross-reference */
+		end = sd_scan_find(&doc->config->active_scan, data, end, size);
+		while (end < size && active_char[data[end]] == MD_CHAR_REF &&
+		       (end + 1 >= size || data[end + 1] != '#'))
+			end = sd_scan_find(&doc->config->active_scan, data, end + 1, size);
+
+		if (doc->config->md.normal_text) {
 			work.data = data + i;
 			work.size = end - i;
-			doc->md.normal_text(ob, &work, &doc->data);
+			doc->config->md.normal_text(ob, &work, &doc->data);
 		}
 		else
 			sd_buffer_put(ob, data + i, end - i);
 
-		if (end >= size) break;
+		if (end >= size || budget_spent(doc, ob)) break;
 		i = end;
 
 		end = markdown_char_ptrs[ (int)active_char[data[end]] ](ob, doc, data + i, i - consumed, size - i);
@@ -575,6 +951,9 @@ parse_inline(sd_buffer *ob, sd_document *doc, uint8_t *data, size_t size)
 			consumed = i;
 		}
 	}
+
+	budget_written(doc, ob);
+	inline_frame_pop(doc, &frame);
 }
 
 /* is_escaped • returns whether special char at data[loc] is escaped by '\\' */
@@ -589,26 +968,29 @@ is_escaped(uint8_t *data, size_t loc)
 	return (loc - i) % 2;
 }
 
-/* find_emph_char • looks for the next emph uint8_t, skipping other constructs */
+/* scan_emph_char • looks for the next emph uint8_t, skipping other constructs;
+ * *end is set to how far the data was read */
 static size_t
-find_emph_char(uint8_t *data, size_t size, uint8_t c)
+scan_emph_char(uint8_t *data, size_t size, uint8_t c, size_t *end)
 {
-	size_t i = 0;
+	size_t i = 0, ret = 0;
 
 	while (i < size) {
 		while (i < size && data[i] != c && data[i] != '[' && data[i] != '`')
 			i++;
 
 		if (i == size)
-			return 0;
+			break;
 
 		/* not counting escaped chars */
 		if (is_escaped(data, i)) {
 			i++; continue;
 		}
 
-		if (data[i] == c)
-			return i;
+		if (data[i] == c) {
+			ret = i;
+			break;
+		}
 
 		/* skipping a codespan */
 		if (data[i] == '`') {
@@ -620,7 +1002,7 @@ find_emph_char(uint8_t *data, size_t size, uint8_t c)
 				i++; span_nb++;
 			}
 
-			if (i >= size) return 0;
+			if (i >= size) break;
 
 			/* finding the matching closing sequence */
 			bt = 0;
@@ -632,7 +1014,10 @@ find_emph_char(uint8_t *data, size_t size, uint8_t c)
 			}
 
 			/* not a well-formed codespan; use found matching emph char */
-			if (bt < span_nb && i >= size) return tmp_i;
+			if (bt < span_nb && i >= size) {
+				ret = tmp_i;
+				break;
+			}
 		}
 		/* skipping a link */
 		else if (data[i] == '[') {
@@ -649,8 +1034,10 @@ find_emph_char(uint8_t *data, size_t size, uint8_t c)
 			while (i < size && _isspace(data[i]))
 				i++;
 
-			if (i >= size)
-				return tmp_i;
+			if (i >= size) {
+				ret = tmp_i;
+				break;
+			}
 
 			switch (data[i]) {
 			case '[':
@@ -660,79 +1047,644 @@ find_emph_char(uint8_t *data, size_t size, uint8_t c)
 				cc = ')'; break;
 
 			default:
-				if (tmp_i)
-					return tmp_i;
+				if (tmp_i) {
+					ret = tmp_i;
+					break;
+				}
 				else
 					continue;
 			}
 
+			if (ret)
+				break;
+
 			i++;
 			while (i < size && data[i] != cc) {
 				if (!tmp_i && data[i] == c) tmp_i = i;
 				i++;
 			}
 
-			if (i >= size)
-				return tmp_i;
+			if (i >= size) {
+				ret = tmp_i;
+				break;
+			}
 
 			i++;
 		}
 	}
 
-	return 0;
+	*end = i < size ? i : size;
+	return ret;
 }
 
-/* parse_emph1 • parsing single emphase */
-/* closed by a symbol not preceded by spacing and not followed by symbol */
+/* scan_next • next position of the byte at or after i in the frame, or the
+ * size of the frame; the table of the index is built on first use */
 static size_t
-parse_emph1(sd_buffer *ob, sd_document *doc, uint8_t *data, size_t size, uint8_t c)
+scan_next(struct inline_frame *frame, uint8_t b, size_t i)
 {
-	size_t i = 0, len;
-	sd_buffer *work = 0;
-	int r;
-
-	/* skipping one symbol if coming from emph3 */
-	if (size > 1 && data[0] == c && data[1] == c) i = 1;
+	struct scan_index *index = frame->index;
+	size_t delta = frame->data - index->data;
+	size_t j, next;
+
+	if (i >= frame->size)
+		return frame->size;
+
+	if (!index->next[b]) {
+		index->next[b] = sd_malloc((index->size + 1) * sizeof(uint32_t));
+		next = index->size;
+		index->next[b][next] = (uint32_t)next;
+		for (j = index->size; j-- > 0; ) {
+			if (index->data[j] == b)
+				next = j;
+			index->next[b][j] = (uint32_t)next;
+		}
+	}
 
-	while (i < size) {
-		len = find_emph_char(data + i, size - i, c);
-		if (!len) return 0;
-		i += len;
-		if (i >= size) return 0;
+	next = index->next[b][i + delta] - delta;
+	return next < frame->size ? next : frame->size;
+}
 
-		if (data[i] == c && !_isspace(data[i - 1])) {
+/* scan_next_text • next position at or after i that is not spacing */
+static size_t
+scan_next_text(struct inline_frame *frame, size_t i)
+{
+	struct scan_index *index = frame->index;
+	size_t delta = frame->data - index->data;
+	size_t j, next;
+
+	if (i >= frame->size)
+		return frame->size;
+
+	if (!index->next_text) {
+		index->next_text = sd_malloc((index->size + 1) * sizeof(uint32_t));
+		next = index->size;
+		index->next_text[next] = (uint32_t)next;
+		for (j = index->size; j-- > 0; ) {
+			if (!_isspace(index->data[j]))
+				next = j;
+			index->next_text[j] = (uint32_t)next;
+		}
+	}
 
-			if (doc->ext_flags & UPSKIRT_EXT_NO_INTRA_EMPHASIS) {
-				if (i + 1 < size && isalnum(data[i + 1]))
-					continue;
-			}
+	next = index->next_text[i + delta] - delta;
+	return next < frame->size ? next : frame->size;
+}
 
-			work = newbuf(doc, BUFFER_SPAN);
-			parse_inline(work, doc, data, i);
+/* scan_runs • builds the end of every run of backticks and, at the start
+ * of a run, the next run that is at least as long */
+static void
+scan_runs(struct scan_index *index)
+{
+	uint32_t *stack = sd_malloc((index->size + 1) * sizeof(uint32_t));
+	size_t count = 0, i, end;
 
-			if (doc->ext_flags & UPSKIRT_EXT_UNDERLINE && c == '_')
-				r = doc->md.underline(ob, work, &doc->data);
-			else
-				r = doc->md.emphasis(ob, work, &doc->data);
+	index->run_end = sd_malloc((index->size + 1) * sizeof(uint32_t));
+	index->run_next = sd_malloc((index->size + 1) * sizeof(uint32_t));
 
-			popbuf(doc, BUFFER_SPAN);
-			return r ? i + 1 : 0;
+	/* runs from the last one, keeping the following runs that are
+	 * longer than every run between them and the current one */
+	for (end = i = index->size; i-- > 0; ) {
+		if (index->data[i] != '`') {
+			end = i;
+			continue;
 		}
+
+		index->run_end[i] = (uint32_t)end;
+		if (i > 0 && index->data[i - 1] == '`')
+			continue;
+
+		while (count && index->run_end[stack[count - 1]] - stack[count - 1] < end - i)
+			count--;
+
+		index->run_next[i] = count ? stack[count - 1] : (uint32_t)index->size;
+		stack[count++] = (uint32_t)i;
 	}
 
-	return 0;
+	free(stack);
 }
 
-/* parse_emph2 • parsing single emphase */
+/* scan_codespan_end • end of the codespan opened by a run of `span`
+ * backticks ending at i, or 0 when it is not closed */
 static size_t
-parse_emph2(sd_buffer *ob, sd_document *doc, uint8_t *data, size_t size, uint8_t c)
+scan_codespan_end(struct inline_frame *frame, size_t i, size_t span)
 {
-	size_t i = 0, len;
-	sd_buffer *work = 0;
-	int r;
+	struct scan_index *index = frame->index;
+	size_t delta = frame->data - index->data;
+	size_t run = scan_next(frame, '`', i), end;
 
-	while (i < size) {
-		len = find_emph_char(data + i, size - i, c);
+	while (run < frame->size) {
+		end = index->run_end[run + delta] - delta;
+		if (end > frame->size)
+			end = frame->size;
+
+		if (end - run >= span)
+			return run + span;
+
+		run = index->run_next[run + delta] - delta;
+	}
+
+	return 0;
+}
+
+/* scan_step • does what scan_emph_char does from the special char at i:
+ * returns 1 when the scan ends there, with its result or the size of the
+ * frame in *result, 0 with the position to go on from in *next */
+static int
+scan_step(struct inline_frame *frame, uint8_t c, size_t i, size_t *next, size_t *result)
+{
+	const uint8_t *data = frame->data;
+	size_t size = frame->size;
+	size_t tmp_i, end, close;
+	uint8_t cc;
+
+	/* not counting escaped chars */
+	if (is_escaped((uint8_t *)data, i)) {
+		*next = i + 1;
+		return 0;
+	}
+
+	if (data[i] == c) {
+		*result = i;
+		return 1;
+	}
+
+	/* skipping a codespan */
+	if (data[i] == '`') {
+		if (!frame->index->run_end)
+			scan_runs(frame->index);
+
+		end = frame->index->run_end[i + (data - frame->index->data)] - (data - frame->index->data);
+		if (end >= size) {
+			*result = size;
+			return 1;
+		}
+
+		close = scan_codespan_end(frame, end, end - i);
+		if (!close) {
+			*result = scan_next(frame, c, end);
+			return 1;
+		}
+
+		*next = close;
+		return 0;
+	}
+
+	/* skipping a link */
+	end = scan_next(frame, ']', i + 1);
+	tmp_i = scan_next(frame, c, i + 1);
+	if (tmp_i >= end)
+		tmp_i = size;
+
+	if (end >= size) {
+		*result = tmp_i;
+		return 1;
+	}
+
+	i = scan_next_text(frame, end + 1);
+	if (i >= size) {
+		*result = tmp_i;
+		return 1;
+	}
+
+	if (data[i] == '[')
+		cc = ']';
+	else if (data[i] == '(')
+		cc = ')';
+	else if (tmp_i < size) {
+		*result = tmp_i;
+		return 1;
+	} else {
+		*next = i;
+		return 0;
+	}
+
+	end = scan_next(frame, cc, i + 1);
+	if (tmp_i >= size) {
+		tmp_i = scan_next(frame, c, i + 1);
+		if (tmp_i >= end)
+			tmp_i = size;
+	}
+
+	if (end >= size) {
+		*result = tmp_i;
+		return 1;
+	}
+
+	*next = end + 1;
+	return 0;
+}
+
+/* scan_special • next char at or after i where scanning for c stops */
+static size_t
+scan_special(struct inline_frame *frame, uint8_t c, size_t i)
+{
+	size_t a = scan_next(frame, c, i);
+	size_t b = scan_next(frame, '[', i);
+	size_t d = scan_next(frame, '`', i);
+
+	if (b < a) a = b;
+	return d < a ? d : a;
+}
+
+/* scan_memo • result of scanning for c from i, remembered for every
+ * special char the scan goes through */
+static size_t
+scan_memo(struct inline_frame *frame, uint32_t *memo, uint8_t c, size_t i)
+{
+	size_t start, next, result, unused;
+
+	start = i = scan_special(frame, c, i);
+	while (1) {
+		if (i >= frame->size) {
+			result = frame->size;
+			break;
+		}
+
+		if (memo[i] != UINT32_MAX) {
+			result = memo[i];
+			break;
+		}
+
+		if (scan_step(frame, c, i, &next, &result))
+			break;
+
+		i = scan_special(frame, c, next);
+	}
+
+	for (i = start; i < frame->size && memo[i] == UINT32_MAX; ) {
+		memo[i] = (uint32_t)result;
+		if (scan_step(frame, c, i, &next, &unused))
+			break;
+
+		i = scan_special(frame, c, next);
+	}
+
+	return result;
+}
+
+/* frame_memo • memo of the scans for c in the frame, once scanning has
+ * cost more than a few passes over it; NULL before that */
+static uint32_t *
+frame_memo(struct inline_frame *frame, uint8_t c)
+{
+	struct inline_frame *parent;
+	size_t m;
+
+	for (m = 0; m < frame->memo_count; ++m) {
+		if (frame->memo_char[m] == c)
+			return frame->memo[m];
+	}
+
+	if (frame->work <= INLINE_SCAN_PASSES * frame->size + INLINE_SCAN_SLACK ||
+		frame->size >= UINT32_MAX || m == INLINE_MEMOS)
+		return NULL;
+
+	/* the index of an enclosing frame works for any part of it */
+	for (parent = frame->parent; !frame->index && parent; parent = parent->parent) {
+		if (parent->index && parent->index->data <= frame->data &&
+			frame->data + frame->size <= parent->index->data + parent->index->size)
+			frame->index = parent->index;
+	}
+
+	if (!frame->index) {
+		frame->index = sd_calloc(1, sizeof(struct scan_index));
+		frame->index->data = frame->data;
+		frame->index->size = frame->size;
+		frame->own_index = 1;
+	}
+
+	frame->memo_char[m] = c;
+	frame->memo[m] = sd_malloc(frame->size * sizeof(uint32_t));
+	memset(frame->memo[m], 0xFF, frame->size * sizeof(uint32_t));
+	frame->memo_count++;
+
+	return frame->memo[m];
+}
+
+/* find_emph_char • looks for the next emph uint8_t, skipping other constructs;
+ * the scans of a frame of inline text are memoized when they get costly */
+static size_t
+find_emph_char(sd_document *doc, uint8_t *data, size_t size, uint8_t c)
+{
+	struct inline_frame *frame = doc->inline_frame;
+	uint32_t *memo;
+	size_t ret, end, start;
+
+	/* only the scans up to the end of the frame can be shared */
+	if (!frame || data < frame->data || data + size != frame->data + frame->size ||
+		(data > frame->data && data[-1] == '\\'))
+		return scan_emph_char(data, size, c, &end);
+
+	memo = frame_memo(frame, c);
+	if (!memo) {
+		ret = scan_emph_char(data, size, c, &end);
+		frame->work += end;
+		return ret;
+	}
+
+	/* the scan does not look at a closing char where it starts */
+	if (!size || data[0] == c)
+		return 0;
+
+	start = data - frame->data;
+	ret = scan_memo(frame, memo, c, start);
+
+	return ret < frame->size ? ret - start : 0;
+}
+
+/* inline_frame_push • makes the text parsed by parse_inline the current frame */
+static void
+inline_frame_push(sd_document *doc, struct inline_frame *frame, const uint8_t *data, size_t size)
+{
+	int i;
+
+	frame->data = data;
+	frame->size = size;
+	frame->work = 0;
+	frame->index = NULL;
+	frame->own_index = 0;
+	frame->memo_count = 0;
+	frame->link_work = 0;
+	frame->link_end = NULL;
+	for (i = 0; i < CLOSE_COUNT; ++i)
+		frame->close[i].from = SIZE_MAX;
+	frame->parent = doc->inline_frame;
+	doc->inline_frame = frame;
+}
+
+static void
+inline_frame_pop(sd_document *doc, struct inline_frame *frame)
+{
+	size_t i;
+
+	for (i = 0; i < frame->memo_count; ++i)
+		free(frame->memo[i]);
+	free(frame->link_end);
+
+	if (frame->own_index) {
+		for (i = 0; i < 256; ++i)
+			free(frame->index->next[i]);
+		free(frame->index->next_text);
+		free(frame->index->run_end);
+		free(frame->index->run_next);
+		free(frame->index);
+	}
+
+	doc->inline_frame = frame->parent;
+}
+
+/* frame_start • the current frame when data runs to its end, with the
+ * offset of data in it; the frame keeps what the scans from there found */
+static struct inline_frame *
+frame_start(sd_document *doc, const uint8_t *data, size_t size, size_t *start)
+{
+	struct inline_frame *frame = doc->inline_frame;
+
+	if (!frame || data < frame->data || data + size != frame->data + frame->size)
+		return NULL;
+
+	*start = data - frame->data;
+	return frame;
+}
+
+/* scan_close • position of the closing string of type from i, or size;
+ * *until is set to the last start from which the search ends there */
+static size_t
+scan_close(const uint8_t *data, size_t size, int type, size_t i, size_t *until)
+{
+	uint8_t quote;
+
+	switch (type) {
+	case CLOSE_TAG:
+		while (i < size && data[i] != '>')
+			i++;
+		break;
+
+	case CLOSE_COMMENT:
+		while (i + 2 < size && !(data[i] == '-' && data[i + 1] == '-' && data[i + 2] == '>'))
+			i++;
+		if (i + 2 >= size)
+			i = size;
+		break;
+
+	case CLOSE_AUTOLINK:
+		while (i < size) {
+			if (data[i] == '\\') i += 2;
+			else if (data[i] == '>' || data[i] == '\'' ||
+					data[i] == '"' || data[i] == ' ' || data[i] == '\n')
+					break;
+			else i++;
+		}
+		break;
+
+	default:
+		/* the title goes on up to its quote, then to a ')' */
+		quote = type == CLOSE_TITLE_SINGLE ? '\'' : '"';
+		while (i < size && data[i] != quote)
+			i += data[i] == '\\' ? 2 : 1;
+
+		*until = i < size ? i : size;
+		if (i < size)
+			for (i++; i < size && data[i] != ')'; )
+				i += data[i] == '\\' ? 2 : 1;
+
+		/* no ')' after the quote is none after any later one */
+		if (i >= size)
+			*until = size;
+		return i < size ? i : size;
+	}
+
+	if (i > size)
+		i = size;
+	*until = i;
+	return i;
+}
+
+/* find_close • position of the closing string of type from i in data, or
+ * size; in the text of a frame the last search is remembered, so that a
+ * run of openers without a closer does not read the rest of the text for
+ * every one of them */
+static size_t
+find_close(sd_document *doc, const uint8_t *data, size_t size, int type, size_t i)
+{
+	struct inline_frame *frame;
+	struct frame_close *close;
+	size_t start, until;
+
+	if (i >= size)
+		return size;
+
+	frame = frame_start(doc, data, size, &start);
+	if (!frame)
+		return scan_close(data, size, type, i, &until);
+
+	close = &frame->close[type];
+	if (start + i < close->from || start + i > close->until) {
+		close->at = start + scan_close(data, size, type, i, &until);
+		close->from = start + i;
+		close->until = start + until;
+	}
+
+	return close->at - start;
+}
+
+/* scan_link_end • end of the destination of an inline link starting at i:
+ * a ')' closing no parenthesis opened after i, or a quote after spacing */
+static size_t
+scan_link_end(const uint8_t *data, size_t size, size_t i)
+{
+	size_t nb_p = 0;
+
+	while (i < size) {
+		if (data[i] == '\\') i += 2;
+		else if (data[i] == '(' && i != 0) {
+			nb_p++; i++;
+		}
+		else if (data[i] == ')') {
+			if (nb_p == 0) break;
+			else nb_p--;
+			i++;
+		} else if (i >= 1 && _isspace(data[i-1]) && (data[i] == '\'' || data[i] == '"')) break;
+		else i++;
+	}
+
+	return i < size ? i : size;
+}
+
+/* frame_link_end • builds the end of scan_link_end from every position of
+ * the frame: the first ')' to its right at the depth of parentheses of the
+ * position, or the first quote after spacing when it comes before */
+static void
+frame_link_end(struct inline_frame *frame)
+{
+	const uint8_t *data = frame->data;
+	size_t size = frame->size, level = size, quote = size, i;
+	uint8_t *kind = sd_malloc(size);
+	uint32_t *close = sd_malloc((2 * size + 1) * sizeof(uint32_t));
+	uint32_t end;
+
+	/* the chars the scan stops on, leaving out the escaped ones; level is
+	 * the depth of parentheses shifted by size, to index close */
+	for (i = 0; i < size; ) {
+		if (data[i] == '\\') {
+			kind[i++] = 0;
+			if (i < size)
+				kind[i++] = 0;
+			continue;
+		}
+
+		kind[i] = 0;
+		if (data[i] == '(' || data[i] == ')')
+			kind[i] = data[i];
+		else if (i >= 1 && _isspace(data[i - 1]) && (data[i] == '\'' || data[i] == '"'))
+			kind[i] = '"';
+
+		if (kind[i] == '(')
+			level++;
+		else if (kind[i] == ')')
+			level--;
+		i++;
+	}
+
+	for (i = 0; i <= 2 * size; ++i)
+		close[i] = (uint32_t)size;
+
+	/* from the end, with the depth before every position */
+	frame->link_end = sd_malloc(size * sizeof(uint32_t));
+	for (i = size; i-- > 0; ) {
+		if (kind[i] == '(')
+			level--;
+		else if (kind[i] == ')')
+			close[++level] = (uint32_t)i;
+		else if (kind[i] == '"')
+			quote = i;
+
+		end = close[level];
+		frame->link_end[i] = end < quote ? end : (uint32_t)quote;
+	}
+
+	free(kind);
+	free(close);
+}
+
+/* find_link_end • scan_link_end of data, from a table of the frame once
+ * the scans cost more than a few passes over it */
+static size_t
+find_link_end(sd_document *doc, const uint8_t *data, size_t size, size_t i)
+{
+	struct inline_frame *frame;
+	size_t start, end;
+
+	if (i >= size)
+		return size;
+
+	frame = frame_start(doc, data, size, &start);
+	if (!frame)
+		return scan_link_end(data, size, i);
+
+	if (!frame->link_end) {
+		end = scan_link_end(data, size, i);
+		frame->link_work += end - i;
+		if (frame->link_work > INLINE_SCAN_PASSES * frame->size + INLINE_SCAN_SLACK &&
+			frame->size < UINT32_MAX)
+			frame_link_end(frame);
+		return end;
+	}
+
+	return frame->link_end[start + i] - start;
+}
+
+/* parse_emph1 • parsing single emphase */
+/* closed by a symbol not preceded by spacing and not followed by symbol */
+static size_t
+parse_emph1(sd_buffer *ob, sd_document *doc, uint8_t *data, size_t size, uint8_t c)
+{
+	size_t i = 0, len;
+	sd_buffer *work = 0;
+	int r;
+
+	/* skipping one symbol if coming from emph3 */
+	if (size > 1 && data[0] == c && data[1] == c) i = 1;
+
+	while (i < size) {
+		len = find_emph_char(doc, data + i, size - i, c);
+		if (!len) return 0;
+		i += len;
+		if (i >= size) return 0;
+
+		if (data[i] == c && !_isspace(data[i - 1])) {
+
+			if (doc->config->ext_flags & UPSKIRT_EXT_NO_INTRA_EMPHASIS) {
+				if (i + 1 < size && isalnum(data[i + 1]))
+					continue;
+			}
+
+			work = newbuf(doc, BUFFER_SPAN);
+			parse_inline(work, doc, data, i);
+
+			if (doc->config->ext_flags & UPSKIRT_EXT_UNDERLINE && c == '_')
+				r = doc->config->md.underline(ob, work, &doc->data);
+			else
+				r = doc->config->md.emphasis(ob, work, &doc->data);
+
+			popbuf(doc, BUFFER_SPAN);
+			return r ? i + 1 : 0;
+		}
+	}
+
+	return 0;
+}
+
+/* parse_emph2 • parsing single emphase */
+static size_t
+parse_emph2(sd_buffer *ob, sd_document *doc, uint8_t *data, size_t size, uint8_t c)
+{
+	size_t i = 0, len;
+	sd_buffer *work = 0;
+	int r;
+
+	while (i < size) {
+		len = find_emph_char(doc, data + i, size - i, c);
 		if (!len) return 0;
 		i += len;
 
@@ -741,11 +1693,11 @@ parse_emph2(sd_buffer *ob, sd_document *doc, uint8_t *data, size_t size, uint8_t
 			parse_inline(work, doc, data, i);
 
 			if (c == '~')
-				r = doc->md.strikethrough(ob, work, &doc->data);
+				r = doc->config->md.strikethrough(ob, work, &doc->data);
 			else if (c == '=')
-				r = doc->md.highlight(ob, work, &doc->data);
+				r = doc->config->md.highlight(ob, work, &doc->data);
 			else
-				r = doc->md.double_emphasis(ob, work, &doc->data);
+				r = doc->config->md.double_emphasis(ob, work, &doc->data);
 
 			popbuf(doc, BUFFER_SPAN);
 			return r ? i + 2 : 0;
@@ -764,7 +1716,7 @@ parse_emph3(sd_buffer *ob, sd_document *doc, uint8_t *data, size_t size, uint8_t
 	int r;
 
 	while (i < size) {
-		len = find_emph_char(data + i, size - i, c);
+		len = find_emph_char(doc, data + i, size - i, c);
 		if (!len) return 0;
 		i += len;
 
@@ -772,12 +1724,12 @@ parse_emph3(sd_buffer *ob, sd_document *doc, uint8_t *data, size_t size, uint8_t
 		if (data[i] != c || _isspace(data[i - 1]))
 			continue;
 
-		if (i + 2 < size && data[i + 1] == c && data[i + 2] == c && doc->md.triple_emphasis) {
+		if (i + 2 < size && data[i + 1] == c && data[i + 2] == c && doc->config->md.triple_emphasis) {
 			/* triple symbol found */
 			sd_buffer *work = newbuf(doc, BUFFER_SPAN);
 
 			parse_inline(work, doc, data, i);
-			r = doc->md.triple_emphasis(ob, work, &doc->data);
+			r = doc->config->md.triple_emphasis(ob, work, &doc->data);
 			popbuf(doc, BUFFER_SPAN);
 			return r ? i + 3 : 0;
 
@@ -804,7 +1756,7 @@ parse_math(sd_buffer *ob, sd_document *doc, uint8_t *data, size_t offset, size_t
 	sd_buffer text = { NULL, 0, 0, 0, NULL, NULL, NULL };
 	size_t i = delimsz;
 
-	if (!doc->md.math)
+	if (!doc->config->md.math)
 		return 0;
 
 	/* find ending delimiter */
@@ -829,89 +1781,76 @@ parse_math(sd_buffer *ob, sd_document *doc, uint8_t *data, size_t offset, size_t
 	/* if this is a $$ and MATH_EXPLICIT is not active,
 	 * guess whether displaymode should be enabled from the context */
 	i += delimsz;
-	if (delimsz == 2 && !(doc->ext_flags & UPSKIRT_EXT_MATH_EXPLICIT))
+	if (delimsz == 2 && !(doc->config->ext_flags & UPSKIRT_EXT_MATH_EXPLICIT))
 		displaymode = is_empty_all(data - offset, offset) && is_empty_all(data + i, size - i);
 
 	/* call callback */
-	if (doc->md.math(ob, &text, displaymode, &doc->data))
+	if (doc->config->md.math(ob, &text, displaymode, &doc->data))
 		return i;
 
 	return 0;
 }
 
-static char*
-load_file(const char* path, char* base_folder, size_t * size)
+/* load_include • returns the contents of a file named in the document,
+ * reading it on first use; NULL when it is not a regular file */
+static const sd_input *
+load_include(sd_document *doc, const uint8_t *name, size_t size)
 {
-	if (path == NULL)
+	struct include_file *inc;
+	char *path;
+
+	if (!size)
 		return NULL;
-	FILE *f;
-	if (path[0] != '/') {
-		char *cwd;
-
-		if (base_folder != NULL) {
-			int n1 = strlen(base_folder);
-			int n2 = strlen(path);
-			int n =  n1 + n2 + 2;
-			cwd = malloc(n*sizeof(char));
-			cwd[n-1] = 0;
-			memcpy(cwd, base_folder, n1);
-			cwd[n1] = '/';
-			memcpy(cwd+n1+1, path, n2);
-		} else {
-			cwd = malloc(128*sizeof(char));
-			memset(cwd, 0, 128);
-			getcwd(cwd, 128);
-			strcat(cwd, "/");
-			strcat(cwd, path);
-		}
-		f =fopen(cwd, "rb");
-		free(cwd);
+
+	path = resolve_path(&doc->arena, name, size, doc->config->base_folder);
+
+	for (inc = doc->includes; inc != NULL; inc = inc->next) {
+		if (strcmp(inc->path, path) == 0)
+			return inc->found ? &inc->contents : NULL;
 	}
-	else
-		f = fopen(path, "rb");
 
-	fseek(f, 0, SEEK_END);
-	*size = ftell(f);
-	fseek(f, 0, SEEK_SET);
+	inc = sd_arena_alloc(&doc->arena, sizeof(struct include_file));
+	inc->path = path;
+	inc->found = is_regular_file(path) && sd_input_load(&inc->contents, path) == 0;
+	inc->next = doc->includes;
+	doc->includes = inc;
 
-	char *string = malloc(*size + 1);
-	fread(string, *size, 1, f);
-	fclose(f);
+	return inc->found ? &inc->contents : NULL;
+}
 
-	string[*size] = 0;
-	return string;
+static void
+free_includes(struct include_file *inc)
+{
+	for (; inc != NULL; inc = inc->next) {
+		if (inc->found)
+			sd_input_release(&inc->contents);
+	}
 }
 
+/* include_name • size of the path in @include(path) */
 static size_t
-parse_include(sd_buffer *ob, sd_document *doc, uint8_t *data, size_t offset, size_t size)
+include_name(const uint8_t *data, size_t size)
 {
-	/* @include(path) */
 	size_t i = 9;
-	size_t n = 0;
-	for (;i < size; i++)
-	{
-		if (data[i] == ')')
-		{
-			break;
-		}
-		n++;
-	}
-	if (n){
-		char * path = malloc((n+1)*sizeof(uint8_t));
-		path[n] = 0;
-		memcpy(path, data+9, n);
-		if (is_regular_file(path, doc->base_folder)){
-			size_t neu_size = 0;
-			char * buffer = load_file(path, doc->base_folder, &neu_size);
 
-			sub_render(doc, ob, (uint8_t*)buffer, neu_size, 0);
+	while (i < size && data[i] != ')')
+		i++;
 
-		}
-		free(path);
-	}
-	return i+1;
+	return i - 9;
 }
 
+static size_t
+parse_include(sd_buffer *ob, sd_document *doc, uint8_t *data, size_t offset, size_t size)
+{
+	/* @include(path) */
+	size_t n = include_name(data, size);
+	const sd_input *contents = load_include(doc, data + 9, n);
+
+	if (contents)
+		sub_render(doc, ob, contents->data, contents->size, 0);
+
+	return 9 + n + 1;
+}
 
 /* char_emphasis • single and double emphasis parsing */
 static size_t
@@ -920,7 +1859,7 @@ char_emphasis(sd_buffer *ob, sd_document *doc, uint8_t *data, size_t offset, siz
 	uint8_t c = data[0];
 	size_t ret;
 
-	if (doc->ext_flags & UPSKIRT_EXT_NO_INTRA_EMPHASIS) {
+	if (doc->config->ext_flags & UPSKIRT_EXT_NO_INTRA_EMPHASIS) {
 		if (offset > 0 && !_isspace(data[-1]) && data[-1] != '>' && data[-1] != '(')
 			return 0;
 	}
@@ -963,7 +1902,7 @@ char_linebreak(sd_buffer *ob, sd_document *doc, uint8_t *data, size_t offset, si
 	while (ob->size && ob->data[ob->size - 1] == ' ')
 		ob->size--;
 
-	return doc->md.linebreak(ob, &doc->data) ? 1 : 0;
+	return doc->config->md.linebreak(ob, &doc->data) ? 1 : 0;
 }
 
 
@@ -1002,10 +1941,10 @@ char_codespan(sd_buffer *ob, sd_document *doc, uint8_t *data, size_t offset, siz
 		work.data = data + f_begin;
 		work.size = f_end - f_begin;
 
-		if (!doc->md.codespan(ob, &work, &doc->data))
+		if (!doc->config->md.codespan(ob, &work, &doc->data))
 			end = 0;
 	} else {
-		if (!doc->md.codespan(ob, 0, &doc->data))
+		if (!doc->config->md.codespan(ob, 0, &doc->data))
 			end = 0;
 	}
 
@@ -1026,7 +1965,7 @@ char_quote(sd_buffer *ob, sd_document *doc, uint8_t *data, size_t offset, size_t
 	end = nq;
 	while (1) {
 		i = end;
-		end += find_emph_char(data + end, size - end, '"');
+		end += find_emph_char(doc, data + end, size - end, '"');
 		if (end == i) return 0;		/* no matching delimiter */
 		i = end;
 		while (end < size && data[end] == '"' && end - i < nq) end++;
@@ -1047,11 +1986,11 @@ char_quote(sd_buffer *ob, sd_document *doc, uint8_t *data, size_t offset, size_t
 		sd_buffer *work = newbuf(doc, BUFFER_SPAN);
 		parse_inline(work, doc, data + f_begin, f_end - f_begin);
 
-		if (!doc->md.quote(ob, work, &doc->data))
+		if (!doc->config->md.quote(ob, work, &doc->data))
 			end = 0;
 		popbuf(doc, BUFFER_SPAN);
 	} else {
-		if (!doc->md.quote(ob, 0, &doc->data))
+		if (!doc->config->md.quote(ob, 0, &doc->data))
 			end = 0;
 	}
 
@@ -1068,7 +2007,7 @@ char_escape(sd_buffer *ob, sd_document *doc, uint8_t *data, size_t offset, size_
 	size_t w;
 
 	if (size > 1) {
-		if (data[1] == '\\' && (doc->ext_flags & UPSKIRT_EXT_MATH) &&
+		if (data[1] == '\\' && (doc->config->ext_flags & UPSKIRT_EXT_MATH) &&
 			size > 2 && (data[2] == '(' || data[2] == '[')) {
 			const char *end = (data[2] == '[') ? "\\\\]" : "\\\\)";
 			w = parse_math(ob, doc, data, offset, size, end, 3, data[2] == '[');
@@ -1078,17 +2017,17 @@ char_escape(sd_buffer *ob, sd_document *doc, uint8_t *data, size_t offset, size_
 		if (strchr(escape_chars, data[1]) == NULL)
 			return 0;
 
-		if (doc->md.normal_text) {
+		if (doc->config->md.normal_text) {
 			work.data = data + 1;
 			work.size = 1;
-			doc->md.normal_text(ob, &work, &doc->data);
+			doc->config->md.normal_text(ob, &work, &doc->data);
 		}
 		else sd_buffer_putc(ob, data[1]);
 	} else if (size == 1) {
-		if (doc->md.normal_text) {
+		if (doc->config->md.normal_text) {
 			work.data = data;
 			work.size = 1;
-			doc->md.normal_text(ob, &work, &doc->data);
+			doc->config->md.normal_text(ob, &work, &doc->data);
 		}
 		else sd_buffer_putc(ob, data[0]);
 	}
@@ -1115,10 +2054,10 @@ char_entity(sd_buffer *ob, sd_document *doc, uint8_t *data, size_t offset, size_
 	else
 		return 0; /* lone '&' */
 
-	if (doc->md.entity) {
+	if (doc->config->md.entity) {
 		work.data = data;
 		work.size = end;
-		doc->md.entity(ob, &work, &doc->data);
+		doc->config->md.entity(ob, &work, &doc->data);
 	}
 	else sd_buffer_put(ob, data, end);
 
@@ -1131,23 +2070,23 @@ char_langle_tag(sd_buffer *ob, sd_document *doc, uint8_t *data, size_t offset, s
 {
 	sd_buffer work = { NULL, 0, 0, 0, NULL, NULL, NULL };
 	sd_autolink_type altype = UPSKIRT_AUTOLINK_NONE;
-	size_t end = tag_length(data, size, &altype);
+	size_t end = tag_length(doc, data, size, &altype);
 	int ret = 0;
 
 	work.data = data;
 	work.size = end;
 
 	if (end > 2) {
-		if (doc->md.autolink && altype != UPSKIRT_AUTOLINK_NONE) {
+		if (doc->config->md.autolink && altype != UPSKIRT_AUTOLINK_NONE) {
 			sd_buffer *u_link = newbuf(doc, BUFFER_SPAN);
 			work.data = data + 1;
 			work.size = end - 2;
 			unscape_text(u_link, &work);
-			ret = doc->md.autolink(ob, u_link, altype, &doc->data);
+			ret = doc->config->md.autolink(ob, u_link, altype, &doc->data);
 			popbuf(doc, BUFFER_SPAN);
 		}
-		else if (doc->md.raw_html)
-			ret = doc->md.raw_html(ob, &work, &doc->data);
+		else if (doc->config->md.raw_html)
+			ret = doc->config->md.raw_html(ob, &work, &doc->data);
 	}
 
 	if (!ret) return 0;
@@ -1160,7 +2099,7 @@ char_autolink_www(sd_buffer *ob, sd_document *doc, uint8_t *data, size_t offset,
 	sd_buffer *link, *link_url, *link_text;
 	size_t link_len, rewind;
 
-	if (!doc->md.link || doc->in_link_body)
+	if (!doc->config->md.link || doc->in_link_body)
 		return 0;
 
 	link = newbuf(doc, BUFFER_SPAN);
@@ -1175,13 +2114,13 @@ char_autolink_www(sd_buffer *ob, sd_document *doc, uint8_t *data, size_t offset,
 		else
 			ob->size = 0;
 
-		if (doc->md.normal_text) {
+		if (doc->config->md.normal_text) {
 			link_text = newbuf(doc, BUFFER_SPAN);
-			doc->md.normal_text(link_text, link, &doc->data);
-			doc->md.link(ob, link_text, link_url, NULL, &doc->data);
+			doc->config->md.normal_text(link_text, link, &doc->data);
+			doc->config->md.link(ob, link_text, link_url, NULL, &doc->data);
 			popbuf(doc, BUFFER_SPAN);
 		} else {
-			doc->md.link(ob, link, link_url, NULL, &doc->data);
+			doc->config->md.link(ob, link, link_url, NULL, &doc->data);
 		}
 		popbuf(doc, BUFFER_SPAN);
 	}
@@ -1194,25 +2133,24 @@ static size_t
 char_ref(sd_buffer *ob, sd_document *doc, uint8_t *data, size_t offset, size_t size)
 {
 
-	if (startsWith("(#", (char*)data)){
+	if (has_prefix(data, size, "(#")){
 		size_t i;
 		for (i=2; i < size; i++)
 		{
 			if (data[i]==')')
 				break;
 		}
-		char * ref_id = malloc((i-1)*sizeof(char));
-		ref_id[i-2] = 0;
-		memcpy(ref_id, data+2, i-2);
+		char * ref_id = sd_arena_strndup(&doc->arena, data+2, i-2);
 		int count = 0;
-		if (find_ref(doc->floating_references, ref_id, &count))
+		if (find_ref(&doc->floats, ref_id, &count))
 		{
-			if (doc->md.ref)
-				doc->md.ref(ob, ref_id, count);
+			if (doc->config->md.ref)
+				doc->config->md.ref(ob, ref_id, count);
 			return i+1;
 		} else {
-			if (doc->md.ref)
-				doc->md.ref(ob, ref_id, -1);
+			doc->missing++;
+			if (doc->config->md.ref)
+				doc->config->md.ref(ob, ref_id, -1);
 			return i+1;
 		}
 	}
@@ -1223,26 +2161,26 @@ static size_t
 char_autolink_email(sd_buffer *ob, sd_document *doc, uint8_t *data, size_t offset, size_t size)
 {
 
-	if (startsWith("@include(", (char*)data))
+	if (has_prefix(data, size, "@include("))
     {
     	return parse_include(ob, doc, data, offset, size);
     }
-    if (startsWith("@\\", (char*)data) && is_separator(data[2])){
-	    if (doc->md.linebreak)
+    if (has_prefix(data, size, "@\\") && size > 2 && is_separator(data[2])){
+	    if (doc->config->md.linebreak)
 	    {
-	    	doc->md.linebreak(ob, &doc->data);
+	    	doc->config->md.linebreak(ob, &doc->data);
 	    }
 	    return 3;
     }
-    if (startsWith("@pagebreak", (char*)data))
+    if (has_prefix(data, size, "@pagebreak"))
    	{
-	   	if (doc->md.pagebreak)
+	   	if (doc->config->md.pagebreak)
    		{
-  			doc->md.pagebreak(ob);
+  			doc->config->md.pagebreak(ob);
    		}
    		return 10;
    	}
-    if (startsWith("@caption(", (char*)data))
+    if (has_prefix(data, size, "@caption("))
    	{
    		/** skip it **/
    		size_t i;
@@ -1255,7 +2193,7 @@ char_autolink_email(sd_buffer *ob, sd_document *doc, uint8_t *data, size_t offse
 	sd_buffer *link;
 	size_t link_len, rewind;
 
-	if (!doc->md.autolink || doc->in_link_body)
+	if (!doc->config->md.autolink || doc->in_link_body)
 		return 0;
 
 	link = newbuf(doc, BUFFER_SPAN);
@@ -1266,7 +2204,7 @@ char_autolink_email(sd_buffer *ob, sd_document *doc, uint8_t *data, size_t offse
 		else
 			ob->size = 0;
 
-		doc->md.autolink(ob, link, UPSKIRT_AUTOLINK_EMAIL, &doc->data);
+		doc->config->md.autolink(ob, link, UPSKIRT_AUTOLINK_EMAIL, &doc->data);
 	}
 
 	popbuf(doc, BUFFER_SPAN);
@@ -1279,7 +2217,7 @@ char_autolink_url(sd_buffer *ob, sd_document *doc, uint8_t *data, size_t offset,
 	sd_buffer *link;
 	size_t link_len, rewind;
 
-	if (!doc->md.autolink || doc->in_link_body)
+	if (!doc->config->md.autolink || doc->in_link_body)
 		return 0;
 
 	link = newbuf(doc, BUFFER_SPAN);
@@ -1290,7 +2228,7 @@ char_autolink_url(sd_buffer *ob, sd_document *doc, uint8_t *data, size_t offset,
 		else
 			ob->size = 0;
 
-		doc->md.autolink(ob, link, UPSKIRT_AUTOLINK_NORMAL, &doc->data);
+		doc->config->md.autolink(ob, link, UPSKIRT_AUTOLINK_NORMAL, &doc->data);
 	}
 
 	popbuf(doc, BUFFER_SPAN);
@@ -1313,22 +2251,22 @@ static size_t
 char_link(sd_buffer *ob, sd_document *doc, uint8_t *data, size_t offset, size_t size)
 {
 	int is_img = (offset && data[-1] == '!' && !is_escaped(data - offset, offset - 1));
-	int is_footnote = (doc->ext_flags & UPSKIRT_EXT_FOOTNOTES && data[1] == '^');
+	int is_footnote = (doc->config->ext_flags & UPSKIRT_EXT_FOOTNOTES && data[1] == '^');
 	size_t i = 1, txt_e, link_b = 0, link_e = 0, title_b = 0, title_e = 0;
 	sd_buffer *content = NULL;
 	sd_buffer *link = NULL;
 	sd_buffer *title = NULL;
 	sd_buffer *u_link = NULL;
 	size_t org_work_size = doc->work_bufs[BUFFER_SPAN].size;
-	int ret = 0, in_title = 0, qtype = 0;
+	int ret = 0, qtype = 0;
 
 	/* checking whether the correct renderer exists */
-	if ((is_footnote && !doc->md.footnote_ref) || (is_img && !doc->md.image)
-		|| (!is_img && !is_footnote && !doc->md.link))
+	if ((is_footnote && !doc->config->md.footnote_ref) || (is_img && !doc->config->md.image)
+		|| (!is_img && !is_footnote && !doc->config->md.link))
 		goto cleanup;
 
 	/* looking for the matching closing bracket */
-	i += find_emph_char(data + i, size - i, ']');
+	i += find_emph_char(doc, data + i, size - i, ']');
 	txt_e = i;
 
 	if (i < size && data[i] == ']') i++;
@@ -1345,24 +2283,29 @@ char_link(sd_buffer *ob, sd_document *doc, uint8_t *data, size_t offset, size_t
 		id.data = data + 2;
 		id.size = txt_e - 2;
 
-		fr = find_footnote_ref(&doc->footnotes_found, id.data, id.size);
+		fr = find_footnote_ref(&doc->notes, id.data, id.size);
 
 		if (fr) {
 			int is_used = fr->is_used;
 
+			if (doc->piece)
+				piece_note(doc->piece, fr);
+
 			/* mark footnote used */
 			if (!is_used) {
-				if(!add_footnote_ref(&doc->footnotes_used, fr))
+				if(!add_footnote_ref(&doc->arena, &doc->footnotes_used, fr))
 					goto cleanup;
 				fr->is_used = 1;
 				fr->num = doc->footnotes_used.count;
 			}
 
 			/* render */
-			if (doc->md.footnote_ref)
-				ret = doc->md.footnote_ref(ob, fr->num, is_used, &doc->data);
-		} else if (doc->md.footnote_ref) {
-			ret = doc->md.footnote_ref(ob, -1, 0, &doc->data);
+			if (doc->config->md.footnote_ref)
+				ret = doc->config->md.footnote_ref(ob, fr->num, is_used, &doc->data);
+		} else {
+			doc->missing++;
+			if (doc->config->md.footnote_ref)
+				ret = doc->config->md.footnote_ref(ob, -1, 0, &doc->data);
 		}
 
 		goto cleanup;
@@ -1375,8 +2318,6 @@ char_link(sd_buffer *ob, sd_document *doc, uint8_t *data, size_t offset, size_t
 
 	/* inline style link */
 	if (i < size && data[i] == '(') {
-		size_t nb_p;
-
 		/* skipping initial spacing */
 		i++;
 
@@ -1386,21 +2327,7 @@ char_link(sd_buffer *ob, sd_document *doc, uint8_t *data, size_t offset, size_t
 		link_b = i;
 
 		/* looking for link end: ' " ) */
-		/* Count the number of open parenthesis */
-		nb_p = 0;
-
-		while (i < size) {
-			if (data[i] == '\\') i += 2;
-			else if (data[i] == '(' && i != 0) {
-				nb_p++; i++;
-			}
-			else if (data[i] == ')') {
-				if (nb_p == 0) break;
-				else nb_p--;
-				i++;
-			} else if (i >= 1 && _isspace(data[i-1]) && (data[i] == '\'' || data[i] == '"')) break;
-			else i++;
-		}
+		i = find_link_end(doc, data, size, i);
 
 		if (i >= size) goto cleanup;
 		link_e = i;
@@ -1408,16 +2335,12 @@ char_link(sd_buffer *ob, sd_document *doc, uint8_t *data, size_t offset, size_t
 		/* looking for title end if present */
 		if (data[i] == '\'' || data[i] == '"') {
 			qtype = data[i];
-			in_title = 1;
 			i++;
 			title_b = i;
 
-			while (i < size) {
-				if (data[i] == '\\') i += 2;
-				else if (data[i] == qtype) {in_title = 0; i++;}
-				else if ((data[i] == ')') && !in_title) break;
-				else i++;
-			}
+			/* up to the closing quote, then to the ')' */
+			i = find_close(doc, data, size,
+				qtype == '"' ? CLOSE_TITLE_DOUBLE : CLOSE_TITLE_SINGLE, i);
 
 			if (i >= size) goto cleanup;
 
@@ -1475,9 +2398,11 @@ char_link(sd_buffer *ob, sd_document *doc, uint8_t *data, size_t offset, size_t
 		else
 			sd_buffer_put(id, data + link_b, link_e - link_b);
 
-		lr = find_link_ref(doc->refs, id->data, id->size);
-		if (!lr)
+		lr = find_link_ref(&doc->refs, id->data, id->size);
+		if (!lr) {
+			doc->missing++;
 			goto cleanup;
+		}
 
 		/* keeping link and title from link_ref */
 		link = lr->link;
@@ -1486,7 +2411,7 @@ char_link(sd_buffer *ob, sd_document *doc, uint8_t *data, size_t offset, size_t
 	}
 
 	/* ruby text extension */
-	else if (i < size && data[i] == '{' && doc->ext_flags & UPSKIRT_EXT_RUBY) {
+	else if (i < size && data[i] == '{' && doc->config->ext_flags & UPSKIRT_EXT_RUBY) {
 		/* looking for the enclosing bracket */
 		i++;
 		title_b = i;
@@ -1505,7 +2430,7 @@ char_link(sd_buffer *ob, sd_document *doc, uint8_t *data, size_t offset, size_t
 			sd_buffer_put(title, data + title_b, title_e - title_b);
 		}
 
-		ret = doc->md.ruby(ob, content, title, &doc->data);
+		ret = doc->config->md.ruby(ob, content, title, &doc->data);
 		i++;
 
 		goto cleanup;
@@ -1513,14 +2438,14 @@ char_link(sd_buffer *ob, sd_document *doc, uint8_t *data, size_t offset, size_t
 
 	/* citation extension */
 	else if (txt_e >= 4 && data[1] == '[' && data[txt_e - 1] == ']' &&
-			 doc->ext_flags & UPSKIRT_EXT_CITE) {
+			 doc->config->ext_flags & UPSKIRT_EXT_CITE) {
 
 		/* building content */
 		content = newbuf(doc, BUFFER_SPAN);
 		sd_buffer_put(content, data + 2, txt_e	- 3);
 
-		if (doc->md.cite)
-			ret = doc->md.cite(ob, content, &doc->data);
+		if (doc->config->md.cite)
+			ret = doc->config->md.cite(ob, content, &doc->data);
 
 		/* rewinding the spacing */
 		i = txt_e + 1;
@@ -1536,9 +2461,11 @@ char_link(sd_buffer *ob, sd_document *doc, uint8_t *data, size_t offset, size_t
 		replace_spacing(id, data + 1, txt_e - 1);
 
 		/* finding the link_ref */
-		lr = find_link_ref(doc->refs, id->data, id->size);
-		if (!lr)
+		lr = find_link_ref(&doc->refs, id->data, id->size);
+		if (!lr) {
+			doc->missing++;
 			goto cleanup;
+		}
 
 		/* keeping link and title from link_ref */
 		link = lr->link;
@@ -1569,9 +2496,9 @@ char_link(sd_buffer *ob, sd_document *doc, uint8_t *data, size_t offset, size_t
 
 	/* calling the relevant rendering function */
 	if (is_img) {
-		ret = doc->md.image(ob, u_link, title, content, &doc->data);
+		ret = doc->config->md.image(ob, u_link, title, content, &doc->data);
 	} else {
-		ret = doc->md.link(ob, content, u_link, title, &doc->data);
+		ret = doc->config->md.link(ob, content, u_link, title, &doc->data);
 	}
 
 	/* cleanup */
@@ -1586,7 +2513,7 @@ char_superscript(sd_buffer *ob, sd_document *doc, uint8_t *data, size_t offset,
 	size_t sup_start, sup_len;
 	sd_buffer *sup;
 
-	if (!doc->md.superscript)
+	if (!doc->config->md.superscript)
 		return 0;
 
 	if (size < 2)
@@ -1594,7 +2521,7 @@ char_superscript(sd_buffer *ob, sd_document *doc, uint8_t *data, size_t offset,
 
 	if (data[1] == '(') {
 		sup_start = 2;
-		sup_len = find_emph_char(data + 2, size - 2, ')') + 2;
+		sup_len = find_emph_char(doc, data + 2, size - 2, ')') + 2;
 
 		if (sup_len == size)
 			return 0;
@@ -1610,7 +2537,7 @@ char_superscript(sd_buffer *ob, sd_document *doc, uint8_t *data, size_t offset,
 
 	sup = newbuf(doc, BUFFER_SPAN);
 	parse_inline(sup, doc, data + sup_start, sup_len - sup_start);
-	doc->md.superscript(ob, sup, &doc->data);
+	doc->config->md.superscript(ob, sup, &doc->data);
 	popbuf(doc, BUFFER_SPAN);
 
 	return (sup_start == 2) ? sup_len + 1 : sup_len;
@@ -1624,7 +2551,7 @@ char_math(sd_buffer *ob, sd_document *doc, uint8_t *data, size_t offset, size_t
 		return parse_math(ob, doc, data, offset, size, "$$", 2, 1);
 
 	/* single dollar allowed only with MATH_EXPLICIT flag */
-	if (doc->ext_flags & UPSKIRT_EXT_MATH_EXPLICIT)
+	if (doc->config->ext_flags & UPSKIRT_EXT_MATH_EXPLICIT)
 		return parse_math(ob, doc, data, offset, size, "$", 1, 0);
 
 	return 0;
@@ -1748,7 +2675,7 @@ is_atxheader(sd_document *doc, uint8_t *data, size_t size)
 	if (data[0] != '#')
 		return 0;
 
-	if (doc->ext_flags & UPSKIRT_EXT_SPACE_HEADERS) {
+	if (doc->config->ext_flags & UPSKIRT_EXT_SPACE_HEADERS) {
 		size_t level = 0;
 
 		while (level < size && level < 6 && data[level] == '#')
@@ -1912,11 +2839,13 @@ prefix_uli(uint8_t *data, size_t size)
 static size_t
 prefix_float(uint8_t * data, size_t size)
 {
-	char * txt = (char*) data;
-	return (startsWith("@figure", txt) || startsWith("@table",txt) ||
-	        startsWith("@code", txt) || startsWith("@listing",txt) ||
-	        startsWith("@abstract", txt) || startsWith("@equation", txt) ||
-	        startsWith("@toc", txt));
+	if (!size || data[0] != '@')
+		return 0;
+
+	return (has_prefix(data, size, "@figure") || has_prefix(data, size, "@table") ||
+	        has_prefix(data, size, "@code") || has_prefix(data, size, "@listing") ||
+	        has_prefix(data, size, "@abstract") || has_prefix(data, size, "@equation") ||
+	        has_prefix(data, size, "@toc"));
 }
 
 /* parse_block • parsing of one block, returning next uint8_t to parse */
@@ -1932,7 +2861,6 @@ parse_blockquote(sd_buffer *ob, sd_document *doc, uint8_t *data, size_t size)
 	uint8_t *work_data = 0;
 	sd_buffer *out = 0;
 
-	out = newbuf(doc, BUFFER_BLOCK);
 	beg = 0;
 	while (beg < size) {
 		for (end = beg + 1; end < size && data[end - 1] != '\n'; end++);
@@ -1959,9 +2887,23 @@ parse_blockquote(sd_buffer *ob, sd_document *doc, uint8_t *data, size_t size)
 		beg = end;
 	}
 
+	if (doc->config->md.open_blockquote && doc->config->md.close_blockquote) {
+		sd_buffer view;
+
+		doc->config->md.open_blockquote(ob, &doc->data);
+		sd_buffer_view_open(&view, ob);
+		doc->in_place++;
+		parse_block(&view, doc, work_data, work_size, -1);
+		doc->in_place--;
+		sd_buffer_view_close(&view);
+		doc->config->md.close_blockquote(ob, &doc->data);
+		return end;
+	}
+
+	out = newbuf(doc, BUFFER_BLOCK);
 	parse_block(out, doc, work_data, work_size, -1);
-	if (doc->md.blockquote)
-		doc->md.blockquote(ob, out, &doc->data);
+	if (doc->config->md.blockquote)
+		doc->config->md.blockquote(ob, out, &doc->data);
 	popbuf(doc, BUFFER_BLOCK);
 	return end;
 }
@@ -2005,8 +2947,8 @@ parse_paragraph(sd_buffer *ob, sd_document *doc, uint8_t *data, size_t size)
 	if (!level) {
 		sd_buffer *tmp = newbuf(doc, BUFFER_BLOCK);
 		parse_inline(tmp, doc, work.data, work.size);
-		if (doc->md.paragraph)
-			doc->md.paragraph(ob, tmp, &doc->data);
+		if (doc->config->md.paragraph)
+			doc->config->md.paragraph(ob, tmp, &doc->data);
 		popbuf(doc, BUFFER_BLOCK);
 	} else {
 		sd_buffer *header_work;
@@ -2027,8 +2969,8 @@ parse_paragraph(sd_buffer *ob, sd_document *doc, uint8_t *data, size_t size)
 				sd_buffer *tmp = newbuf(doc, BUFFER_BLOCK);
 				parse_inline(tmp, doc, work.data, work.size);
 
-				if (doc->md.paragraph)
-					doc->md.paragraph(ob, tmp, &doc->data);
+				if (doc->config->md.paragraph)
+					doc->config->md.paragraph(ob, tmp, &doc->data);
 
 				popbuf(doc, BUFFER_BLOCK);
 				work.data += beg;
@@ -2050,10 +2992,12 @@ parse_paragraph(sd_buffer *ob, sd_document *doc, uint8_t *data, size_t size)
 		} else if (level == 3) {
 			doc->counter.subsection++;
 		}
+		if (doc->piece)
+			piece_header(doc->piece, level);
 
-		if (doc->md.header){
+		if (doc->config->md.header){
 
-			doc->md.header(ob, header_work, (int)level, &doc->data, doc->counter, doc->document_metadata->numbering);
+			doc->config->md.header(ob, header_work, (int)level, &doc->data, doc->counter, doc->document_metadata->numbering);
 		}
 		popbuf(doc, BUFFER_SPAN);
 	}
@@ -2098,8 +3042,8 @@ parse_fencedcode(sd_buffer *ob, sd_document *doc, uint8_t *data, size_t size)
 	text.data = data + text_start;
 	text.size = line_start - text_start;
 
-	if (doc->md.blockcode)
-		doc->md.blockcode(ob, text.size ? &text : NULL, lang.size ? &lang : NULL, &doc->data);
+	if (doc->config->md.blockcode)
+		doc->config->md.blockcode(ob, text.size ? &text : NULL, lang.size ? &lang : NULL, &doc->data);
 
 	return i;
 }
@@ -2138,8 +3082,8 @@ parse_blockcode(sd_buffer *ob, sd_document *doc, uint8_t *data, size_t size)
 
 	sd_buffer_putc(work, '\n');
 
-	if (doc->md.blockcode)
-		doc->md.blockcode(ob, work, NULL, &doc->data);
+	if (doc->config->md.blockcode)
+		doc->config->md.blockcode(ob, work, NULL, &doc->data);
 
 	popbuf(doc, BUFFER_BLOCK);
 	return beg;
@@ -2152,8 +3096,9 @@ parse_blockcode(sd_buffer *ob, sd_document *doc, uint8_t *data, size_t size)
 static size_t
 parse_listitem(sd_buffer *ob, sd_document *doc, uint8_t *data, size_t size, sd_list_flags *flags)
 {
-	sd_buffer *work = 0, *inter = 0;
+	sd_buffer *work = 0, *inter = 0, view;
 	size_t beg = 0, end, pre, sublist = 0, orgpre = 0, i;
+	int in_place = doc->config->md.open_listitem && doc->config->md.close_listitem;
 	int in_empty = 0, has_inside_empty = 0, in_fence = 0;
 
 	/* keeping track of the first indentation prefix */
@@ -2176,15 +3121,20 @@ parse_listitem(sd_buffer *ob, sd_document *doc, uint8_t *data, size_t size, sd_l
 	while (end < size && data[end - 1] != '\n')
 		end++;
 
-	if (doc->ext_flags & UPSKIRT_EXT_FENCED_CODE) {
+	if (doc->config->ext_flags & UPSKIRT_EXT_FENCED_CODE) {
 		if (is_codefence(data + beg, end - beg, NULL, NULL)) {
 			in_fence = 1;
 		}
 	}
 
-	/* getting working buffers */
+	/* getting working buffers; in place, the view takes the place of the
+	 * intermediate one */
 	work = newbuf(doc, BUFFER_SPAN);
-	inter = newbuf(doc, BUFFER_SPAN);
+	if (in_place) {
+		doc->in_place++;
+		inter = &view;
+	} else
+		inter = newbuf(doc, BUFFER_SPAN);
 
 	/* putting the first line into the working buffer */
 	sd_buffer_put(work, data + beg, end - beg);
@@ -2213,7 +3163,7 @@ parse_listitem(sd_buffer *ob, sd_document *doc, uint8_t *data, size_t size, sd_l
 
 		pre = i;
 
-		if (doc->ext_flags & UPSKIRT_EXT_FENCED_CODE) {
+		if (doc->config->ext_flags & UPSKIRT_EXT_FENCED_CODE) {
 			if (is_codefence(data + beg + i, end - beg - i, NULL, NULL))
 				in_fence = !in_fence;
 		}
@@ -2267,6 +3217,11 @@ parse_listitem(sd_buffer *ob, sd_document *doc, uint8_t *data, size_t size, sd_l
 	if (has_inside_empty)
 		*flags |= UPSKIRT_LI_BLOCK;
 
+	if (in_place) {
+		doc->config->md.open_listitem(ob, *flags, &doc->data);
+		sd_buffer_view_open(&view, ob);
+	}
+
 	if (*flags & UPSKIRT_LI_BLOCK) {
 		/* intermediate render of block li */
 		if (sublist && sublist < work->size) {
@@ -2286,10 +3241,16 @@ parse_listitem(sd_buffer *ob, sd_document *doc, uint8_t *data, size_t size, sd_l
 	}
 
 	/* render of li itself */
-	if (doc->md.listitem)
-		doc->md.listitem(ob, inter, *flags, &doc->data);
+	if (in_place) {
+		sd_buffer_view_close(&view);
+		doc->config->md.close_listitem(ob, *flags, &doc->data);
+		doc->in_place--;
+	} else {
+		if (doc->config->md.listitem)
+			doc->config->md.listitem(ob, inter, *flags, &doc->data);
+		popbuf(doc, BUFFER_SPAN);
+	}
 
-	popbuf(doc, BUFFER_SPAN);
 	popbuf(doc, BUFFER_SPAN);
 	return beg;
 }
@@ -2299,10 +3260,17 @@ parse_listitem(sd_buffer *ob, sd_document *doc, uint8_t *data, size_t size, sd_l
 static size_t
 parse_list(sd_buffer *ob, sd_document *doc, uint8_t *data, size_t size, sd_list_flags flags)
 {
-	sd_buffer *work = 0;
+	sd_buffer *work = 0, view;
 	size_t i = 0, j;
+	int in_place = doc->config->md.open_list && doc->config->md.close_list;
 
-	work = newbuf(doc, BUFFER_BLOCK);
+	if (in_place) {
+		doc->config->md.open_list(ob, flags, &doc->data);
+		sd_buffer_view_open(&view, ob);
+		doc->in_place++;
+		work = &view;
+	} else
+		work = newbuf(doc, BUFFER_BLOCK);
 
 	while (i < size) {
 		j = parse_listitem(work, doc, data + i, size - i, &flags);
@@ -2312,14 +3280,20 @@ parse_list(sd_buffer *ob, sd_document *doc, uint8_t *data, size_t size, sd_list_
 			break;
 	}
 
-	if (doc->md.list)
-		doc->md.list(ob, work, flags, &doc->data);
-	popbuf(doc, BUFFER_BLOCK);
+	if (in_place) {
+		doc->in_place--;
+		sd_buffer_view_close(&view);
+		doc->config->md.close_list(ob, flags, &doc->data);
+	} else {
+		if (doc->config->md.list)
+			doc->config->md.list(ob, work, flags, &doc->data);
+		popbuf(doc, BUFFER_BLOCK);
+	}
 	return i;
 }
 
 uint8_t *
-get_atxheader_info(uint8_t *data, size_t size, size_t * level, size_t * skip)
+get_atxheader_info(sd_arena *arena, uint8_t *data, size_t size, size_t * level, size_t * skip)
 {
 	*level = 0;
 	size_t i, end;
@@ -2342,10 +3316,7 @@ get_atxheader_info(uint8_t *data, size_t size, size_t * level, size_t * skip)
 	if (end <= i)
 		return NULL;
 
-	uint8_t * title =  malloc(sizeof(uint8_t)*(end - i + 1));
-	title[end-i] = 0;
-	memcpy(title, data+i, end-i);
-	return title;
+	return (uint8_t *)sd_arena_strndup(arena, data+i, end-i);
 }
 
 /* parse_atxheader • parsing of atx-style headers */
@@ -2355,7 +3326,7 @@ parse_atxheader(sd_buffer *ob, sd_document *doc, uint8_t *data, size_t size)
 	size_t level = 0;
 	size_t skip = 0;
 
-	uint8_t * title = get_atxheader_info(data, size, &level, &skip);
+	uint8_t * title = get_atxheader_info(&doc->arena, data, size, &level, &skip);
 
 	if (level == 1)
 	{
@@ -2370,15 +3341,17 @@ parse_atxheader(sd_buffer *ob, sd_document *doc, uint8_t *data, size_t size)
 	{
 		doc->counter.subsection ++;
 	}
+	if (doc->piece)
+		piece_header(doc->piece, level);
 
 	if (title) {
 		sd_buffer *work = newbuf(doc, BUFFER_SPAN);
 
 		parse_inline(work, doc, title, strlen((char*)title));
 
-		if (doc->md.header)
+		if (doc->config->md.header)
 		{
-			doc->md.header(ob, work, (int)level, &doc->data, doc->counter, doc->document_metadata->numbering);
+			doc->config->md.header(ob, work, (int)level, &doc->data, doc->counter, doc->document_metadata->numbering);
 		}
 		popbuf(doc, BUFFER_SPAN);
 	}
@@ -2395,8 +3368,8 @@ parse_footnote_def(sd_buffer *ob, sd_document *doc, unsigned int num, uint8_t *d
 
 	parse_block(work, doc, data, size, -1);
 
-	if (doc->md.footnote_def)
-	doc->md.footnote_def(ob, work, num, &doc->data);
+	if (doc->config->md.footnote_def)
+	doc->config->md.footnote_def(ob, work, num, &doc->data);
 	popbuf(doc, BUFFER_SPAN);
 }
 
@@ -2420,8 +3393,8 @@ parse_footnote_list(sd_buffer *ob, sd_document *doc, struct footnote_list *footn
 		item = item->next;
 	}
 
-	if (doc->md.footnotes)
-		doc->md.footnotes(ob, work, &doc->data);
+	if (doc->config->md.footnotes)
+		doc->config->md.footnotes(ob, work, &doc->data);
 	popbuf(doc, BUFFER_BLOCK);
 }
 
@@ -2540,8 +3513,8 @@ parse_htmlblock(sd_buffer *ob, sd_document *doc, uint8_t *data, size_t size, int
 
 			if (j) {
 				work.size = i + j;
-				if (do_render && doc->md.blockhtml)
-					doc->md.blockhtml(ob, &work, &doc->data);
+				if (do_render && doc->config->md.blockhtml)
+					doc->config->md.blockhtml(ob, &work, &doc->data);
 				return work.size;
 			}
 		}
@@ -2557,8 +3530,8 @@ parse_htmlblock(sd_buffer *ob, sd_document *doc, uint8_t *data, size_t size, int
 				j = is_empty(data + i, size - i);
 				if (j) {
 					work.size = i + j;
-					if (do_render && doc->md.blockhtml)
-						doc->md.blockhtml(ob, &work, &doc->data);
+					if (do_render && doc->config->md.blockhtml)
+						doc->config->md.blockhtml(ob, &work, &doc->data);
 					return work.size;
 				}
 			}
@@ -2582,8 +3555,8 @@ parse_htmlblock(sd_buffer *ob, sd_document *doc, uint8_t *data, size_t size, int
 
 	/* the end of the block has been found */
 	work.size = tag_end;
-	if (do_render && doc->md.blockhtml)
-		doc->md.blockhtml(ob, &work, &doc->data);
+	if (do_render && doc->config->md.blockhtml)
+		doc->config->md.blockhtml(ob, &work, &doc->data);
 
 	return tag_end;
 }
@@ -2601,7 +3574,7 @@ parse_table_row(
 	size_t i = 0, col, len;
 	sd_buffer *row_work = 0;
 
-	if (!doc->md.table_cell || !doc->md.table_row)
+	if (!doc->config->md.table_cell || !doc->config->md.table_row)
 		return;
 
 	row_work = newbuf(doc, BUFFER_SPAN);
@@ -2620,7 +3593,7 @@ parse_table_row(
 
 		cell_start = i;
 
-		len = find_emph_char(data + i, size - i, '|');
+		len = find_emph_char(doc, data + i, size - i, '|');
 
 		/* Two possibilities for len == 0:
 		   1) No more pipe char found in the current line.
@@ -2637,7 +3610,7 @@ parse_table_row(
 			cell_end--;
 
 		parse_inline(cell_work, doc, data + cell_start, 1 + cell_end - cell_start);
-		doc->md.table_cell(row_work, cell_work, col_data[col] | header_flag, &doc->data);
+		doc->config->md.table_cell(row_work, cell_work, col_data[col] | header_flag, &doc->data);
 
 		popbuf(doc, BUFFER_SPAN);
 		i++;
@@ -2645,10 +3618,10 @@ parse_table_row(
 
 	for (; col < columns; ++col) {
 		sd_buffer empty_cell = { 0, 0, 0, 0, NULL, NULL, NULL };
-		doc->md.table_cell(row_work, &empty_cell, col_data[col] | header_flag, &doc->data);
+		doc->config->md.table_cell(row_work, &empty_cell, col_data[col] | header_flag, &doc->data);
 	}
 
-	doc->md.table_row(ob, row_work, &doc->data);
+	doc->config->md.table_row(ob, row_work, &doc->data);
 
 	popbuf(doc, BUFFER_SPAN);
 }
@@ -2795,14 +3768,14 @@ parse_table(
 			i++;
 		}
 
-        if (doc->md.table_header)
-            doc->md.table_header(work, header_work, &doc->data);
+        if (doc->config->md.table_header)
+            doc->config->md.table_header(work, header_work, &doc->data);
 
-        if (doc->md.table_body)
-            doc->md.table_body(work, body_work, &doc->data);
+        if (doc->config->md.table_body)
+            doc->config->md.table_body(work, body_work, &doc->data);
 
-		if (doc->md.table)
-			doc->md.table(ob, work, &doc->data, col_data, columns);
+		if (doc->config->md.table)
+			doc->config->md.table(ob, work, &doc->data, col_data, columns);
 	}
 
 	free(col_data);
@@ -2820,25 +3793,25 @@ parse_abstract(
 	size_t size)
 {
 	size_t skip = 0;
-	while (skip < size && !startsWith("\n@/\n", (char*)data+skip))
+	while (skip < size && !has_prefix(data + skip, size - skip, "\n@/\n"))
 	{
 		skip ++;
 	}
 
 
-	if (doc->md.abstract)
+	if (doc->config->md.abstract)
 	{
-		doc->md.abstract(ob);
+		doc->config->md.abstract(ob);
 		parse_block(ob, doc, data, skip, -1);
-		if (doc->md.keywords && doc->document_metadata->keywords)
+		if (doc->config->md.keywords && doc->document_metadata->keywords)
 		{
-			sd_buffer * b = sd_buffer_new(1);
+			sd_buffer * b = newbuf(doc, BUFFER_SPAN);
 			sd_buffer_puts(b, doc->document_metadata->keywords);
-			doc->md.keywords(ob,b,NULL);
-			sd_buffer_free(b);
+			doc->config->md.keywords(ob,b,NULL);
+			popbuf(doc, BUFFER_SPAN);
 
 		}
-		doc->md.close(ob);
+		doc->config->md.close(ob);
 	}
 	if (skip < size)
 	{
@@ -2860,14 +3833,12 @@ parse_caption(sd_document *doc,
 		i++;
 	}
 	if (i) {
-		sd_buffer * buf = sd_buffer_new(1);
+		sd_buffer * buf = newbuf(doc, BUFFER_SPAN);
 		parse_inline(buf, doc, data, i);
-		uint8_t * tmp = malloc(sizeof(uint8_t) * (buf->size+1));
-		tmp[buf->size] = 0;
-		memcpy(tmp, buf->data, buf->size);
+		uint8_t * tmp = (uint8_t*)sd_arena_strndup(&doc->arena, buf->data, buf->size);
 		// clean escape chars 
 		tmp = (uint8_t*)clean_string((char*)tmp, buf->size);
-		sd_buffer_free(buf);
+		popbuf(doc, BUFFER_SPAN);
 		return tmp;
 	}
 	return NULL;
@@ -2894,16 +3865,14 @@ parse_fl(
 			begin ++;
 		}
 		if (begin > 2){
-			args.id = malloc(sizeof(char)*(begin));
-			args.id[begin-1] = 0;
-			memcpy(args.id, data+1, begin-1);
+			args.id = sd_arena_strndup(&doc->arena, data+1, begin-1);
 		}
 		begin++;
 
 	}
-	while (skip+begin < size && !startsWith("\n@/", (char*)data+skip+begin))
+	while (skip+begin < size && !has_prefix(data + skip + begin, size - skip - begin, "\n@/"))
 	{
-		if (startsWith("\n@caption(",(char*) data+skip+begin))
+		if (has_prefix(data + skip + begin, size - skip - begin, "\n@caption("))
 		{
 			args.caption = (char*)parse_caption(doc, data+skip+begin+10, size-begin-skip-10);
 		}
@@ -2911,11 +3880,11 @@ parse_fl(
 	}
 
 
-	if (doc->md.open_float)
+	if (doc->config->md.open_float)
 	{
-		doc->md.open_float(ob, args, &doc->data);
+		doc->config->md.open_float(ob, args, &doc->data);
 		parse_block(ob, doc, data+begin, skip, -1);
-		doc->md.close_float(ob, args, &doc->data);
+		doc->config->md.close_float(ob, args, &doc->data);
 	}
 	if (skip < size)
 	{
@@ -2942,24 +3911,21 @@ parse_eq(
 		while (begin < size && (data[begin] !=')' && data[begin] !='\n')){
 			begin ++;
 		}
-		args.id = malloc(sizeof(char)*(begin));
-		args.id[begin-1] = 0;
-		memcpy(args.id, data+1, begin-1);
+		args.id = sd_arena_strndup(&doc->arena, data+1, begin-1);
 		begin++;
 	}
-	while (skip+begin < size && !startsWith("\n@/", (char*)data+skip+begin))
+	while (skip+begin < size && !has_prefix(data + skip + begin, size - skip - begin, "\n@/"))
 	{
 		skip ++;
 	}
 
-	if (doc->md.opn_equation && skip)
+	if (doc->config->md.opn_equation && skip)
 	{
-		doc->md.opn_equation(ob, args.id, &doc->data);
-		sd_buffer * text = sd_buffer_new(skip);
-		sd_buffer_put(text, data+begin, skip);
-		if (doc->md.eq_math)
-			doc->md.eq_math(ob, text, 2, &doc->data);
-		doc->md.cls_equation(ob, &doc->data);
+		doc->config->md.opn_equation(ob, args.id, &doc->data);
+		sd_buffer text = { data + begin, skip, 0, 0, NULL, NULL, NULL };
+		if (doc->config->md.eq_math)
+			doc->config->md.eq_math(ob, &text, 2, &doc->data);
+		doc->config->md.cls_equation(ob, &doc->data);
 	}
 	if (skip < size)
 	{
@@ -2976,25 +3942,27 @@ parse_float(
 	uint8_t *data,
 	size_t size)
 {
-	if (startsWith("@abstract", (char*)data) && is_separator(data[9])) {
+	if (has_prefix(data, size, "@abstract") && size > 9 && is_separator(data[9])) {
 		return parse_abstract(ob, doc, data+9,size-9)+9;
 	}
-	if (startsWith("@figure", (char*)data) && is_separator(data[7])) {
+	if (has_prefix(data, size, "@figure") && size > 7 && is_separator(data[7])) {
 		return parse_fl(ob, doc, data+7, size-7, FIGURE)+7;
 	}
-	if (startsWith("@table", (char*)data) && is_separator(data[6])) {
+	if (has_prefix(data, size, "@table") && size > 6 && is_separator(data[6])) {
 		return parse_fl(ob, doc, data+6, size-6, TABLE)+6;
 	}
-	if (startsWith("@listing", (char*)data) && is_separator(data[8])) {
+	if (has_prefix(data, size, "@listing") && size > 8 && is_separator(data[8])) {
 		return parse_fl(ob, doc, data+8, size-8, LISTING)+8;
 	}
-	if (startsWith("@equation", (char*)data) && is_separator(data[9])) {
+	if (has_prefix(data, size, "@equation") && size > 9 && is_separator(data[9])) {
 		return parse_eq(ob, doc, data+9, size-9) + 9;
 	}
-	if (startsWith("@toc", (char*)data) && is_separator(data[4]))
+	if (has_prefix(data, size, "@toc") && size > 4 && is_separator(data[4]))
 	{
-		if (doc->md.toc && doc->table_of_contents)
-			doc->md.toc(ob, doc->table_of_contents, doc->document_metadata->numbering);
+		/* the headers that follow are not always known */
+		doc->missing++;
+		if (doc->config->md.toc && doc->table_of_contents)
+			doc->config->md.toc(ob, doc->table_of_contents, doc->document_metadata->numbering);
 		return 4;
 	}
 
@@ -3003,8 +3971,8 @@ parse_float(
 
 static void
 parse_position(sd_buffer *ob, sd_document *doc){
-	if (doc->md.position){
-		doc->md.position(ob);
+	if (doc->config->md.position){
+		doc->config->md.position(ob);
 	}
 }
 
@@ -3017,10 +3985,14 @@ parse_block(sd_buffer *ob, sd_document *doc, uint8_t *data, size_t size, int pos
 	beg = 0;
 
 	if (doc->work_bufs[BUFFER_SPAN].size +
-		doc->work_bufs[BUFFER_BLOCK].size > doc->max_nesting)
+		doc->work_bufs[BUFFER_BLOCK].size + doc->in_place > doc->config->max_nesting)
 		return;
 
 	while (beg < size) {
+		flush_output(doc, ob, 0);
+		if (budget_spent(doc, ob))
+			break;
+
 		if (position >= 0 && beg >= position) {
 			position = -1;
 			parse_position(ob, doc);
@@ -3031,7 +4003,7 @@ parse_block(sd_buffer *ob, sd_document *doc, uint8_t *data, size_t size, int pos
 		if (is_atxheader(doc, txt_data, end))
 			beg += parse_atxheader(ob, doc, txt_data, end);
 
-		else if (data[beg] == '<' && doc->md.blockhtml &&
+		else if (data[beg] == '<' && doc->config->md.blockhtml &&
 				(i = parse_htmlblock(ob, doc, txt_data, end, 1)) != 0)
 			beg += i;
 
@@ -3039,8 +4011,8 @@ parse_block(sd_buffer *ob, sd_document *doc, uint8_t *data, size_t size, int pos
 			beg += i;
 
 		else if (is_hrule(txt_data, end)) {
-			if (doc->md.hrule)
-				doc->md.hrule(ob, &doc->data);
+			if (doc->config->md.hrule)
+				doc->config->md.hrule(ob, &doc->data);
 
 			while (beg < size && data[beg] != '\n')
 				beg++;
@@ -3048,18 +4020,18 @@ parse_block(sd_buffer *ob, sd_document *doc, uint8_t *data, size_t size, int pos
 			beg++;
 		}
 
-		else if ((doc->ext_flags & UPSKIRT_EXT_FENCED_CODE) != 0 &&
+		else if ((doc->config->ext_flags & UPSKIRT_EXT_FENCED_CODE) != 0 &&
 			(i = parse_fencedcode(ob, doc, txt_data, end)) != 0)
 			beg += i;
 
-		else if ((doc->ext_flags & UPSKIRT_EXT_TABLES) != 0 &&
+		else if ((doc->config->ext_flags & UPSKIRT_EXT_TABLES) != 0 &&
 			(i = parse_table(ob, doc, txt_data, end)) != 0)
 			beg += i;
 
 		else if (prefix_quote(txt_data, end))
 			beg += parse_blockquote(ob, doc, txt_data, end);
 
-		else if (!(doc->ext_flags & UPSKIRT_EXT_DISABLE_INDENTED_CODE) && prefix_code(txt_data, end))
+		else if (!(doc->config->ext_flags & UPSKIRT_EXT_DISABLE_INDENTED_CODE) && prefix_code(txt_data, end))
 			beg += parse_blockcode(ob, doc, txt_data, end);
 
 		else if (prefix_float(txt_data, end))
@@ -3073,6 +4045,8 @@ parse_block(sd_buffer *ob, sd_document *doc, uint8_t *data, size_t size, int pos
 
 		else
 			beg += parse_paragraph(ob, doc, txt_data, end);
+
+		budget_written(doc, ob);
 	}
 	if (position > 0) {
 		parse_position(ob, doc);
@@ -3084,18 +4058,18 @@ parse_block(sd_buffer *ob, sd_document *doc, uint8_t *data, size_t size, int pos
 /*********************
  * REFERENCE PARSING *
  *********************/
-void load_notes(const uint8_t * text, size_t size,  char* base_folder, struct footnote_list *list);
+void load_notes(sd_document *doc, const uint8_t * text, size_t size, struct footnote_list *list);
 
 /* is_footnote • returns whether a line is a footnote definition or not */
 static int
-is_footnote(const uint8_t *data, size_t beg, size_t end, size_t *last, char* base_folder, struct footnote_list *list)
+is_footnote(sd_document *doc, const uint8_t *data, size_t beg, size_t end, size_t *last, struct footnote_list *list)
 {
-	if (startsWith("@bib(", (char*)data+beg))
+	if (has_prefix(data + beg, end - beg, "@bib("))
 		{
 
 			size_t n = 0;
 			size_t i = 5+beg;
-			while(data[i] != '\n' && i != end)
+			while(i < end && data[i] != '\n')
 			{
 				if (data[i]==')')
 					break;
@@ -3104,20 +4078,13 @@ is_footnote(const uint8_t *data, size_t beg, size_t end, size_t *last, char* bas
 			}
 
 			if (n){
-				char * path = malloc((n+1)*sizeof(char));
-				path[n] = 0;
-				strncpy(path, (char*)data+beg+5, n);
-				if (is_regular_file(path, base_folder)){
-					size_t size = 0;
-					char * bib = load_file(path, base_folder, &size);
-					load_notes((uint8_t*)bib, size, base_folder, list);
-					free(bib);
-				}
-				free(path);
+				const sd_input * bib = load_include(doc, data+beg+5, n);
+				if (bib)
+					load_notes(doc, bib->data, bib->size, list);
 			}
 
 	        i = beg;
-	        while(data[i]!='\n')
+	        while(i < end && data[i]!='\n')
 		      	i ++;
 	        *last = i;
 
@@ -3211,11 +4178,10 @@ is_footnote(const uint8_t *data, size_t beg, size_t end, size_t *last, char* bas
 
 	if (list) {
 		struct footnote_ref *ref;
-		ref = create_footnote_ref(list, data + id_offset, id_end - id_offset);
-		if (!ref)
-			return 0;
-		if (!add_footnote_ref(list, ref)) {
-			free_footnote_ref(ref);
+		ref = create_footnote_ref(&doc->arena, &doc->notes, data + id_offset, id_end - id_offset);
+		ref->index = list->count;
+		if (!add_footnote_ref(&doc->arena, list, ref)) {
+			sd_buffer_free(contents);
 			return 0;
 		}
 		ref->contents = contents;
@@ -3226,7 +4192,7 @@ is_footnote(const uint8_t *data, size_t beg, size_t end, size_t *last, char* bas
 
 /* is_ref • returns whether a line is a reference or not */
 static int
-is_ref(const uint8_t *data, size_t beg, size_t end, size_t *last, struct link_ref **refs)
+is_ref(sd_arena *arena, const uint8_t *data, size_t beg, size_t end, size_t *last, struct label_table *refs)
 {
 /*	int n; */
 
@@ -3323,16 +4289,14 @@ is_ref(const uint8_t *data, size_t beg, size_t end, size_t *last, struct link_re
 	if (refs) {
 		struct link_ref *ref;
 
-		ref = add_link_ref(refs, data + id_offset, id_end - id_offset);
+		ref = add_link_ref(arena, refs, data + id_offset, id_end - id_offset);
 		if (!ref)
 			return 0;
 
-		ref->link = sd_buffer_new(link_end - link_offset);
-		sd_buffer_put(ref->link, data + link_offset, link_end - link_offset);
+		ref->link = arena_buffer(arena, data + link_offset, link_end - link_offset);
 
 		if (title_end > title_offset) {
-			ref->title = sd_buffer_new(title_end - title_offset);
-			sd_buffer_put(ref->title, data + title_offset, title_end - title_offset);
+			ref->title = arena_buffer(arena, data + title_offset, title_end - title_offset);
 		}
 	}
 
@@ -3341,7 +4305,7 @@ is_ref(const uint8_t *data, size_t beg, size_t end, size_t *last, struct link_re
 
 
 void
-load_notes(const uint8_t * data, size_t size,  char* base_folder, struct footnote_list *list)
+load_notes(sd_document *doc, const uint8_t * data, size_t size, struct footnote_list *list)
 {
 	static const uint8_t UTF8_BOM[] = {0xEF, 0xBB, 0xBF};
 	size_t beg, end;
@@ -3353,7 +4317,7 @@ load_notes(const uint8_t * data, size_t size,  char* base_folder, struct footnot
 
 	while (beg < size) /* iterating over lines */
 	{
-		if (is_footnote(data, beg, size, &end, base_folder, list))
+		if (is_footnote(doc, data, beg, size, &end, list))
 			beg = end;
 		else { /* skipping to the next line */
 			end = beg;
@@ -3401,698 +4365,2501 @@ static void expand_tabs(sd_buffer *ob, const uint8_t *line, size_t size)
 	}
 }
 
-/**********************
- * EXPORTED FUNCTIONS *
- **********************/
+/********************
+ * BLOCK BOUNDARIES *
+ ********************/
+
+#define SCAN_HEADER 1	/* an ATX header outside of code fences */
+#define SCAN_BLOCK 2	/* a top-level block starts there for sure */
+#define SCAN_MORE 4	/* the following lines are needed to tell */
+
+/* block_scan: constructs the top-level parser may be in the middle of,
+ * followed line by line without parsing */
+struct block_scan {
+	size_t protect;		/* end of the last HTML block */
+	size_t fence_w;		/* code fence being skipped, if fence_chr */
+	size_t fence_width;
+	uint8_t fence_chr;
+	int in_float;
+	int in_abstract;
+	int after_empty;
+};
 
-sd_document *
-sd_document_new(
-	const sd_renderer *renderer,
-	sd_extensions extensions,
-    ext_definition * user_ext,
-    const char * base_folder,
-	size_t max_nesting)
+static void
+block_scan_init(struct block_scan *scan)
 {
-	sd_document *doc = NULL;
-
-	assert(max_nesting > 0 && renderer);
-
-	doc = sd_malloc(sizeof(sd_document));
-	memcpy(&doc->md, renderer, sizeof(sd_renderer));
-
-	doc->extensions = user_ext;
-	doc->base_folder = (base_folder != NULL) ? strdup (base_folder) : NULL;
-
-	doc->counter = (h_counter){0, 0, 0};
+	memset(scan, 0x0, sizeof(struct block_scan));
+	scan->after_empty = 1;
+}
 
-	doc->floating_references = NULL;
-	doc->document_metadata = NULL;
-	doc->table_of_contents = NULL;
-	doc->data.opaque = renderer->opaque;
-	doc->data.meta = NULL;
+/* htmlblock_known • whether the end of the HTML block opening data, if
+ * any, can be found in the complete lines of data */
+static int
+htmlblock_known(sd_document *doc, uint8_t *data, size_t size)
+{
+	const char *curtag = NULL;
+	size_t i = 1, end;
 
-	sd_stack_init(&doc->work_bufs[BUFFER_BLOCK], 4);
-	sd_stack_init(&doc->work_bufs[BUFFER_SPAN], 8);
+	while (i < size && data[i] != '>' && data[i] != ' ' && data[i] != '\n')
+		i++;
 
-	memset(doc->active_char, 0x0, 256);
+	if (i < size && data[i] != '\n')
+		curtag = sd_find_block_tag((char *)data + 1, (int)i - 1);
 
-	if (extensions & UPSKIRT_EXT_UNDERLINE && doc->md.underline) {
-		doc->active_char['_'] = MD_CHAR_EMPHASIS;
+	if (curtag) {
+		end = htmlblock_find_end_strict(curtag, strlen(curtag), doc, data, size);
+		return end && end < size;
 	}
 
-	if (doc->md.emphasis || doc->md.double_emphasis || doc->md.triple_emphasis) {
-		doc->active_char['*'] = MD_CHAR_EMPHASIS;
-		doc->active_char['_'] = MD_CHAR_EMPHASIS;
-		if (extensions & UPSKIRT_EXT_STRIKETHROUGH)
-			doc->active_char['~'] = MD_CHAR_EMPHASIS;
-		if (extensions & UPSKIRT_EXT_HIGHLIGHT)
-			doc->active_char['='] = MD_CHAR_EMPHASIS;
+	/* comments and rules, ending with a line followed by an empty one */
+	if (has_prefix(data, size, "<!--") || (size > 2 &&
+	    (data[1] == 'h' || data[1] == 'H') && (data[2] == 'r' || data[2] == 'R'))) {
+		end = parse_htmlblock(NULL, doc, data, size, 0);
+		return end && end < size;
 	}
 
-	if (doc->md.codespan)
-		doc->active_char['`'] = MD_CHAR_CODESPAN;
+	return 1;
+}
 
-	if (doc->md.linebreak)
-		doc->active_char['\n'] = MD_CHAR_LINEBREAK;
+/* block_scan_line • follows the line data[i..eol); data[0..size) must
+ * only hold complete lines unless final is set. Blocks are known to start at
+ * the ATX headers following an empty line, where paragraphs, lists,
+ * quotes and indented code all end, unless they are in a code fence, a
+ * float or an HTML block. */
+static int
+block_scan_line(sd_document *doc, struct block_scan *scan, uint8_t *data, size_t size, size_t i, size_t eol, int final)
+{
+	size_t width, w, end;
+	uint8_t chr;
+	int found = 0;
+
+	if (scan->fence_chr) {
+		w = is_codefence(data + i, eol - i, &width, &chr);
+		if (w == scan->fence_w && width == scan->fence_width && chr == scan->fence_chr &&
+		    is_empty(data + i + w, eol - i - w))
+			scan->fence_chr = 0;
+	} else if (is_atxheader(doc, data + i, size - i)) {
+		found = SCAN_HEADER;
+		if (scan->after_empty && !scan->in_float && i >= scan->protect)
+			found |= SCAN_BLOCK;
+	} else if (data[i] == '<' && doc->config->md.blockhtml) {
+		if (!final && !htmlblock_known(doc, data + i, size - i))
+			return SCAN_MORE;
+
+		end = i + parse_htmlblock(NULL, doc, data + i, size - i, 0);
+		if (end > scan->protect)
+			scan->protect = end;
+	} else if (doc->config->ext_flags & UPSKIRT_EXT_FENCED_CODE) {
+		sd_buffer lang = { NULL, 0, 0, 0, NULL, NULL, NULL };
+
+		w = parse_codefence(data + i, eol - i, &lang, &width, &chr);
+		if (w) {
+			scan->fence_w = w;
+			scan->fence_width = width;
+			scan->fence_chr = chr;
+		}
+	}
 
-	if (doc->md.image || doc->md.link || doc->md.footnotes || doc->md.footnote_ref) {
-		doc->active_char['['] = MD_CHAR_LINK;
-		doc->active_char['!'] = MD_CHAR_IMAGE;
+	/* floats end on their closing line, even inside a code fence */
+	if (scan->in_float) {
+		if (has_prefix(data + i, eol - i, "@/") && (!scan->in_abstract || eol - i == 2))
+			scan->in_float = 0;
+	} else if (prefix_float(data + i, eol - i) &&
+		   !has_prefix(data + i, eol - i, "@toc") &&
+		   !has_prefix(data + i, eol - i, "@code")) {
+		scan->in_float = 1;
+		scan->in_abstract = has_prefix(data + i, eol - i, "@abstract");
 	}
 
-	doc->active_char['<'] = MD_CHAR_LANGLE;
-	doc->active_char['\\'] = MD_CHAR_ESCAPE;
-	doc->active_char['&'] = MD_CHAR_ENTITY;
+	scan->after_empty = is_empty(data + i, size - i) != 0;
+	return found;
+}
 
-	if (extensions & UPSKIRT_EXT_AUTOLINK) {
-		doc->active_char[':'] = MD_CHAR_AUTOLINK_URL;
-		doc->active_char['@'] = MD_CHAR_AUTOLINK_EMAIL;
-		doc->active_char['w'] = MD_CHAR_AUTOLINK_WWW;
-	}
+/**********************
+ * PARALLEL RENDERING *
+ **********************/
 
-	if (extensions & UPSKIRT_EXT_SUPERSCRIPT)
-		doc->active_char['^'] = MD_CHAR_SUPERSCRIPT;
+/* texts smaller than this are always rendered by the calling thread */
+#ifndef UPSKIRT_PARALLEL_MIN_SIZE
+#define UPSKIRT_PARALLEL_MIN_SIZE (256 * 1024)
+#endif
 
-	if (extensions & UPSKIRT_EXT_QUOTE)
-		doc->active_char['"'] = MD_CHAR_QUOTE;
+/* pieces per thread, so that the threads finish at about the same time */
+#define PARALLEL_PIECES 4
+
+#ifndef UPSKIRT_NO_THREADS
+#ifdef _WIN32
+typedef HANDLE parallel_thread;
+typedef CRITICAL_SECTION parallel_lock;
+#define parallel_lock_init(l)	InitializeCriticalSection(l)
+#define parallel_lock_free(l)	DeleteCriticalSection(l)
+#define parallel_lock_enter(l)	EnterCriticalSection(l)
+#define parallel_lock_leave(l)	LeaveCriticalSection(l)
+#else
+typedef pthread_t parallel_thread;
+typedef pthread_mutex_t parallel_lock;
+#define parallel_lock_init(l)	pthread_mutex_init(l, NULL)
+#define parallel_lock_free(l)	pthread_mutex_destroy(l)
+#define parallel_lock_enter(l)	pthread_mutex_lock(l)
+#define parallel_lock_leave(l)	pthread_mutex_unlock(l)
+#endif
+#endif
 
-	if (extensions & UPSKIRT_EXT_MATH)
-		doc->active_char['$'] = MD_CHAR_MATH;
+/* parallel_job: pieces of one render, shared out between the threads */
+struct parallel_job {
+	sd_document *doc;
+	struct render_piece *pieces;
+	size_t count;
 
-	doc->active_char['('] = MD_CHAR_REF;
+	void *guess;			/* renderer state every piece starts from at first */
+	struct footnote_ref **notes;	/* footnotes found, in order */
+	size_t note_count;
+	unsigned int *nums;		/* guessed number of each footnote, NULL once exact */
 
-	/* Extension data */
-	doc->ext_flags = extensions;
-	doc->max_nesting = max_nesting;
-	doc->in_link_body = 0;
+	/* exact state reached by the pieces fixed up so far */
+	h_counter counter;
+	void *state;
+	int filled;
 
-	return doc;
-}
-size_t
-skip_yaml(sd_document *doc, sd_buffer *ob, const uint8_t *data, size_t size)
+	size_t next;			/* next piece to look at */
+	size_t next_worker;		/* next document to hand to a thread */
+#ifndef UPSKIRT_NO_THREADS
+	parallel_lock lock;
+#endif
+};
+
+/* piece_header • records a header of the given level */
+static void
+piece_header(struct render_piece *piece, size_t level)
 {
-	size_t skip = 0;
-	if (startsWith("---", (char*)data) && is_separator(data[3])){
-		skip += 4;
-		while (skip < size && !(startsWith("\n---", (char*)data+skip) &&
-		       (skip + 4 >= size || is_separator(data[skip+4])))) {
-			skip ++;
-		}
-		if (skip < size)
-		{
-			skip += 5;
-		}
+	struct header_shift *shift = &piece->shift;
+
+	piece->headers++;
+
+	if (level == 1) {
+		shift->chapter++;
+		shift->section = shift->subsection = 0;
+		shift->keep_section = shift->keep_subsection = 0;
+	} else if (level == 2) {
+		shift->section++;
+		shift->subsection = 0;
+		shift->keep_subsection = 0;
+	} else if (level == 3) {
+		shift->subsection++;
 	}
-	return skip;
 }
 
-void
-sub_render(sd_document *doc, sd_buffer *ob, const uint8_t *data, size_t size, int position)
+/* piece_note • records a reference to a footnote, whatever its state at
+ * the beginning of the piece */
+static void
+piece_note(struct render_piece *piece, const struct footnote_ref *fr)
 {
-	static const uint8_t UTF8_BOM[] = {0xEF, 0xBB, 0xBF};
+	if (!piece->noted[fr->index]) {
+		piece->noted[fr->index] = 1;
+		piece->notes[piece->note_count++] = fr->index;
+	}
+}
 
-	sd_buffer *text;
-	size_t beg, end;
-	text = sd_buffer_new(64);
+/* shift_counter • header counter after the headers of a piece */
+static h_counter
+shift_counter(h_counter counter, const struct header_shift *shift)
+{
+	counter.chapter += shift->chapter;
+	counter.section = (shift->keep_section ? counter.section : 0) + shift->section;
+	counter.subsection = (shift->keep_subsection ? counter.subsection : 0) + shift->subsection;
 
-	/* Preallocate enough space for our buffer to avoid expanding while copying */
-	sd_buffer_grow(text, size);
-	/* first pass: looking for references, copying everything else */
-	beg = 0;
+	return counter;
+}
 
-	int footnotes_enabled = doc->ext_flags & UPSKIRT_EXT_FOOTNOTES;
+static int
+same_counter(const h_counter *a, const h_counter *b)
+{
+	return a->chapter == b->chapter && a->section == b->section &&
+		a->subsection == b->subsection;
+}
 
-	/* Skip a possible UTF-8 BOM, even though the Unicode standard
-	 * discourages having these in UTF-8 documents */
-	if (size >= 3 && memcmp(data, UTF8_BOM, 3) == 0)
-		beg += 3;
+/* parallel_split • cuts data where a top-level block starts for sure; the
+ * headers met on the way give a first guess of the counter at the beginning
+ * of every piece */
+static size_t
+parallel_split(sd_document *doc, struct render_piece *pieces, size_t max, uint8_t *data, size_t size)
+{
+	size_t count = 0, start = 0, target = size / max;
+	size_t i = 0, eol;
+	struct block_scan scan;
+	h_counter counter = doc->counter;
+	int found;
 
-	while (beg < size) /* iterating over lines */
-		if (footnotes_enabled && is_footnote(data, beg, size, &end, doc->base_folder, &doc->footnotes_found))
-			beg = end;
-		else if (is_ref(data, beg, size, &end, doc->refs))
-			beg = end;
-		else { /* skipping to the next line */
-			end = beg;
-			while (end < size && data[end] != '\n' && data[end] != '\r')
-				end++;
+	block_scan_init(&scan);
+	pieces[0].counter = counter;
 
-			/* adding the line body if present */
-			if (end > beg)
-				expand_tabs(text, data + beg, end - beg);
+	while (i < size) {
+		for (eol = i; eol < size && data[eol] != '\n'; eol++);
 
-			while (end < size && (data[end] == '\n' || data[end] == '\r')) {
-				/* add one \n per newline */
-				if (data[end] == '\n' || (end + 1 < size && data[end + 1] != '\n'))
-					sd_buffer_putc(text, '\n');
-				end++;
-			}
+		found = block_scan_line(doc, &scan, data, size, i, eol, 1);
 
-			beg = end;
+		if ((found & SCAN_BLOCK) && count + 1 < max && i - start >= target) {
+			pieces[count].data = data + start;
+			pieces[count].size = i - start;
+			pieces[++count].counter = counter;
+			start = i;
 		}
 
-	/* pre-grow the output buffer to minimize allocations */
-	sd_buffer_grow(ob, text->size + (text->size >> 1));
+		if (found & SCAN_HEADER) {
+			size_t level = 0;
 
-	/* second pass: actual rendering */
-	if (doc->md.doc_header)
-		doc->md.doc_header(ob, 0, &doc->data);
+			while (level < 6 && i + level < eol && data[i + level] == '#')
+				level++;
 
-	if (text->size) {
-		size_t skip = skip_yaml(doc, ob, text->data, text->size);
-		/* adding a final newline if not already present */
-		if (text->data[text->size - 1] != '\n' &&  text->data[text->size - 1] != '\r')
-			sd_buffer_putc(text, '\n');
+			if (level == 1)
+				counter = (h_counter){ counter.chapter + 1, 0, 0 };
+			else if (level == 2)
+				counter = (h_counter){ counter.chapter, counter.section + 1, 0 };
+			else if (level == 3)
+				counter.subsection++;
+		}
 
-		parse_block(ob, doc, text->data+skip, text->size-skip, position-skip);
+		i = eol + 1;
 	}
-	sd_buffer_free(text);
+
+	pieces[count].data = data + start;
+	pieces[count].size = size - start;
+
+	return count + 1;
 }
 
-int parse_keyword(char * keyword, metadata * meta,  const uint8_t *data, size_t size)
+/* parallel_notes • guesses the footnotes every piece uses for the first
+ * time from the references written in its text, so that the pieces after
+ * the first footnote start from the right numbers in the first round */
+static void
+parallel_notes(sd_document *doc, struct parallel_job *job)
 {
-	/** clean keyword **/
-	remove_char(keyword, ' ');
-	remove_char(keyword, '\n');
-	remove_char(keyword, '\t');
+	unsigned int count = doc->footnotes_used.count;
+	size_t p, i, j;
 
-	int j;
-	int skip = 0;
-	int text = 0;
-	for (j = 0 ; j+1 < size && data[j+1] != '\n'; j++){
-		if (!text && data[j] == ' ')
-			skip ++;
-		else if (!text && data[j] != ' ')
-			text = 1;
-	}
-	if (j == 0)
-	{
-		return 1;
-	}
-	char * word = malloc(sizeof(char) * (j-skip+3));
-	memset(word, 0, (j-skip+3));
-	memcpy(word, data+skip, (j-skip+1));
+	job->nums = sd_arena_calloc(&doc->arena, job->note_count, sizeof(unsigned int));
+	for (i = 0; i < job->note_count; ++i)
+		if (job->notes[i]->is_used)
+			job->nums[i] = job->notes[i]->num;
 
+	for (p = 0; p < job->count; ++p) {
+		struct render_piece *piece = &job->pieces[p];
+		uint8_t *data = piece->data;
 
-	if (!strcmp(keyword, "title")) {
-		meta->title = word;
-	} else if (!strcmp(keyword, "author")) {
-		meta->authors = add_string(meta->authors, word);
-	} else if (!strcmp(keyword, "keywords")) {
-		meta->keywords = word;
-	} else if (!strcmp(keyword, "style")) {
-		meta->style = word;
-	} else if (!strcmp(keyword, "affiliation")) {
-		meta->affiliation = word;
-	} else if (!strcmp(keyword, "numbering")) {
-		meta->numbering = !strcmp(word, "true");
-	} else if (!strcmp(keyword, "paper")) {
-		meta->paper_size = string_to_paper(word);
-	} else if (!strcmp(keyword, "class")) {
-		meta->doc_class = string_to_class(word);
-	} else if (!strcmp(keyword, "font-size")) {
-		meta->font_size = atoi(word);
-	}else {
-		free(word);
-	}
+		piece->footnotes = count;
 
-	return j+1;
+		for (i = 0; i + 2 < piece->size; i = j) {
+			struct footnote_ref *fr;
+
+			j = i + 1;
+			if (data[i] != '[' || data[i + 1] != '^' || (i > 0 && data[i - 1] == '\\'))
+				continue;
+
+			/* a bracket starts the next reference, every byte is read twice at most */
+			for (j = i + 2; j < piece->size && data[j] != ']' && data[j] != '[' && data[j] != '\n'; j++);
+			if (j == piece->size || data[j] != ']' || j == i + 2)
+				continue;
+
+			fr = find_footnote_ref(&doc->notes, data + i + 2, j - i - 2);
+			if (fr && !job->nums[fr->index])
+				job->nums[fr->index] = ++count;
+		}
+	}
 }
 
-void
-append(reference * head, reference * next)
+/* same_notes • whether the footnotes referenced by a piece were in the
+ * state they have after the pieces before it, count being the number of
+ * footnotes used by then */
+static int
+same_notes(struct parallel_job *job, struct render_piece *piece, unsigned int count)
 {
-	if (!head)
-		return;
-	if (head->next)
-		append(head->next, next);
-	else
-		head->next = next;
+	size_t i;
+
+	for (i = 0; i < piece->note_count; ++i) {
+		const struct footnote_ref *ref = job->notes[piece->notes[i]];
+		unsigned int num = job->nums[piece->notes[i]];
+
+		if (num > piece->footnotes)
+			num = 0;
+
+		/* the new ones are numbered from the count */
+		if (num != (ref->is_used ? ref->num : 0) || (!num && piece->footnotes != count))
+			return 0;
+	}
+
+	return 1;
 }
 
-reference *
-add_reference(char * id, int counter, float_type type, reference * ref)
+/* parallel_detach • forgets everything a worker borrowed from the main document */
+static void
+parallel_detach(sd_document *worker)
 {
-	reference * next = malloc(sizeof(reference));
-	next->next = NULL;
-	next->id = id;
-	next->type = type;
-	next->counter = counter;
-	if (ref)
-	{
-		append(ref, next);
-		return ref;
-	}
-	return next;
+	label_table_init(&worker->refs, 0);
+	label_table_init(&worker->notes, 0);
+	memset(&worker->footnotes_used, 0x0, sizeof(worker->footnotes_used));
+
+	label_table_init(&worker->floats, 1);
+	worker->table_of_contents = NULL;
+	worker->document_metadata = NULL;
+	worker->data.meta = NULL;
 }
 
-metadata *
-parse_yaml(const uint8_t *data, size_t size)
+/* piece_render • renders a piece on a worker, starting from the state of the
+ * piece; the footnotes numbered up to piece->footnotes count as used, with
+ * the guessed numbers in the first round and the exact ones afterwards */
+static void
+piece_render(sd_document *worker, struct parallel_job *job, struct render_piece *piece)
 {
-	metadata * meta = malloc(sizeof(metadata));
+	const sd_document *doc = job->doc;
+	size_t state_size = doc->config->md.opaque_size;
+	struct footnote_ref *notes = NULL;
+	uint8_t *text;
+	size_t i;
 
-	meta->keywords = NULL;
-	meta->authors = NULL;
-	meta->style = NULL;
-	meta->title = NULL;
+	sd_document_reset(worker);
 
-	meta->paper_size = A4PAPER;
-	meta->doc_class = CLASS_ARTICLE;
-	meta->font_size = 10;
+	/* blockquotes are parsed in place, the text must stay intact for
+	 * another render of the piece */
+	text = sd_arena_alloc(&worker->arena, piece->size);
+	memcpy(text, piece->data, piece->size);
 
-	meta->numbering = 0;
-	meta->affiliation = NULL;
+	/* everything gathered by the first pass is only read */
+	worker->refs = doc->refs;
+	worker->floats = doc->floats;
+	worker->table_of_contents = doc->table_of_contents;
+	worker->document_metadata = doc->document_metadata;
+	worker->data.meta = doc->data.meta;
 
-	if (startsWith("---", (char*)data) && is_separator(data[3])){
-		int i = 4;
-		while (i < size){
-			if (startsWith("---\n", (char*)data+i))
-				break;
-			int j;
-			for (j = 0 ; j+i+1 < size && data[i+j+1] != ':' && data[i+j+1] != '\n'; j++){}
-			if (data[j+i+1] == ':'){
-				char type[1024];
-				memset(type, 0, j+3);
-				memcpy(type, data+i, j+1);
-				j += parse_keyword(type, meta, data+i+j+2, size - i - j - 2);
-	       }
+	/* but the footnotes are marked when used, each piece has its own copy */
+	if (job->note_count)
+		notes = sd_arena_alloc(&worker->arena, job->note_count * sizeof(struct footnote_ref));
 
-            i+=j+3;
-		}
+	for (i = 0; i < job->note_count; ++i) {
+		unsigned int num;
+
+		notes[i] = *job->notes[i];
+		num = job->nums ? job->nums[i] : notes[i].is_used ? notes[i].num : 0;
+		notes[i].is_used = num != 0 && num <= piece->footnotes;
+		notes[i].num = notes[i].is_used ? num : 0;
 	}
-	return meta;
-}
+	worker->footnotes_used.count = piece->footnotes;
 
-void
-render_metadata(sd_document *doc, sd_buffer *ob, metadata * meta)
-{
+	/* with an index of its own pointing to the copies */
+	worker->notes = doc->notes;
+	if (doc->notes.count) {
+		size_t slots = doc->notes.mask + 1;
 
-	if (meta->title != NULL && doc->md.title)
-	{
-		sd_buffer * b = sd_buffer_new(1);
-		sd_buffer_puts(b, meta->title);
-		doc->md.title(ob,b, meta);
-		sd_buffer_free(b);
+		worker->notes.slots = sd_arena_alloc(&worker->arena, slots * sizeof(struct label_slot));
+		memcpy(worker->notes.slots, doc->notes.slots, slots * sizeof(struct label_slot));
+
+		for (i = 0; i < slots; ++i) {
+			struct footnote_ref *ref = worker->notes.slots[i].value;
+			if (ref)
+				worker->notes.slots[i].value = &notes[ref->index];
+		}
 	}
-	if (meta->authors != NULL && doc->md.authors)
-	{
-		sd_buffer * b = sd_buffer_new(1);
 
-		doc->md.authors(ob,meta->authors);
-		sd_buffer_free(b);
+	worker->counter = piece->counter;
+	if (state_size)
+		memcpy(worker->state, piece->state ? piece->state : job->guess, state_size);
+
+	piece->headers = 0;
+	piece->shift = (struct header_shift){ 0, 0, 0, 1, 1 };
+	piece->note_count = 0;
+	if (job->note_count) {
+		if (!piece->notes)
+			piece->notes = sd_malloc(job->note_count * sizeof(unsigned int));
+		piece->noted = sd_arena_calloc(&worker->arena, job->note_count, 1);
 	}
-	if (meta->affiliation != NULL && doc->md.affiliation)
-	{
-		sd_buffer * b = sd_buffer_new(1);
-		sd_buffer_puts(b, meta->affiliation);
-		doc->md.affiliation(ob,b,NULL);
-		sd_buffer_free(b);
+	/* renderers look whether they are at the beginning of the output */
+	piece->ob->size = 0;
+	if (piece->filled)
+		sd_buffer_putc(piece->ob, '\n');
+
+	/* the pieces share the deadline of the render */
+	sd_document_set_limits(worker, &doc->limits);
+	budget_start(worker, piece->ob);
+	worker->deadline = doc->deadline;
+
+	worker->piece = piece;
+	parse_block(piece->ob, worker, text, piece->size, piece->position);
+	worker->piece = NULL;
+	piece->status = worker->status;
+	piece->noted = NULL;
+
+	if (state_size) {
+		memcpy(piece->after, worker->state, state_size);
+		piece->state_changed = memcmp(piece->after,
+			piece->state ? piece->state : job->guess, state_size) != 0;
 	}
 
+	parallel_detach(worker);
 }
-int find_ref(reference * refs, char*id, int *counter)
+
+/* parallel_next • takes the next piece waiting for a render */
+static struct render_piece *
+parallel_next(struct parallel_job *job)
 {
-	if (!refs)
-		return 0;
+	struct render_piece *piece = NULL;
 
-	if (strcmp(refs->id, id) == 0)
-	{
+#ifndef UPSKIRT_NO_THREADS
+	parallel_lock_enter(&job->lock);
+#endif
+	while (job->next < job->count && !job->pieces[job->next].redo)
+		job->next++;
 
-		*counter = refs->counter;
+	if (job->next < job->count)
+		piece = &job->pieces[job->next++];
+#ifndef UPSKIRT_NO_THREADS
+	parallel_lock_leave(&job->lock);
+#endif
+
+	return piece;
+}
+
+static void
+parallel_work(struct parallel_job *job, sd_document *worker)
+{
+	struct render_piece *piece;
+
+	while ((piece = parallel_next(job)) != NULL)
+		piece_render(worker, job, piece);
+}
+
+#ifndef UPSKIRT_NO_THREADS
+#ifdef _WIN32
+static DWORD WINAPI
+parallel_thread_main(LPVOID opaque)
+#else
+static void *
+parallel_thread_main(void *opaque)
+#endif
+{
+	struct parallel_job *job = opaque;
+	sd_document *worker;
+
+	parallel_lock_enter(&job->lock);
+	worker = job->doc->workers[job->next_worker++];
+	parallel_lock_leave(&job->lock);
+
+	parallel_work(job, worker);
+	return 0;
+}
+#endif
+
+/* parallel_round • renders the pieces marked for a render, the calling
+ * thread taking its share */
+static void
+parallel_round(struct parallel_job *job)
+{
+	size_t i, todo = 0;
+
+	for (i = 0; i < job->count; ++i)
+		todo += job->pieces[i].redo != 0;
+
+	job->next = 0;
+	job->next_worker = 1;
+
+#ifndef UPSKIRT_NO_THREADS
+	if (todo > 1) {
+		size_t threads = job->doc->parallel < todo ? job->doc->parallel : todo;
+		parallel_thread *tids = sd_malloc(threads * sizeof(parallel_thread));
+		size_t started;
+
+		for (started = 0; started + 1 < threads; started++) {
+#ifdef _WIN32
+			tids[started] = CreateThread(NULL, 0, parallel_thread_main, job, 0, NULL);
+			if (tids[started] == NULL) break;
+#else
+			if (pthread_create(&tids[started], NULL, parallel_thread_main, job) != 0) break;
+#endif
+		}
+
+		parallel_work(job, job->doc->workers[0]);
+
+		for (i = 0; i < started; ++i) {
+#ifdef _WIN32
+			WaitForSingleObject(tids[i], INFINITE);
+			CloseHandle(tids[i]);
+#else
+			pthread_join(tids[i], NULL);
+#endif
+		}
+
+		free(tids);
+		return;
+	}
+#endif
+
+	parallel_work(job, job->doc->workers[0]);
+}
+
+/* parallel_advance • moves the exact state past a piece: the header
+ * counter and the numbers of the footnotes referenced there for the first time */
+static void
+parallel_advance(sd_document *doc, struct parallel_job *job, struct render_piece *piece)
+{
+	size_t i;
+
+	job->counter = shift_counter(job->counter, &piece->shift);
+	job->filled = job->filled || piece->ob->size > (size_t)piece->filled;
+
+	for (i = 0; i < piece->note_count; ++i) {
+		struct footnote_ref *ref = job->notes[piece->notes[i]];
+
+		if (!ref->is_used) {
+			add_footnote_ref(&doc->arena, &doc->footnotes_used, ref);
+			ref->is_used = 1;
+			ref->num = doc->footnotes_used.count;
+		}
+	}
+}
+
+/* parallel_stopped • whether the render of a piece stopped early; the
+ * first one in order gives the status of the render */
+static int
+parallel_stopped(sd_document *doc, struct parallel_job *job)
+{
+	size_t i;
+
+	for (i = 0; i < job->count; ++i) {
+		if (job->pieces[i].status != UPSKIRT_RENDER_OK) {
+			doc->status = job->pieces[i].status;
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/* parallel_fixup • walks the pieces in order with the exact state at the
+ * beginning of each one and marks for a second render the pieces that used a
+ * wrong guess; returns the first piece that must be rendered after the ones
+ * before it, when the renderer cannot merge two changes of its state */
+static size_t
+parallel_fixup(sd_document *doc, struct parallel_job *job)
+{
+	size_t state_size = doc->config->md.opaque_size;
+	size_t i, tail;
+
+	for (i = 0; i < job->count; ++i) {
+		struct render_piece *piece = &job->pieces[i];
+		int filled = job->filled;
+
+		piece->redo = piece->filled != filled ||
+			(piece->headers && !same_counter(&piece->counter, &job->counter)) ||
+			!same_notes(job, piece, doc->footnotes_used.count) ||
+			(piece->state_changed && memcmp(job->state, job->guess, state_size) != 0);
+
+		piece->counter = job->counter;
+		piece->footnotes = doc->footnotes_used.count;
+
+		if (piece->redo && state_size) {
+			piece->state = sd_arena_alloc(&doc->arena, state_size);
+			memcpy(piece->state, job->state, state_size);
+		}
+
+		if (piece->state_changed) {
+			if (doc->config->md.state_merge)
+				doc->config->md.state_merge(job->state, job->guess, piece->after);
+			else if (!piece->redo)
+				memcpy(job->state, piece->after, state_size);
+			else
+				break;
+		}
+
+		parallel_advance(doc, job, piece);
+		piece->filled = filled;
+	}
+
+	/* the rest is rendered once the state before it is known */
+	for (tail = i; i < job->count; ++i)
+		job->pieces[i].redo = 0;
+
+	/* from now on the pieces start from the footnotes actually used */
+	job->nums = NULL;
+
+	return tail;
+}
+
+/* parallel_render • renders data piece by piece on the threads of the
+ * document; returns 0 when it is better rendered in one go */
+static int
+parallel_render(sd_buffer *ob, sd_document *doc, uint8_t *data, size_t size, int position)
+{
+	size_t state_size = doc->config->md.opaque_size;
+	size_t max = doc->parallel * PARALLEL_PIECES;
+	struct parallel_job job;
+	struct footnote_item *item;
+	size_t i, tail;
+	int stop;
+
+	/* included files add references while rendering */
+	if (doc->parallel < 2 || size < UPSKIRT_PARALLEL_MIN_SIZE || doc->includes)
+		return 0;
+
+	/* steps and output are counted in the order of the document */
+	if (doc->limits.max_steps || doc->limits.max_output)
+		return 0;
+
+	/* a renderer state that is not copied cannot be shared by the threads */
+	if (!state_size && doc->config->md.opaque)
+		return 0;
+
+	memset(&job, 0x0, sizeof(job));
+	job.doc = doc;
+	job.pieces = sd_arena_calloc(&doc->arena, max, sizeof(struct render_piece));
+	job.count = parallel_split(doc, job.pieces, max, data, size);
+	if (job.count < 2)
+		return 0;
+
+	if (!doc->workers) {
+		doc->workers = sd_malloc(doc->parallel * sizeof(sd_document *));
+		for (i = 0; i < doc->parallel; ++i)
+			doc->workers[i] = sd_document_new_from_config(doc->config);
+	}
+
+	job.note_count = doc->footnotes_found.count;
+	job.notes = sd_arena_alloc(&doc->arena, job.note_count * sizeof(struct footnote_ref *));
+	for (item = doc->footnotes_found.head, i = 0; item != NULL; item = item->next)
+		job.notes[i++] = item->ref;
+	if (job.note_count)
+		parallel_notes(doc, &job);
+
+	job.counter = doc->counter;
+	job.filled = ob->size > 0;
+	if (state_size) {
+		job.state = sd_arena_alloc(&doc->arena, state_size);
+		memcpy(job.state, doc->state, state_size);
+		job.guess = sd_arena_alloc(&doc->arena, state_size);
+		memcpy(job.guess, doc->state, state_size);
+	}
+
+	for (i = 0; i < job.count; ++i) {
+		struct render_piece *piece = &job.pieces[i];
+		int offset = (int)(piece->data - data);
+
+		if (position < offset || (position >= offset + (int)piece->size && i + 1 < job.count))
+			piece->position = -1;
+		else
+			piece->position = position - offset;
+
+		piece->ob = sd_buffer_new(64);
+		piece->filled = i > 0 || ob->size > 0;
+		sd_buffer_grow(piece->ob, piece->size + (piece->size >> 1));
+		if (state_size)
+			piece->after = sd_arena_alloc(&doc->arena, state_size);
+		piece->redo = 1;
+	}
+
+	/* first round on guesses, second round on the exact state of the
+	 * pieces whose output depended on a wrong guess */
+#ifndef UPSKIRT_NO_THREADS
+	parallel_lock_init(&job.lock);
+#endif
+	parallel_round(&job);
+	tail = job.count;
+	if (!parallel_stopped(doc, &job)) {
+		tail = parallel_fixup(doc, &job);
+		parallel_round(&job);
+		parallel_stopped(doc, &job);
+	}
+#ifndef UPSKIRT_NO_THREADS
+	parallel_lock_free(&job.lock);
+#endif
+
+	for (i = tail; i < job.count && doc->status == UPSKIRT_RENDER_OK; ++i) {
+		struct render_piece *piece = &job.pieces[i];
+
+		piece->counter = job.counter;
+		piece->footnotes = doc->footnotes_used.count;
+		piece->filled = job.filled;
+		piece->state = job.state;
+
+		piece_render(doc->workers[0], &job, piece);
+		if (state_size)
+			memcpy(job.state, piece->after, state_size);
+		parallel_advance(doc, &job, piece);
+		doc->status = piece->status;
+	}
+
+	/* a render stopped early goes up to the first piece that stopped */
+	for (i = 0, stop = 0; i < job.count; ++i) {
+		struct render_piece *piece = &job.pieces[i];
+
+		if (!stop)
+			sd_buffer_put(ob, piece->ob->data + piece->filled, piece->ob->size - piece->filled);
+		stop = stop || piece->status != UPSKIRT_RENDER_OK;
+
+		sd_buffer_free(piece->ob);
+		free(piece->notes);
+		flush_output(doc, ob, 0);
+	}
+
+	doc->counter = job.counter;
+	if (state_size)
+		memcpy(doc->state, job.state, state_size);
+
+	return 1;
+}
+
+/**********************
+ * EXPORTED FUNCTIONS *
+ **********************/
+
+sd_document_config *
+sd_document_config_new(
+	const sd_renderer *renderer,
+	sd_extensions extensions,
+	ext_definition * user_ext,
+	const char * base_folder,
+	size_t max_nesting)
+{
+	sd_document_config *config = NULL;
+
+	assert(max_nesting > 0 && renderer);
+
+	config = sd_malloc(sizeof(sd_document_config));
+	memcpy(&config->md, renderer, sizeof(sd_renderer));
+
+	config->extensions = user_ext;
+	config->base_folder = (base_folder != NULL) ? strdup (base_folder) : NULL;
+
+	memset(config->active_char, 0x0, 256);
+
+	if (extensions & UPSKIRT_EXT_UNDERLINE && config->md.underline) {
+		config->active_char['_'] = MD_CHAR_EMPHASIS;
+	}
+
+	if (config->md.emphasis || config->md.double_emphasis || config->md.triple_emphasis) {
+		config->active_char['*'] = MD_CHAR_EMPHASIS;
+		config->active_char['_'] = MD_CHAR_EMPHASIS;
+		if (extensions & UPSKIRT_EXT_STRIKETHROUGH)
+			config->active_char['~'] = MD_CHAR_EMPHASIS;
+		if (extensions & UPSKIRT_EXT_HIGHLIGHT)
+			config->active_char['='] = MD_CHAR_EMPHASIS;
+	}
+
+	if (config->md.codespan)
+		config->active_char['`'] = MD_CHAR_CODESPAN;
+
+	if (config->md.linebreak)
+		config->active_char['\n'] = MD_CHAR_LINEBREAK;
+
+	if (config->md.image || config->md.link || config->md.footnotes || config->md.footnote_ref) {
+		config->active_char['['] = MD_CHAR_LINK;
+		config->active_char['!'] = MD_CHAR_IMAGE;
+	}
+
+	config->active_char['<'] = MD_CHAR_LANGLE;
+	config->active_char['\\'] = MD_CHAR_ESCAPE;
+	config->active_char['&'] = MD_CHAR_ENTITY;
+
+	if (extensions & UPSKIRT_EXT_AUTOLINK) {
+		config->active_char[':'] = MD_CHAR_AUTOLINK_URL;
+		config->active_char['@'] = MD_CHAR_AUTOLINK_EMAIL;
+		config->active_char['w'] = MD_CHAR_AUTOLINK_WWW;
+	}
+
+	if (extensions & UPSKIRT_EXT_SUPERSCRIPT)
+		config->active_char['^'] = MD_CHAR_SUPERSCRIPT;
+
+	if (extensions & UPSKIRT_EXT_QUOTE)
+		config->active_char['"'] = MD_CHAR_QUOTE;
+
+	if (extensions & UPSKIRT_EXT_MATH)
+		config->active_char['$'] = MD_CHAR_MATH;
+
+	if (extensions & UPSKIRT_EXT_SCI)
+		config->active_char['('] = MD_CHAR_REF;
+
+	sd_scan_init(&config->active_scan, config->active_char);
+
+	/* Extension data */
+	config->ext_flags = extensions;
+	config->max_nesting = max_nesting;
+
+	return config;
+}
+
+void
+sd_document_config_free(sd_document_config *config)
+{
+	if (config->base_folder)
+		free(config->base_folder);
+	free(config);
+}
+
+sd_document *
+sd_document_new_from_config(const sd_document_config *config)
+{
+	sd_document *doc = NULL;
+
+	assert(config);
+
+	doc = sd_malloc(sizeof(sd_document));
+	doc->config = config;
+	doc->own_config = NULL;
+
+	/* renderers that tell the size of their state get a copy per document,
+	 * refreshed before every render */
+	doc->state = NULL;
+	if (config->md.opaque_size)
+		doc->state = sd_malloc(config->md.opaque_size);
+	doc->data.opaque = config->md.opaque;
+	doc->data.meta = NULL;
+
+	doc->includes = NULL;
+	sd_arena_init(&doc->arena, 0);
+
+	doc->counter = (h_counter){0, 0, 0};
+
+	label_table_init(&doc->floats, 1);
+	doc->document_metadata = NULL;
+	doc->table_of_contents = NULL;
+
+	label_table_init(&doc->refs, 0);
+	memset(&doc->footnotes_found, 0x0, sizeof(doc->footnotes_found));
+	memset(&doc->footnotes_used, 0x0, sizeof(doc->footnotes_used));
+	label_table_init(&doc->notes, 0);
+
+	sd_stack_init(&doc->work_bufs[BUFFER_BLOCK], 4);
+	sd_stack_init(&doc->work_bufs[BUFFER_SPAN], 8);
+
+	doc->in_place = 0;
+	doc->in_link_body = 0;
+	doc->inline_frame = NULL;
+
+	doc->output = NULL;
+	doc->output_opaque = NULL;
+	doc->output_threshold = 0;
+	doc->out = NULL;
+	doc->out_start = 0;
+	doc->written = 0;
+
+	memset(&doc->limits, 0x0, sizeof(doc->limits));
+	doc->limited = 0;
+	doc->status = UPSKIRT_RENDER_OK;
+	doc->steps = 0;
+	doc->deadline = 0;
+
+	doc->stream = NULL;
+	doc->missing = 0;
+
+	doc->piece = NULL;
+	doc->parallel = 0;
+	doc->workers = NULL;
+
+	return doc;
+}
+
+sd_document *
+sd_document_new(
+	const sd_renderer *renderer,
+	sd_extensions extensions,
+    ext_definition * user_ext,
+    const char * base_folder,
+	size_t max_nesting)
+{
+	sd_document_config *config;
+	sd_document *doc;
+
+	config = sd_document_config_new(renderer, extensions, user_ext, base_folder, max_nesting);
+	doc = sd_document_new_from_config(config);
+	doc->own_config = config;
+
+	return doc;
+}
+size_t
+skip_yaml(sd_document *doc, sd_buffer *ob, const uint8_t *data, size_t size)
+{
+	size_t skip = 0;
+	if (has_prefix(data, size, "---") && size > 3 && is_separator(data[3])){
+		skip += 4;
+		while (skip < size && !(has_prefix(data + skip, size - skip, "\n---") &&
+		       (skip + 4 >= size || is_separator(data[skip+4])))) {
+			skip ++;
+		}
+		if (skip < size)
+		{
+			skip += 5;
+		}
+	}
+	return skip;
+}
+
+/* render_text • second pass: renders the text produced by the prepass */
+static void
+render_text(sd_document *doc, sd_buffer *ob, sd_buffer *text, int position)
+{
+	/* pre-grow the output buffer to minimize allocations */
+	sd_buffer_grow(ob, text->size + (text->size >> 1));
+
+	if (doc->config->md.doc_header)
+		doc->config->md.doc_header(ob, 0, &doc->data);
+
+	if (text->size) {
+		size_t skip = skip_yaml(doc, ob, text->data, text->size);
+		/* adding a final newline if not already present */
+		if (text->data[text->size - 1] != '\n' &&  text->data[text->size - 1] != '\r')
+			sd_buffer_putc(text, '\n');
+
+		if (!parallel_render(ob, doc, text->data+skip, text->size-skip, position-skip))
+			parse_block(ob, doc, text->data+skip, text->size-skip, position-skip);
+	}
+}
+
+struct prepass_state;
+static void prepass(sd_document *doc, sd_buffer *text, const uint8_t *data, size_t size, struct prepass_state *pass);
+
+void
+sub_render(sd_document *doc, sd_buffer *ob, const uint8_t *data, size_t size, int position)
+{
+	sd_buffer *text = sd_buffer_new(64);
+
+	prepass(doc, text, data, size, NULL);
+	render_text(doc, ob, text, position);
+
+	sd_buffer_free(text);
+}
+
+/* append_string • adds a string at the end of a list, counting the
+ * strings that follow each node like add_string does */
+static Strings *
+append_string(sd_arena *arena, Strings *head, char *str)
+{
+	Strings *next = sd_arena_alloc(arena, sizeof(Strings));
+	Strings *it;
+
+	next->size = 1;
+	next->str = str;
+	next->next = NULL;
+
+	if (!head)
+		return next;
+
+	for (it = head; ; it = it->next) {
+		it->size++;
+		if (!it->next) {
+			it->next = next;
+			break;
+		}
+	}
+
+	return head;
+}
+
+int parse_keyword(sd_arena *arena, char * keyword, metadata * meta,  const uint8_t *data, size_t size)
+{
+	/** clean keyword **/
+	remove_char(keyword, ' ');
+	remove_char(keyword, '\n');
+	remove_char(keyword, '\t');
+
+	int j;
+	int skip = 0;
+	int text = 0;
+	for (j = 0 ; j+1 < size && data[j+1] != '\n'; j++){
+		if (!text && data[j] == ' ')
+			skip ++;
+		else if (!text && data[j] != ' ')
+			text = 1;
+	}
+	if (j == 0)
+	{
 		return 1;
 	}
-	return find_ref(refs->next, id, counter);
+	char * word = sd_arena_calloc(arena, j-skip+3, sizeof(char));
+	memcpy(word, data+skip, (j-skip+1));
+
+
+	if (!strcmp(keyword, "title")) {
+		meta->title = word;
+	} else if (!strcmp(keyword, "author")) {
+		meta->authors = append_string(arena, meta->authors, word);
+	} else if (!strcmp(keyword, "keywords")) {
+		meta->keywords = word;
+	} else if (!strcmp(keyword, "style")) {
+		meta->style = word;
+	} else if (!strcmp(keyword, "affiliation")) {
+		meta->affiliation = word;
+	} else if (!strcmp(keyword, "numbering")) {
+		meta->numbering = !strcmp(word, "true");
+	} else if (!strcmp(keyword, "paper")) {
+		meta->paper_size = string_to_paper(word);
+	} else if (!strcmp(keyword, "class")) {
+		meta->doc_class = string_to_class(word);
+	} else if (!strcmp(keyword, "font-size")) {
+		meta->font_size = atoi(word);
+	} else if (!arena) {
+		free(word);
+	}
+
+	return j+1;
+}
+
+/* parse_yaml • metadata of the YAML header; the strings and the metadata
+ * itself are taken from the heap when arena is NULL */
+metadata *
+parse_yaml(sd_arena *arena, const uint8_t *data, size_t size)
+{
+	metadata * meta = sd_arena_alloc(arena, sizeof(metadata));
+
+	meta->keywords = NULL;
+	meta->authors = NULL;
+	meta->style = NULL;
+	meta->title = NULL;
+
+	meta->paper_size = A4PAPER;
+	meta->doc_class = CLASS_ARTICLE;
+	meta->font_size = 10;
+
+	meta->numbering = 0;
+	meta->affiliation = NULL;
+
+	if (has_prefix(data, size, "---") && size > 3 && is_separator(data[3])){
+		int i = 4;
+		while (i < size){
+			if (has_prefix(data + i, size - i, "---\n"))
+				break;
+			int j;
+			for (j = 0 ; j+i+1 < size && data[i+j+1] != ':' && data[i+j+1] != '\n'; j++){}
+			if (j+i+1 < size && data[j+i+1] == ':'){
+				char type[1024];
+				memset(type, 0, j+3);
+				memcpy(type, data+i, j+1);
+				j += parse_keyword(arena, type, meta, data+i+j+2, size - i - j - 2);
+	       }
+
+            i+=j+3;
+		}
+	}
+	return meta;
+}
+
+void
+render_metadata(sd_document *doc, sd_buffer *ob, metadata * meta)
+{
+
+	if (meta->title != NULL && doc->config->md.title)
+	{
+		sd_buffer * b = newbuf(doc, BUFFER_SPAN);
+		sd_buffer_puts(b, meta->title);
+		doc->config->md.title(ob,b, meta);
+		popbuf(doc, BUFFER_SPAN);
+	}
+	if (meta->authors != NULL && doc->config->md.authors)
+	{
+		doc->config->md.authors(ob,meta->authors);
+	}
+	if (meta->affiliation != NULL && doc->config->md.affiliation)
+	{
+		sd_buffer * b = newbuf(doc, BUFFER_SPAN);
+		sd_buffer_puts(b, meta->affiliation);
+		doc->config->md.affiliation(ob,b,NULL);
+		popbuf(doc, BUFFER_SPAN);
+	}
+
+}
+
+void
+check_for_ref(sd_document *doc, const uint8_t *data, size_t size, html_counter * counter, float_type type)
+{
+	int caption = 0;
+	size_t i = 0;
+	while (i < size && !has_prefix(data + i, size - i, "@/\n")){
+		i++;
+		if (has_prefix(data + i, size - i, "@caption(")){
+			caption = 1;
+		}
+	}
+	if (caption || type==EQUATION){
+		int c =0;
+		switch (type)
+		{
+		case EQUATION:
+			c = ++(counter->equation);
+			break;
+		case TABLE:
+			c = ++(counter->table);
+			break;
+		case LISTING:
+			c = ++(counter->listing);
+			break;
+		case FIGURE:
+			c = ++(counter->figure);
+			break;
+		}
+
+		if (size && data[0] == '('){
+			i = 1;
+			while (i < size && data[i] != '\n' && data[i] !=')')
+			{
+				i ++ ;
+			}
+			if (i > 1)
+			{
+				char * id = sd_arena_strndup(&doc->arena, data+1, i-1);
+				add_reference(&doc->arena, &doc->floats, id, c, type);
+			}
+		}
+	}
+}
+
+
+void
+look_for_ref(sd_document *doc, const uint8_t *data, size_t size, html_counter * counter)
+{
+
+	if (has_prefix(data, size, "@figure"))
+	{
+		check_for_ref(doc, data+7, size-7, counter, FIGURE);
+	}
+	if (has_prefix(data, size, "@table"))
+	{
+		check_for_ref(doc, data+6, size-6,counter, TABLE);
+	}
+	if (has_prefix(data, size, "@listing"))
+	{
+		check_for_ref(doc, data+8, size-8,counter,  LISTING);
+	}
+	if (has_prefix(data, size, "@equation"))
+	{
+		check_for_ref(doc, data+9, size-9,counter, EQUATION);
+	}
+}
+
+
+
+/* prepass: state of the first pass over one text, gathering the TOC
+ * entries and numbering the floats on the way */
+struct prepass_state {
+	html_counter *counter;
+	int want_toc;
+	size_t toc_begin;	/* TOC entries start after the YAML header */
+	uint8_t code_block;	/* fence char of the code block being skipped */
+	toc *root;
+	toc *current;
+};
+
+static void prepass_scan(sd_document *doc, struct prepass_state *pass, const uint8_t *data, size_t size, size_t from, size_t to);
+
+static void
+prepass_init(struct prepass_state *pass, html_counter *counter, int want_toc, toc *parent, const uint8_t *data, size_t size)
+{
+	size_t i = 0;
+
+	/* the YAML header never contributes to the TOC */
+	if (size > 4 && has_prefix(data, size, "---") && is_separator(data[3])){
+		i  = 4;
+		while (i < size) {
+			if (data[i-1] == '\n' && has_prefix(data + i, size - i, "---") &&
+			    i + 3 < size && is_separator(data[i + 3])) {
+				i += 3;
+				break;
+			}
+			i++;
+		}
+	}
+
+	pass->counter = counter;
+	pass->want_toc = want_toc;
+	pass->toc_begin = i;
+	pass->code_block = 0;
+	pass->root = parent;
+	pass->current = parent;
+}
+
+static void
+prepass_add_toc(sd_arena *arena, struct prepass_state *pass, size_t level, char *title)
+{
+	toc * next = sd_arena_alloc(arena, sizeof(toc));
+	next->sibling = NULL;
+	next->nesting = level;
+	next->text = title;
+	if (!pass->current) {
+		pass->root = next;
+	} else {
+		pass->current->sibling = next;
+	}
+	pass->current = next;
+}
+
+/* prepass_line • TOC entries and code fences at the beginning of a line */
+static void
+prepass_line(sd_document *doc, struct prepass_state *pass, const uint8_t *data, size_t size, size_t i)
+{
+	if (!pass->code_block) {
+		if (is_atxheader(doc, (uint8_t*)data+i, size-i))
+		{
+			size_t level = 0;
+			uint8_t * title = get_atxheader_info(&doc->arena, (uint8_t*)data+i, size-i, &level, NULL);
+			if (level <= 3 && title)
+				prepass_add_toc(&doc->arena, pass, level, (char*) title);
+		} else if (i > 0 && is_headerline((uint8_t*)data+i, size-i)){
+			size_t j = i - 1;
+			int somechar = 0;
+			while (j > 0 && data[j - 1] != '\n') {
+				if (!is_separator(data[j -1]))
+					somechar = 1;
+				j --;
+			}
+			if ((i - j) > 1 && somechar) {
+				size_t level = data[i] == '-' ? 2 : 1;
+				char * title = sd_arena_strndup(&doc->arena, data+j, i-j-2);
+
+				prepass_add_toc(&doc->arena, pass, level, title);
+			}
+		} else if (is_codefence((uint8_t*)data+i, size-i, NULL, NULL)) {
+			pass->code_block = data[i];
+		}
+	} else if (data[i] == pass->code_block && is_codefence((uint8_t*)data+i, size-i, NULL, NULL)) {
+		pass->code_block = 0;
+	}
+}
+
+/* prepass_marker • floats and included files, starting at an '@' */
+static void
+prepass_marker(sd_document *doc, struct prepass_state *pass, const uint8_t *data, size_t size, size_t i)
+{
+	if (prefix_float((uint8_t*)data+i, size-i))
+	{
+		look_for_ref(doc, data+i, size-i, pass->counter);
+	}
+	else if (has_prefix(data + i, size - i, "@include("))
+	{
+		/* floats are numbered everywhere, but headers only count
+		 * outside of code blocks */
+		int want_toc = pass->want_toc && !pass->code_block &&
+			i >= pass->toc_begin && i + 1 < size;
+		const sd_input * text = load_include(doc, data+i+9, include_name(data+i, size-i));
+		if (text && text->size)
+		{
+			struct prepass_state sub;
+
+			prepass_init(&sub, pass->counter, want_toc, pass->current, text->data, text->size);
+			prepass_scan(doc, &sub, text->data, text->size, 0, text->size);
+			if (want_toc && !pass->root && sub.root)
+				pass->root = sub.root;
+		}
+	}
+}
+
+/* prepass_scan • visits the lines and markers of data[from..to) */
+static void
+prepass_scan(sd_document *doc, struct prepass_state *pass, const uint8_t *data, size_t size, size_t from, size_t to)
+{
+	size_t i = from, eol;
+	const uint8_t *mark;
+
+	while (i < to) {
+		if (pass->want_toc && i >= pass->toc_begin && i + 1 < size &&
+		    (i == 0 || data[i - 1] == '\n'))
+			prepass_line(doc, pass, data, size, i);
+
+		mark = memchr(data + i, '\n', to - i);
+		eol = mark ? (size_t)(mark - data) + 1 : to;
+
+		while (i < eol && (mark = memchr(data + i, '@', eol - i)) != NULL) {
+			i = mark - data;
+			prepass_marker(doc, pass, data, size, i);
+			i++;
+		}
+
+		i = eol;
+	}
+}
+
+/* prepass • first pass over the source: link references and footnotes are
+ * collected and everything else is copied to text with tabs expanded;
+ * with a pass state, floats are numbered and the TOC gathered as well */
+static void
+prepass(sd_document *doc, sd_buffer *text, const uint8_t *data, size_t size, struct prepass_state *pass)
+{
+	static const uint8_t UTF8_BOM[] = {0xEF, 0xBB, 0xBF};
+	size_t beg = 0, end;
+	int footnotes_enabled = doc->config->ext_flags & UPSKIRT_EXT_FOOTNOTES;
+
+	/* Preallocate enough space for our buffer to avoid expanding while copying */
+	sd_buffer_grow(text, size);
+
+	/* Skip a possible UTF-8 BOM, even though the Unicode standard
+	 * discourages having these in UTF-8 documents */
+	if (size >= 3 && memcmp(data, UTF8_BOM, 3) == 0)
+		beg += 3;
+
+	if (pass)
+		prepass_scan(doc, pass, data, size, 0, beg);
+
+	while (beg < size) { /* iterating over lines */
+		if (footnotes_enabled && is_footnote(doc, data, beg, size, &end, &doc->footnotes_found))
+			;
+		else if (is_ref(&doc->arena, data, beg, size, &end, &doc->refs))
+			;
+		else { /* skipping to the next line */
+			end = beg;
+			while (end < size && data[end] != '\n' && data[end] != '\r')
+				end++;
+
+			/* adding the line body if present */
+			if (end > beg)
+				expand_tabs(text, data + beg, end - beg);
+
+			while (end < size && (data[end] == '\n' || data[end] == '\r')) {
+				/* add one \n per newline */
+				if (data[end] == '\n' || (end + 1 < size && data[end + 1] != '\n'))
+					sd_buffer_putc(text, '\n');
+				end++;
+			}
+		}
+
+		if (pass)
+			prepass_scan(doc, pass, data, size, beg, end);
+
+		beg = end;
+	}
+}
+
+
+metadata* document_metadata(const uint8_t *data, size_t size)
+{
+	return parse_yaml(NULL, data, size);
+}
+
+void
+sd_document_render(sd_document *doc, sd_buffer *ob, const uint8_t *data, size_t size, int position)
+{
+
+	int footnotes_enabled;
+
+	/* start from a clean state, whatever the previous render left */
+	sd_document_reset(doc);
+	budget_start(doc, ob);
+
+	footnotes_enabled = doc->config->ext_flags & UPSKIRT_EXT_FOOTNOTES;
+
+	/* first pass: references, footnotes, floats and TOC in one go */
+	html_counter counter = {0,0,0,0};
+	struct prepass_state pass;
+	sd_buffer *text = sd_buffer_new(64);
+
+	prepass_init(&pass, &counter, 1, NULL, data, size);
+	prepass(doc, text, data, size, &pass);
+	doc->table_of_contents = pass.root;
+
+	metadata * meta = parse_yaml(&doc->arena, data, size);
+	doc->document_metadata = meta;
+	doc->data.meta = meta;
+
+	if (doc->config->md.head)
+		doc->config->md.head(ob, meta, doc->config->extensions);
+	if (doc->config->md.begin)
+		doc->config->md.begin(ob, &doc->data);
+	render_metadata(doc, ob, meta);
+
+	if (doc->config->md.inner)
+		doc->config->md.inner(ob, &doc->data);
+
+	render_text(doc, ob, text, position);
+	sd_buffer_free(text);
+
+	/* footnotes */
+	if (footnotes_enabled)
+		parse_footnote_list(ob, doc, &doc->footnotes_used);
+
+	if (doc->config->md.doc_footer)
+		doc->config->md.doc_footer(ob, 0, &doc->data);
+	if (doc->config->md.end)
+		doc->config->md.end(ob, doc->config->extensions, &doc->data);
+	flush_output(doc, ob, 1);
+
+	/* clean-up */
+	assert(doc->work_bufs[BUFFER_SPAN].size == 0);
+	assert(doc->work_bufs[BUFFER_BLOCK].size == 0);
+
+	sd_document_reset(doc);
+}
+
+void
+sd_document_render_inline(sd_document *doc, sd_buffer *ob, const uint8_t *data, size_t size, int position)
+{
+	size_t i = 0, mark;
+	sd_buffer *text = sd_buffer_new(64);
+
+	sd_document_reset(doc);
+	budget_start(doc, ob);
+
+	/* first pass: expand tabs and process newlines */
+	sd_buffer_grow(text, size);
+	while (1) {
+		mark = i;
+		while (i < size && data[i] != '\n' && data[i] != '\r')
+			i++;
+
+		expand_tabs(text, data + mark, i - mark);
+
+		if (i >= size)
+			break;
+
+		while (i < size && (data[i] == '\n' || data[i] == '\r')) {
+			/* add one \n per newline */
+			if (data[i] == '\n' || (i + 1 < size && data[i + 1] != '\n'))
+				sd_buffer_putc(text, '\n');
+			i++;
+		}
+	}
+
+	/* second pass: actual rendering */
+	sd_buffer_grow(ob, text->size + (text->size >> 1));
+
+	if (doc->config->md.doc_header)
+		doc->config->md.doc_header(ob, 1, &doc->data);
+
+	parse_inline(ob, doc, text->data, text->size);
+
+	if (doc->config->md.doc_footer)
+		doc->config->md.doc_footer(ob, 1, &doc->data);
+	budget_cut(doc, ob);
+
+	/* clean-up */
+	sd_buffer_free(text);
+
+	assert(doc->work_bufs[BUFFER_SPAN].size == 0);
+	assert(doc->work_bufs[BUFFER_BLOCK].size == 0);
+
+	sd_document_reset(doc);
+}
+
+/* tree_arg • the string of a node as the argument of a callback */
+static const sd_buffer *
+tree_arg(const sd_tree *tree, sd_span span, sd_buffer *buf)
+{
+	if (!span.size)
+		return NULL;
+
+	buf->data = (uint8_t *)tree->text + span.offset;
+	buf->size = span.size - 1;
+	return buf;
+}
+
+/* tree_strdup • a string of a node copied for the callbacks taking a char * */
+static char *
+tree_strdup(sd_document *doc, const sd_tree *tree, sd_span span)
+{
+	if (!span.size)
+		return NULL;
+
+	return sd_arena_strndup(&doc->arena, tree->text + span.offset, span.size - 1);
+}
+
+/* tree_metadata • the metadata kept by the head of a tree */
+static metadata *
+tree_metadata(sd_document *doc, const sd_tree *tree, const sd_node *head)
+{
+	metadata *meta = sd_arena_calloc(&doc->arena, 1, sizeof(metadata));
+	uint32_t i = head->child;
+	int field;
+
+	for (field = 0; i; field++, i = tree->nodes[i].next) {
+		char *str = tree_strdup(doc, tree, tree->nodes[i].text[0]);
+
+		switch (field) {
+		case 0: meta->title = str; break;
+		case 1: meta->keywords = str; break;
+		case 2: meta->style = str; break;
+		case 3: meta->affiliation = str; break;
+		default: meta->authors = append_string(&doc->arena, meta->authors, str); break;
+		}
+	}
+
+	meta->paper_size = head->value[0];
+	meta->doc_class = head->value[1];
+	meta->font_size = head->value[2];
+	meta->numbering = head->value[3];
+	return meta;
+}
+
+/* tree_toc • the list of TOC entries of a node */
+static toc *
+tree_toc(sd_document *doc, const sd_tree *tree, const sd_node *node)
+{
+	toc *head = NULL, *last = NULL, *entry;
+	uint32_t i;
+
+	for (i = node->child; i; i = tree->nodes[i].next) {
+		entry = sd_arena_alloc(&doc->arena, sizeof(toc));
+		entry->nesting = tree->nodes[i].value[0];
+		entry->text = tree_strdup(doc, tree, tree->nodes[i].text[0]);
+		entry->sibling = NULL;
+
+		if (last)
+			last->sibling = entry;
+		else
+			head = entry;
+		last = entry;
+	}
+
+	return head;
+}
+
+/* tree_match • the node closing the block opened at index, 0 when missing */
+static uint32_t
+tree_match(const sd_tree *tree, uint32_t index, uint32_t open, uint32_t close)
+{
+	size_t depth = 0;
+
+	for (; index; index = tree->nodes[index].next) {
+		if (tree->nodes[index].type == open)
+			depth++;
+		else if (tree->nodes[index].type == close && --depth == 0)
+			return index;
+	}
+
+	return 0;
+}
+
+static void tree_render_list(sd_buffer *ob, sd_document *doc, const sd_tree *tree, uint32_t index, uint32_t end);
+
+/* tree_content • renders the content of a node to a work buffer */
+static sd_buffer *
+tree_content(sd_document *doc, const sd_tree *tree, const sd_node *node, int type)
+{
+	sd_buffer *work = newbuf(doc, type);
+
+	tree_render_list(work, doc, tree, node->child, 0);
+	return work;
+}
+
+/* tree_verbatim • what a span becomes when it is not rendered */
+static void
+tree_verbatim(sd_buffer *ob, sd_document *doc, const sd_buffer *text)
+{
+	if (!text)
+		return;
+
+	if (doc->config->md.normal_text)
+		doc->config->md.normal_text(ob, text, &doc->data);
+	else
+		sd_buffer_put(ob, text->data, text->size);
+}
+
+/* tree_span • renders a span made of its content alone */
+static void
+tree_span(sd_buffer *ob, sd_document *doc, const sd_tree *tree, const sd_node *node,
+	int (*span)(sd_buffer *, const sd_buffer *, const sd_renderer_data *))
+{
+	sd_buffer *content = tree_content(doc, tree, node, BUFFER_SPAN);
+
+	if (!span || !span(ob, content, &doc->data))
+		sd_buffer_put(ob, content->data, content->size);
+	popbuf(doc, BUFFER_SPAN);
+}
+
+/* tree_block • renders a block made of its content alone */
+static void
+tree_block(sd_buffer *ob, sd_document *doc, const sd_tree *tree, const sd_node *node,
+	void (*block)(sd_buffer *, const sd_buffer *, const sd_renderer_data *))
+{
+	sd_buffer *content = tree_content(doc, tree, node, BUFFER_BLOCK);
+
+	if (block)
+		block(ob, content, &doc->data);
+	popbuf(doc, BUFFER_BLOCK);
+}
+
+/* tree_render_node • calls the renderer for the node at index, returning the
+ * node that follows; the ranges opened by a float, an equation or an abstract
+ * are rendered up to their end, or left out with the callback opening them */
+static uint32_t
+tree_render_node(sd_buffer *ob, sd_document *doc, const sd_tree *tree, uint32_t index)
+{
+	const sd_renderer *md = &doc->config->md;
+	const sd_node *node = &tree->nodes[index];
+	sd_buffer arg[3] = {
+		{ 0, 0, 0, 0, NULL, NULL, NULL },
+		{ 0, 0, 0, 0, NULL, NULL, NULL },
+		{ 0, 0, 0, 0, NULL, NULL, NULL }
+	};
+	const sd_buffer *text = tree_arg(tree, node->text[0], &arg[0]);
+	const sd_buffer *text2 = tree_arg(tree, node->text[1], &arg[1]);
+	sd_buffer *content, view;
+	uint32_t end;
+	int ret = 0;
+
+	switch (node->type) {
+	case UPSKIRT_NODE_TEXT:
+		tree_verbatim(ob, doc, text);
+		break;
+
+	case UPSKIRT_NODE_HEAD:
+		doc->document_metadata = tree_metadata(doc, tree, node);
+		doc->data.meta = doc->document_metadata;
+		if (md->head)
+			md->head(ob, doc->document_metadata, doc->config->extensions);
+		break;
+
+	case UPSKIRT_NODE_TITLE:
+		if (md->title && text)
+			md->title(ob, text, doc->document_metadata);
+		break;
+
+	case UPSKIRT_NODE_AUTHORS:
+		if (md->authors && doc->document_metadata && doc->document_metadata->authors)
+			md->authors(ob, doc->document_metadata->authors);
+		break;
+
+	case UPSKIRT_NODE_AFFILIATION:
+		if (md->affiliation && text)
+			md->affiliation(ob, text, NULL);
+		break;
+
+	case UPSKIRT_NODE_KEYWORDS:
+		if (md->keywords && text)
+			md->keywords(ob, text, NULL);
+		break;
+
+	case UPSKIRT_NODE_BEGIN:
+		if (md->begin)
+			md->begin(ob, &doc->data);
+		break;
+
+	case UPSKIRT_NODE_INNER:
+		if (md->inner)
+			md->inner(ob, &doc->data);
+		break;
+
+	case UPSKIRT_NODE_END:
+		if (md->end)
+			md->end(ob, doc->config->extensions, &doc->data);
+		break;
+
+	case UPSKIRT_NODE_PAGEBREAK:
+		if (md->pagebreak)
+			md->pagebreak(ob);
+		break;
+
+	case UPSKIRT_NODE_ABSTRACT:
+		end = tree_match(tree, index, UPSKIRT_NODE_ABSTRACT, UPSKIRT_NODE_CLOSE);
+		if (md->abstract) {
+			md->abstract(ob);
+			tree_render_list(ob, doc, tree, node->next, end);
+			if (end && md->close)
+				md->close(ob);
+		}
+		return end ? tree->nodes[end].next : 0;
+
+	case UPSKIRT_NODE_OPEN_EQUATION:
+		end = tree_match(tree, index, UPSKIRT_NODE_OPEN_EQUATION, UPSKIRT_NODE_CLOSE_EQUATION);
+		if (md->opn_equation) {
+			md->opn_equation(ob, tree_strdup(doc, tree, node->text[0]), &doc->data);
+			tree_render_list(ob, doc, tree, node->next, end);
+			if (end && md->cls_equation)
+				md->cls_equation(ob, &doc->data);
+		}
+		return end ? tree->nodes[end].next : 0;
+
+	case UPSKIRT_NODE_OPEN_FLOAT:
+		end = tree_match(tree, index, UPSKIRT_NODE_OPEN_FLOAT, UPSKIRT_NODE_CLOSE_FLOAT);
+		if (md->open_float) {
+			float_args args = {0};
+
+			args.id = tree_strdup(doc, tree, node->text[0]);
+			args.type = node->value[0];
+			if (node->value[1]) {
+				content = tree_content(doc, tree, node, BUFFER_SPAN);
+				args.caption = clean_string(sd_arena_strndup(&doc->arena,
+					content->data, content->size), content->size);
+				popbuf(doc, BUFFER_SPAN);
+			}
+
+			md->open_float(ob, args, &doc->data);
+			tree_render_list(ob, doc, tree, node->next, end);
+			if (end && md->close_float)
+				md->close_float(ob, args, &doc->data);
+		}
+		return end ? tree->nodes[end].next : 0;
+
+	case UPSKIRT_NODE_BLOCKCODE:
+		if (md->blockcode)
+			md->blockcode(ob, text, text2, &doc->data);
+		break;
+
+	case UPSKIRT_NODE_BLOCKQUOTE:
+		if (md->open_blockquote && md->close_blockquote) {
+			md->open_blockquote(ob, &doc->data);
+			sd_buffer_view_open(&view, ob);
+			doc->in_place++;
+			tree_render_list(&view, doc, tree, node->child, 0);
+			doc->in_place--;
+			sd_buffer_view_close(&view);
+			md->close_blockquote(ob, &doc->data);
+		} else
+			tree_block(ob, doc, tree, node, md->blockquote);
+		break;
+
+	case UPSKIRT_NODE_HEADER:
+		content = tree_content(doc, tree, node, BUFFER_SPAN);
+		if (md->header) {
+			h_counter counter;
+
+			counter.chapter = node->value[1];
+			counter.section = node->value[2];
+			counter.subsection = node->value[3];
+			md->header(ob, content, node->value[0], &doc->data, counter,
+				doc->document_metadata ? doc->document_metadata->numbering : 0);
+		}
+		popbuf(doc, BUFFER_SPAN);
+		break;
+
+	case UPSKIRT_NODE_HRULE:
+		if (md->hrule)
+			md->hrule(ob, &doc->data);
+		break;
+
+	case UPSKIRT_NODE_LIST:
+		if (md->open_list && md->close_list) {
+			md->open_list(ob, node->value[0] & UPSKIRT_LIST_ORDERED, &doc->data);
+			sd_buffer_view_open(&view, ob);
+			doc->in_place++;
+			tree_render_list(&view, doc, tree, node->child, 0);
+			doc->in_place--;
+			sd_buffer_view_close(&view);
+			md->close_list(ob, node->value[0], &doc->data);
+		} else {
+			content = tree_content(doc, tree, node, BUFFER_BLOCK);
+			if (md->list)
+				md->list(ob, content, node->value[0], &doc->data);
+			popbuf(doc, BUFFER_BLOCK);
+		}
+		break;
+
+	case UPSKIRT_NODE_LISTITEM:
+		if (md->open_listitem && md->close_listitem) {
+			md->open_listitem(ob, node->value[0], &doc->data);
+			sd_buffer_view_open(&view, ob);
+			doc->in_place++;
+			tree_render_list(&view, doc, tree, node->child, 0);
+			sd_buffer_view_close(&view);
+			md->close_listitem(ob, node->value[0], &doc->data);
+			doc->in_place--;
+		} else {
+			content = tree_content(doc, tree, node, BUFFER_SPAN);
+			if (md->listitem)
+				md->listitem(ob, content, node->value[0], &doc->data);
+			popbuf(doc, BUFFER_SPAN);
+		}
+		break;
+
+	case UPSKIRT_NODE_PARAGRAPH:
+		tree_block(ob, doc, tree, node, md->paragraph);
+		break;
+
+	case UPSKIRT_NODE_TABLE:
+		content = tree_content(doc, tree, node, BUFFER_BLOCK);
+		if (md->table) {
+			int i, columns = node->value[0];
+			sd_table_flags *flags = sd_arena_calloc(&doc->arena, columns ? columns : 1, sizeof(sd_table_flags));
+
+			for (i = 0; text && i < columns && (size_t)i < text->size; i++)
+				flags[i] = text->data[i];
+			md->table(ob, content, &doc->data, flags, columns);
+		}
+		popbuf(doc, BUFFER_BLOCK);
+		break;
+
+	case UPSKIRT_NODE_TABLE_HEADER:
+		tree_block(ob, doc, tree, node, md->table_header);
+		break;
+
+	case UPSKIRT_NODE_TABLE_BODY:
+		tree_block(ob, doc, tree, node, md->table_body);
+		break;
+
+	case UPSKIRT_NODE_TABLE_ROW:
+		tree_block(ob, doc, tree, node, md->table_row);
+		break;
+
+	case UPSKIRT_NODE_TABLE_CELL:
+		content = tree_content(doc, tree, node, BUFFER_SPAN);
+		if (md->table_cell)
+			md->table_cell(ob, content, node->value[0], &doc->data);
+		popbuf(doc, BUFFER_SPAN);
+		break;
+
+	case UPSKIRT_NODE_FOOTNOTES:
+		tree_block(ob, doc, tree, node, md->footnotes);
+		break;
+
+	case UPSKIRT_NODE_FOOTNOTE_DEF:
+		content = tree_content(doc, tree, node, BUFFER_BLOCK);
+		if (md->footnote_def)
+			md->footnote_def(ob, content, node->value[0], &doc->data);
+		popbuf(doc, BUFFER_BLOCK);
+		break;
+
+	/* without the callback, the parser makes a paragraph of the block */
+	case UPSKIRT_NODE_BLOCKHTML:
+		if (md->blockhtml)
+			md->blockhtml(ob, text, &doc->data);
+		else if (md->paragraph && text) {
+			content = newbuf(doc, BUFFER_SPAN);
+			arg[0].size = text->size;
+			while (arg[0].size && text->data[arg[0].size - 1] == '\n')
+				arg[0].size--;
+			tree_verbatim(content, doc, &arg[0]);
+			md->paragraph(ob, content, &doc->data);
+			popbuf(doc, BUFFER_SPAN);
+		}
+		break;
+
+	case UPSKIRT_NODE_TOC:
+		if (md->toc)
+			md->toc(ob, tree_toc(doc, tree, node), node->value[0]);
+		break;
+
+	case UPSKIRT_NODE_AUTOLINK:
+		if (md->autolink)
+			ret = md->autolink(ob, text, node->value[0], &doc->data);
+		if (!ret)
+			tree_verbatim(ob, doc, text);
+		break;
+
+	case UPSKIRT_NODE_CODESPAN:
+		if (md->codespan)
+			ret = md->codespan(ob, text, &doc->data);
+		if (!ret)
+			tree_verbatim(ob, doc, text);
+		break;
+
+	case UPSKIRT_NODE_DOUBLE_EMPHASIS:
+		tree_span(ob, doc, tree, node, md->double_emphasis);
+		break;
+
+	case UPSKIRT_NODE_EMPHASIS:
+		tree_span(ob, doc, tree, node, md->emphasis);
+		break;
+
+	case UPSKIRT_NODE_UNDERLINE:
+		tree_span(ob, doc, tree, node, md->underline);
+		break;
+
+	case UPSKIRT_NODE_HIGHLIGHT:
+		tree_span(ob, doc, tree, node, md->highlight);
+		break;
+
+	case UPSKIRT_NODE_QUOTE:
+		tree_span(ob, doc, tree, node, md->quote);
+		break;
+
+	case UPSKIRT_NODE_CITE:
+		if (md->cite)
+			ret = md->cite(ob, text, &doc->data);
+		if (!ret)
+			tree_verbatim(ob, doc, text);
+		break;
+
+	case UPSKIRT_NODE_IMAGE: {
+		const sd_buffer *alt = node->child ?
+			tree_arg(tree, tree->nodes[node->child].text[0], &arg[2]) : NULL;
+
+		if (md->image)
+			ret = md->image(ob, text, text2, alt, &doc->data);
+		if (!ret)
+			tree_verbatim(ob, doc, alt);
+		break;
+	}
+
+	case UPSKIRT_NODE_LINEBREAK:
+		if (md->linebreak)
+			md->linebreak(ob, &doc->data);
+		break;
+
+	case UPSKIRT_NODE_LINK:
+		content = tree_content(doc, tree, node, BUFFER_SPAN);
+		if (md->link)
+			ret = md->link(ob, node->value[0] ? content : NULL, text, text2, &doc->data);
+		if (!ret)
+			sd_buffer_put(ob, content->data, content->size);
+		popbuf(doc, BUFFER_SPAN);
+		break;
+
+	case UPSKIRT_NODE_TRIPLE_EMPHASIS:
+		tree_span(ob, doc, tree, node, md->triple_emphasis);
+		break;
+
+	case UPSKIRT_NODE_STRIKETHROUGH:
+		tree_span(ob, doc, tree, node, md->strikethrough);
+		break;
+
+	case UPSKIRT_NODE_SUPERSCRIPT:
+		tree_span(ob, doc, tree, node, md->superscript);
+		break;
+
+	case UPSKIRT_NODE_FOOTNOTE_REF:
+		if (md->footnote_ref)
+			md->footnote_ref(ob, node->value[0], node->value[1], &doc->data);
+		break;
+
+	case UPSKIRT_NODE_MATH:
+	case UPSKIRT_NODE_EQ_MATH: {
+		int (*math)(sd_buffer *, const sd_buffer *, int, const sd_renderer_data *) =
+			node->type == UPSKIRT_NODE_MATH ? md->math : md->eq_math;
+
+		if (math)
+			ret = math(ob, text, node->value[0], &doc->data);
+		if (!ret && node->type == UPSKIRT_NODE_MATH)
+			tree_verbatim(ob, doc, text);
+		break;
+	}
+
+	case UPSKIRT_NODE_RUBY:
+		if (md->ruby)
+			ret = md->ruby(ob, text, text2, &doc->data);
+		if (!ret)
+			tree_verbatim(ob, doc, text);
+		break;
+
+	case UPSKIRT_NODE_REF:
+		if (md->ref)
+			md->ref(ob, tree_strdup(doc, tree, node->text[0]), node->value[0]);
+		break;
+
+	case UPSKIRT_NODE_RAW_HTML:
+		if (md->raw_html)
+			ret = md->raw_html(ob, text, &doc->data);
+		if (!ret)
+			tree_verbatim(ob, doc, text);
+		break;
+
+	case UPSKIRT_NODE_ENTITY:
+		if (md->entity)
+			md->entity(ob, text, &doc->data);
+		else if (text)
+			sd_buffer_put(ob, text->data, text->size);
+		break;
+
+	case UPSKIRT_NODE_DOC_HEADER:
+		if (md->doc_header)
+			md->doc_header(ob, node->value[0], &doc->data);
+		break;
+
+	case UPSKIRT_NODE_DOC_FOOTER:
+		if (md->doc_footer)
+			md->doc_footer(ob, node->value[0], &doc->data);
+		break;
+
+	case UPSKIRT_NODE_POSITION:
+		if (md->position)
+			md->position(ob);
+		break;
+
+	default:
+		break;
+	}
+
+	return node->next;
+}
+
+/* tree_render_list • renders the nodes from index up to end, excluded */
+static void
+tree_render_list(sd_buffer *ob, sd_document *doc, const sd_tree *tree, uint32_t index, uint32_t end)
+{
+	while (index && index != end && !budget_spent(doc, ob))
+		index = tree_render_node(ob, doc, tree, index);
 }
 
 void
-check_for_ref(sd_document *doc, const uint8_t *data, size_t size, html_counter * counter, float_type type)
+sd_document_render_tree(sd_document *doc, sd_buffer *ob, const sd_tree *tree)
 {
-	int caption = 0;
-	size_t i = 0;
-	while (i < size && !startsWith("@/\n", (char*)data+i)){
-		i++;
-		if (startsWith("@caption(", (char*)data+i)){
-			caption = 1;
-		}
+	uint32_t index;
+
+	/* start from a clean state, whatever the previous render left */
+	sd_document_reset(doc);
+	budget_start(doc, ob);
+
+	/* the renderers count on the metadata the parser starts with, which the
+	 * head of the tree replaces */
+	doc->document_metadata = parse_yaml(&doc->arena, (const uint8_t *)"", 0);
+	doc->data.meta = doc->document_metadata;
+
+	/* the output goes to the sink between top-level nodes */
+	index = tree && tree->count ? tree->nodes[0].child : 0;
+	while (index && !budget_spent(doc, ob)) {
+		index = tree_render_node(ob, doc, tree, index);
+		flush_output(doc, ob, 0);
 	}
-	if (caption || type==EQUATION){
-		int c =0;
-		switch (type)
-		{
-		case EQUATION:
-			c = ++(counter->equation);
-			break;
-		case TABLE:
-			c = ++(counter->table);
-			break;
-		case LISTING:
-			c = ++(counter->listing);
-			break;
-		case FIGURE:
-			c = ++(counter->figure);
-			break;
-		}
+	flush_output(doc, ob, 1);
 
-		if (data[0] == '('){
-			i = 1;
-			while (i < size && data[i] != '\n' && data[i] !=')')
-			{
-				i ++ ;
-			}
-			if (i > 1)
-			{
-				char * id = malloc((i)*sizeof(char));
-				memset(id, 0, i);
-				memcpy(id, data+1, i-1);
-				doc->floating_references = add_reference(id, c, type, doc->floating_references);
-			}
-		}
-	}
+	/* clean-up */
+	assert(doc->work_bufs[BUFFER_SPAN].size == 0);
+	assert(doc->work_bufs[BUFFER_BLOCK].size == 0);
+
+	sd_document_reset(doc);
 }
 
+/* render_stream: state of a render fed with the input piece by piece */
+struct render_stream {
+	sd_buffer *input;	/* input received and not prepassed yet */
+	sd_buffer *text;	/* text of the blocks put off until the end */
+	sd_buffer *work;	/* copy of the text being rendered */
+	void *state;		/* renderer state before the blocks being rendered */
+	size_t scanned;		/* input already followed by scan */
+	size_t complete;	/* end of the complete lines of the input */
+	size_t searched;	/* input looked for the end of the lines */
+	struct block_scan scan;
+	struct prepass_state pass;
+	html_counter counter;
+	int active;		/* a render is in progress */
+	int started;		/* the beginning of the document is rendered */
+	int first;		/* the next blocks start the document */
+	int filled;		/* something was written to the output */
+	int put_off;		/* a block used a definition that may come later */
+};
 
-void
-look_for_ref(sd_document *doc, const uint8_t *data, size_t size, html_counter * counter)
+static void
+stream_reset(struct render_stream *stream)
 {
+	sd_buffer *bufs[] = { stream->input, stream->text, stream->work };
+	size_t i;
 
-	if (startsWith("@figure", (char*)data))
-	{
-		check_for_ref(doc, data+7, size-7, counter, FIGURE);
-	}
-	if (startsWith("@table", (char*)data))
-	{
-		check_for_ref(doc, data+6, size-6,counter, TABLE);
+	for (i = 0; i < sizeof(bufs) / sizeof(bufs[0]); ++i) {
+		bufs[i]->size = 0;
+		if (bufs[i]->asize > WORK_BUFFER_MAX)
+			sd_buffer_reset(bufs[i]);
 	}
-	if (startsWith("@listing", (char*)data))
-	{
-		check_for_ref(doc, data+8, size-8,counter,  LISTING);
+
+	stream->scanned = stream->complete = stream->searched = 0;
+	block_scan_init(&stream->scan);
+	stream->counter = (html_counter){0, 0, 0, 0};
+	stream->active = stream->started = stream->first = 0;
+	stream->filled = stream->put_off = 0;
+}
+
+static void
+stream_free(struct render_stream *stream)
+{
+	sd_buffer_free(stream->input);
+	sd_buffer_free(stream->text);
+	sd_buffer_free(stream->work);
+	free(stream->state);
+	free(stream);
+}
+
+/* stream_begin • the stream of the document, starting a new render when
+ * none is in progress */
+static struct render_stream *
+stream_begin(sd_document *doc, sd_buffer *ob)
+{
+	struct render_stream *stream = doc->stream;
+
+	if (!stream) {
+		stream = sd_malloc(sizeof(struct render_stream));
+		stream->input = sd_buffer_new(4096);
+		stream->text = sd_buffer_new(4096);
+		stream->work = sd_buffer_new(4096);
+		stream->state = NULL;
+		if (doc->config->md.opaque_size)
+			stream->state = sd_malloc(doc->config->md.opaque_size);
+		stream_reset(stream);
+		doc->stream = stream;
 	}
-	if (startsWith("@equation", (char*)data))
-	{
-		check_for_ref(doc, data+9, size-9,counter, EQUATION);
+
+	if (!stream->active) {
+		sd_document_reset(doc);
+		budget_start(doc, ob);
+		stream->active = 1;
 	}
+
+	return stream;
 }
 
-char*
-load_text(uint8_t *data, size_t size, char* base_folder, size_t * new_size)
+/* stream_header • whether the beginning of the input is known: the BOM and
+ * the YAML header, up to the end of its closing line, go into the first
+ * blocks; *end is set to where the block boundaries are looked for */
+static int
+stream_header(const uint8_t *data, size_t size, int final, size_t *end)
 {
-	/* @include(path) */
-	size_t i = 9;
-	size_t n = 0;
-	*new_size = 0;
-	for (;i < size; i++)
-	{
-		if (data[i] == ')')
-		{
-			break;
-		}
-		n++;
-	}
-	if (n){
-		char * path = malloc((n+1)*sizeof(uint8_t));
-		path[n] = 0;
-		memcpy(path, data+9, n);
-		if (is_regular_file(path, base_folder)){
+	size_t i = 0, j;
+
+	if (size >= 3 && data[0] == 0xEF && data[1] == 0xBB && data[2] == 0xBF)
+		i = 3;
+
+	*end = i;
+
+	if (size - i < 4)
+		return final || (size > i && data[i] != '-');
+
+	if (!has_prefix(data + i, size - i, "---") || !is_separator(data[i + 3]))
+		return 1;
+
+	/* same closing line as skip_yaml */
+	for (j = i + 4; j < size; ++j) {
+		if (has_prefix(data + j, size - j, "\n---") &&
+		    (j + 4 >= size || is_separator(data[j + 4]))) {
+			if (j + 4 >= size)
+				break;
+
+			for (j += 4; j < size && data[j] != '\n'; ++j);
+			if (j >= size)
+				break;
 
-			char * buffer = load_file(path, base_folder, new_size);
-			free(path);
-			return buffer;
+			*end = j + 1;
+			return 1;
 		}
-		free(path);
 	}
-	return NULL;
+
+	*end = size;
+	return final;
 }
 
+/* stream_start • renders the beginning of the document */
+static void
+stream_start(sd_document *doc, sd_buffer *ob, size_t end)
+{
+	struct render_stream *stream = doc->stream;
+	const uint8_t *data = stream->input->data;
+	size_t size = stream->input->size;
+	metadata *meta;
 
+	prepass_init(&stream->pass, &stream->counter, 1, NULL, data, size);
 
-void
-find_references(sd_document *doc, const uint8_t *data, size_t size, html_counter * counter)
+	meta = parse_yaml(&doc->arena, data, size);
+	doc->document_metadata = meta;
+	doc->data.meta = meta;
+
+	if (doc->config->md.head)
+		doc->config->md.head(ob, meta, doc->config->extensions);
+	if (doc->config->md.begin)
+		doc->config->md.begin(ob, &doc->data);
+	render_metadata(doc, ob, meta);
+
+	if (doc->config->md.inner)
+		doc->config->md.inner(ob, &doc->data);
+	if (doc->config->md.doc_header)
+		doc->config->md.doc_header(ob, 0, &doc->data);
+
+	stream->scanned = end;
+	stream->started = 1;
+	stream->first = 1;
+}
+
+/* stream_blocks • prepasses the first size bytes of the input, which end
+ * before a top-level block, and renders their blocks unless they need a
+ * definition that has not been received; from then on, the blocks are put
+ * off until the whole input is known */
+static void
+stream_blocks(sd_document *doc, sd_buffer *ob, size_t size, int final)
 {
-	size_t i;
-	for (i = 0; i < size; i++)
-	{
-		if (prefix_float((uint8_t*)data+i, size-i))
-		{
-			look_for_ref(doc, data+i, size-i, counter);
-		}
-		else if (startsWith("@include(", (char*) data+i))
-		{
-			size_t text_size;
-			char * text = load_text((uint8_t*)data+i, size-i, doc->base_folder, &text_size);
-			if (text_size && text)
-			{
-				find_references(doc,(const uint8_t*) text, text_size, counter);
-				free(text);
-			}
-		}
+	struct render_stream *stream = doc->stream;
+	size_t state_size = doc->config->md.opaque_size;
+	sd_buffer *text = stream->text;
+	struct footnote_list used;
+	struct footnote_item *item;
+	h_counter counter;
+	size_t from = text->size, out;
+
+	prepass(doc, text, stream->input->data, size, &stream->pass);
+	doc->table_of_contents = stream->pass.root;
+	stream->pass.toc_begin = 0;
+	sd_buffer_slurp(stream->input, size);
+
+	if (stream->first) {
+		sd_buffer_slurp(text, skip_yaml(doc, NULL, text->data, text->size));
+		stream->first = 0;
+	}
+
+	if (final && text->size > from &&
+	    text->data[text->size - 1] != '\n' && text->data[text->size - 1] != '\r')
+		sd_buffer_putc(text, '\n');
+
+	/* included files add definitions while rendering, and a shared
+	 * renderer state cannot be restored */
+	if (doc->includes || (!state_size && doc->config->md.opaque))
+		stream->put_off = 1;
+
+	if (stream->put_off || !text->size)
+		return;
+
+	counter = doc->counter;
+	used = doc->footnotes_used;
+	if (state_size)
+		memcpy(stream->state, doc->state, state_size);
+	out = ob->size;
+
+	/* blockquotes are parsed in place, the text is kept for later */
+	sd_buffer_set(stream->work, text->data, text->size);
+	doc->missing = 0;
+	parse_block(ob, doc, stream->work->data, stream->work->size, -1);
+
+	if (!doc->missing) {
+		text->size = 0;
+		return;
+	}
+
+	/* a later definition may change these blocks: back to the state
+	 * before them, unless max_output already cut the output shorter */
+	if (ob->size > out)
+		ob->size = out;
+	doc->counter = counter;
+	if (state_size)
+		memcpy(doc->state, stream->state, state_size);
+
+	for (item = used.tail ? used.tail->next : doc->footnotes_used.head; item; item = item->next) {
+		item->ref->is_used = 0;
+		item->ref->num = 0;
 	}
+	if (used.tail)
+		used.tail->next = NULL;
+	doc->footnotes_used = used;
+
+	stream->put_off = 1;
 }
 
-toc *
-generate_toc(sd_document * doc, const uint8_t * data, size_t size, toc* parent)
+/* stream_scan • looks for the block boundaries in the complete lines of
+ * the input, rendering the blocks before each one */
+static void
+stream_scan(sd_document *doc, sd_buffer *ob, int final)
 {
-	if (!data || !size)
-		return parent;
-	size_t i = 0;
-	toc * root = parent;
-	toc * current = root;
-	char code_block = 0;
+	struct render_stream *stream = doc->stream;
+	sd_buffer *input = stream->input;
+	size_t complete = input->size, i = stream->scanned, eol;
+	int found;
+
+	/* only the input received since the last look can end a line */
+	if (!final) {
+		while (complete > stream->searched && input->data[complete - 1] != '\n')
+			complete--;
+		if (complete == stream->searched)
+			complete = stream->complete;
+	}
 
-	if (size > 4 && startsWith("---", (char*)data) && is_separator(data[3])){
-		i  = 4;
-		while (i < size) {
-			if (data[i-1] == '\n' && startsWith("---", (char*)data + i) &&  is_separator(data[i + 3])) {
-				i += 3;
-				break;
-			}
-			i++;
-		}
+	while (i < complete) {
+		for (eol = i; eol < complete && input->data[eol] != '\n'; eol++);
 
-	}
+		found = block_scan_line(doc, &stream->scan, input->data, complete, i, eol, final);
+		if (found & SCAN_MORE)
+			break;
 
-	for (; i < size-1; i++)
-	{
-		if (i == 0 || data[i-1] == '\n')
-		{
-			if (!code_block) {
-				if (is_atxheader(doc, (uint8_t*)data+i, size-i))
-				{
-					size_t level = 0;
-					uint8_t * title = get_atxheader_info((uint8_t*)data+i, size-i, &level, NULL);
-					if (level <= 3 && title)
-					{
-						toc * next = malloc(sizeof(toc));
-						next->sibling = NULL;
-						next->nesting = level;
-						next->text = (char*) title;
-						if (!current) {
-							root = next;
-						} else {
-							current->sibling = next;
-						}
-						current = next;
-					}
-				} else if (i > 0 && is_headerline((uint8_t*)data+i, size-i)){
-					size_t j = i - 1;
-					int somechar = 0;
-					while (data[j - 1] != '\n') {
-						if (j == 0)
-							break;
-						if (!is_separator(data[j -1]))
-							somechar = 1;
-						j --;
-					}
-					if ((i - j) > 1 && somechar) {
-						size_t level = data[i] == '-' ? 2 : 1;
-						char * title = malloc(i - j - 1);
-						memcpy(title, data+j, i-j-2);
-						title[i - j - 2] = 0;
-
-						toc * next = malloc(sizeof(toc));
-						next->sibling = NULL;
-						next->nesting = level;
-						next->text = (char*) title;
-						if (!current) {
-							root = next;
-						} else {
-							current->sibling = next;
-						}
-						current = next;
-
-					}
-					/* fprintf(stderr, "(document.c: generate_toc()): Headerline not yet implemented\n"); */
-					//printf("Header line!\n");
-				} else if (is_codefence((uint8_t*)data+i, size-i, NULL, NULL)) {
-					code_block = data[i];
-				}
-			} else if (data[i] == code_block && is_codefence((uint8_t*)data+i, size-i, NULL, NULL)) {
-				code_block = 0;
-			}
-		}
-		if (!code_block && data[i] == '@' && startsWith("@include(", (char*)data+i))
-		{
-			size_t text_size;
-			char * text = load_text((uint8_t*)data+i, size-i, doc->base_folder, &text_size);
-			if (text_size && text)
-			{
+		/* prepass takes no TOC entry on the line after a BOM, which
+		 * has to come in the same blocks */
+		if ((found & SCAN_BLOCK) && i > 0 &&
+		    !(stream->first && i == 3 && input->data[0] == 0xEF)) {
+			stream_blocks(doc, ob, i, 0);
 
-				toc * t = generate_toc(doc,(const uint8_t*) text, text_size, current);
-				if (!root && t)
-				{
-					root = t;
-				}
-				free(text);
-			}
+			stream->scan.protect = stream->scan.protect > i ? stream->scan.protect - i : 0;
+			complete -= i;
+			eol -= i;
 		}
+
+		i = eol + 1;
 	}
-	return root;
+
+	stream->scanned = i < complete ? i : complete;
+	stream->complete = complete;
+	stream->searched = input->size;
+
+	if (final)
+		stream_blocks(doc, ob, input->size, 1);
 }
 
+/* stream_open • renderers look whether they write at the beginning of the
+ * output, which the caller may have emptied since the last call */
+static size_t
+stream_open(sd_document *doc, sd_buffer *ob)
+{
+	size_t placeholder = 0;
 
-metadata* document_metadata(const uint8_t *data, size_t size)
+	if (!ob->size && doc->stream->filled) {
+		sd_buffer_putc(ob, '\n');
+		placeholder = 1;
+	}
+
+	doc->out = ob;
+	doc->out_start = ob->size;
+	return placeholder;
+}
+
+static void
+stream_close(sd_document *doc, sd_buffer *ob, size_t placeholder)
 {
-	return parse_yaml(data, size);
+	budget_cut(doc, ob);
+	doc->written += ob->size - doc->out_start;
+	sd_buffer_slurp(ob, placeholder);
+	if (ob->size)
+		doc->stream->filled = 1;
 }
 
 void
-sd_document_render(sd_document *doc, sd_buffer *ob, const uint8_t *data, size_t size, int position)
+sd_document_feed(sd_document *doc, sd_buffer *ob, const uint8_t *data, size_t size)
 {
+	struct render_stream *stream;
+	size_t placeholder, end;
 
-	int footnotes_enabled;
+	assert(doc && ob);
 
-	/* reset the references table */
-	memset(&doc->refs, 0x0, REF_TABLE_SIZE * sizeof(void *));
+	stream = stream_begin(doc, ob);
+	sd_buffer_put(stream->input, data, size);
+	placeholder = stream_open(doc, ob);
 
-	footnotes_enabled = doc->ext_flags & UPSKIRT_EXT_FOOTNOTES;
+	if (!stream->started && stream_header(stream->input->data, stream->input->size, 0, &end))
+		stream_start(doc, ob, end);
 
-	/* reset the footnotes lists */
-	if (footnotes_enabled) {
-		memset(&doc->footnotes_found, 0x0, sizeof(doc->footnotes_found));
-		memset(&doc->footnotes_used, 0x0, sizeof(doc->footnotes_used));
-	}
-	html_counter counter = {0,0,0,0};
-	find_references(doc, data, size, &counter);
+	if (stream->started)
+		stream_scan(doc, ob, 0);
 
+	stream_close(doc, ob, placeholder);
+}
 
-	doc->table_of_contents = generate_toc(doc, data, size, NULL);
+void
+sd_document_finish(sd_document *doc, sd_buffer *ob)
+{
+	struct render_stream *stream;
+	size_t placeholder, end;
 
-	metadata * meta = parse_yaml(data, size);
-	doc->document_metadata = meta;
-	doc->data.meta = meta;
+	assert(doc && ob);
 
-	if (doc->md.head)
-		doc->md.head(ob, meta, doc->extensions);
-	if (doc->md.begin)
-		doc->md.begin(ob, &doc->data);
-	render_metadata(doc, ob, meta);
+	stream = stream_begin(doc, ob);
+	placeholder = stream_open(doc, ob);
 
-	if (doc->md.inner)
-		doc->md.inner(ob, &doc->data);
+	if (!stream->started) {
+		stream_header(stream->input->data, stream->input->size, 1, &end);
+		stream_start(doc, ob, end);
+	}
 
-	sub_render(doc, ob, data, size, position);
-	/* footnotes */
-	if (footnotes_enabled)
+	stream_scan(doc, ob, 1);
+
+	/* the blocks put off now have all the definitions */
+	if (stream->text->size &&
+	    !parallel_render(ob, doc, stream->text->data, stream->text->size, -1))
+		parse_block(ob, doc, stream->text->data, stream->text->size, -1);
+
+	if (doc->config->ext_flags & UPSKIRT_EXT_FOOTNOTES)
 		parse_footnote_list(ob, doc, &doc->footnotes_used);
 
-	if (doc->md.doc_footer)
-		doc->md.doc_footer(ob, 0, &doc->data);
-	if (doc->md.end)
-		doc->md.end(ob, doc->extensions, &doc->data);
-	/* clean-up */
+	if (doc->config->md.doc_footer)
+		doc->config->md.doc_footer(ob, 0, &doc->data);
+	if (doc->config->md.end)
+		doc->config->md.end(ob, doc->config->extensions, &doc->data);
 
-	free_link_refs(doc->refs);
-	if (footnotes_enabled) {
-		free_footnote_list(&doc->footnotes_found, 1);
-		free_footnote_list(&doc->footnotes_used, 0);
-	}
+	stream_close(doc, ob, placeholder);
 
 	assert(doc->work_bufs[BUFFER_SPAN].size == 0);
 	assert(doc->work_bufs[BUFFER_BLOCK].size == 0);
+
+	sd_document_reset(doc);
+}
+
+/* reset_work_bufs • empties a pool, giving back the buffers that grew
+ * past WORK_BUFFER_MAX */
+static void
+reset_work_bufs(sd_stack *pool)
+{
+	size_t i;
+
+	pool->size = 0;
+
+	for (i = 0; i < pool->asize; ++i) {
+		sd_buffer *work = pool->item[i];
+
+		if (work && work->asize > WORK_BUFFER_MAX)
+			sd_buffer_reset(work);
+	}
 }
 
 void
-sd_document_render_inline(sd_document *doc, sd_buffer *ob, const uint8_t *data, size_t size, int position)
+sd_document_reset(sd_document *doc)
 {
-	size_t i = 0, mark;
-	sd_buffer *text = sd_buffer_new(64);
+	assert(doc);
 
-	/* reset the references table */
-	memset(&doc->refs, 0x0, REF_TABLE_SIZE * sizeof(void *));
+	free_footnote_list(&doc->footnotes_found);
+	memset(&doc->footnotes_found, 0x0, sizeof(doc->footnotes_found));
+	memset(&doc->footnotes_used, 0x0, sizeof(doc->footnotes_used));
+	label_table_init(&doc->notes, 0);
+	label_table_init(&doc->refs, 0);
 
-	/* first pass: expand tabs and process newlines */
-	sd_buffer_grow(text, size);
-	while (1) {
-		mark = i;
-		while (i < size && data[i] != '\n' && data[i] != '\r')
-			i++;
+	free_includes(doc->includes);
+	doc->includes = NULL;
 
-		expand_tabs(text, data + mark, i - mark);
+	/* everything else was taken from the arena */
+	label_table_init(&doc->floats, 1);
+	doc->table_of_contents = NULL;
+	doc->document_metadata = NULL;
+	doc->data.meta = NULL;
+	sd_arena_reset(&doc->arena, ARENA_RETAIN);
 
-		if (i >= size)
-			break;
+	doc->counter = (h_counter){0, 0, 0};
+	doc->in_place = 0;
+	doc->in_link_body = 0;
+	doc->inline_frame = NULL;
+	doc->missing = 0;
+	doc->out = NULL;
 
-		while (i < size && (data[i] == '\n' || data[i] == '\r')) {
-			/* add one \n per newline */
-			if (data[i] == '\n' || (i + 1 < size && data[i + 1] != '\n'))
-				sd_buffer_putc(text, '\n');
-			i++;
-		}
+	if (doc->stream)
+		stream_reset(doc->stream);
+
+	if (doc->state) {
+		memcpy(doc->state, doc->config->md.opaque, doc->config->md.opaque_size);
+		doc->data.opaque = doc->state;
 	}
 
-	/* second pass: actual rendering */
-	sd_buffer_grow(ob, text->size + (text->size >> 1));
+	reset_work_bufs(&doc->work_bufs[BUFFER_BLOCK]);
+	reset_work_bufs(&doc->work_bufs[BUFFER_SPAN]);
+}
 
-	if (doc->md.doc_header)
-		doc->md.doc_header(ob, 1, &doc->data);
+/* free_workers • frees the documents of the parallel threads */
+static void
+free_workers(sd_document *doc)
+{
+	unsigned int i;
 
-	parse_inline(ob, doc, text->data, text->size);
+	if (!doc->workers)
+		return;
 
-	if (doc->md.doc_footer)
-		doc->md.doc_footer(ob, 1, &doc->data);
+	for (i = 0; i < doc->parallel; ++i)
+		sd_document_free(doc->workers[i]);
 
-	/* clean-up */
-	sd_buffer_free(text);
-	assert(doc->work_bufs[BUFFER_SPAN].size == 0);
-	assert(doc->work_bufs[BUFFER_BLOCK].size == 0);
+	free(doc->workers);
+	doc->workers = NULL;
 }
 
 void
-free_references(reference * ref)
+sd_document_set_parallel(sd_document *doc, unsigned int threads)
 {
-	if (ref)
-	{
-		free(ref->id);
-		free_references(ref->next);
-		free(ref->next);
-	}
+	assert(doc);
+
+	free_workers(doc);
+	doc->parallel = threads;
 }
 
 void
-free_toc(toc * ToC)
+sd_document_set_output(sd_document *doc, sd_output_callback output, void *opaque, size_t threshold)
 {
-	if (ToC)
-	{
-		free(ToC->text);
-		free_toc(ToC->sibling);
-		free(ToC);
-	}
+	assert(doc);
+
+	doc->output = output;
+	doc->output_opaque = opaque;
+	doc->output_threshold = threshold;
 }
 
 void
-free_meta(metadata * meta)
+sd_document_set_limits(sd_document *doc, const sd_render_limits *limits)
 {
-	if (!meta)
-		return;
-	if (meta->affiliation)
-		free(meta->affiliation);
-	if (meta->keywords)
-		free(meta->keywords);
-	if (meta->style)
-		free(meta->style);
-	if (meta->title)
-		free(meta->title);
-	free_strings(meta->authors);
-	free(meta);
+	assert(doc);
+
+	if (limits)
+		doc->limits = *limits;
+	else
+		memset(&doc->limits, 0x0, sizeof(doc->limits));
+
+	doc->limited = doc->limits.max_output || doc->limits.max_steps || doc->limits.timeout_ms;
+}
+
+sd_render_status
+sd_document_status(const sd_document *doc)
+{
+	assert(doc);
+
+	return doc->status;
 }
 
 void
@@ -4108,10 +6875,13 @@ sd_document_free(sd_document *doc)
 
 	sd_stack_uninit(&doc->work_bufs[BUFFER_SPAN]);
 	sd_stack_uninit(&doc->work_bufs[BUFFER_BLOCK]);
-	free_references(doc->floating_references);
-	free_toc(doc->table_of_contents);
-	free_meta(doc->document_metadata);
-	if (doc->base_folder)
-		free(doc->base_folder);
+	free_includes(doc->includes);
+	sd_arena_uninit(&doc->arena);
+	free_workers(doc);
+	if (doc->stream)
+		stream_free(doc->stream);
+	free(doc->state);
+	if (doc->own_config)
+		sd_document_config_free(doc->own_config);
 	free(doc);
 }
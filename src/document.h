@@ -90,6 +90,13 @@ typedef enum sd_autolink_type {
 	UPSKIRT_AUTOLINK_EMAIL		/* e-mail link without explit mailto: */
 } sd_autolink_type;
 
+typedef enum sd_render_status {
+	UPSKIRT_RENDER_OK = 0,		/* the render went to the end */
+	UPSKIRT_RENDER_OUTPUT_LIMIT,	/* stopped past max_output bytes */
+	UPSKIRT_RENDER_STEP_LIMIT,	/* stopped past max_steps steps */
+	UPSKIRT_RENDER_TIMEOUT		/* stopped past timeout_ms */
+} sd_render_status;
+
 
 
 /*********
@@ -99,6 +106,23 @@ typedef enum sd_autolink_type {
 struct sd_document;
 typedef struct sd_document sd_document;
 
+struct sd_document_config;
+typedef struct sd_document_config sd_document_config;
+
+struct sd_tree;
+
+/* sd_output_callback: receives the output of a render as it is flushed */
+typedef void (*sd_output_callback)(const uint8_t *data, size_t size, void *opaque);
+
+/* sd_render_limits: bounds put on every render of a document; 0 leaves
+ * a bound out */
+struct sd_render_limits {
+	size_t max_output;		/* bytes of output */
+	size_t max_steps;		/* blocks and spans parsed */
+	unsigned long timeout_ms;	/* time from the start of the render */
+};
+typedef struct sd_render_limits sd_render_limits;
+
 typedef struct metadata {
 	char              *title;
 	Strings           *authors;
@@ -238,6 +262,24 @@ struct sd_renderer {
 	
 	/* position reference */
 	void (*position)(sd_buffer *ob);
+
+	/* size of the state pointed by opaque; when set, every document renders
+	 * on its own copy of the state and the renderer can be shared */
+	size_t opaque_size;
+
+	/* adds to state what a render changed from before to after, so that the
+	 * pieces of a document rendered in parallel can be put back in order */
+	void (*state_merge)(void *state, const void *before, const void *after);
+
+	/* containers rendered in place - when both are set, the content is
+	 * written to ob between the two calls, in a view seeing it empty, instead
+	 * of being copied by the callback of the container above */
+	void (*open_blockquote)(sd_buffer *ob, const sd_renderer_data *data);
+	void (*close_blockquote)(sd_buffer *ob, const sd_renderer_data *data);
+	void (*open_list)(sd_buffer *ob, sd_list_flags flags, const sd_renderer_data *data);
+	void (*close_list)(sd_buffer *ob, sd_list_flags flags, const sd_renderer_data *data);
+	void (*open_listitem)(sd_buffer *ob, sd_list_flags flags, const sd_renderer_data *data);
+	void (*close_listitem)(sd_buffer *ob, sd_list_flags flags, const sd_renderer_data *data);
 };
 typedef struct sd_renderer sd_renderer;
 
@@ -257,12 +299,68 @@ sd_document *sd_document_new(
 	size_t max_nesting
 ) __attribute__ ((malloc));
 
+/* sd_document_config_new: compile the parser configuration for a renderer;
+ * it is never modified afterwards and can be shared between threads */
+sd_document_config *sd_document_config_new(
+	const sd_renderer *renderer,
+	sd_extensions extensions,
+	ext_definition * exeternal_extensions,
+	const char * base_folder,
+	size_t max_nesting
+) __attribute__ ((malloc));
+
+/* sd_document_config_free: deallocate a parser configuration */
+void sd_document_config_free(sd_document_config *config);
+
+/* sd_document_new_from_config: allocate the per-thread state of a document
+ * processor; the configuration must outlive it */
+sd_document *sd_document_new_from_config(const sd_document_config *config) __attribute__ ((malloc));
+
 /* sd_document_render: render regular Markdown using the document processor */
 void sd_document_render(sd_document *doc, sd_buffer *ob, const uint8_t *data, size_t size, int position);
 
 /* sd_document_render_inline: render inline Markdown using the document processor */
 void sd_document_render_inline(sd_document *doc, sd_buffer *ob, const uint8_t *data, size_t size, int position);
 
+/* sd_document_render_tree: render a tree recorded by the renderer of tree.h,
+ * without parsing again; spans the renderer leaves out, with a NULL callback
+ * or returning 0, are replaced by their content */
+void sd_document_render_tree(sd_document *doc, sd_buffer *ob, const struct sd_tree *tree);
+
+/* sd_document_feed: render Markdown received piece by piece; the blocks are
+ * appended to ob once complete, unless they use a definition not received yet,
+ * in which case they and everything after wait for sd_document_finish */
+void sd_document_feed(sd_document *doc, sd_buffer *ob, const uint8_t *data, size_t size);
+
+/* sd_document_finish: render what is left of the input given to sd_document_feed */
+void sd_document_finish(sd_document *doc, sd_buffer *ob);
+
+/* sd_document_set_parallel: render large documents on the given number of
+ * threads, splitting them between top-level blocks; 0 or 1 to disable. The
+ * pieces whose footnote numbers differ from the ones guessed from the text
+ * before them are rendered a second time */
+void sd_document_set_parallel(sd_document *doc, unsigned int threads);
+
+/* sd_document_set_output: have sd_document_render hand the output over to
+ * the callback every time it reaches threshold bytes at the end of a
+ * top-level block, and all of it at the end, leaving ob empty; NULL to keep
+ * the whole output in ob */
+void sd_document_set_output(sd_document *doc, sd_output_callback output, void *opaque, size_t threshold);
+
+/* sd_document_set_limits: bound the renders of the document; a render going
+ * past a limit stops at the next block or span, closes the document and
+ * leaves what it rendered in ob, cut to max_output bytes; NULL to remove
+ * the limits */
+void sd_document_set_limits(sd_document *doc, const sd_render_limits *limits);
+
+/* sd_document_status: whether the last render went to the end, or the
+ * limit that stopped it */
+sd_render_status sd_document_status(const sd_document *doc);
+
+/* sd_document_reset: drop the state left by the last render, keeping the
+ * memory of the instance for the next one; renders call it themselves */
+void sd_document_reset(sd_document *doc);
+
 /* sd_document_free: deallocate a document processor instance */
 void sd_document_free(sd_document *doc);
 
@@ -1,13 +1,28 @@
 #include "escape.h"
+#include "scan.h"
 
 #include <assert.h>
 #include <stdio.h>
 #include <string.h>
 
+#ifndef UPSKIRT_NO_THREADS
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+#endif
+
 
 #define likely(x)       __builtin_expect((x),1)
 #define unlikely(x)     __builtin_expect((x),0)
 
+/* the search tables of the maps below, built once by escape_scan_init */
+static sd_scan_table href_scan;
+static sd_scan_table html_scan;
+
+static void escape_scan_init(void);
+
 
 /*
  * The following characters will not be escaped:
@@ -33,24 +48,28 @@
  *
  * All other characters will be escaped to %XX.
  *
+ * The table marks the characters that are escaped;
+ * the runs of the others are found by sd_scan_find
+ * in the search table built from it.
+ *
  */
-static const uint8_t HREF_SAFE[UINT8_MAX+1] = {
-	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-	0, 1, 0, 1, 1, 1, 0, 0, 1, 1, 1, 1, 1, 1, 1, 1,
-	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 1, 0, 1,
+static const uint8_t HREF_ESCAPE_TABLE[] = {
 	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
-	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 1,
-	0, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
-	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0,
-	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+	1, 0, 1, 0, 0, 0, 1, 1, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 0, 1, 0,
 	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 0,
+	1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1,
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
 };
 
 void
@@ -58,13 +77,13 @@ sd_escape_href(sd_buffer *ob, const uint8_t *data, size_t size)
 {
 	static const char hex_chars[] = "0123456789ABCDEF";
 	size_t  i = 0, mark;
-	char hex_str[3];
+	uint8_t *hex_str;
 
-	hex_str[0] = '%';
+	escape_scan_init();
 
 	while (i < size) {
 		mark = i;
-		while (i < size && HREF_SAFE[data[i]]) i++;
+		i = sd_scan_find(&href_scan, data, i, size);
 
 		/* Optimization for cases where there's nothing to escape */
 		if (mark == 0 && i >= size) {
@@ -106,9 +125,11 @@ sd_escape_href(sd_buffer *ob, const uint8_t *data, size_t size)
 
 		/* every other character goes with a %XX escaping */
 		default:
+			hex_str = sd_buffer_reserve(ob, 3);
+			hex_str[0] = '%';
 			hex_str[1] = hex_chars[(data[i] >> 4) & 0xF];
 			hex_str[2] = hex_chars[data[i] & 0xF];
-			sd_buffer_put(ob, (uint8_t *)hex_str, 3);
+			sd_buffer_commit(ob, 3);
 		}
 
 		i++;
@@ -127,7 +148,7 @@ sd_escape_href(sd_buffer *ob, const uint8_t *data, size_t size)
  * / --> &#x2F;     forward slash is included as it helps end an HTML entity
  *
  */
-static const uint8_t HTML_ESCAPE_TABLE[UINT8_MAX+1] = {
+static const uint8_t HTML_ESCAPE_TABLE[] = {
 	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
 	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
 	0, 0, 1, 0, 0, 0, 2, 3, 0, 0, 0, 0, 0, 0, 0, 4,
@@ -146,24 +167,78 @@ static const uint8_t HTML_ESCAPE_TABLE[UINT8_MAX+1] = {
 	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
 };
 
-static const char *HTML_ESCAPES[] = {
-        "",
-        "&quot;",
-        "&amp;",
-        "&#39;",
-        "&#47;",
-        "&lt;",
-        "&gt;"
+/* escape_scan_build • builds the search tables from the maps */
+static void
+escape_scan_build(void)
+{
+	sd_scan_init(&href_scan, HREF_ESCAPE_TABLE);
+	sd_scan_init(&html_scan, HTML_ESCAPE_TABLE);
+}
+
+#if !defined(UPSKIRT_NO_THREADS) && defined(_WIN32)
+static BOOL CALLBACK
+escape_scan_once(PINIT_ONCE once, PVOID param, PVOID *context)
+{
+	(void)once; (void)param; (void)context;
+	escape_scan_build();
+	return TRUE;
+}
+#endif
+
+/* escape_scan_init • builds the search tables on the first escape, so that
+ * the implementation for this CPU is selected once for all of them */
+static void
+escape_scan_init(void)
+{
+#if defined(UPSKIRT_NO_THREADS)
+	static int ready = 0;
+
+	if (!ready) {
+		escape_scan_build();
+		ready = 1;
+	}
+#elif defined(_WIN32)
+	static INIT_ONCE once = INIT_ONCE_STATIC_INIT;
+
+	InitOnceExecuteOnce(&once, escape_scan_once, NULL, NULL);
+#else
+	static pthread_once_t once = PTHREAD_ONCE_INIT;
+
+	pthread_once(&once, escape_scan_build);
+#endif
+}
+
+#define HTML_ESCAPE(str) { str, sizeof(str) - 1 }
+
+static const struct html_escape {
+	const char *str;
+	size_t size;
+} HTML_ESCAPES[] = {
+	HTML_ESCAPE(""),
+	HTML_ESCAPE("&quot;"),
+	HTML_ESCAPE("&amp;"),
+	HTML_ESCAPE("&#39;"),
+	HTML_ESCAPE("&#47;"),
+	HTML_ESCAPE("&lt;"),
+	HTML_ESCAPE("&gt;")
 };
 
 void
 sd_escape_html(sd_buffer *ob, const uint8_t *data, size_t size, int secure)
 {
-	size_t i = 0, mark;
+	const struct html_escape *escape;
+	size_t i = 0, mark = 0;
+
+	escape_scan_init();
 
 	while (1) {
-		mark = i;
-		while (i < size && HTML_ESCAPE_TABLE[data[i]] == 0) i++;
+		i = sd_scan_find(&html_scan, data, i, size);
+
+		/* The forward slash is only escaped in secure mode */
+		if (i < size && !secure && data[i] == '/') {
+			i++;
+			continue;
+		}
 
 		/* Optimization for cases where there's nothing to escape */
 		if (mark == 0 && i >= size) {
@@ -176,13 +251,9 @@ sd_escape_html(sd_buffer *ob, const uint8_t *data, size_t size, int secure)
 
 		if (i >= size) break;
 
-		/* The forward slash is only escaped in secure mode */
-		if (!secure && data[i] == '/') {
-			sd_buffer_putc(ob, '/');
-		} else {
-			sd_buffer_puts(ob, HTML_ESCAPES[HTML_ESCAPE_TABLE[data[i]]]);
-		}
+		escape = &HTML_ESCAPES[HTML_ESCAPE_TABLE[data[i]]];
+		sd_buffer_put(ob, (const uint8_t *)escape->str, escape->size);
 
-		i++;
+		mark = ++i;
 	}
 }
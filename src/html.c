@@ -287,7 +287,7 @@ rndr_blockcode(sd_buffer *ob, const sd_buffer *text, const sd_buffer *lang, cons
 			char * copy = malloc((text->size + 1)*sizeof(char));
 			memset(copy, 0, text->size+1);
 			memcpy(copy, text->data, text->size);
-			sd_buffer * b = sd_buffer_new(1);
+			sd_buffer * b = sd_buffer_new(64);
 			sd_buffer_printf(b, "gnuplot -e 'set term svg size 300,200;\n%s'", copy);
 
 			FILE *p = popen((char*)b->data, "r");
@@ -337,14 +337,26 @@ rndr_blockcode(sd_buffer *ob, const sd_buffer *text, const sd_buffer *lang, cons
 }
 
 static void
-rndr_blockquote(sd_buffer *ob, const sd_buffer *content, const sd_renderer_data *data)
+rndr_open_blockquote(sd_buffer *ob, const sd_renderer_data *data)
 {
 	if (ob->size) sd_buffer_putc(ob, '\n');
 	UPSKIRT_BUFPUTSL(ob, "<blockquote>\n");
-	if (content) sd_buffer_put(ob, content->data, content->size);
+}
+
+static void
+rndr_close_blockquote(sd_buffer *ob, const sd_renderer_data *data)
+{
 	UPSKIRT_BUFPUTSL(ob, "</blockquote>\n");
 }
 
+static void
+rndr_blockquote(sd_buffer *ob, const sd_buffer *content, const sd_renderer_data *data)
+{
+	rndr_open_blockquote(ob, data);
+	if (content) sd_buffer_put(ob, content->data, content->size);
+	rndr_close_blockquote(ob, data);
+}
+
 static int
 rndr_codespan(sd_buffer *ob, const sd_buffer *text, const sd_renderer_data *data)
 {
@@ -510,28 +522,50 @@ rndr_link(sd_buffer *ob, const sd_buffer *content, const sd_buffer *link, const
 }
 
 static void
-rndr_list(sd_buffer *ob, const sd_buffer *content, sd_list_flags flags, const sd_renderer_data *data)
+rndr_open_list(sd_buffer *ob, sd_list_flags flags, const sd_renderer_data *data)
 {
 	if (ob->size) sd_buffer_putc(ob, '\n');
 	sd_buffer_puts(ob, (flags & UPSKIRT_LIST_ORDERED ? "<ol dir=\"auto\">\n" : "<ul dir=\"auto\">\n"));
-	if (content) sd_buffer_put(ob, content->data, content->size);
+}
+
+static void
+rndr_close_list(sd_buffer *ob, sd_list_flags flags, const sd_renderer_data *data)
+{
 	sd_buffer_put(ob, (const uint8_t *)(flags & UPSKIRT_LIST_ORDERED ? "</ol>\n" : "</ul>\n"), 6);
 }
 
 static void
-rndr_listitem(sd_buffer *ob, const sd_buffer *content, sd_list_flags flags, const sd_renderer_data *data)
+rndr_list(sd_buffer *ob, const sd_buffer *content, sd_list_flags flags, const sd_renderer_data *data)
+{
+	rndr_open_list(ob, flags, data);
+	if (content) sd_buffer_put(ob, content->data, content->size);
+	rndr_close_list(ob, flags, data);
+}
+
+static void
+rndr_open_listitem(sd_buffer *ob, sd_list_flags flags, const sd_renderer_data *data)
 {
 	UPSKIRT_BUFPUTSL(ob, "<li>");
-	if (content) {
-		size_t size = content->size;
-		while (size && content->data[size - 1] == '\n')
-			size--;
+}
 
-		sd_buffer_put(ob, content->data, size);
-	}
+/* rndr_close_listitem • the trailing newlines of the content are dropped,
+ * the opening never ends with one */
+static void
+rndr_close_listitem(sd_buffer *ob, sd_list_flags flags, const sd_renderer_data *data)
+{
+	while (ob->size && ob->data[ob->size - 1] == '\n')
+		ob->size--;
 	UPSKIRT_BUFPUTSL(ob, "</li>\n");
 }
 
+static void
+rndr_listitem(sd_buffer *ob, const sd_buffer *content, sd_list_flags flags, const sd_renderer_data *data)
+{
+	rndr_open_listitem(ob, flags, data);
+	if (content) sd_buffer_put(ob, content->data, content->size);
+	rndr_close_listitem(ob, flags, data);
+}
+
 static void
 rndr_paragraph(sd_buffer *ob, const sd_buffer *content, const sd_renderer_data *data)
 {
@@ -773,10 +807,26 @@ rndr_superscript(sd_buffer *ob, const sd_buffer *content, const sd_renderer_data
 static void
 rndr_normal_text(sd_buffer *ob, const sd_buffer *content, const sd_renderer_data *data)
 {
-	if (content)
+	sd_html_renderer_state *state = data->opaque;
+
+	if (!content)
+		return;
+
+	if (state->flags & UPSKIRT_RENDER_SMARTYPANTS)
+		sd_html_smartypants_span(ob, &state->smartypants, content->data, content->size, 1);
+	else
 		escape_html(ob, content->data, content->size);
 }
 
+/* rndr_entity • copies the entity, smart quotes for &quot; and the like */
+static void
+rndr_entity(sd_buffer *ob, const sd_buffer *text, const sd_renderer_data *data)
+{
+	sd_html_renderer_state *state = data->opaque;
+
+	sd_html_smartypants_span(ob, &state->smartypants, text->data, text->size, 0);
+}
+
 static void
 rndr_footnotes(sd_buffer *ob, const sd_buffer *content, const sd_renderer_data *data)
 {
@@ -1281,9 +1331,23 @@ sd_html_toc_renderer_new(int nesting_level, localization local)
 	memcpy(renderer, &cb_default, sizeof(sd_renderer));
 
 	renderer->opaque = state;
+	renderer->opaque_size = sizeof(sd_html_renderer_state);
 	return renderer;
 }
 
+/* html_state_merge • adds the floats numbered between before and after */
+static void
+html_state_merge(void *opaque, const void *before, const void *after)
+{
+	sd_html_renderer_state *state = opaque;
+	const sd_html_renderer_state *b = before, *a = after;
+
+	state->counter.figure += a->counter.figure - b->counter.figure;
+	state->counter.equation += a->counter.equation - b->counter.equation;
+	state->counter.listing += a->counter.listing - b->counter.listing;
+	state->counter.table += a->counter.table - b->counter.table;
+}
+
 sd_renderer *
 sd_html_renderer_new(sd_render_flags render_flags, int nesting_level, localization local)
 {
@@ -1377,6 +1441,22 @@ sd_html_renderer_new(sd_render_flags render_flags, int nesting_level, localizati
 		renderer->blockhtml = NULL;
 
 	renderer->opaque = state;
+	renderer->opaque_size = sizeof(sd_html_renderer_state);
+	renderer->state_merge = html_state_merge;
+
+	/* a quote opens or closes depending on the ones before it, the pieces
+	 * of a parallel render using them cannot be merged */
+	if (render_flags & UPSKIRT_RENDER_SMARTYPANTS) {
+		renderer->entity = rndr_entity;
+		renderer->state_merge = NULL;
+	}
+
+	renderer->open_blockquote = rndr_open_blockquote;
+	renderer->close_blockquote = rndr_close_blockquote;
+	renderer->open_list = rndr_open_list;
+	renderer->close_list = rndr_close_list;
+	renderer->open_listitem = rndr_open_listitem;
+	renderer->close_listitem = rndr_close_listitem;
 	return renderer;
 }
 
@@ -15,6 +15,13 @@ extern "C" {
 
 
 
+/* sd_smartypants_data: quotes left open by the text given to SmartyPants */
+struct sd_smartypants_data {
+	int in_squote;
+	int in_dquote;
+	unsigned int quotes;	/* quotes looked at, the text depending on the ones before */
+};
+
 struct sd_html_renderer_state {
 	void *opaque;
 
@@ -28,6 +35,7 @@ struct sd_html_renderer_state {
 	sd_render_flags flags;
 	html_counter counter;
 	localization localization;
+	struct sd_smartypants_data smartypants;
 
 	/* extra callbacks */
 	void (*link_attributes)(sd_buffer *ob, const sd_buffer *url, const sd_renderer_data *data);
@@ -45,6 +53,11 @@ int parse_at_size(const uint8_t *data, int *out_w, int *out_h, const char *tag);
 /* sd_html_smartypants: process an HTML snippet using SmartyPants for smart punctuation */
 void sd_html_smartypants(sd_buffer *ob, const uint8_t *data, size_t size);
 
+/* sd_html_smartypants_span: like sd_html_smartypants, on one span of a longer
+ * text with the quotes left open before it in smrt; raw text not escaped yet
+ * (escape set) is escaped like sd_escape_html does and holds no tags */
+void sd_html_smartypants_span(sd_buffer *ob, struct sd_smartypants_data *smrt, const uint8_t *data, size_t size, int escape);
+
 /* sd_html_is_tag: checks if data starts with a specific tag, returns the tag type or NONE */
 sd_render_tag sd_html_is_tag(const uint8_t *data, size_t size, const char *tagname);
 
@@ -1,4 +1,5 @@
 #include "html.h"
+#include "escape.h"
 
 #include <string.h>
 #include <stdlib.h>
@@ -9,24 +10,21 @@
 #define snprintf _snprintf
 #endif
 
-struct smartypants_data {
-	int in_squote;
-	int in_dquote;
-};
-
-static size_t smartypants_cb__ltag(sd_buffer *ob, struct smartypants_data *smrt, uint8_t previous_char, const uint8_t *text, size_t size);
-static size_t smartypants_cb__dquote(sd_buffer *ob, struct smartypants_data *smrt, uint8_t previous_char, const uint8_t *text, size_t size);
-static size_t smartypants_cb__amp(sd_buffer *ob, struct smartypants_data *smrt, uint8_t previous_char, const uint8_t *text, size_t size);
-static size_t smartypants_cb__period(sd_buffer *ob, struct smartypants_data *smrt, uint8_t previous_char, const uint8_t *text, size_t size);
-static size_t smartypants_cb__number(sd_buffer *ob, struct smartypants_data *smrt, uint8_t previous_char, const uint8_t *text, size_t size);
-static size_t smartypants_cb__dash(sd_buffer *ob, struct smartypants_data *smrt, uint8_t previous_char, const uint8_t *text, size_t size);
-static size_t smartypants_cb__parens(sd_buffer *ob, struct smartypants_data *smrt, uint8_t previous_char, const uint8_t *text, size_t size);
-static size_t smartypants_cb__squote(sd_buffer *ob, struct smartypants_data *smrt, uint8_t previous_char, const uint8_t *text, size_t size);
-static size_t smartypants_cb__backtick(sd_buffer *ob, struct smartypants_data *smrt, uint8_t previous_char, const uint8_t *text, size_t size);
-static size_t smartypants_cb__escape(sd_buffer *ob, struct smartypants_data *smrt, uint8_t previous_char, const uint8_t *text, size_t size);
+static size_t smartypants_cb__ltag(sd_buffer *ob, struct sd_smartypants_data *smrt, uint8_t previous_char, const uint8_t *text, size_t size);
+static size_t smartypants_cb__dquote(sd_buffer *ob, struct sd_smartypants_data *smrt, uint8_t previous_char, const uint8_t *text, size_t size);
+static size_t smartypants_cb__amp(sd_buffer *ob, struct sd_smartypants_data *smrt, uint8_t previous_char, const uint8_t *text, size_t size);
+static size_t smartypants_cb__period(sd_buffer *ob, struct sd_smartypants_data *smrt, uint8_t previous_char, const uint8_t *text, size_t size);
+static size_t smartypants_cb__number(sd_buffer *ob, struct sd_smartypants_data *smrt, uint8_t previous_char, const uint8_t *text, size_t size);
+static size_t smartypants_cb__dash(sd_buffer *ob, struct sd_smartypants_data *smrt, uint8_t previous_char, const uint8_t *text, size_t size);
+static size_t smartypants_cb__parens(sd_buffer *ob, struct sd_smartypants_data *smrt, uint8_t previous_char, const uint8_t *text, size_t size);
+static size_t smartypants_cb__squote(sd_buffer *ob, struct sd_smartypants_data *smrt, uint8_t previous_char, const uint8_t *text, size_t size);
+static size_t smartypants_cb__backtick(sd_buffer *ob, struct sd_smartypants_data *smrt, uint8_t previous_char, const uint8_t *text, size_t size);
+static size_t smartypants_cb__escape(sd_buffer *ob, struct sd_smartypants_data *smrt, uint8_t previous_char, const uint8_t *text, size_t size);
+static size_t smartypants_cb__squote_text(sd_buffer *ob, struct sd_smartypants_data *smrt, uint8_t previous_char, const uint8_t *text, size_t size);
+static size_t smartypants_cb__html_char(sd_buffer *ob, struct sd_smartypants_data *smrt, uint8_t previous_char, const uint8_t *text, size_t size);
 
 static size_t (*smartypants_cb_ptrs[])
-	(sd_buffer *, struct smartypants_data *, uint8_t, const uint8_t *, size_t) =
+	(sd_buffer *, struct sd_smartypants_data *, uint8_t, const uint8_t *, size_t) =
 {
 	NULL,					/* 0 */
 	smartypants_cb__dash,	/* 1 */
@@ -39,6 +37,8 @@ static size_t (*smartypants_cb_ptrs[])
 	smartypants_cb__ltag,	/* 8 */
 	smartypants_cb__backtick, /* 9 */
 	smartypants_cb__escape, /* 10 */
+	smartypants_cb__squote_text, /* 11 */
+	smartypants_cb__html_char, /* 12 */
 };
 
 static const uint8_t smartypants_cb_chars[UINT8_MAX+1] = {
@@ -60,6 +60,26 @@ static const uint8_t smartypants_cb_chars[UINT8_MAX+1] = {
 	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
 };
 
+/* the same for raw text, where the markdown escapes and the tags are gone */
+static const uint8_t smartypants_text_chars[UINT8_MAX+1] = {
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 4, 0, 0, 0, 12, 11, 2, 0, 0, 0, 0, 1, 6, 0,
+	0, 7, 0, 7, 0, 0, 0, 0, 0, 0, 0, 0, 12, 0, 12, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	9, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+};
+
 static int
 word_boundary(uint8_t c)
 {
@@ -89,10 +109,12 @@ squote_len(const uint8_t *text, size_t size)
 
 /* Converts " or ' at very beginning or end of a word to left or right quote */
 static int
-smartypants_quotes(sd_buffer *ob, uint8_t previous_char, uint8_t next_char, uint8_t quote, int *is_open)
+smartypants_quotes(sd_buffer *ob, struct sd_smartypants_data *smrt, uint8_t previous_char, uint8_t next_char, uint8_t quote, int *is_open)
 {
 	char ent[8];
 
+	smrt->quotes++;
+
 	if (*is_open && !word_boundary(next_char))
 		return 0;
 
@@ -112,7 +134,7 @@ smartypants_quotes(sd_buffer *ob, uint8_t previous_char, uint8_t next_char, uint
 	'text' points at the last character of the single-quote, e.g. ' or ;
 */
 static size_t
-smartypants_squote(sd_buffer *ob, struct smartypants_data *smrt, uint8_t previous_char, const uint8_t *text, size_t size,
+smartypants_squote(sd_buffer *ob, struct sd_smartypants_data *smrt, uint8_t previous_char, const uint8_t *text, size_t size,
 				   const uint8_t *squote_text, size_t squote_size)
 {
 	if (size >= 2) {
@@ -122,7 +144,7 @@ smartypants_squote(sd_buffer *ob, struct smartypants_data *smrt, uint8_t previou
 		/* convert '' to &ldquo; or &rdquo; */
 		if (next_squote_len > 0) {
 			uint8_t next_char = (size > 1+next_squote_len) ? text[1+next_squote_len] : 0;
-			if (smartypants_quotes(ob, previous_char, next_char, 'd', &smrt->in_dquote))
+			if (smartypants_quotes(ob, smrt, previous_char, next_char, 'd', &smrt->in_dquote))
 				return next_squote_len;
 		}
 
@@ -147,7 +169,7 @@ smartypants_squote(sd_buffer *ob, struct smartypants_data *smrt, uint8_t previou
 		}
 	}
 
-	if (smartypants_quotes(ob, previous_char, size > 0 ? text[1] : 0, 's', &smrt->in_squote))
+	if (smartypants_quotes(ob, smrt, previous_char, size > 1 ? text[1] : 0, 's', &smrt->in_squote))
 		return 0;
 
 	sd_buffer_put(ob, squote_text, squote_size);
@@ -156,14 +178,29 @@ smartypants_squote(sd_buffer *ob, struct smartypants_data *smrt, uint8_t previou
 
 /* Converts ' to left or right single quote. */
 static size_t
-smartypants_cb__squote(sd_buffer *ob, struct smartypants_data *smrt, uint8_t previous_char, const uint8_t *text, size_t size)
+smartypants_cb__squote(sd_buffer *ob, struct sd_smartypants_data *smrt, uint8_t previous_char, const uint8_t *text, size_t size)
 {
 	return smartypants_squote(ob, smrt, previous_char, text, size, text, 1);
 }
 
+/* Converts ' in raw text, escaping it when left alone */
+static size_t
+smartypants_cb__squote_text(sd_buffer *ob, struct sd_smartypants_data *smrt, uint8_t previous_char, const uint8_t *text, size_t size)
+{
+	return smartypants_squote(ob, smrt, previous_char, text, size, (const uint8_t *)"&#39;", 5);
+}
+
+/* Escapes & < > of raw text */
+static size_t
+smartypants_cb__html_char(sd_buffer *ob, struct sd_smartypants_data *smrt, uint8_t previous_char, const uint8_t *text, size_t size)
+{
+	sd_escape_html(ob, text, 1, 0);
+	return 0;
+}
+
 /* Converts (c), (r), (tm) */
 static size_t
-smartypants_cb__parens(sd_buffer *ob, struct smartypants_data *smrt, uint8_t previous_char, const uint8_t *text, size_t size)
+smartypants_cb__parens(sd_buffer *ob, struct sd_smartypants_data *smrt, uint8_t previous_char, const uint8_t *text, size_t size)
 {
 	if (size >= 3) {
 		uint8_t t1 = tolower(text[1]);
@@ -191,7 +228,7 @@ smartypants_cb__parens(sd_buffer *ob, struct smartypants_data *smrt, uint8_t pre
 
 /* Converts "--" to em-dash, etc. */
 static size_t
-smartypants_cb__dash(sd_buffer *ob, struct smartypants_data *smrt, uint8_t previous_char, const uint8_t *text, size_t size)
+smartypants_cb__dash(sd_buffer *ob, struct sd_smartypants_data *smrt, uint8_t previous_char, const uint8_t *text, size_t size)
 {
 	if (size >= 3 && text[1] == '-' && text[2] == '-') {
 		UPSKIRT_BUFPUTSL(ob, "&mdash;");
@@ -209,11 +246,11 @@ smartypants_cb__dash(sd_buffer *ob, struct smartypants_data *smrt, uint8_t previ
 
 /* Converts &quot; etc. */
 static size_t
-smartypants_cb__amp(sd_buffer *ob, struct smartypants_data *smrt, uint8_t previous_char, const uint8_t *text, size_t size)
+smartypants_cb__amp(sd_buffer *ob, struct sd_smartypants_data *smrt, uint8_t previous_char, const uint8_t *text, size_t size)
 {
 	size_t len;
 	if (size >= 6 && memcmp(text, "&quot;", 6) == 0) {
-		if (smartypants_quotes(ob, previous_char, size >= 7 ? text[6] : 0, 'd', &smrt->in_dquote))
+		if (smartypants_quotes(ob, smrt, previous_char, size >= 7 ? text[6] : 0, 'd', &smrt->in_dquote))
 			return 5;
 	}
 
@@ -231,7 +268,7 @@ smartypants_cb__amp(sd_buffer *ob, struct smartypants_data *smrt, uint8_t previo
 
 /* Converts "..." to ellipsis */
 static size_t
-smartypants_cb__period(sd_buffer *ob, struct smartypants_data *smrt, uint8_t previous_char, const uint8_t *text, size_t size)
+smartypants_cb__period(sd_buffer *ob, struct sd_smartypants_data *smrt, uint8_t previous_char, const uint8_t *text, size_t size)
 {
 	if (size >= 3 && text[1] == '.' && text[2] == '.') {
 		UPSKIRT_BUFPUTSL(ob, "&hellip;");
@@ -249,10 +286,10 @@ smartypants_cb__period(sd_buffer *ob, struct smartypants_data *smrt, uint8_t pre
 
 /* Converts `` to opening double quote */
 static size_t
-smartypants_cb__backtick(sd_buffer *ob, struct smartypants_data *smrt, uint8_t previous_char, const uint8_t *text, size_t size)
+smartypants_cb__backtick(sd_buffer *ob, struct sd_smartypants_data *smrt, uint8_t previous_char, const uint8_t *text, size_t size)
 {
 	if (size >= 2 && text[1] == '`') {
-		if (smartypants_quotes(ob, previous_char, size >= 3 ? text[2] : 0, 'd', &smrt->in_dquote))
+		if (smartypants_quotes(ob, smrt, previous_char, size >= 3 ? text[2] : 0, 'd', &smrt->in_dquote))
 			return 1;
 	}
 
@@ -262,7 +299,7 @@ smartypants_cb__backtick(sd_buffer *ob, struct smartypants_data *smrt, uint8_t p
 
 /* Converts 1/2, 1/4, 3/4 */
 static size_t
-smartypants_cb__number(sd_buffer *ob, struct smartypants_data *smrt, uint8_t previous_char, const uint8_t *text, size_t size)
+smartypants_cb__number(sd_buffer *ob, struct sd_smartypants_data *smrt, uint8_t previous_char, const uint8_t *text, size_t size)
 {
 	if (word_boundary(previous_char) && size >= 3) {
 		if (text[0] == '1' && text[1] == '/' && text[2] == '2') {
@@ -295,16 +332,16 @@ smartypants_cb__number(sd_buffer *ob, struct smartypants_data *smrt, uint8_t pre
 
 /* Converts " to left or right double quote */
 static size_t
-smartypants_cb__dquote(sd_buffer *ob, struct smartypants_data *smrt, uint8_t previous_char, const uint8_t *text, size_t size)
+smartypants_cb__dquote(sd_buffer *ob, struct sd_smartypants_data *smrt, uint8_t previous_char, const uint8_t *text, size_t size)
 {
-	if (!smartypants_quotes(ob, previous_char, size > 0 ? text[1] : 0, 'd', &smrt->in_dquote))
+	if (!smartypants_quotes(ob, smrt, previous_char, size > 1 ? text[1] : 0, 'd', &smrt->in_dquote))
 		UPSKIRT_BUFPUTSL(ob, "&quot;");
 
 	return 0;
 }
 
 static size_t
-smartypants_cb__ltag(sd_buffer *ob, struct smartypants_data *smrt, uint8_t previous_char, const uint8_t *text, size_t size)
+smartypants_cb__ltag(sd_buffer *ob, struct sd_smartypants_data *smrt, uint8_t previous_char, const uint8_t *text, size_t size)
 {
 	static const char *skip_tags[] = {
 	  "pre", "code", "var", "samp", "kbd", "math", "script", "style"
@@ -354,7 +391,7 @@ smartypants_cb__ltag(sd_buffer *ob, struct smartypants_data *smrt, uint8_t previ
 }
 
 static size_t
-smartypants_cb__escape(sd_buffer *ob, struct smartypants_data *smrt, uint8_t previous_char, const uint8_t *text, size_t size)
+smartypants_cb__escape(sd_buffer *ob, struct sd_smartypants_data *smrt, uint8_t previous_char, const uint8_t *text, size_t size)
 {
 	if (size < 2)
 		return 0;
@@ -406,30 +443,59 @@ static struct {
 #endif
 
 void
-sd_html_smartypants(sd_buffer *ob, const uint8_t *text, size_t size)
+sd_html_smartypants_span(sd_buffer *ob, struct sd_smartypants_data *smrt, const uint8_t *text, size_t size, int escape)
 {
+	const uint8_t *chars = escape ? smartypants_text_chars : smartypants_cb_chars;
 	size_t i;
-	struct smartypants_data smrt = {0, 0};
 
 	if (!text)
 		return;
 
-	sd_buffer_grow(ob, size);
+	sd_buffer_grow(ob, ob->size + size);
+	i = 0;
 
-	for (i = 0; i < size; ++i) {
+	/* a code span left open splits `` over two spans of text */
+	if (escape && size && text[0] == '`' && ob->size && ob->data[ob->size - 1] == '`') {
+		ob->size--;
+		if (!smartypants_quotes(ob, smrt, ob->size ? ob->data[ob->size - 1] : 0,
+				size > 1 ? text[1] : 0, 'd', &smrt->in_dquote))
+			UPSKIRT_BUFPUTSL(ob, "``");
+		i = 1;
+	}
+
+	for (; i < size; ++i) {
 		size_t org;
 		uint8_t action = 0;
+		uint8_t previous_char;
 
 		org = i;
-		while (i < size && (action = smartypants_cb_chars[text[i]]) == 0)
+		while (i < size && (action = chars[text[i]]) == 0)
 			i++;
 
-		if (i > org)
-			sd_buffer_put(ob, text + org, i - org);
+		if (i > org) {
+			if (escape)
+				sd_escape_html(ob, text + org, i - org, 0);
+			else
+				sd_buffer_put(ob, text + org, i - org);
+		}
 
 		if (i < size) {
+			/* the span follows what is already in ob */
+			if (i)
+				previous_char = text[i - 1];
+			else
+				previous_char = ob->size ? ob->data[ob->size - 1] : 0;
+
 			i += smartypants_cb_ptrs[(int)action]
-				(ob, &smrt, i ? text[i - 1] : 0, text + i, size - i);
+				(ob, smrt, previous_char, text + i, size - i);
 		}
 	}
 }
+
+void
+sd_html_smartypants(sd_buffer *ob, const uint8_t *text, size_t size)
+{
+	struct sd_smartypants_data smrt = {0, 0, 0};
+
+	sd_html_smartypants_span(ob, &smrt, text, size, 0);
+}
@@ -0,0 +1,132 @@
+#include "input.h"
+
+#include <string.h>
+#include <assert.h>
+
+#if !defined(_WIN32)
+#define UPSKIRT_HAVE_MMAP
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#define INPUT_UNIT 4096
+
+static void
+input_init(sd_input *input)
+{
+	input->data = NULL;
+	input->size = 0;
+	input->map = NULL;
+	input->map_size = 0;
+	input->buf = NULL;
+}
+
+#ifdef UPSKIRT_HAVE_MMAP
+/* input_map • maps a regular file read from its beginning; returns 0 when
+ * the descriptor is anything else, so that it gets read instead */
+static int
+input_map(sd_input *input, int fd)
+{
+	struct stat st;
+	void *map;
+
+	if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size <= 0)
+		return 0;
+
+	/* only whole files: the stream may already have been read from */
+	if (lseek(fd, 0, SEEK_CUR) != 0)
+		return 0;
+
+	map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED)
+		return 0;
+
+#ifdef MADV_SEQUENTIAL
+	madvise(map, (size_t)st.st_size, MADV_SEQUENTIAL);
+#endif
+
+	input->map = map;
+	input->map_size = (size_t)st.st_size;
+	input->data = map;
+	input->size = input->map_size;
+
+	return 1;
+}
+#endif
+
+/* input_buffer • reads a stream until EOF, straight into the buffer */
+static int
+input_buffer(sd_input *input, FILE *file, size_t unit)
+{
+	sd_buffer *buf = sd_buffer_new(unit ? unit : INPUT_UNIT);
+
+	while (!(feof(file) || ferror(file))) {
+		uint8_t *dest = sd_buffer_reserve(buf, buf->unit);
+		sd_buffer_commit(buf, fread(dest, 1, buf->asize - buf->size, file));
+	}
+
+	input->buf = buf;
+	input->data = buf->data ? buf->data : (const uint8_t *)"";
+	input->size = buf->size;
+
+	return ferror(file);
+}
+
+int
+sd_input_load(sd_input *input, const char *path)
+{
+	FILE *file;
+	int ret;
+
+	assert(input && path);
+
+	input_init(input);
+
+	file = fopen(path, "rb");
+	if (!file)
+		return -1;
+
+#ifdef UPSKIRT_HAVE_MMAP
+	if (input_map(input, fileno(file))) {
+		fclose(file);
+		return 0;
+	}
+#endif
+
+	ret = input_buffer(input, file, INPUT_UNIT);
+	fclose(file);
+
+	return ret;
+}
+
+int
+sd_input_read(sd_input *input, FILE *file, size_t unit)
+{
+	assert(input && file);
+
+	input_init(input);
+
+#ifdef UPSKIRT_HAVE_MMAP
+	if (input_map(input, fileno(file)))
+		return 0;
+#endif
+
+	return input_buffer(input, file, unit);
+}
+
+void
+sd_input_release(sd_input *input)
+{
+	if (!input)
+		return;
+
+#ifdef UPSKIRT_HAVE_MMAP
+	if (input->map)
+		munmap(input->map, input->map_size);
+#endif
+
+	sd_buffer_free(input->buf);
+	input_init(input);
+}
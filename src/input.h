@@ -0,0 +1,50 @@
+/* input.h - loading of input files */
+
+#ifndef UPSKIRT_INPUT_H
+#define UPSKIRT_INPUT_H
+
+#include "buffer.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+/*********
+ * TYPES *
+ *********/
+
+/* sd_input: read-only contents of an input file; regular files are
+ * mapped in memory, anything else is read into a buffer */
+struct sd_input {
+	const uint8_t *data;	/* contents, not NUL-terminated */
+	size_t size;		/* size of the contents */
+
+	void *map;		/* mapping of the file, or NULL */
+	size_t map_size;
+	sd_buffer *buf;		/* buffered contents, or NULL */
+};
+
+typedef struct sd_input sd_input;
+
+
+/*************
+ * FUNCTIONS *
+ *************/
+
+/* sd_input_load: load the file at the given path; returns 0 on success */
+int sd_input_load(sd_input *input, const char *path);
+
+/* sd_input_read: load an open stream until EOF, reading unit bytes at a
+ * time when it cannot be mapped; returns 0 on success */
+int sd_input_read(sd_input *input, FILE *file, size_t unit);
+
+/* sd_input_release: unmap or free the contents of the input */
+void sd_input_release(sd_input *input);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /** UPSKIRT_INPUT_H **/
@@ -132,14 +132,26 @@ rndr_blockcode(sd_buffer *ob, const sd_buffer *text, const sd_buffer *lang, cons
 }
 
 static void
-rndr_blockquote(sd_buffer *ob, const sd_buffer *content, const sd_renderer_data *data)
+rndr_open_blockquote(sd_buffer *ob, const sd_renderer_data *data)
 {
 	if (ob->size) sd_buffer_putc(ob, '\n');
 	UPSKIRT_BUFPUTSL(ob, "\\begin{quote}\n");
-	if (content) sd_buffer_put(ob, content->data, content->size);
+}
+
+static void
+rndr_close_blockquote(sd_buffer *ob, const sd_renderer_data *data)
+{
 	UPSKIRT_BUFPUTSL(ob, "\\end{quote}\n");
 }
 
+static void
+rndr_blockquote(sd_buffer *ob, const sd_buffer *content, const sd_renderer_data *data)
+{
+	rndr_open_blockquote(ob, data);
+	if (content) sd_buffer_put(ob, content->data, content->size);
+	rndr_close_blockquote(ob, data);
+}
+
 static int
 rndr_codespan(sd_buffer *ob, const sd_buffer *text, const sd_renderer_data *data)
 {
@@ -306,25 +318,47 @@ rndr_link(sd_buffer *ob, const sd_buffer *content, const sd_buffer *link, const
 }
 
 static void
-rndr_list(sd_buffer *ob, const sd_buffer *content, sd_list_flags flags, const sd_renderer_data *data)
+rndr_open_list(sd_buffer *ob, sd_list_flags flags, const sd_renderer_data *data)
 {
 	if (ob->size) sd_buffer_putc(ob, '\n');
 	sd_buffer_puts(ob, (flags & UPSKIRT_LIST_ORDERED ? "\\begin{enumerate}" : "\\begin{itemize}"));
-	if (content) sd_buffer_put(ob, content->data, content->size);
+}
+
+static void
+rndr_close_list(sd_buffer *ob, sd_list_flags flags, const sd_renderer_data *data)
+{
 	sd_buffer_puts(ob, (flags & UPSKIRT_LIST_ORDERED ? "\\end{enumerate}\n" : "\\end{itemize}\n"));
 }
 
 static void
-rndr_listitem(sd_buffer *ob, const sd_buffer *content, sd_list_flags flags, const sd_renderer_data *data)
+rndr_list(sd_buffer *ob, const sd_buffer *content, sd_list_flags flags, const sd_renderer_data *data)
+{
+	rndr_open_list(ob, flags, data);
+	if (content) sd_buffer_put(ob, content->data, content->size);
+	rndr_close_list(ob, flags, data);
+}
+
+static void
+rndr_open_listitem(sd_buffer *ob, sd_list_flags flags, const sd_renderer_data *data)
 {
 	UPSKIRT_BUFPUTSL(ob, "\n\\item ");
-	if (content) {
-		size_t size = content->size;
-		while (size && content->data[size - 1] == '\n')
-			size--;
+}
 
-		sd_buffer_put(ob, content->data, size);
-	}
+/* rndr_close_listitem • the trailing newlines of the content are dropped,
+ * the opening never ends with one */
+static void
+rndr_close_listitem(sd_buffer *ob, sd_list_flags flags, const sd_renderer_data *data)
+{
+	while (ob->size && ob->data[ob->size - 1] == '\n')
+		ob->size--;
+}
+
+static void
+rndr_listitem(sd_buffer *ob, const sd_buffer *content, sd_list_flags flags, const sd_renderer_data *data)
+{
+	rndr_open_listitem(ob, flags, data);
+	if (content) sd_buffer_put(ob, content->data, content->size);
+	rndr_close_listitem(ob, flags, data);
 }
 
 static void
@@ -894,6 +928,14 @@ sd_latex_renderer_new(sd_render_flags render_flags, int nesting_level, localizat
 	memcpy(renderer, &cb_default, sizeof(sd_renderer));
 
 	renderer->opaque = state;
+	renderer->opaque_size = sizeof(sd_latex_renderer_state);
+
+	renderer->open_blockquote = rndr_open_blockquote;
+	renderer->close_blockquote = rndr_close_blockquote;
+	renderer->open_list = rndr_open_list;
+	renderer->close_list = rndr_close_list;
+	renderer->open_listitem = rndr_open_listitem;
+	renderer->close_listitem = rndr_close_listitem;
 	return renderer;
 }
 
@@ -0,0 +1,215 @@
+#include "scan.h"
+
+#include <string.h>
+#include <assert.h>
+
+/* the vector versions need pshufb (SSSE3) or its 256-bit form (AVX2); they
+ * are compiled for their own target and selected at run time, so the rest
+ * of the library keeps the default instruction set.
+ * Define UPSKIRT_NO_SIMD to build the portable version only. */
+#if !defined(UPSKIRT_NO_SIMD) && defined(__GNUC__) && \
+	(defined(__x86_64__) || defined(__i386__))
+#define UPSKIRT_SCAN_X86
+#include <immintrin.h>
+#endif
+
+static size_t
+scan_find_scalar(const sd_scan_table *table, const uint8_t *data, size_t start, size_t size)
+{
+	size_t i = start;
+
+	while (i < size && table->map[data[i]] == 0)
+		i++;
+
+	return i;
+}
+
+#ifdef UPSKIRT_SCAN_X86
+
+/* the class is matched 16 or 32 bytes at a time by looking both nibbles of
+ * every byte up in a 16-entry table: a byte is a candidate when the group
+ * bits of its low and high nibbles intersect */
+
+__attribute__((target("ssse3")))
+static size_t
+scan_find_ssse3(const sd_scan_table *table, const uint8_t *data, size_t start, size_t size)
+{
+	const __m128i lo = _mm_loadu_si128((const __m128i *)table->lo_nibble);
+	const __m128i hi = _mm_loadu_si128((const __m128i *)table->hi_nibble);
+	const __m128i low4 = _mm_set1_epi8(0x0F);
+	const __m128i zero = _mm_setzero_si128();
+	size_t i = start;
+
+	while (i + 16 <= size) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(data + i));
+		__m128i m = _mm_and_si128(
+			_mm_shuffle_epi8(lo, _mm_and_si128(v, low4)),
+			_mm_shuffle_epi8(hi, _mm_and_si128(_mm_srli_epi16(v, 4), low4)));
+		unsigned int bits = ~(unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(m, zero)) & 0xFFFF;
+
+		while (bits) {
+			size_t pos = i + __builtin_ctz(bits);
+			if (table->map[data[pos]])
+				return pos;
+			bits &= bits - 1;
+		}
+
+		i += 16;
+	}
+
+	return scan_find_scalar(table, data, i, size);
+}
+
+__attribute__((target("avx2")))
+static size_t
+scan_find_avx2(const sd_scan_table *table, const uint8_t *data, size_t start, size_t size)
+{
+	const __m256i lo = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)table->lo_nibble));
+	const __m256i hi = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)table->hi_nibble));
+	const __m256i low4 = _mm256_set1_epi8(0x0F);
+	const __m256i zero = _mm256_setzero_si256();
+	size_t i = start;
+
+	while (i + 32 <= size) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(data + i));
+		__m256i m = _mm256_and_si256(
+			_mm256_shuffle_epi8(lo, _mm256_and_si256(v, low4)),
+			_mm256_shuffle_epi8(hi, _mm256_and_si256(_mm256_srli_epi16(v, 4), low4)));
+		unsigned int bits = ~(unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(m, zero));
+
+		while (bits) {
+			size_t pos = i + __builtin_ctz(bits);
+			if (table->map[data[pos]])
+				return pos;
+			bits &= bits - 1;
+		}
+
+		i += 32;
+	}
+
+	return scan_find_ssse3(table, data, i, size);
+}
+
+#endif
+
+/* scan_select • the fastest implementation this CPU runs */
+static sd_scan_callback
+scan_select(void)
+{
+#ifdef UPSKIRT_SCAN_X86
+	if (__builtin_cpu_supports("avx2"))
+		return &scan_find_avx2;
+	if (__builtin_cpu_supports("ssse3"))
+		return &scan_find_ssse3;
+#endif
+	return &scan_find_scalar;
+}
+
+static int
+popcount16(unsigned int v)
+{
+	int n = 0;
+
+	while (v) {
+		v &= v - 1;
+		n++;
+	}
+
+	return n;
+}
+
+/* build_nibbles • assigns one bit to every distinct set of low nibbles
+ * sharing a high nibble; past 8 sets the closest ones are merged, which
+ * only lets more candidates through */
+static void
+build_nibbles(sd_scan_table *table)
+{
+	unsigned int groups[16];
+	int group_of[16];
+	int ngroups = 0;
+	int h, l, g;
+
+	memset(table->lo_nibble, 0x0, sizeof(table->lo_nibble));
+	memset(table->hi_nibble, 0x0, sizeof(table->hi_nibble));
+
+	for (h = 0; h < 16; ++h) {
+		unsigned int set = 0;
+
+		for (l = 0; l < 16; ++l)
+			if (table->map[(h << 4) | l])
+				set |= 1u << l;
+
+		group_of[h] = -1;
+		if (!set)
+			continue;
+
+		for (g = 0; g < ngroups && groups[g] != set; ++g);
+		if (g == ngroups)
+			groups[ngroups++] = set;
+		group_of[h] = g;
+	}
+
+	while (ngroups > 8) {
+		int a = 0, b = 1, best = 17;
+		int i, j;
+
+		for (i = 0; i < ngroups; ++i)
+			for (j = i + 1; j < ngroups; ++j) {
+				int cost = popcount16(groups[i] | groups[j]);
+				if (cost < best) {
+					best = cost;
+					a = i;
+					b = j;
+				}
+			}
+
+		groups[a] |= groups[b];
+		groups[b] = groups[--ngroups];
+
+		for (h = 0; h < 16; ++h) {
+			if (group_of[h] == b)
+				group_of[h] = a;
+			else if (group_of[h] == ngroups)
+				group_of[h] = b;
+		}
+	}
+
+	for (h = 0; h < 16; ++h)
+		if (group_of[h] >= 0)
+			table->hi_nibble[h] = (uint8_t)(1u << group_of[h]);
+
+	for (g = 0; g < ngroups; ++g)
+		for (l = 0; l < 16; ++l)
+			if (groups[g] & (1u << l))
+				table->lo_nibble[l] |= (uint8_t)(1u << g);
+}
+
+void
+sd_scan_init(sd_scan_table *table, const uint8_t *map)
+{
+	size_t i;
+
+	assert(table && map);
+
+	for (i = 0; i < 256; ++i)
+		table->map[i] = map[i] ? 1 : 0;
+
+	build_nibbles(table);
+
+#ifdef UPSKIRT_SCAN_X86
+	__builtin_cpu_init();
+#endif
+	table->find = scan_select();
+}
+
+size_t
+sd_scan_find(const sd_scan_table *table, const uint8_t *data, size_t start, size_t size)
+{
+	assert(table && table->find);
+
+	/* runs of normal text are often a single char long */
+	if (start >= size || table->map[data[start]])
+		return start;
+
+	return table->find(table, data, start, size);
+}
@@ -0,0 +1,54 @@
+/* scan.h - fast search for classes of bytes */
+
+#ifndef UPSKIRT_SCAN_H
+#define UPSKIRT_SCAN_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+/*********
+ * TYPES *
+ *********/
+
+struct sd_scan_table;
+
+/* sd_scan_callback: returns the index of the first byte of the class at or
+ * after `start`, or `size` when there is none */
+typedef size_t
+(*sd_scan_callback)(const struct sd_scan_table *table, const uint8_t *data, size_t start, size_t size);
+
+/* sd_scan_table: a class of bytes, with the nibble masks used by the vector
+ * implementations; the masks may describe a superset of the class, every
+ * candidate they find is confirmed against `map`. Tables are built by
+ * sd_scan_init, once, and searched as often as needed */
+struct sd_scan_table {
+	uint8_t map[256];	/* non-zero for the bytes of the class */
+	uint8_t lo_nibble[16];	/* group bits for the low nibble */
+	uint8_t hi_nibble[16];	/* group bits for the high nibble */
+	sd_scan_callback find;	/* implementation selected for this CPU */
+};
+
+typedef struct sd_scan_table sd_scan_table;
+
+
+/*************
+ * FUNCTIONS *
+ *************/
+
+/* sd_scan_init: build the table for the bytes whose `map` entry is non-zero */
+void sd_scan_init(sd_scan_table *table, const uint8_t *map);
+
+/* sd_scan_find: index of the first byte of the class in data[start..size), or size */
+size_t sd_scan_find(const sd_scan_table *table, const uint8_t *data, size_t start, size_t size);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /** UPSKIRT_SCAN_H **/
@@ -0,0 +1,1272 @@
+#include "tree.h"
+
+#include <string.h>
+#include <stdlib.h>
+#include <assert.h>
+
+/* The recording renderer writes to the output the text of the content, every
+ * TREE_MARK doubled and every backslash as TREE_MARK, TREE_BACKSLASH, so that
+ * the parser cleaning a caption of its escapes leaves the text alone, and one
+ * record for each call:
+ *	TREE_MARK, the index of the node, TREE_MARK
+ * for the calls recorded as a node straight away, and
+ *	TREE_MARK, TREE_CALL, the type, a pointer, a value, TREE_MARK
+ * for the calls made without the renderer data, which become a node once the
+ * content holding them is read. Numbers are written 6 bits a byte, each
+ * between 0x80 and 0xBF, so that nothing else can be mistaken for them */
+#define TREE_MARK 0xFF
+#define TREE_CALL 0xC0
+#define TREE_BACKSLASH 0xC1
+
+#define REF_SIZE 7		/* mark, 5 bytes of index, mark */
+#define CALL_SIZE 22		/* mark, call, 2 bytes of type, 11 of pointer, 6 of value, mark */
+
+#define TREE_NODE(rec, index) ((sd_node *)(rec)->nodes->data + (index))
+
+/* tree_recorder: state of the recording renderer */
+struct tree_recorder {
+	sd_buffer *nodes;	/* nodes of the tree being recorded */
+	sd_buffer *text;	/* strings of the tree being recorded */
+	sd_buffer *linked;	/* one byte per node, set once it is in a content */
+	size_t start;		/* size of the output when the tree was started */
+	sd_tree *tree;		/* last tree recorded, until it is taken */
+};
+
+
+/*******************
+ * RECORD ENCODING *
+ *******************/
+
+static uint8_t *
+put_bits(uint8_t *p, uint64_t value, int bytes)
+{
+	int i;
+
+	for (i = 0; i < bytes; i++)
+		*p++ = 0x80 | ((value >> (6 * i)) & 0x3F);
+	return p;
+}
+
+static int
+get_bits(const uint8_t *p, int bytes, uint64_t *value)
+{
+	int i;
+
+	*value = 0;
+	for (i = 0; i < bytes; i++) {
+		if ((p[i] & 0xC0) != 0x80)
+			return 0;
+		*value |= (uint64_t)(p[i] & 0x3F) << (6 * i);
+	}
+	return 1;
+}
+
+/* put_ref • writes the record of a node to the output */
+static void
+put_ref(sd_buffer *ob, uint32_t index)
+{
+	uint8_t rec[REF_SIZE];
+
+	rec[0] = rec[REF_SIZE - 1] = TREE_MARK;
+	put_bits(rec + 1, index, 5);
+	sd_buffer_put(ob, rec, REF_SIZE);
+}
+
+/* put_call • writes the record of a call made without the renderer data */
+static void
+put_call(sd_buffer *ob, sd_node_type type, const void *ptr, int value)
+{
+	uint8_t rec[CALL_SIZE], *p;
+
+	rec[0] = rec[CALL_SIZE - 1] = TREE_MARK;
+	rec[1] = TREE_CALL;
+	p = put_bits(rec + 2, type, 2);
+	p = put_bits(p, (uint64_t)(uintptr_t)ptr, 11);
+	put_bits(p, (uint32_t)value, 6);
+	sd_buffer_put(ob, rec, CALL_SIZE);
+}
+
+/* put_text • writes text to the output, escaping the marks and backslashes */
+static void
+put_text(sd_buffer *ob, const uint8_t *data, size_t size)
+{
+	size_t i = 0, org;
+
+	while (i < size) {
+		org = i;
+		while (i < size && data[i] != TREE_MARK && data[i] != '\\')
+			i++;
+		sd_buffer_put(ob, data + org, i - org);
+
+		if (i < size) {
+			sd_buffer_putc(ob, TREE_MARK);
+			sd_buffer_putc(ob, data[i] == TREE_MARK ? TREE_MARK : TREE_BACKSLASH);
+			i++;
+		}
+	}
+}
+
+
+/*****************
+ * TREE BUILDING *
+ *****************/
+
+static uint32_t
+tree_node(struct tree_recorder *rec, sd_node_type type)
+{
+	uint32_t index = (uint32_t)(rec->nodes->size / sizeof(sd_node));
+	sd_node *node;
+
+	sd_buffer_grow(rec->nodes, rec->nodes->size + sizeof(sd_node));
+	node = TREE_NODE(rec, index);
+	memset(node, 0x0, sizeof(sd_node));
+	node->type = type;
+	rec->nodes->size += sizeof(sd_node);
+	sd_buffer_putc(rec->linked, 0);
+
+	return index;
+}
+
+/* tree_string • copies a string to the text of the tree */
+static sd_span
+tree_string(struct tree_recorder *rec, const uint8_t *data, size_t size)
+{
+	sd_span span;
+
+	span.offset = (uint32_t)rec->text->size;
+	span.size = (uint32_t)size + 1;
+	sd_buffer_put(rec->text, data, size);
+	sd_buffer_putc(rec->text, 0);
+	return span;
+}
+
+static sd_span
+tree_buffer(struct tree_recorder *rec, const sd_buffer *buf)
+{
+	sd_span none = { 0, 0 };
+
+	return buf ? tree_string(rec, buf->data, buf->size) : none;
+}
+
+static sd_span
+tree_cstr(struct tree_recorder *rec, const char *str)
+{
+	sd_span none = { 0, 0 };
+
+	return str ? tree_string(rec, (const uint8_t *)str, strlen(str)) : none;
+}
+
+static uint32_t
+tree_text_node(struct tree_recorder *rec, const char *str)
+{
+	uint32_t index = tree_node(rec, UPSKIRT_NODE_TEXT);
+
+	TREE_NODE(rec, index)->text[0] = tree_cstr(rec, str);
+	return index;
+}
+
+/* tree_text_run • the node of the text copied since run */
+static uint32_t
+tree_text_run(struct tree_recorder *rec, size_t run)
+{
+	uint32_t index = tree_node(rec, UPSKIRT_NODE_TEXT);
+
+	sd_buffer_putc(rec->text, 0);
+	TREE_NODE(rec, index)->text[0].offset = (uint32_t)run;
+	TREE_NODE(rec, index)->text[0].size = (uint32_t)(rec->text->size - run);
+	return index;
+}
+
+/* tree_copy • a copy of the node at index and of all of its content */
+static uint32_t
+tree_copy(struct tree_recorder *rec, uint32_t index)
+{
+	uint32_t copy = tree_node(rec, UPSKIRT_NODE_ROOT);
+	uint32_t child, item, last = 0;
+
+	*TREE_NODE(rec, copy) = *TREE_NODE(rec, index);
+	TREE_NODE(rec, copy)->child = 0;
+	TREE_NODE(rec, copy)->next = 0;
+
+	for (child = TREE_NODE(rec, index)->child; child; child = TREE_NODE(rec, child)->next) {
+		item = tree_copy(rec, child);
+		rec->linked->data[item] = 1;
+
+		if (last)
+			TREE_NODE(rec, last)->next = item;
+		else
+			TREE_NODE(rec, copy)->child = item;
+		last = item;
+	}
+
+	return copy;
+}
+
+/* tree_link • appends a node to a content; a node already in another one,
+ * like the caption given to both ends of a float, is appended as a copy so
+ * that every node is in one content only */
+static void
+tree_link(struct tree_recorder *rec, uint32_t *first, uint32_t *last, uint32_t index)
+{
+	if (rec->linked->data[index])
+		index = tree_copy(rec, index);
+
+	rec->linked->data[index] = 1;
+	if (*last)
+		TREE_NODE(rec, *last)->next = index;
+	else
+		*first = index;
+	*last = index;
+}
+
+/* tree_call • the node of a call made without the renderer data */
+static uint32_t
+tree_call(struct tree_recorder *rec, const sd_renderer_data *data, sd_node_type type, const void *ptr, int value)
+{
+	metadata *meta = data->meta;
+	uint32_t index, first = 0, last = 0;
+	const toc *entry;
+	Strings *author;
+
+	switch (type) {
+	case UPSKIRT_NODE_HEAD:
+		if (meta) {
+			tree_link(rec, &first, &last, tree_text_node(rec, meta->title));
+			tree_link(rec, &first, &last, tree_text_node(rec, meta->keywords));
+			tree_link(rec, &first, &last, tree_text_node(rec, meta->style));
+			tree_link(rec, &first, &last, tree_text_node(rec, meta->affiliation));
+			for (author = meta->authors; author; author = author->next)
+				tree_link(rec, &first, &last, tree_text_node(rec, author->str));
+		}
+		index = tree_node(rec, type);
+		if (meta) {
+			TREE_NODE(rec, index)->value[0] = meta->paper_size;
+			TREE_NODE(rec, index)->value[1] = meta->doc_class;
+			TREE_NODE(rec, index)->value[2] = meta->font_size;
+			TREE_NODE(rec, index)->value[3] = meta->numbering;
+		}
+		break;
+
+	/* the content of these is the metadata */
+	case UPSKIRT_NODE_TITLE:
+	case UPSKIRT_NODE_AFFILIATION:
+	case UPSKIRT_NODE_KEYWORDS:
+		index = tree_node(rec, type);
+		if (meta)
+			TREE_NODE(rec, index)->text[0] = tree_cstr(rec,
+				type == UPSKIRT_NODE_TITLE ? meta->title :
+				type == UPSKIRT_NODE_AFFILIATION ? meta->affiliation : meta->keywords);
+		break;
+
+	case UPSKIRT_NODE_TOC:
+		for (entry = ptr; entry; entry = entry->sibling) {
+			uint32_t item = tree_node(rec, UPSKIRT_NODE_TOC_ENTRY);
+
+			TREE_NODE(rec, item)->value[0] = entry->nesting;
+			TREE_NODE(rec, item)->text[0] = tree_cstr(rec, entry->text);
+			tree_link(rec, &first, &last, item);
+		}
+		index = tree_node(rec, type);
+		TREE_NODE(rec, index)->value[0] = value;
+		break;
+
+	case UPSKIRT_NODE_REF:
+		index = tree_node(rec, type);
+		TREE_NODE(rec, index)->text[0] = tree_cstr(rec, ptr);
+		TREE_NODE(rec, index)->value[0] = value;
+		break;
+
+	default:
+		index = tree_node(rec, type);
+		break;
+	}
+
+	TREE_NODE(rec, index)->child = first;
+	return index;
+}
+
+/* tree_content • makes the list of nodes of what the recording renderer
+ * wrote; the pieces of records cut by the parser rewinding are skipped */
+static uint32_t
+tree_content(struct tree_recorder *rec, const sd_renderer_data *data, const uint8_t *src, size_t size)
+{
+	uint32_t first = 0, last = 0, index;
+	size_t i = 0, run = 0, end;
+	int in_text = 0;
+	uint64_t type, ptr, value;
+	const uint8_t *mark;
+
+	while (i < size) {
+		if (src[i] != TREE_MARK || (i + 1 < size &&
+			(src[i + 1] == TREE_MARK || src[i + 1] == TREE_BACKSLASH))) {
+			if (!in_text) {
+				run = rec->text->size;
+				in_text = 1;
+			}
+
+			if (src[i] == TREE_MARK) {
+				sd_buffer_putc(rec->text, src[i + 1] == TREE_MARK ? TREE_MARK : '\\');
+				i += 2;
+				continue;
+			}
+
+			mark = memchr(src + i, TREE_MARK, size - i);
+			end = mark ? (size_t)(mark - src) : size;
+			sd_buffer_put(rec->text, src + i, end - i);
+			i = end;
+			continue;
+		}
+
+		if (in_text) {
+			tree_link(rec, &first, &last, tree_text_run(rec, run));
+			in_text = 0;
+		}
+
+		if (i + REF_SIZE <= size && src[i + REF_SIZE - 1] == TREE_MARK &&
+			get_bits(src + i + 1, 5, &value) &&
+			value > 0 && value < rec->nodes->size / sizeof(sd_node)) {
+			tree_link(rec, &first, &last, (uint32_t)value);
+			i += REF_SIZE;
+		}
+		else if (i + CALL_SIZE <= size && src[i + 1] == TREE_CALL &&
+			src[i + CALL_SIZE - 1] == TREE_MARK &&
+			get_bits(src + i + 2, 2, &type) && type < UPSKIRT_NODE_COUNT &&
+			get_bits(src + i + 4, 11, &ptr) &&
+			get_bits(src + i + 15, 6, &value)) {
+			index = tree_call(rec, data, (sd_node_type)type,
+				(const void *)(uintptr_t)ptr, (int)(uint32_t)value);
+			tree_link(rec, &first, &last, index);
+			i += CALL_SIZE;
+		}
+		else {
+			/* what is left of a record cut short */
+			i++;
+			if (i < size && src[i] == TREE_CALL)
+				i++;
+			while (i < size && (src[i] & 0xC0) == 0x80)
+				i++;
+		}
+	}
+
+	if (in_text)
+		tree_link(rec, &first, &last, tree_text_run(rec, run));
+
+	return first;
+}
+
+static uint32_t
+tree_children(struct tree_recorder *rec, const sd_renderer_data *data, const sd_buffer *content)
+{
+	return content ? tree_content(rec, data, content->data, content->size) : 0;
+}
+
+/* tree_begin • drops whatever was recorded, the tree starting at start */
+static void
+tree_begin(struct tree_recorder *rec, size_t start)
+{
+	rec->nodes->size = 0;
+	rec->text->size = 0;
+	rec->linked->size = 0;
+	rec->start = start;
+
+	tree_node(rec, UPSKIRT_NODE_ROOT);
+}
+
+/* tree_finish • makes the tree of everything written since it began, taking
+ * it out of the output */
+static void
+tree_finish(struct tree_recorder *rec, sd_buffer *ob, const sd_renderer_data *data)
+{
+	size_t start = rec->start < ob->size ? rec->start : ob->size;
+	size_t nodes_size, text_size;
+	uint32_t first;
+	sd_tree *tree;
+
+	if (!rec->nodes->size)
+		return;
+
+	first = tree_content(rec, data, ob->data + start, ob->size - start);
+	TREE_NODE(rec, 0)->child = first;
+	ob->size = start;
+
+	nodes_size = rec->nodes->size;
+	text_size = rec->text->size;
+
+	tree = sd_malloc(sizeof(sd_tree) + nodes_size + text_size);
+	tree->nodes = (const sd_node *)(tree + 1);
+	tree->count = nodes_size / sizeof(sd_node);
+	tree->text = (const uint8_t *)(tree + 1) + nodes_size;
+	tree->text_size = text_size;
+
+	memcpy(tree + 1, rec->nodes->data, nodes_size);
+	if (text_size)
+		memcpy((uint8_t *)(tree + 1) + nodes_size, rec->text->data, text_size);
+
+	sd_tree_free(rec->tree);
+	rec->tree = tree;
+
+	rec->nodes->size = 0;
+	rec->text->size = 0;
+	rec->linked->size = 0;
+}
+
+
+/***********************
+ * RECORDING CALLBACKS *
+ ***********************/
+
+/* every callback returns what the HTML renderer returns, so that the tree is
+ * parsed the same way as the HTML output */
+
+static void
+rndr_block(sd_buffer *ob, sd_node_type type, const sd_buffer *content, const sd_renderer_data *data)
+{
+	struct tree_recorder *rec = data->opaque;
+	uint32_t child = tree_children(rec, data, content);
+	uint32_t index = tree_node(rec, type);
+
+	TREE_NODE(rec, index)->child = child;
+	put_ref(ob, index);
+}
+
+static int
+rndr_span(sd_buffer *ob, sd_node_type type, const sd_buffer *content, const sd_renderer_data *data)
+{
+	if (!content || !content->size)
+		return 0;
+
+	rndr_block(ob, type, content, data);
+	return 1;
+}
+
+/* rndr_text_node • a node with strings only */
+static uint32_t
+rndr_text_node(sd_buffer *ob, sd_node_type type, const sd_buffer *text, const sd_buffer *text2, const sd_renderer_data *data)
+{
+	struct tree_recorder *rec = data->opaque;
+	uint32_t index = tree_node(rec, type);
+
+	TREE_NODE(rec, index)->text[0] = tree_buffer(rec, text);
+	TREE_NODE(rec, index)->text[1] = tree_buffer(rec, text2);
+	put_ref(ob, index);
+	return index;
+}
+
+static void
+rndr_value_node(sd_buffer *ob, sd_node_type type, int value, const sd_renderer_data *data)
+{
+	struct tree_recorder *rec = data->opaque;
+	uint32_t index = tree_node(rec, type);
+
+	TREE_NODE(rec, index)->value[0] = value;
+	put_ref(ob, index);
+}
+
+static void
+rndr_head(sd_buffer *ob, metadata *doc_metadata, ext_definition *extensions)
+{
+	put_call(ob, UPSKIRT_NODE_HEAD, NULL, 0);
+}
+
+static void
+rndr_title(sd_buffer *ob, const sd_buffer *content, const metadata *data)
+{
+	put_call(ob, UPSKIRT_NODE_TITLE, NULL, 0);
+}
+
+static void
+rndr_authors(sd_buffer *ob, Strings *authors)
+{
+	put_call(ob, UPSKIRT_NODE_AUTHORS, NULL, 0);
+}
+
+static void
+rndr_affiliation(sd_buffer *ob, const sd_buffer *content, const sd_renderer_data *data)
+{
+	put_call(ob, UPSKIRT_NODE_AFFILIATION, NULL, 0);
+}
+
+static void
+rndr_keywords(sd_buffer *ob, const sd_buffer *content, const sd_renderer_data *data)
+{
+	put_call(ob, UPSKIRT_NODE_KEYWORDS, NULL, 0);
+}
+
+/* rndr_begin • the tree starts with the head written just before */
+static void
+rndr_begin(sd_buffer *ob, const sd_renderer_data *data)
+{
+	struct tree_recorder *rec = data->opaque;
+	size_t start = ob->size;
+
+	if (start >= CALL_SIZE && ob->data[start - CALL_SIZE] == TREE_MARK &&
+		ob->data[start - CALL_SIZE + 1] == TREE_CALL &&
+		ob->data[start - CALL_SIZE + 2] == (0x80 | UPSKIRT_NODE_HEAD))
+		start -= CALL_SIZE;
+
+	tree_begin(rec, start);
+	rndr_value_node(ob, UPSKIRT_NODE_BEGIN, 0, data);
+}
+
+static void
+rndr_inner(sd_buffer *ob, const sd_renderer_data *data)
+{
+	rndr_value_node(ob, UPSKIRT_NODE_INNER, 0, data);
+}
+
+static void
+rndr_end(sd_buffer *ob, ext_definition *extensions, const sd_renderer_data *data)
+{
+	rndr_value_node(ob, UPSKIRT_NODE_END, 0, data);
+	tree_finish(data->opaque, ob, data);
+}
+
+static void
+rndr_pagebreak(sd_buffer *ob)
+{
+	put_call(ob, UPSKIRT_NODE_PAGEBREAK, NULL, 0);
+}
+
+static void
+rndr_close(sd_buffer *ob)
+{
+	put_call(ob, UPSKIRT_NODE_CLOSE, NULL, 0);
+}
+
+static void
+rndr_abstract(sd_buffer *ob)
+{
+	put_call(ob, UPSKIRT_NODE_ABSTRACT, NULL, 0);
+}
+
+static void
+rndr_open_equation(sd_buffer *ob, const char *ref, const sd_renderer_data *data)
+{
+	struct tree_recorder *rec = data->opaque;
+	uint32_t index = tree_node(rec, UPSKIRT_NODE_OPEN_EQUATION);
+
+	TREE_NODE(rec, index)->text[0] = tree_cstr(rec, ref);
+	put_ref(ob, index);
+}
+
+static void
+rndr_close_equation(sd_buffer *ob, const sd_renderer_data *data)
+{
+	rndr_value_node(ob, UPSKIRT_NODE_CLOSE_EQUATION, 0, data);
+}
+
+static void
+rndr_float(sd_buffer *ob, sd_node_type type, float_args args, const sd_renderer_data *data)
+{
+	struct tree_recorder *rec = data->opaque;
+	uint32_t child = 0, index;
+
+	if (args.caption)
+		child = tree_content(rec, data, (const uint8_t *)args.caption, strlen(args.caption));
+
+	index = tree_node(rec, type);
+	TREE_NODE(rec, index)->child = child;
+	TREE_NODE(rec, index)->value[0] = args.type;
+	TREE_NODE(rec, index)->value[1] = args.caption != NULL;
+	TREE_NODE(rec, index)->text[0] = tree_cstr(rec, args.id);
+	put_ref(ob, index);
+}
+
+static void
+rndr_open_float(sd_buffer *ob, float_args args, const sd_renderer_data *data)
+{
+	rndr_float(ob, UPSKIRT_NODE_OPEN_FLOAT, args, data);
+}
+
+static void
+rndr_close_float(sd_buffer *ob, float_args args, const sd_renderer_data *data)
+{
+	rndr_float(ob, UPSKIRT_NODE_CLOSE_FLOAT, args, data);
+}
+
+static void
+rndr_blockcode(sd_buffer *ob, const sd_buffer *text, const sd_buffer *lang, const sd_renderer_data *data)
+{
+	rndr_text_node(ob, UPSKIRT_NODE_BLOCKCODE, text, lang, data);
+}
+
+static void
+rndr_blockquote(sd_buffer *ob, const sd_buffer *content, const sd_renderer_data *data)
+{
+	rndr_block(ob, UPSKIRT_NODE_BLOCKQUOTE, content, data);
+}
+
+static void
+rndr_header(sd_buffer *ob, const sd_buffer *content, int level, const sd_renderer_data *data, h_counter counter, int numbering)
+{
+	struct tree_recorder *rec = data->opaque;
+	uint32_t child = tree_children(rec, data, content);
+	uint32_t index = tree_node(rec, UPSKIRT_NODE_HEADER);
+	sd_node *node = TREE_NODE(rec, index);
+
+	node->child = child;
+	node->value[0] = level;
+	node->value[1] = counter.chapter;
+	node->value[2] = counter.section;
+	node->value[3] = counter.subsection;
+	put_ref(ob, index);
+}
+
+static void
+rndr_hrule(sd_buffer *ob, const sd_renderer_data *data)
+{
+	rndr_value_node(ob, UPSKIRT_NODE_HRULE, 0, data);
+}
+
+static void
+rndr_flags_block(sd_buffer *ob, sd_node_type type, const sd_buffer *content, int flags, const sd_renderer_data *data)
+{
+	struct tree_recorder *rec = data->opaque;
+	uint32_t child = tree_children(rec, data, content);
+	uint32_t index = tree_node(rec, type);
+
+	TREE_NODE(rec, index)->child = child;
+	TREE_NODE(rec, index)->value[0] = flags;
+	put_ref(ob, index);
+}
+
+static void
+rndr_list(sd_buffer *ob, const sd_buffer *content, sd_list_flags flags, const sd_renderer_data *data)
+{
+	rndr_flags_block(ob, UPSKIRT_NODE_LIST, content, flags, data);
+}
+
+static void
+rndr_listitem(sd_buffer *ob, const sd_buffer *content, sd_list_flags flags, const sd_renderer_data *data)
+{
+	rndr_flags_block(ob, UPSKIRT_NODE_LISTITEM, content, flags, data);
+}
+
+static void
+rndr_paragraph(sd_buffer *ob, const sd_buffer *content, const sd_renderer_data *data)
+{
+	rndr_block(ob, UPSKIRT_NODE_PARAGRAPH, content, data);
+}
+
+static void
+rndr_table(sd_buffer *ob, const sd_buffer *content, const sd_renderer_data *data, sd_table_flags *flags, int columns)
+{
+	struct tree_recorder *rec = data->opaque;
+	uint32_t child = tree_children(rec, data, content);
+	uint32_t index = tree_node(rec, UPSKIRT_NODE_TABLE);
+	sd_span span;
+	int i;
+
+	span.offset = (uint32_t)rec->text->size;
+	span.size = (uint32_t)columns + 1;
+	for (i = 0; i < columns; i++)
+		sd_buffer_putc(rec->text, (uint8_t)flags[i]);
+	sd_buffer_putc(rec->text, 0);
+
+	TREE_NODE(rec, index)->child = child;
+	TREE_NODE(rec, index)->value[0] = columns;
+	TREE_NODE(rec, index)->text[0] = span;
+	put_ref(ob, index);
+}
+
+static void
+rndr_table_header(sd_buffer *ob, const sd_buffer *content, const sd_renderer_data *data)
+{
+	rndr_block(ob, UPSKIRT_NODE_TABLE_HEADER, content, data);
+}
+
+static void
+rndr_table_body(sd_buffer *ob, const sd_buffer *content, const sd_renderer_data *data)
+{
+	rndr_block(ob, UPSKIRT_NODE_TABLE_BODY, content, data);
+}
+
+static void
+rndr_table_row(sd_buffer *ob, const sd_buffer *content, const sd_renderer_data *data)
+{
+	rndr_block(ob, UPSKIRT_NODE_TABLE_ROW, content, data);
+}
+
+static void
+rndr_table_cell(sd_buffer *ob, const sd_buffer *content, sd_table_flags flags, const sd_renderer_data *data)
+{
+	rndr_flags_block(ob, UPSKIRT_NODE_TABLE_CELL, content, flags, data);
+}
+
+static void
+rndr_footnotes(sd_buffer *ob, const sd_buffer *content, const sd_renderer_data *data)
+{
+	rndr_block(ob, UPSKIRT_NODE_FOOTNOTES, content, data);
+}
+
+static void
+rndr_footnote_def(sd_buffer *ob, const sd_buffer *content, unsigned int num, const sd_renderer_data *data)
+{
+	rndr_flags_block(ob, UPSKIRT_NODE_FOOTNOTE_DEF, content, (int)num, data);
+}
+
+static void
+rndr_blockhtml(sd_buffer *ob, const sd_buffer *text, const sd_renderer_data *data)
+{
+	rndr_text_node(ob, UPSKIRT_NODE_BLOCKHTML, text, NULL, data);
+}
+
+static void
+rndr_toc(sd_buffer *ob, toc *ToC, int numbering)
+{
+	put_call(ob, UPSKIRT_NODE_TOC, ToC, numbering);
+}
+
+static int
+rndr_autolink(sd_buffer *ob, const sd_buffer *link, sd_autolink_type type, const sd_renderer_data *data)
+{
+	struct tree_recorder *rec = data->opaque;
+	uint32_t index;
+
+	if (!link || !link->size)
+		return 0;
+
+	index = rndr_text_node(ob, UPSKIRT_NODE_AUTOLINK, link, NULL, data);
+	TREE_NODE(rec, index)->value[0] = type;
+	return 1;
+}
+
+static int
+rndr_codespan(sd_buffer *ob, const sd_buffer *text, const sd_renderer_data *data)
+{
+	rndr_text_node(ob, UPSKIRT_NODE_CODESPAN, text, NULL, data);
+	return 1;
+}
+
+static int
+rndr_double_emphasis(sd_buffer *ob, const sd_buffer *content, const sd_renderer_data *data)
+{
+	return rndr_span(ob, UPSKIRT_NODE_DOUBLE_EMPHASIS, content, data);
+}
+
+static int
+rndr_emphasis(sd_buffer *ob, const sd_buffer *content, const sd_renderer_data *data)
+{
+	return rndr_span(ob, UPSKIRT_NODE_EMPHASIS, content, data);
+}
+
+static int
+rndr_underline(sd_buffer *ob, const sd_buffer *content, const sd_renderer_data *data)
+{
+	return rndr_span(ob, UPSKIRT_NODE_UNDERLINE, content, data);
+}
+
+static int
+rndr_highlight(sd_buffer *ob, const sd_buffer *content, const sd_renderer_data *data)
+{
+	return rndr_span(ob, UPSKIRT_NODE_HIGHLIGHT, content, data);
+}
+
+static int
+rndr_quote(sd_buffer *ob, const sd_buffer *content, const sd_renderer_data *data)
+{
+	return rndr_span(ob, UPSKIRT_NODE_QUOTE, content, data);
+}
+
+static int
+rndr_cite(sd_buffer *ob, const sd_buffer *content, const sd_renderer_data *data)
+{
+	if (!content || !content->size)
+		return 0;
+
+	rndr_text_node(ob, UPSKIRT_NODE_CITE, content, NULL, data);
+	return 1;
+}
+
+static int
+rndr_image(sd_buffer *ob, const sd_buffer *link, const sd_buffer *title, const sd_buffer *alt, const sd_renderer_data *data)
+{
+	struct tree_recorder *rec = data->opaque;
+	uint32_t index, child = 0;
+
+	if (!link || !link->size)
+		return 0;
+
+	if (alt) {
+		child = tree_node(rec, UPSKIRT_NODE_TEXT);
+		TREE_NODE(rec, child)->text[0] = tree_buffer(rec, alt);
+		rec->linked->data[child] = 1;
+	}
+
+	index = rndr_text_node(ob, UPSKIRT_NODE_IMAGE, link, title, data);
+	TREE_NODE(rec, index)->child = child;
+	return 1;
+}
+
+static int
+rndr_linebreak(sd_buffer *ob, const sd_renderer_data *data)
+{
+	rndr_value_node(ob, UPSKIRT_NODE_LINEBREAK, 0, data);
+	return 1;
+}
+
+static int
+rndr_link(sd_buffer *ob, const sd_buffer *content, const sd_buffer *link, const sd_buffer *title, const sd_renderer_data *data)
+{
+	struct tree_recorder *rec = data->opaque;
+	uint32_t child = tree_children(rec, data, content);
+	uint32_t index = rndr_text_node(ob, UPSKIRT_NODE_LINK, link, title, data);
+
+	TREE_NODE(rec, index)->child = child;
+	TREE_NODE(rec, index)->value[0] = content != NULL;
+	return 1;
+}
+
+static int
+rndr_triple_emphasis(sd_buffer *ob, const sd_buffer *content, const sd_renderer_data *data)
+{
+	return rndr_span(ob, UPSKIRT_NODE_TRIPLE_EMPHASIS, content, data);
+}
+
+static int
+rndr_strikethrough(sd_buffer *ob, const sd_buffer *content, const sd_renderer_data *data)
+{
+	return rndr_span(ob, UPSKIRT_NODE_STRIKETHROUGH, content, data);
+}
+
+static int
+rndr_superscript(sd_buffer *ob, const sd_buffer *content, const sd_renderer_data *data)
+{
+	return rndr_span(ob, UPSKIRT_NODE_SUPERSCRIPT, content, data);
+}
+
+static int
+rndr_footnote_ref(sd_buffer *ob, int num, int is_crossref, const sd_renderer_data *data)
+{
+	struct tree_recorder *rec = data->opaque;
+	uint32_t index = tree_node(rec, UPSKIRT_NODE_FOOTNOTE_REF);
+
+	TREE_NODE(rec, index)->value[0] = num;
+	TREE_NODE(rec, index)->value[1] = is_crossref;
+	put_ref(ob, index);
+	return 1;
+}
+
+static int
+rndr_math_node(sd_buffer *ob, sd_node_type type, const sd_buffer *text, int displaymode, const sd_renderer_data *data)
+{
+	struct tree_recorder *rec = data->opaque;
+	uint32_t index = rndr_text_node(ob, type, text, NULL, data);
+
+	TREE_NODE(rec, index)->value[0] = displaymode;
+	return 1;
+}
+
+static int
+rndr_math(sd_buffer *ob, const sd_buffer *text, int displaymode, const sd_renderer_data *data)
+{
+	return rndr_math_node(ob, UPSKIRT_NODE_MATH, text, displaymode, data);
+}
+
+static int
+rndr_eq_math(sd_buffer *ob, const sd_buffer *text, int displaymode, const sd_renderer_data *data)
+{
+	return rndr_math_node(ob, UPSKIRT_NODE_EQ_MATH, text, displaymode, data);
+}
+
+static int
+rndr_ruby(sd_buffer *ob, const sd_buffer *content, const sd_buffer *ruby, const sd_renderer_data *data)
+{
+	if (!content || !content->size)
+		return 0;
+
+	rndr_text_node(ob, UPSKIRT_NODE_RUBY, content, ruby, data);
+	return 1;
+}
+
+static int
+rndr_ref(sd_buffer *ob, char *id, int count)
+{
+	put_call(ob, UPSKIRT_NODE_REF, id, count);
+	return 1;
+}
+
+static int
+rndr_raw_html(sd_buffer *ob, const sd_buffer *text, const sd_renderer_data *data)
+{
+	rndr_text_node(ob, UPSKIRT_NODE_RAW_HTML, text, NULL, data);
+	return 1;
+}
+
+static void
+rndr_entity(sd_buffer *ob, const sd_buffer *text, const sd_renderer_data *data)
+{
+	rndr_text_node(ob, UPSKIRT_NODE_ENTITY, text, NULL, data);
+}
+
+static void
+rndr_normal_text(sd_buffer *ob, const sd_buffer *text, const sd_renderer_data *data)
+{
+	put_text(ob, text->data, text->size);
+}
+
+/* rndr_doc_header • an inline render starts the tree */
+static void
+rndr_doc_header(sd_buffer *ob, int inline_render, const sd_renderer_data *data)
+{
+	if (inline_render)
+		tree_begin(data->opaque, ob->size);
+	rndr_value_node(ob, UPSKIRT_NODE_DOC_HEADER, inline_render, data);
+}
+
+static void
+rndr_doc_footer(sd_buffer *ob, int inline_render, const sd_renderer_data *data)
+{
+	rndr_value_node(ob, UPSKIRT_NODE_DOC_FOOTER, inline_render, data);
+	if (inline_render)
+		tree_finish(data->opaque, ob, data);
+}
+
+static void
+rndr_position(sd_buffer *ob)
+{
+	put_call(ob, UPSKIRT_NODE_POSITION, NULL, 0);
+}
+
+/***************
+ * SAVED TREES *
+ ***************/
+
+/* A saved tree is a header, the nodes then the text, all as they are in
+ * memory, so that a mapped file is rendered where it lies. The byte order and
+ * the size of a node are those of the machine that saved it, and a file made
+ * elsewhere is turned down rather than converted. */
+#define TREE_MAGIC "SDTREE\r\n"
+#define TREE_VERSION 1
+#define TREE_ORDER 0x01020304
+#define TREE_DEPTH_MAX 1024	/* contents nested deeper are turned down */
+
+/* tree_header: first bytes of a saved tree */
+struct tree_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t order;		/* TREE_ORDER as written by the machine */
+	uint32_t node_size;	/* sizeof(sd_node) */
+	uint32_t count;		/* nodes following the header */
+	uint32_t text_size;	/* bytes of text following the nodes */
+	uint32_t reserved;
+};
+
+/* tree_check_span • whether a span is a string ending inside the text */
+static int
+tree_check_span(const sd_tree *tree, sd_span span)
+{
+	if (!span.size)
+		return 1;
+
+	return span.offset < tree->text_size &&
+		span.size <= tree->text_size - span.offset &&
+		tree->text[span.offset + span.size - 1] == 0;
+}
+
+/* tree_check_node • whether the arguments of a node are safe to render */
+static int
+tree_check_node(const sd_tree *tree, const sd_node *node)
+{
+	if (node->type >= UPSKIRT_NODE_COUNT ||
+	    node->child >= tree->count || node->next >= tree->count ||
+	    !tree_check_span(tree, node->text[0]) ||
+	    !tree_check_span(tree, node->text[1]))
+		return 0;
+
+	switch (node->type) {
+	case UPSKIRT_NODE_TABLE:
+		/* the columns index the flags */
+		return node->value[0] >= 0 &&
+			node->text[0].size == (uint32_t)node->value[0] + 1;
+
+	/* the parser never calls these without their text */
+	case UPSKIRT_NODE_BLOCKHTML:
+	case UPSKIRT_NODE_TOC_ENTRY:
+	case UPSKIRT_NODE_CITE:
+	case UPSKIRT_NODE_MATH:
+	case UPSKIRT_NODE_EQ_MATH:
+	case UPSKIRT_NODE_REF:
+	case UPSKIRT_NODE_RAW_HTML:
+	case UPSKIRT_NODE_ENTITY:
+		return node->text[0].size != 0;
+
+	default:
+		return 1;
+	}
+}
+
+/* tree_close • the node type closing the range a node type opens, 0 for
+ * the nodes opening none */
+static uint32_t
+tree_close(uint32_t type)
+{
+	switch (type) {
+	case UPSKIRT_NODE_ABSTRACT: return UPSKIRT_NODE_CLOSE;
+	case UPSKIRT_NODE_OPEN_EQUATION: return UPSKIRT_NODE_CLOSE_EQUATION;
+	case UPSKIRT_NODE_OPEN_FLOAT: return UPSKIRT_NODE_CLOSE_FLOAT;
+	default: return 0;
+	}
+}
+
+/* tree_check • whether every node reached from the root is sound and reached
+ * once, so that rendering ends; the ranges opened in a content must nest
+ * within each other, and together with the contents they must not go deeper
+ * than the stack of the renderer can take */
+static int
+tree_check(const sd_tree *tree)
+{
+	struct { uint32_t index, depth; } *lists;
+	uint32_t ranges[TREE_DEPTH_MAX];
+	size_t top = 0;
+	uint8_t *seen;
+	int ok = 1;
+
+	if (!tree->count || tree->nodes[0].type != UPSKIRT_NODE_ROOT ||
+	    tree->nodes[0].next || !tree_check_node(tree, &tree->nodes[0]))
+		return 0;
+
+	/* every node is pushed at most once, when it is seen first */
+	seen = sd_calloc(tree->count, 1);
+	lists = sd_malloc(tree->count * sizeof(lists[0]));
+
+	seen[0] = 1;
+	if (tree->nodes[0].child) {
+		seen[tree->nodes[0].child] = 1;
+		lists[top].index = tree->nodes[0].child;
+		lists[top++].depth = 1;
+	}
+
+	while (ok && top) {
+		uint32_t index = lists[--top].index;
+		uint32_t depth = lists[top].depth;
+		size_t open = 0, i;
+
+		/* the nodes of one content, after one another */
+		for (; ok && index; index = tree->nodes[index].next) {
+			const sd_node *node = &tree->nodes[index];
+			uint32_t close = tree_close(node->type);
+
+			if (!tree_check_node(tree, node)) {
+				ok = 0;
+				break;
+			}
+
+			if (close) {
+				if (depth + open >= TREE_DEPTH_MAX) {
+					ok = 0;
+					break;
+				}
+				ranges[open++] = close;
+			} else if (open && node->type == ranges[open - 1])
+				open--;
+			else if (open && (node->type == UPSKIRT_NODE_CLOSE ||
+			    node->type == UPSKIRT_NODE_CLOSE_EQUATION ||
+			    node->type == UPSKIRT_NODE_CLOSE_FLOAT)) {
+				/* a node closing a range further out would end it
+				 * inside the inner one */
+				for (i = 0; i < open && ranges[i] != node->type; i++);
+				if (i < open) {
+					ok = 0;
+					break;
+				}
+			}
+
+			if (node->child) {
+				if (seen[node->child] || depth + open >= TREE_DEPTH_MAX) {
+					ok = 0;
+					break;
+				}
+				seen[node->child] = 1;
+				lists[top].index = node->child;
+				lists[top++].depth = depth + open + 1;
+			}
+
+			if (node->next) {
+				if (seen[node->next]) {
+					ok = 0;
+					break;
+				}
+				seen[node->next] = 1;
+			}
+		}
+	}
+
+	free(lists);
+	free(seen);
+	return ok;
+}
+
+
+sd_renderer *
+sd_tree_renderer_new(void)
+{
+	static const sd_renderer cb_default = {
+		NULL,
+
+		rndr_head,
+		rndr_title,
+		rndr_authors,
+		rndr_affiliation,
+		rndr_keywords,
+		rndr_begin,
+		rndr_inner,
+		rndr_end,
+		rndr_pagebreak,
+
+		rndr_close,
+		rndr_abstract,
+		rndr_open_equation,
+		rndr_close_equation,
+		rndr_open_float,
+		rndr_close_float,
+		rndr_blockcode,
+		rndr_blockquote,
+		rndr_header,
+		rndr_hrule,
+		rndr_list,
+		rndr_listitem,
+		rndr_paragraph,
+		rndr_table,
+		rndr_table_header,
+		rndr_table_body,
+		rndr_table_row,
+		rndr_table_cell,
+		rndr_footnotes,
+		rndr_footnote_def,
+		rndr_blockhtml,
+		rndr_toc,
+
+		rndr_autolink,
+		rndr_codespan,
+		rndr_double_emphasis,
+		rndr_emphasis,
+		rndr_underline,
+		rndr_highlight,
+		rndr_quote,
+		rndr_cite,
+		rndr_image,
+		rndr_linebreak,
+		rndr_link,
+		rndr_triple_emphasis,
+		rndr_strikethrough,
+		rndr_superscript,
+		rndr_footnote_ref,
+		rndr_math,
+		rndr_eq_math,
+		rndr_ruby,
+		rndr_ref,
+		rndr_raw_html,
+
+		rndr_entity,
+		rndr_normal_text,
+
+		rndr_doc_header,
+		rndr_doc_footer,
+		rndr_position,
+	};
+
+	struct tree_recorder *rec;
+	sd_renderer *renderer;
+
+	rec = sd_malloc(sizeof(struct tree_recorder));
+	rec->nodes = sd_buffer_new(64 * sizeof(sd_node));
+	rec->text = sd_buffer_new(1024);
+	rec->linked = sd_buffer_new(64);
+	rec->start = 0;
+	rec->tree = NULL;
+
+	/* no opaque_size nor state_merge: the calls must come in order, from
+	 * one thread */
+	renderer = sd_malloc(sizeof(sd_renderer));
+	memcpy(renderer, &cb_default, sizeof(sd_renderer));
+	renderer->opaque = rec;
+
+	return renderer;
+}
+
+sd_tree *
+sd_tree_renderer_take(sd_renderer *renderer)
+{
+	struct tree_recorder *rec = renderer->opaque;
+	sd_tree *tree = rec->tree;
+
+	rec->tree = NULL;
+	return tree;
+}
+
+void
+sd_tree_renderer_free(sd_renderer *renderer)
+{
+	struct tree_recorder *rec = renderer->opaque;
+
+	sd_tree_free(rec->tree);
+	sd_buffer_free(rec->nodes);
+	sd_buffer_free(rec->text);
+	sd_buffer_free(rec->linked);
+	free(rec);
+	free(renderer);
+}
+
+void
+sd_tree_free(sd_tree *tree)
+{
+	free(tree);
+}
+
+void
+sd_tree_write(sd_buffer *ob, const sd_tree *tree)
+{
+	struct tree_header header;
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, TREE_MAGIC, sizeof(header.magic));
+	header.version = TREE_VERSION;
+	header.order = TREE_ORDER;
+	header.node_size = sizeof(sd_node);
+	header.count = (uint32_t)tree->count;
+	header.text_size = (uint32_t)tree->text_size;
+
+	sd_buffer_put(ob, (const uint8_t *)&header, sizeof(header));
+	sd_buffer_put(ob, (const uint8_t *)tree->nodes, tree->count * sizeof(sd_node));
+	if (tree->text_size)
+		sd_buffer_put(ob, tree->text, tree->text_size);
+}
+
+int
+sd_tree_load(sd_tree *tree, const uint8_t *data, size_t size)
+{
+	struct tree_header header;
+	size_t nodes_size;
+
+	if (size < sizeof(header))
+		return -1;
+	memcpy(&header, data, sizeof(header));
+
+	if (memcmp(header.magic, TREE_MAGIC, sizeof(header.magic)) != 0 ||
+	    header.version != TREE_VERSION || header.order != TREE_ORDER ||
+	    header.node_size != sizeof(sd_node))
+		return -1;
+
+	/* the nodes are read in place */
+	if ((uintptr_t)(data + sizeof(header)) % sizeof(uint32_t) != 0)
+		return -1;
+
+	nodes_size = (size_t)header.count * sizeof(sd_node);
+	if (nodes_size / sizeof(sd_node) != header.count ||
+	    size - sizeof(header) < nodes_size ||
+	    size - sizeof(header) - nodes_size != header.text_size)
+		return -1;
+
+	tree->nodes = (const sd_node *)(data + sizeof(header));
+	tree->count = header.count;
+	tree->text = data + sizeof(header) + nodes_size;
+	tree->text_size = header.text_size;
+
+	if (!tree_check(tree)) {
+		memset(tree, 0, sizeof(*tree));
+		return -1;
+	}
+
+	return 0;
+}
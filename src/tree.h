@@ -0,0 +1,194 @@
+/* tree.h - document tree parsed once and rendered many times */
+
+#ifndef UPSKIRT_TREE_H
+#define UPSKIRT_TREE_H
+
+#include "document.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+/*************
+ * CONSTANTS *
+ *************/
+
+/* sd_node_type: one type per callback of sd_renderer, in the same order */
+typedef enum sd_node_type {
+	UPSKIRT_NODE_ROOT,		/* the whole render */
+	UPSKIRT_NODE_TEXT,		/* normal_text */
+
+	/* document level */
+	UPSKIRT_NODE_HEAD,
+	UPSKIRT_NODE_TITLE,
+	UPSKIRT_NODE_AUTHORS,
+	UPSKIRT_NODE_AFFILIATION,
+	UPSKIRT_NODE_KEYWORDS,
+	UPSKIRT_NODE_BEGIN,
+	UPSKIRT_NODE_INNER,
+	UPSKIRT_NODE_END,
+	UPSKIRT_NODE_PAGEBREAK,
+
+	/* block level */
+	UPSKIRT_NODE_CLOSE,
+	UPSKIRT_NODE_ABSTRACT,
+	UPSKIRT_NODE_OPEN_EQUATION,
+	UPSKIRT_NODE_CLOSE_EQUATION,
+	UPSKIRT_NODE_OPEN_FLOAT,
+	UPSKIRT_NODE_CLOSE_FLOAT,
+	UPSKIRT_NODE_BLOCKCODE,
+	UPSKIRT_NODE_BLOCKQUOTE,
+	UPSKIRT_NODE_HEADER,
+	UPSKIRT_NODE_HRULE,
+	UPSKIRT_NODE_LIST,
+	UPSKIRT_NODE_LISTITEM,
+	UPSKIRT_NODE_PARAGRAPH,
+	UPSKIRT_NODE_TABLE,
+	UPSKIRT_NODE_TABLE_HEADER,
+	UPSKIRT_NODE_TABLE_BODY,
+	UPSKIRT_NODE_TABLE_ROW,
+	UPSKIRT_NODE_TABLE_CELL,
+	UPSKIRT_NODE_FOOTNOTES,
+	UPSKIRT_NODE_FOOTNOTE_DEF,
+	UPSKIRT_NODE_BLOCKHTML,
+	UPSKIRT_NODE_TOC,
+	UPSKIRT_NODE_TOC_ENTRY,		/* one entry of the list given to toc */
+
+	/* span level */
+	UPSKIRT_NODE_AUTOLINK,
+	UPSKIRT_NODE_CODESPAN,
+	UPSKIRT_NODE_DOUBLE_EMPHASIS,
+	UPSKIRT_NODE_EMPHASIS,
+	UPSKIRT_NODE_UNDERLINE,
+	UPSKIRT_NODE_HIGHLIGHT,
+	UPSKIRT_NODE_QUOTE,
+	UPSKIRT_NODE_CITE,
+	UPSKIRT_NODE_IMAGE,
+	UPSKIRT_NODE_LINEBREAK,
+	UPSKIRT_NODE_LINK,
+	UPSKIRT_NODE_TRIPLE_EMPHASIS,
+	UPSKIRT_NODE_STRIKETHROUGH,
+	UPSKIRT_NODE_SUPERSCRIPT,
+	UPSKIRT_NODE_FOOTNOTE_REF,
+	UPSKIRT_NODE_MATH,
+	UPSKIRT_NODE_EQ_MATH,
+	UPSKIRT_NODE_RUBY,
+	UPSKIRT_NODE_REF,
+	UPSKIRT_NODE_RAW_HTML,
+
+	/* low level */
+	UPSKIRT_NODE_ENTITY,
+
+	/* miscellaneous */
+	UPSKIRT_NODE_DOC_HEADER,
+	UPSKIRT_NODE_DOC_FOOTER,
+	UPSKIRT_NODE_POSITION,
+
+	UPSKIRT_NODE_COUNT
+} sd_node_type;
+
+
+/*********
+ * TYPES *
+ *********/
+
+/* sd_span: a string of the tree, at offset in its text; size counts the NUL
+ * ending the string, so that a size of 0 stands for a NULL argument */
+struct sd_span {
+	uint32_t offset;
+	uint32_t size;
+};
+typedef struct sd_span sd_span;
+
+/* sd_node: one call of the renderer; the content of a node is the list of
+ * nodes starting at child and following next, 0 ending the lists since
+ * nodes[0] is the root, and a node is in one content only. What the
+ * arguments of the call became:
+ *   TEXT, ENTITY, CODESPAN, BLOCKHTML, RAW_HTML, CITE, TITLE, AFFILIATION,
+ *   KEYWORDS, OPEN_EQUATION (id), REF (id)	text[0]
+ *   BLOCKCODE	text[0] the code, text[1] the language
+ *   RUBY	text[0] the content, text[1] the ruby
+ *   AUTOLINK	text[0] the link, value[0] the type
+ *   LINK	content, text[0] the link, text[1] the title, value[0] 0 when the
+ *		content is NULL
+ *   IMAGE	text[0] the link, text[1] the title, a TEXT content the alt
+ *   HEADER	content, value[0] the level, value[1..3] the counter
+ *   LIST, LISTITEM, TABLE_CELL	content, value[0] the flags
+ *   TABLE	content, value[0] the columns, text[0] a byte of flags each
+ *   FOOTNOTE_DEF	content, value[0] the number
+ *   FOOTNOTE_REF	value[0] the number, value[1] is_crossref
+ *   MATH, EQ_MATH	text[0], value[0] displaymode
+ *   REF	value[0] the count
+ *   OPEN_FLOAT, CLOSE_FLOAT	text[0] the id, value[0] the type, value[1]
+ *		1 with a caption, rendered from the content
+ *   TOC	TOC_ENTRY content, value[0] the numbering
+ *   TOC_ENTRY	text[0], value[0] the nesting
+ *   HEAD	the metadata: TEXT content with the title, keywords, style,
+ *		affiliation then every author, value[0..3] the paper size,
+ *		class, font size and numbering
+ *   AUTHORS	nothing, the authors are those of HEAD
+ *   DOC_HEADER, DOC_FOOTER	value[0] inline_render
+ * and the other containers have their content only */
+struct sd_node {
+	uint32_t type;		/* sd_node_type */
+	uint32_t child;		/* first node of the content */
+	uint32_t next;		/* following node in the same content */
+	int32_t value[4];
+	sd_span text[2];
+};
+typedef struct sd_node sd_node;
+
+/* sd_tree: what a document renders to, parsed once; the nodes and their
+ * text are held in the same allocation as the tree */
+struct sd_tree {
+	const sd_node *nodes;	/* nodes[0] is the root */
+	size_t count;
+	const uint8_t *text;	/* strings of the nodes, each ending with a NUL */
+	size_t text_size;
+};
+typedef struct sd_tree sd_tree;
+
+
+/*************
+ * FUNCTIONS *
+ *************/
+
+/* sd_tree_renderer_new: allocate a renderer recording the tree of what
+ * sd_document_render or sd_document_render_inline parse with it, instead of
+ * rendering it; the document must not be fed nor hand the output over */
+sd_renderer *sd_tree_renderer_new(void) __attribute__ ((malloc));
+
+/* sd_tree_renderer_take: the tree of the last render, which the caller
+ * frees; NULL when nothing was recorded since the last call */
+sd_tree *sd_tree_renderer_take(sd_renderer *renderer);
+
+/* sd_tree_renderer_free: deallocate a recording renderer */
+void sd_tree_renderer_free(sd_renderer *renderer);
+
+/* sd_tree_node: the node of the tree at index */
+#define sd_tree_node(tree, index) (&(tree)->nodes[(index)])
+
+/* sd_tree_text: the string of the tree at span, NULL when there is none */
+#define sd_tree_text(tree, span) ((span).size ? (const char *)(tree)->text + (span).offset : NULL)
+
+/* sd_tree_free: deallocate a tree */
+void sd_tree_free(sd_tree *tree);
+
+/* sd_tree_write: append to ob the tree as a file sd_tree_load reads back on
+ * the same kind of machine; the file only holds for the extensions the
+ * document was parsed with */
+void sd_tree_write(sd_buffer *ob, const sd_tree *tree);
+
+/* sd_tree_load: make tree the tree saved in data, which stays in use by the
+ * tree and is not copied; checks all of it so that a damaged file is turned
+ * down rather than rendered, and returns 0 on success. The tree is not to be
+ * given to sd_tree_free */
+int sd_tree_load(sd_tree *tree, const uint8_t *data, size_t size);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /** UPSKIRT_TREE_H **/
@@ -24,6 +24,7 @@ typedef enum sd_render_flags {
 	UPSKIRT_RENDER_CHARTER    = (1 << 5),
 	UPSKIRT_RENDER_GNUPLOT    = (1 << 6),
 	UPSKIRT_RENDER_CSS        = (1 << 7),
+	UPSKIRT_RENDER_SMARTYPANTS = (1 << 8),
 } sd_render_flags;
 
 typedef enum sd_render_tag {
@@ -86,8 +86,12 @@ class MarkdownTestsMeta(type):
 
         for test in config['tests']:
             input_name = test['input']
+            # The flags tell apart the runs of the same input.
             attr_name = 'test_' + SLUGIFY_PATTERN.sub(
-                '_', os.path.splitext(input_name)[0].lower(),
+                '_', ' '.join(
+                    [os.path.splitext(input_name)[0]] +
+                    (test.get('flags') or [])
+                ).lower(),
             )
             func = _make_test(test)
             func.__doc__ = input_name
@@ -0,0 +1,67 @@
+/* arena.c - memory kept by an arena reused over many renders */
+
+#include "arena.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define RETAIN (256 * 1024)
+#define UNIT 4096
+
+static int failed = 0;
+
+static void
+check(int ok, const char *what, size_t size)
+{
+	if (!ok) {
+		fprintf(stderr, "FAIL: %s (%lu bytes held)\n", what, (unsigned long)size);
+		failed = 1;
+	}
+}
+
+/* render • allocates what a render of about size bytes of input takes */
+static void
+render(sd_arena *arena, size_t size)
+{
+	size_t i;
+
+	for (i = 0; i < size / 16; i++)
+		sd_arena_calloc(arena, 1, 16 + i % 64);
+}
+
+int
+main(void)
+{
+	sd_arena arena;
+	size_t peak, held, i;
+
+	sd_arena_init(&arena, UNIT);
+
+	/* one large document, with an object larger than a chunk */
+	render(&arena, 16 * 1024 * 1024);
+	sd_arena_alloc(&arena, 1024 * 1024);
+	peak = sd_arena_size(&arena);
+	sd_arena_reset(&arena, RETAIN);
+
+	held = sd_arena_size(&arena);
+	check(peak > UNIT + RETAIN, "the large render fills more than the retained size", peak);
+	check(held <= UNIT + RETAIN, "reset gives back the chunks past the retained size", held);
+
+	/* then many small ones, which fit in what was kept */
+	for (i = 0; i < 100000; i++) {
+		render(&arena, 2048);
+		sd_arena_reset(&arena, RETAIN);
+	}
+
+	check(sd_arena_size(&arena) == held, "small renders reuse the kept chunks", sd_arena_size(&arena));
+
+	/* a retained size of zero keeps the first chunk only */
+	render(&arena, 1024 * 1024);
+	sd_arena_reset(&arena, 0);
+	check(sd_arena_size(&arena) == UNIT, "reset to the first chunk", sd_arena_size(&arena));
+
+	sd_arena_uninit(&arena);
+	check(sd_arena_size(&arena) == 0, "uninit frees every chunk", sd_arena_size(&arena));
+
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
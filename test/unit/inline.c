@@ -0,0 +1,99 @@
+/* inline.c - runs of openers without a closer are parsed in linear time */
+
+#include "document.h"
+#include "html.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define REPEAT 20000
+#define TRIES 3
+#define MAX_RATIO 3.0	/* twice the input, 2x when linear and 4x when quadratic */
+#define SLACK 0.01	/* seconds the clock may be off by on short runs */
+
+static int failed = 0;
+
+static localization
+get_local(void)
+{
+	localization local;
+	local.figure = "Figure";
+	local.listing = "Listing";
+	local.table = "Table";
+	return local;
+}
+
+/* time_run • best CPU time of rendering count copies of pattern */
+static double
+time_run(sd_document *document, const char *pattern, int count)
+{
+	sd_buffer *ib = sd_buffer_new(64 * 1024);
+	sd_buffer *ob = sd_buffer_new(64 * 1024);
+	double elapsed, best = 0;
+	clock_t start;
+	int i;
+
+	for (i = 0; i < count; i++)
+		sd_buffer_puts(ib, pattern);
+
+	for (i = 0; i < TRIES; i++) {
+		ob->size = 0;
+		start = clock();
+		sd_document_render(document, ob, ib->data, ib->size, -1);
+		elapsed = (double)(clock() - start) / CLOCKS_PER_SEC;
+
+		if (i == 0 || elapsed < best)
+			best = elapsed;
+	}
+
+	if (ob->size == 0) {
+		fprintf(stderr, "FAIL: %d times \"%s\" rendered nothing\n", count, pattern);
+		failed = 1;
+	}
+
+	sd_buffer_free(ib);
+	sd_buffer_free(ob);
+	return best;
+}
+
+/* check_run • renders REPEAT and twice REPEAT copies of pattern; the time
+ * grows about fourfold when every opener reads the rest of the paragraph,
+ * twofold when it does not, whatever the speed of the machine */
+static void
+check_run(sd_document *document, const char *pattern)
+{
+	double once = time_run(document, pattern, REPEAT);
+	double twice = time_run(document, pattern, 2 * REPEAT);
+
+	if (twice > MAX_RATIO * once + SLACK) {
+		fprintf(stderr, "FAIL: \"%s\" took %.3f s %d times, %.3f s %d times\n",
+			pattern, once, REPEAT, twice, 2 * REPEAT);
+		failed = 1;
+	}
+}
+
+int
+main(void)
+{
+	sd_renderer *renderer;
+	sd_document *document;
+
+	renderer = sd_html_renderer_new(0, 0, get_local());
+	document = sd_document_new(renderer, UPSKIRT_EXT_SPAN, NULL, NULL, 16);
+
+	/* inline links whose destination is never closed */
+	check_run(document, "[a](");
+	check_run(document, "[a](x \"");
+	check_run(document, "[a](()");
+
+	/* emphasis around tags, comments and autolinks that never end */
+	check_run(document, "*<a ");
+	check_run(document, "<!-- >");
+	check_run(document, "<a:");
+
+	sd_document_free(document);
+	sd_html_renderer_free(renderer);
+
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,91 @@
+/* limits.c - max_output holds on a single block larger than the limit */
+
+#include "document.h"
+#include "html.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define MAX_OUTPUT 1000
+
+static int failed = 0;
+
+static void
+check(int ok, const char *what, size_t size)
+{
+	if (!ok) {
+		fprintf(stderr, "FAIL: %s (%lu bytes of output)\n", what, (unsigned long)size);
+		failed = 1;
+	}
+}
+
+static localization
+get_local(void)
+{
+	localization local;
+	local.figure = "Figure";
+	local.listing = "Listing";
+	local.table = "Table";
+	return local;
+}
+
+/* count_output • counts the bytes handed over to the sink */
+static void
+count_output(const uint8_t *data, size_t size, void *opaque)
+{
+	(void)data;
+	*(size_t *)opaque += size;
+}
+
+int
+main(void)
+{
+	sd_render_limits limits = { MAX_OUTPUT, 0, 0 };
+	sd_renderer *renderer;
+	sd_document *document;
+	sd_buffer *ib, *ob;
+	size_t handed = 0;
+	int i;
+
+	/* one indented code block, the last block of the document */
+	ib = sd_buffer_new(64 * 1024);
+	for (i = 0; i < 100000; i++)
+		sd_buffer_printf(ib, "    line %d of the <code> block\n", i);
+
+	ob = sd_buffer_new(64 * 1024);
+	renderer = sd_html_renderer_new(0, 0, get_local());
+	document = sd_document_new(renderer, UPSKIRT_EXT_BLOCK, NULL, NULL, 16);
+	sd_document_set_limits(document, &limits);
+
+	sd_document_render(document, ob, ib->data, ib->size, -1);
+	check(sd_document_status(document) == UPSKIRT_RENDER_OUTPUT_LIMIT, "render stops at the limit", ob->size);
+	check(ob->size <= MAX_OUTPUT, "render is cut to the limit", ob->size);
+
+	/* the same through the sink */
+	ob->size = 0;
+	sd_document_set_output(document, count_output, &handed, 256);
+	sd_document_render(document, ob, ib->data, ib->size, -1);
+	check(sd_document_status(document) == UPSKIRT_RENDER_OUTPUT_LIMIT, "flushed render stops at the limit", handed);
+	check(handed + ob->size <= MAX_OUTPUT, "flushed render is cut to the limit", handed + ob->size);
+	sd_document_set_output(document, NULL, NULL, 0);
+
+	/* and fed by chunks */
+	ob->size = 0;
+	handed = 0;
+	for (i = 0; i < (int)ib->size; i += 4096) {
+		sd_document_feed(document, ob, ib->data + i, ib->size - i < 4096 ? ib->size - i : 4096);
+		handed += ob->size;
+		ob->size = 0;
+	}
+	sd_document_finish(document, ob);
+	handed += ob->size;
+	check(sd_document_status(document) == UPSKIRT_RENDER_OUTPUT_LIMIT, "stream stops at the limit", handed);
+	check(handed <= MAX_OUTPUT, "stream is cut to the limit", handed);
+
+	sd_buffer_free(ib);
+	sd_buffer_free(ob);
+	sd_document_free(document);
+	sd_html_renderer_free(renderer);
+
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -27,6 +27,10 @@ SOURCES += \
     src/html_blocks.c \
     src/html_smartypants.c \
     src/stack.c \
+    src/arena.c \
+    src/input.c \
+    src/scan.c \
+    src/tree.c \
     src/version.c
 
 HEADERS += \
@@ -36,5 +40,9 @@ HEADERS += \
     src/escape.h \
     src/html.h \
     src/stack.h \
+    src/arena.h \
+    src/input.h \
+    src/scan.h \
+    src/tree.h \
     src/version.h
 